@@ -141,7 +141,8 @@ struct SendDataPktQueue
 
 	void EnqueueAndSort(u_int seq_num, u_short data_len, u_short flag, DATA* data, struct pcap_pkthdr* header, const u_char* pkt_data)
 	{
-		ForwardPkt* pkt = (ForwardPkt *)malloc(sizeof(ForwardPkt));
+		ForwardPkt* pkt = (ForwardPkt *)malloc(sizeof(ForwardPkt) + PKT_SIZE);
+		pkt->pkt_data = (u_char *)(pkt + 1);
 		pkt->seq_num = seq_num;
 		pkt->data_len = data_len;
 		pkt->ctr_flag = flag;
@@ -270,20 +271,10 @@ struct clientState
 	u_int seq_nxt;
 	u_short win_scale;
 	u_short sender_win_scale;
-	//ForwardPkt *httpRequest;			// http request packet
-        ForwardPktBuffer httpRequest;
 	u_short ack_count;
 
-	sack_header sack;
-
 	clientState()
 	{
-            httpRequest.capacity = HTTP_CAP;
-            httpRequest.pktQueue = (ForwardPkt *)malloc(sizeof(ForwardPkt)*httpRequest.capacity);
-            httpRequest.init();
-                
-            //httpRequest->initPkt();
-
             win_scale = sender_win_scale = 0;
             ack_count = 0;
             send_data_id = rcv_wnd = rcv_nxt = rcv_adv =  snd_nxt = seq_nxt = 0;
@@ -292,12 +283,9 @@ struct clientState
 	void flush()
 	{
             send_data_id = rcv_wnd = rcv_nxt = rcv_adv =  snd_nxt = seq_nxt = 0;
-            httpRequest.init();
             win_scale = sender_win_scale = 0;
             ack_count = 0;
             state = LISTEN;
-            sack.flush();
-
 	}
 
 	~clientState()
@@ -349,40 +337,397 @@ struct conn_stats
 };
 
 
+
+/**
+ * The part of a connection off the per-packet path: the HTTP request held
+ * until the server side is up, the SACK list the gateway advertises to the
+ * server, the experiment log and the stats. Allocated on its own and
+ * reached through conn_state::cold, so it never shares a cache line with
+ * the ACK and scheduler state.
+ */
+struct conn_cold
+{
+	ForwardPktBuffer httpRequest;	// http request packets
+	sack_header sack;
+	FILE* rttFd;			// For Experiment Output
+	conn_stats connStats;
+
+	conn_cold()
+	{
+		httpRequest.alloc(HTTP_CAP);
+		rttFd = NULL;
+	}
+
+	void flush()
+	{
+		if (rttFd)
+		{
+			fclose(rttFd);
+			rttFd = NULL;
+		}
+
+		httpRequest.init();
+		sack.flush();
+	}
+};
+
 struct TCB;
+pkt_slab slab;            // sized by the connection pool, see pool.grow_conn()
+buffer_budget buf_budget;
+struct DATA* uplink_data; // client to server side, carries budget_reopen() window updates
+
+struct slab_cache
+{
+	u_char* frames[SLAB_CACHE];
+	u_int n;
+};
+__thread slab_cache slab_local; // zero-initialized per thread
+
+u_char* slab_take()
+{
+	if (!slab_local.n)
+		slab_local.n = slab.take(slab_local.frames, SLAB_CACHE / 2);
+
+	return (slab_local.n ? slab_local.frames[-- slab_local.n] : NULL);
+}
+void inline slab_put(u_char* frame)
+{
+	if (slab_local.n == SLAB_CACHE)
+	{
+		slab.put(slab_local.frames + SLAB_CACHE / 2, SLAB_CACHE / 2);
+		slab_local.n = SLAB_CACHE / 2;
+	}
+
+	slab_local.frames[slab_local.n ++] = frame;
+}
+/**
+ * Retransmission buffer of a connection. Same ring indices and interface
+ * as ForwardPktBuffer. The per-slot metadata is one dense array, so the
+ * ACK, SACK and RTO scans walk contiguous memory. A slot's frame comes
+ * from the slab when it is filled at the tail and goes back when the ACK
+ * moves unAck past it.
+ *
+ * With PAYLOAD_STORAGE a slot keeps no frame. Payloads are appended back
+ * to back to a byte stream of capacity * PKT_SIZE bytes, and a slot only
+ * records where its bytes start (off). The stream is backed chunk by chunk
+ * with slab frames: chunk c, bytes c * PKT_SIZE up to (c + 1) * PKT_SIZE,
+ * is meta[c].pkt_data, taken when the tail first writes into it and put
+ * back once unAck has moved past its last byte. The headers of the last
+ * segment stored become the connection's template (hdr), which
+ * build_data_frame() completes for each slot on send.
+ */
+struct SlabPktBuffer
+{
+	/* the ring and stream cursors come first, conn_state keeps them in its hot lines */
+	ForwardPkt* meta;
+	u_int capacity, _size, _head, _tail, _unAck, _pkts, _last_head, _last_pkts;
+	u_int _frames; ///< slots holding a slab frame, all of them from _unAck up to _tail
+	u_int _gen;    ///< generation of the owning connection, a slot stamped with another one is free
+#ifdef PAYLOAD_STORAGE
+	u_int _s_head, _s_tail; ///< stream offsets of the first un-ACKed and the next appended byte
+
+	volatile u_int _hdr_seq; ///< odd while the capture path rewrites hdr
+	u_short _ip_id;         ///< IP ID of the next frame built
+	BOOL _ip_id_set;        ///< _ip_id was seeded from this connection's first template
+	u_char* hdr;            ///< PKT_HDR_MAX bytes, Ethernet/IP/TCP header of the latest segment stored
+#endif
+
+	SlabPktBuffer(u_int size):capacity(size)
+	{
+		meta = (ForwardPkt *)huge_alloc(sizeof(ForwardPkt)*capacity);
+		for (u_int i = 0; i < capacity; i ++)
+		{
+			meta[i].initPkt();
+			meta[i].pkt_data = NULL;
+		}
+#ifdef PAYLOAD_STORAGE
+		hdr = (u_char *)huge_alloc(PKT_HDR_MAX);
+		memset(hdr, 0, PKT_HDR_MAX);
+		_s_head = _s_tail = _hdr_seq = 0;
+		_ip_id = 0;
+		_ip_id_set = FALSE;
+#endif
+
+		_head = _tail = _size = _unAck = _pkts = _last_head = _last_pkts = _frames = _gen = 0;
+	}
+
+	~SlabPktBuffer()
+	{
+		release_all();
+		huge_free(meta);
+#ifdef PAYLOAD_STORAGE
+		huge_free(hdr);
+#endif
+	}
+
+	void inline flush()
+	{
+		init();
+	}
+
+	/*
+	 * No slot is cleared: whatever the last connection left un-ACKed is
+	 * stamped with its generation, and live() stops counting it once the
+	 * next connection bumps _gen. rcv_data_pkt() rewrites a slot before it
+	 * is occupied again, so recycling only costs returning the frames.
+	 */
+	inline void init()
+	{
+		release_all();
+
+		_head = _tail = _size = _unAck = _pkts = _last_head = _last_pkts = 0;
+#ifdef PAYLOAD_STORAGE
+		_s_head = _s_tail = 0;
+		_ip_id_set = FALSE;
+#endif
+	}
+
+	void release_all()
+	{
+#ifdef PAYLOAD_STORAGE
+		u_int first = _s_head / PKT_SIZE; // the chunks in use are one run from here
+#else
+		u_int first = _unAck % capacity;
+#endif
+		for (u_int i = first, n = 0; _frames && n < capacity; i = (i + 1) % capacity, n ++)
+		{
+			if (meta[i].pkt_data)
+			{
+				slab_put(meta[i].pkt_data);
+				meta[i].pkt_data = NULL;
+				_frames --;
+			}
+		}
+	}
+
+	inline BOOL live(ForwardPkt* pkt) { return pkt->occupy && pkt->gen == _gen; }
+	inline ForwardPkt* unAck() { return meta + (_unAck % capacity); }
+#ifdef PAYLOAD_STORAGE
+	inline void unAckNext()
+	{
+		_unAck = (_unAck + 1) % capacity;
+
+		/* the slot moved past may be initPkt()ed already, so the new head comes from its successor */
+		u_int s_head = (live(meta + _unAck) ? meta[_unAck].off : _s_tail);
+		for (u_int c = _s_head / PKT_SIZE; c != s_head / PKT_SIZE; c = (c + 1) % capacity)
+		{
+			if (meta[c].pkt_data)
+			{
+				slab_put(meta[c].pkt_data);
+				meta[c].pkt_data = NULL;
+				_frames --;
+			}
+		}
+		_s_head = s_head;
+	}
+#else
+	inline void unAckNext()
+	{
+		ForwardPkt* pkt = meta + (_unAck % capacity);
+		if (pkt->pkt_data)
+		{
+			slab_put(pkt->pkt_data);
+			pkt->pkt_data = NULL;
+			_frames --;
+		}
+		_unAck = (_unAck + 1) % capacity;
+	}
+#endif
+	inline ForwardPkt* head() { return meta + (_head % capacity); }
+	inline void headNext() { _head = (_head + 1) % capacity; _pkts --; }
+	inline void headPrev()
+	{
+            if (_head == 0)
+                _head = capacity - 1;
+            else
+                _head = (_head - 1) % capacity;
+
+            _pkts ++;
+	}
+	inline void lastHeadNext() { _last_head = (_last_head + 1) % capacity; _last_pkts --; }
+	inline void lastHeadPrev()
+	{
+            if (_last_head == 0)
+                _last_head = capacity - 1;
+            else
+                _last_head = (_last_head - 1) % capacity;
+
+            _last_pkts ++;
+	}
+	inline ForwardPkt* lastHead() { return meta + (_last_head % capacity); }
+#ifdef PAYLOAD_STORAGE
+	/*
+	 * Appends len payload bytes to the stream and returns the tail slot
+	 * with off set. NULL when the slab is exhausted or the stream has no
+	 * room left, the segment is then dropped as if it never arrived.
+	 */
+	ForwardPkt* tail(const u_char* payload, u_int len)
+	{
+		u_int stream = capacity * PKT_SIZE;
+		u_int used = (_s_tail + stream - _s_head) % stream;
+		if (used + len > (capacity - 1) * PKT_SIZE)
+			return NULL;
+
+		for (u_int pos = _s_tail, left = len; left; )
+		{
+			u_int c = pos / PKT_SIZE, at = pos % PKT_SIZE;
+			if (!meta[c].pkt_data)
+			{
+				if ((meta[c].pkt_data = slab_take()) == NULL)
+					return NULL;
+				_frames ++;
+			}
+
+			u_int n = (left < PKT_SIZE - at ? left : PKT_SIZE - at);
+			memcpy(meta[c].pkt_data + at, payload, n);
+			payload += n;
+			left -= n;
+			pos = (pos + n) % stream;
+		}
+
+		ForwardPkt* pkt = meta + (_tail % capacity);
+		pkt->off = _s_tail;
+		_s_tail = (_s_tail + len) % stream;
+		return pkt;
+	}
+
+	/* copies len bytes from stream offset off, FALSE unless they are all still between _s_head and _s_tail */
+	BOOL payload(u_int off, u_int len, u_char* dst)
+	{
+		u_int stream = capacity * PKT_SIZE;
+		if ((off + stream - _s_head) % stream + len > (_s_tail + stream - _s_head) % stream)
+			return FALSE; // ACKed, its chunks may already hold another segment's bytes
+
+		while (len)
+		{
+			u_int at = off % PKT_SIZE;
+			u_char* chunk = meta[off / PKT_SIZE].pkt_data;
+			if (chunk == NULL)
+				return FALSE;
+
+			u_int n = (len < PKT_SIZE - at ? len : PKT_SIZE - at);
+			memcpy(dst, chunk + at, n);
+			dst += n;
+			len -= n;
+			off = (off + n) % (capacity * PKT_SIZE);
+		}
+		return TRUE;
+	}
+
+	/* the headers of pkt_data, hdr_len bytes, become the template for every later send */
+	inline void set_template(const u_char* pkt_data, u_int hdr_len)
+	{
+		if (hdr_len > PKT_HDR_MAX)
+			return;
+
+		_hdr_seq ++;
+		__sync_synchronize();
+		memcpy(hdr, pkt_data, hdr_len);
+		__sync_synchronize();
+		_hdr_seq ++;
+	}
+
+	/* IP ID for the next frame, counting up from the ID of the first segment stored */
+	inline u_short next_ip_id(u_short seed)
+	{
+		if (!_ip_id_set)
+		{
+			_ip_id = seed;
+			_ip_id_set = TRUE;
+		}
+		return _ip_id ++;
+	}
+
+	/* a consistent copy of the template, the scheduler reads it without the connection mutex */
+	inline void get_template(u_char* frame)
+	{
+		u_int seq;
+
+		do
+		{
+			while ((seq = _hdr_seq) & 1)
+				;
+			__sync_synchronize();
+			memcpy(frame, hdr, PKT_HDR_MAX);
+			__sync_synchronize();
+		} while (_hdr_seq != seq);
+	}
+#else
+	inline ForwardPkt* tail() // attaches a slab frame, NULL when the slab is exhausted
+	{
+		ForwardPkt* pkt = meta + (_tail % capacity);
+		if (!pkt->pkt_data)
+		{
+			if ((pkt->pkt_data = slab_take()) == NULL)
+				return NULL;
+			_frames ++;
+		}
+		return pkt;
+	}
+#endif
+	inline void tailNext() { _tail = (_tail + 1) % capacity; _pkts ++; }
+
+	inline ForwardPkt* pkt(u_int _index) { return meta + (_index % capacity); }
+	inline u_int pktNext(u_int _index) { return _index = (_index + 1) % capacity; }
+
+	inline u_int size() { return _size; }
+	inline u_int pkts() { return _pkts; }
+
+	inline void increase() { _size ++; }
+	inline void decrease() { _size --; }
+};
 struct conn_state
 {
-    
-        conn_stats connStats;
-    
-	u_long_long initial_time;
-        u_long_long close_time;
-	u_char client_mac_address[6];
-	u_char server_mac_address[6];
+	/* hot: read and written on every ACK and every scheduler visit, the first two cache lines */
+	serverState server_state CACHE_ALIGNED;
+	u_int max_sack_edge;
+	u_int rcv_max_seq_edge;
+	u_int FRTO_ack_count;
+	u_int FRTO_dup_ack_count;
+	u_int rto;
+	SlabPktBuffer dataPktBuffer; ///< its cursors end the hot lines, the header template spills past them
+
+	/* warm: the RTT estimator, the capture path and the rest of the scheduler's reads */
+	u_int max_data_len;
+        u_int opp_rtx_space;
+	u_short MSS;
+	u_short sack_block_num;
+	u_int RTT;
+	u_int LAST_RTT;
+	u_int mdev;
+	u_int rtt_std_dev;
+	u_int nxt_timed_seqno;
+	u_int zero_window_seq_no;
+        BOOL send_out_awin; //use in fast retransmit
+	tcp_sack_block sack_block[NUM_SACK_BLOCK];
+
+	clientState client_state;
+        u_int local_adv_window;
 
 	ip_address client_ip_address;
 	ip_address server_ip_address;
-
 	u_short cPort;
 	u_short sPort;
+	u_char client_mac_address[6];
+	u_char server_mac_address[6];
 
-	ForwardPktBuffer dataPktBuffer;
+	TCB *_tcb;
+	u_int index;
+	u_int generation; ///< bumped every time the slot is given to a new connection
+	u_int buffered;   ///< bytes of dataPktBuffer charged to buf_budget
+	BOOL wnd_closed;  ///< last window cut below one MSS by buf_budget, see budget_reopen()
+	BOOL win_update_due; ///< window update deferred on a full control lane, see tcb_win_update_retry()
+	conn_cold* cold;  ///< out of line, see conn_cold
 
-	pthread_mutex_t mutex;
+	pthread_mutex_t mutex CACHE_ALIGNED;
 	pthread_cond_t m_eventElementAvailable;
 	pthread_cond_t m_eventSpaceAvailable;
-	serverState server_state;
-	clientState client_state;
 
-	// For Experiment Output
-	FILE* rttFd;
+	u_long_long initial_time;
+        u_long_long close_time;
 
 	u_int send_rate;
-	u_int RTT;
-	u_int LAST_RTT;
 	u_int RTT_limit;
-	u_int mdev;
-	u_int nxt_timed_seqno;
 
 	u_long_long last_ack_rcv_time;
 	u_int last_ack_seqno;
@@ -396,36 +741,13 @@ struct conn_state
 	u_int ack_interarrival_time;
 	u_int dft_cumul_ack;
 
-	u_int rto;
-	u_int rtt_std_dev;
-
-	tcp_sack_block sack_block[NUM_SACK_BLOCK];
-	u_short sack_block_num;
 	u_int sack_diff;
 	u_int undup_sack_diff;
 	u_short sack_target_block;
-	u_int max_sack_edge;
-	u_int rcv_max_seq_edge;
 
-        u_int opp_rtx_space;
-        
 	u_long_long ref_ack_time;
 	u_int ref_ack_seq_no;
 
-	u_short MSS;
-	u_int zero_window_seq_no;
-        
-	SlideWindow sliding_avg_win;
-        SlideWindow sliding_tsval_window;
-        SlideWindow sliding_snd_window;
-        
-        SlideWindow sliding_uplink_window;
-        
-	u_int FRTO_ack_count;
-	u_int FRTO_dup_ack_count;
-        BOOL send_out_awin; //use in fast retransmit
-	u_int max_data_len;
-
 #ifdef STD_RTT
 
 	u_int RTT_IETF;
@@ -435,9 +757,6 @@ struct conn_state
 
 #endif
 
-	TCB *_tcb;
-	u_int index;
-
         long long downlink_one_way_delay;
         long long min_downlink_one_way_delay;
         u_int downlink_queueing_length;
@@ -451,27 +770,30 @@ struct conn_state
         long long min_uplink_one_way_delay;
         u_int uplink_queueing_delay;
         u_int rcv_uplink_thruput;
-       
+
+	AckHistory ack_history; ///< this connection's ACKs, for its own rates
+        SlideWindow sliding_snd_window;
         
-        u_long_long startTime;
-        u_int totalByteSent;
+        SlideWindow sliding_uplink_window;
         
-        u_int local_adv_window;
+        /* written by the scheduler on every send */
+        u_long_long startTime CACHE_ALIGNED;
+        u_int totalByteSent;
         
         
-	conn_state(u_int count): dataPktBuffer(count), 
-        sliding_avg_win (SLIDING_WIN_SIZE + 3500, 0, 0), 
-        sliding_tsval_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA),
+	conn_state(u_int count): dataPktBuffer(count), cold(new conn_cold), 
+        ack_history (ACK_HISTORY_SIZE), 
         sliding_snd_window (SND_WIN_SIZE, 0, 0),
         sliding_uplink_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA)
 	{
+            wnd_closed = FALSE;
+            win_update_due = FALSE;
             init_state();
 	}
 
 	conn_state(u_char client_mac[], u_char server_mac[], ip_address client_ip, ip_address server_ip, u_short client_port, u_short server_port, u_int count) : 
-        client_ip_address(client_ip), server_ip_address(server_ip), cPort(client_port), sPort(server_port), dataPktBuffer(count), 
-        sliding_avg_win (SLIDING_WIN_SIZE + 3500, 0, 0),
-        sliding_tsval_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA),
+        dataPktBuffer(count), client_ip_address(client_ip), server_ip_address(server_ip), cPort(client_port), sPort(server_port), cold(new conn_cold), 
+        ack_history (ACK_HISTORY_SIZE),
         sliding_snd_window (SND_WIN_SIZE, 0, 0),
         sliding_uplink_window(SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA)
 	{
@@ -484,6 +806,8 @@ struct conn_state
             close_time = 0;
             memcpy(client_mac_address, client_mac, 6);
             memcpy(server_mac_address, server_mac, 6);
+            wnd_closed = FALSE;
+            win_update_due = FALSE;
             init_state();
 	}
 
@@ -492,9 +816,9 @@ struct conn_state
 		pthread_mutex_init(&mutex, NULL);
 		pthread_cond_init(&m_eventSpaceAvailable, NULL );
 		pthread_cond_init(&m_eventElementAvailable, NULL);
-		rttFd = NULL;
 
 		_tcb = NULL;
+		generation = 0;
 
 		initial_time = 0;
                 close_time = 0;
@@ -565,6 +889,7 @@ struct conn_state
                 
                 rcv_uplink_thruput = 0;
                 local_adv_window = 0;
+                buffered = 0;
                 
                
 	}
@@ -580,6 +905,12 @@ struct conn_state
                 close_time = 0;
 		_tcb = tcb;
 		index = conn_index;
+		generation ++;
+		dataPktBuffer._gen = generation;
+		if (wnd_closed) // slot reused straight from CLOSED
+			__sync_fetch_and_sub(&buf_budget.closed, 1);
+		wnd_closed = FALSE;
+		win_update_due = FALSE;
 
 		memcpy(client_mac_address, client_mac, 6);
 		memcpy(server_mac_address, server_mac, 6);
@@ -587,15 +918,10 @@ struct conn_state
 
 	void inline flush()
 	{
-		if (rttFd)
-		{
-			fclose(rttFd);
-			rttFd = NULL;
-		}
+		cold->flush();
 
-		sliding_avg_win.flush();
+		ack_history.flush();
                 sliding_snd_window.flush();
-                sliding_tsval_window.flush();
                 
                 sliding_uplink_window.flush();
                 
@@ -676,6 +1002,19 @@ struct conn_state
                 startTime = timer.Start();
                 totalByteSent = 0;
                 local_adv_window = 0;
+                buffered = 0;
+                if (wnd_closed)
+                    __sync_fetch_and_sub(&buf_budget.closed, 1);
+                wnd_closed = FALSE;
+                win_update_due = FALSE;
+	}
+
+	u_int footprint() // the object plus its cold part, the slot metadata and sample windows it allocates
+	{
+		return sizeof(conn_state) + sizeof(conn_cold) + (sizeof(ForwardPkt) + PKT_SIZE) * HTTP_CAP + 
+			sizeof(ForwardPkt) * dataPktBuffer.capacity + 
+			ack_history.footprint() + 
+			sliding_snd_window.footprint() + sliding_uplink_window.footprint();
 	}
 
 	~conn_state()
@@ -683,49 +1022,392 @@ struct conn_state
 		pthread_mutex_destroy(&mutex);
 		pthread_cond_destroy(&m_eventElementAvailable);
 		pthread_cond_destroy(&m_eventSpaceAvailable);
+		delete cold;
 	}
 };
 
-struct TCB
+/* the per-ACK fields have to stay in the first two cache lines */
+#define CONN_HOT_BYTES (2 * CACHE_LINE_SIZE)
+static_assert(offsetof(conn_state, rto) < CONN_HOT_BYTES, "conn_state: rto left the hot lines");
+static_assert(offsetof(conn_state, FRTO_dup_ack_count) < CONN_HOT_BYTES, "conn_state: SACK/FRTO state left the hot lines");
+static_assert(offsetof(conn_state, dataPktBuffer._gen) < CONN_HOT_BYTES, "conn_state: buffer cursors left the hot lines");
+#ifdef PAYLOAD_STORAGE
+static_assert(offsetof(conn_state, dataPktBuffer._s_tail) < CONN_HOT_BYTES, "conn_state: stream cursors left the hot lines");
+#endif
+
+/**
+ * Quiescent-state reclamation for the tables of the lock-free maps. Each
+ * thread that probes them registers on its first quiescent point and
+ * reports one between packets or scheduler visits, where it holds no table
+ * pointer. A retired table is freed once every registered thread has
+ * reported a quiescent point after it was unlinked. A thread about to block
+ * goes offline so it does not hold reclamation up.
+ */
+struct grace_period
 {
-	conn_state* conn[MAX_CONN_STATES + 1];
+	struct retired_block
+	{
+		void* ptr;
+		u_long_long epoch;
+		retired_block* next;
+	};
 
-	u_int send_rate;
-	u_int send_rate_lower;
-	u_int send_rate_upper;
-	u_int aggre_bw_estimate;
-	u_int send_beyong_win;
-	u_int sample_rate;
+	enum {OFFLINE = 0};
 
-	pthread_cond_t m_eventConnStateAvailable;
+	volatile u_long_long epoch;
+	volatile u_long_long seen[GRACE_MAX_THREADS]; ///< epoch at each thread's last quiescent point
+	volatile u_int threads;
+	retired_block* volatile pending;
 	pthread_mutex_t mutex;
-	state_array states;
-	
-	SlideWindow sliding_avg_window;
-	SlideWindow sliding_snd_window;
-	SlideWindow sliding_uplink_window;
-	SlideWindow sliding_tsval_window;
-        SlideWindow sliding_gradient_window;
-        
-	u_int rcv_thrughput;
-	u_int rcv_thrughput_approx;
 
-	u_long_long initial_time;
-        u_long_long close_time;
-	ip_address client_ip_address;
-	ip_address server_ip_address;
+	grace_period() : epoch(1), threads(0), pending(NULL)
+	{
+		for (u_int i = 0; i < GRACE_MAX_THREADS; i ++)
+			seen[i] = OFFLINE;
+		pthread_mutex_init(&mutex, NULL);
+	}
 
-	u_int totalByteSent;
-	u_int RTT;
-        u_int RTT_INST;
-	u_int RTT_limit;
-	u_long_long startTime;
-	int pkts_transit;
+	~grace_period()
+	{
+		while (pending)
+		{
+			retired_block* b = pending;
+			pending = b->next;
+			free(b->ptr);
+			free(b);
+		}
+		pthread_mutex_destroy(&mutex);
+	}
 
-        busyPeriodArray BusyPeriod;
-        
-        u_int unsent_data_bytes;        
-        busyPeriod idleTime;
+	int enroll()
+	{
+		u_int id = __sync_fetch_and_add(&threads, 1);
+		if (id >= GRACE_MAX_THREADS)
+		{
+			fprintf(stderr, "\nMore than %d threads probe the connection maps\n", GRACE_MAX_THREADS);
+			exit(-1);
+		}
+		return id;
+	}
+
+	void quiescent(); // also brings a thread back from offline
+	void offline();
+
+	void retire(void* ptr) // ptr is no longer reachable from any map
+	{
+		retired_block* b = (retired_block *)malloc(sizeof(retired_block));
+		b->ptr = ptr;
+
+		pthread_mutex_lock(&mutex);
+		b->epoch = __sync_add_and_fetch(&epoch, 1);
+		b->next = pending;
+		pending = b;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void reclaim()
+	{
+		if (!pending)
+			return;
+
+		pthread_mutex_lock(&mutex);
+		u_long_long passed = epoch;
+		for (u_int i = 0; i < threads && i < GRACE_MAX_THREADS; i ++)
+		{
+			if (seen[i] != OFFLINE && seen[i] < passed)
+				passed = seen[i];
+		}
+
+		retired_block** link = (retired_block **)&pending;
+		while (*link)
+		{
+			retired_block* b = *link;
+			if (b->epoch <= passed)
+			{
+				*link = b->next;
+				free(b->ptr);
+				free(b);
+			}
+			else
+				link = &b->next;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+}grace;
+
+static __thread int grace_id = -1;
+
+void grace_period::quiescent()
+{
+	if (grace_id < 0)
+		grace_id = enroll();
+
+	__sync_synchronize(); // every probe of the last packet is done
+	seen[grace_id] = epoch;
+	__sync_synchronize(); // before the next probe loads a table pointer
+}
+void grace_period::offline()
+{
+	if (grace_id < 0)
+		return;
+
+	__sync_synchronize();
+	seen[grace_id] = OFFLINE;
+}
+void state_array::grow()
+{
+	u_int* ids = (u_int *)malloc(sizeof(u_int) * cap * 2);
+	memcpy(ids, state_id, sizeof(u_int) * cap);
+	memset(ids + cap, 0, sizeof(u_int) * cap);
+
+	u_int* old = state_id;
+	__sync_synchronize(); // the copy is complete before readers can pick it up
+	state_id = ids;
+	cap *= 2;
+	grace.retire(old); // a scheduler visit may still be indexing it
+}
+/**
+ * Client port -> conn_state map of a TCB, open addressing with linear
+ * probing. Writers are serialized by the map's own mutex; readers never
+ * lock. A resized table replaces the old one with a single pointer store
+ * and is handed to grace, which frees it once no reader can still be
+ * probing it.
+ */
+struct conn_map
+{
+	enum {EMPTY_PORT = 0x10000, DELETED_PORT = 0x10001};
+
+	struct slot
+	{
+		volatile u_int port;
+		conn_state* volatile value;
+	};
+	struct slots
+	{
+		u_int mask;
+		slot s[1];
+	};
+	struct ref // what conn[port] yields, reads look up and assignments insert or erase
+	{
+		conn_map* map;
+		u_short port;
+
+		inline operator conn_state*() const { return map->find(port); }
+		inline conn_state* operator->() const { return map->find(port); }
+		inline ref& operator=(conn_state* value)
+		{
+			if (value)
+				map->insert(port, value);
+			else
+				map->erase(port);
+			return *this;
+		}
+	};
+
+	slots* volatile table;
+	u_int used, live; ///< used counts live keys and tombstones
+	pthread_mutex_t mutex;
+
+	conn_map() : used(0), live(0)
+	{
+		table = alloc(CONN_MAP_INIT_SIZE);
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~conn_map()
+	{
+		free(table);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	static slots* alloc(u_int size)
+	{
+		slots* t = (slots *)malloc(sizeof(slots) + sizeof(slot) * (size - 1));
+		t->mask = size - 1;
+		for (u_int i = 0; i < size; i ++)
+		{
+			t->s[i].port = EMPTY_PORT;
+			t->s[i].value = NULL;
+		}
+		return t;
+	}
+
+	static inline u_int hash(u_short port) { return ((u_int)port * 0x9E3779B1u) >> 15; }
+
+	inline ref operator[](u_short port)
+	{
+		ref r = {this, port};
+		return r;
+	}
+
+	inline conn_state* find(u_short port)
+	{
+		slots* t = table;
+		for (u_int i = hash(port) & t->mask, n = 0; n <= t->mask; i = (i + 1) & t->mask, n ++)
+		{
+			if (t->s[i].port == port)
+				return t->s[i].value;
+			if (t->s[i].port == EMPTY_PORT)
+				break;
+		}
+		return NULL;
+	}
+
+	BOOL place(slots* t, u_short port, conn_state* value) // caller holds mutex, TRUE if an empty slot was used
+	{
+		u_int i = hash(port) & t->mask;
+		while (t->s[i].port != EMPTY_PORT && t->s[i].port != DELETED_PORT)
+			i = (i + 1) & t->mask;
+
+		BOOL fresh = (t->s[i].port == EMPTY_PORT);
+		t->s[i].value = value;
+		__sync_synchronize(); // value is visible before the key that leads to it
+		t->s[i].port = port;
+		return fresh;
+	}
+
+	void replace(u_int size) // caller holds mutex
+	{
+		slots* old = table;
+		slots* t = alloc(size);
+
+		for (u_int i = 0; i <= old->mask; i ++)
+		{
+			if (old->s[i].port < EMPTY_PORT)
+				place(t, old->s[i].port, old->s[i].value);
+		}
+
+		__sync_synchronize();
+		table = t;
+		grace.retire(old);
+		used = live;
+	}
+
+	void insert(u_short port, conn_state* value)
+	{
+		pthread_mutex_lock(&mutex);
+		slots* t = table;
+		for (u_int i = hash(port) & t->mask, n = 0; n <= t->mask; i = (i + 1) & t->mask, n ++)
+		{
+			if (t->s[i].port == port)
+			{
+				t->s[i].value = value;
+				pthread_mutex_unlock(&mutex);
+				return;
+			}
+			if (t->s[i].port == EMPTY_PORT)
+				break;
+		}
+
+		if ((used + 1) * 4 > (table->mask + 1) * 3)
+			replace((live + 1) * 2 > table->mask + 1 ? (table->mask + 1) * 2 : table->mask + 1); // grow, or just drop tombstones
+		if (place(table, port, value))
+			used ++;
+		live ++;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void erase(u_short port)
+	{
+		pthread_mutex_lock(&mutex);
+		slots* t = table;
+		for (u_int i = hash(port) & t->mask, n = 0; n <= t->mask; i = (i + 1) & t->mask, n ++)
+		{
+			if (t->s[i].port == port)
+			{
+				t->s[i].value = NULL;
+				t->s[i].port = DELETED_PORT;
+				live --;
+				break;
+			}
+			if (t->s[i].port == EMPTY_PORT)
+				break;
+		}
+		if (!live)
+			clear_locked();
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void clear_locked() // caller holds mutex
+	{
+		if (table->mask + 1 > CONN_MAP_INIT_SIZE)
+		{
+			slots* old = table;
+			slots* t = alloc(CONN_MAP_INIT_SIZE);
+			__sync_synchronize();
+			table = t;
+			grace.retire(old);
+		}
+		else
+		{
+			for (u_int i = 0; i <= table->mask; i ++)
+			{
+				table->s[i].port = EMPTY_PORT;
+				table->s[i].value = NULL;
+			}
+		}
+		used = live = 0;
+	}
+
+	void clear()
+	{
+		pthread_mutex_lock(&mutex);
+		clear_locked();
+		pthread_mutex_unlock(&mutex);
+	}
+};
+struct TCB
+{
+	conn_map conn; ///< indexed by client port
+
+	u_int send_rate;
+	u_int send_rate_lower;
+	u_int send_rate_upper;
+	u_int aggre_bw_estimate;
+	u_int send_beyong_win;
+	u_int sample_rate;
+
+	pthread_mutex_t mutex CACHE_ALIGNED;
+	pthread_cond_t m_eventConnStateAvailable;
+	state_array states;
+	
+	SlideWindow sliding_avg_window CACHE_ALIGNED;    // ACK path
+	SlideWindow sliding_snd_window CACHE_ALIGNED;    // scheduler
+	SlideWindow sliding_uplink_window CACHE_ALIGNED;
+	AckHistory ack_history CACHE_ALIGNED;            // every ACK of the TCB, read by the downlink estimators
+        SlideWindow sliding_gradient_window CACHE_ALIGNED;
+        
+	u_int rcv_thrughput;
+	u_int rcv_thrughput_approx;
+
+	u_long_long initial_time;
+        u_long_long close_time;
+	ip_address client_ip_address;
+	ip_address server_ip_address;
+
+	u_int RTT;
+        u_int RTT_INST;
+	u_int RTT_limit;
+
+	/* written by the scheduler on every send */
+	u_int totalByteSent CACHE_ALIGNED;
+	u_long_long startTime;
+	transit_counter pkts_transit;
+
+	BOOL egress_blocked;          // skipped until the forwarder frees space
+	u_int egress_seq;             // Forward::space_seq when blocked
+	u_long_long egress_block_count;
+	BOOL ctrl_blocked;            // holds a window update the control lane had no room for
+	u_int ctrl_seq;               // Forward::space_seq of the uplink when deferred
+
+	u_long_long sched_cost;       // us the scheduler spent on this TCB in the current interval
+	u_long_long sched_bytes;      // bytes it sent in the current interval
+	volatile u_long_long buffered; // bytes its connections hold, charged to buf_budget
+
+        busyPeriodArray BusyPeriod;
+        
+        u_int unsent_data_bytes;        
+        busyPeriod idleTime;
         
         u_int delay_size;
         int unsent_size;
@@ -781,11 +1463,11 @@ struct TCB
         double increase_factor;
         u_int delay_threshold;
         
-	TCB():sliding_avg_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA), 
+	TCB():sliding_avg_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA, SW_BANDWIDTH|SW_UNSENT), 
 	sliding_snd_window (SND_WIN_SIZE, 0, 0), 
         BusyPeriod(BUSY_PERIOD_ARRAY_SIZE), 
-	sliding_uplink_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA), 
-        sliding_tsval_window(SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA), 
+	sliding_uplink_window (SLIDING_WIN_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA, SW_BANDWIDTH), 
+        ack_history(ACK_HISTORY_SIZE), 
         sliding_gradient_window(SLIDING_GRADIENT_SIZE, SLIDE_TIME_INTERVAL, SLIDE_TIME_DELTA)
 	{
 		send_rate = rcv_thrughput_approx = rcv_thrughput = INITIAL_RATE; //Bps
@@ -801,11 +1483,18 @@ struct TCB
                 
 		pthread_mutex_init(&mutex, NULL);
 		pthread_cond_init(&m_eventConnStateAvailable, NULL );
-		for (int i = 0; i < MAX_CONN_STATES + 1; i ++) {
-			conn[i] = NULL;
-		}
-
-		sample_rate = initial_time = pkts_transit = 0;
+		conn.clear();
+
+		sample_rate = initial_time = 0;
+		pkts_transit.flush();
+		egress_blocked = FALSE;
+		egress_seq = 0;
+		egress_block_count = 0;
+		ctrl_blocked = FALSE;
+		ctrl_seq = 0;
+		sched_cost = 0;
+		sched_bytes = 0;
+		buffered = 0;
                 close_time = 0;
 		totalByteSent = RTT = 0;
                 
@@ -876,17 +1565,23 @@ struct TCB
                 round_start = 0;
                 probe_state = USE_PROBE;
                 
-		for (int i = 0; i < MAX_CONN_STATES + 1; i ++) 
-                {
-                    conn[i] = NULL;
-		}
-
-		sample_rate = initial_time = pkts_transit = 0;
+		conn.clear();
+
+		sample_rate = initial_time = 0;
+		pkts_transit.flush();
+		egress_blocked = FALSE;
+		egress_seq = 0;
+		egress_block_count = 0;
+		ctrl_blocked = FALSE;
+		ctrl_seq = 0;
+		sched_cost = 0;
+		sched_bytes = 0;
+		buffered = 0;
 		close_time = 0;
 		states.flush();
 		sliding_avg_window.flush();
                 sliding_uplink_window.flush();
-                sliding_tsval_window.flush();
+                ack_history.flush();
                 sliding_gradient_window.flush();
                 //snd_window.flush();
 
@@ -940,6 +1635,14 @@ struct TCB
                 delay_threshold = 0;
 	}
 
+	u_int footprint() // the object plus its sample windows and busy periods
+	{
+		return sizeof(TCB) + sizeof(busyPeriod) * BusyPeriod.capacity + 
+			sliding_avg_window.footprint() + sliding_snd_window.footprint() + 
+			sliding_uplink_window.footprint() + ack_history.footprint() + 
+			sliding_gradient_window.footprint();
+	}
+
 	void add_conn(u_short sport, conn_state *new_conn)
 	{
 		conn[sport] = new_conn;
@@ -961,11 +1664,12 @@ struct TCB
             probe_state = USE_PROBE;
                 
             
-            sample_rate = pkts_transit = 0;
+            sample_rate = 0;
+            pkts_transit.flush();
             
             sliding_avg_window.flush();
             sliding_uplink_window.flush();
-            sliding_tsval_window.flush();
+            ack_history.flush();
 	    sliding_gradient_window.flush();
            
             totalByteSent = RTT = 0;
@@ -1020,18 +1724,131 @@ struct TCB
 	{
 		pthread_cond_destroy(&m_eventConnStateAvailable);
 		pthread_mutex_destroy(&mutex);
-		for (int i = 0; i < MAX_CONN_STATES + 1; i ++)
-		{
-			if (conn[i] != NULL)
-				conn[i] = NULL;
-		}
-
 	}
 };
 
-conn_state *conn_table[TOTAL_NUM_CONN];
-TCB *tcb_table[TOTAL_NUM_CONN];
+conn_state** volatile conn_table; ///< directories indexed by conn and TCB id, grown by mem_pool
+TCB** volatile tcb_table;
+
+#ifdef ACK_INBOX
+EventInbox ack_inbox(ACK_INBOX_SIZE); // client ACKs waiting for the scheduler, which owns every TCB
+#endif
+TxCompletionRing tx_done(TX_DONE_SIZE); // departures waiting for the scheduler
+SchedLoad sched_load;
+
+/* thread and memory placement, read from topology.txt; -1 leaves a thread unpinned */
+struct topology
+{
+	int capture_cpu[2];  ///< indexed by DIRECTION
+	int forward_cpu[2];
+	int scheduler_cpu;
+	int mem_cpu;         ///< CPU on the NIC's node, its node backs the packet and connection tables
+	int rt_priority;     ///< SCHED_FIFO priority, 0 keeps the default policy
+	int lock_memory;     ///< mlockall() once the tables are allocated
+
+	topology() : scheduler_cpu(-1), mem_cpu(-1), rt_priority(0), lock_memory(0)
+	{
+		capture_cpu[0] = capture_cpu[1] = forward_cpu[0] = forward_cpu[1] = -1;
+	}
+
+	void load(const char* path)
+	{
+		FILE* file;
+
+		if ((file = fopen(path, "r")) == NULL)
+			return; // optional, threads float and memory is allocated wherever main runs
+
+		fscanf(file, "%d\n", &capture_cpu[CLIENT_TO_SERVER]);
+		fscanf(file, "%d\n", &capture_cpu[SERVER_TO_CLIENT]);
+		fscanf(file, "%d\n", &forward_cpu[CLIENT_TO_SERVER]);
+		fscanf(file, "%d\n", &forward_cpu[SERVER_TO_CLIENT]);
+		fscanf(file, "%d\n", &scheduler_cpu);
+		fscanf(file, "%d\n", &mem_cpu);
+		fscanf(file, "%d\n", &rt_priority);
+		fscanf(file, "%d\n", &lock_memory);
+		fclose(file);
+
+		printf("TOPOLOGY: capture %d/%d forward %d/%d scheduler %d memory %d fifo %d mlock %d\n",
+				capture_cpu[CLIENT_TO_SERVER], capture_cpu[SERVER_TO_CLIENT],
+				forward_cpu[CLIENT_TO_SERVER], forward_cpu[SERVER_TO_CLIENT],
+				scheduler_cpu, mem_cpu, rt_priority, lock_memory);
+	}
+}topo;
+
+void inline pin_self(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		fprintf(stderr, "Unable to pin to CPU %d: %s\n", cpu, strerror(errno));
+}
+void inline set_self_fifo()
+{
+	struct sched_param param;
 
+	if (topo.rt_priority <= 0)
+		return;
+
+	param.sched_priority = topo.rt_priority;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+		fprintf(stderr, "Unable to switch to SCHED_FIFO, keeping the default policy\n");
+}
+void inline spawn_thread(pthread_t* th, void* (*routine)(void *), void* arg, int cpu)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t set;
+	int err;
+
+	pthread_attr_init(&attr);
+	if (cpu >= 0)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	if (topo.rt_priority > 0)
+	{
+		param.sched_priority = topo.rt_priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	if ((err = pthread_create(th, &attr, routine, arg)) == EPERM && topo.rt_priority > 0)
+	{
+		fprintf(stderr, "Unable to use SCHED_FIFO, starting the thread with the default policy\n");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		err = pthread_create(th, &attr, routine, arg);
+	}
+	pthread_attr_destroy(&attr);
+
+	if (err)
+	{
+		fprintf(stderr, "Unable to create thread: %s\n", strerror(err));
+		exit(-1);
+	}
+}
+int nic_numa_node(const char* name)
+{
+	char path[128];
+	FILE* file;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", name);
+	if ((file = fopen(path, "r")) != NULL)
+	{
+		fscanf(file, "%d", &node);
+		fclose(file);
+	}
+
+	return node;
+}
 struct mem_pool
 {
 	state_array ex_tcb;
@@ -1041,6 +1858,12 @@ struct mem_pool
 
 	u_int _size;
 
+	state_array free_conn;    ///< ids of conn_state objects not in use
+	state_array free_tcb;
+	u_int conn_num, tcb_num;  ///< objects allocated so far
+	u_int conn_dir, tcb_dir;  ///< directory slots
+	pthread_mutex_t id_mutex; ///< ids are taken by the capturer and given back by the scheduler
+
 	mem_pool()
 	{
 		printf("MOBILE ACCELERATOR INITIALIZES THE CONNECTION TABLES\n");
@@ -1059,31 +1882,142 @@ struct mem_pool
 		fscanf(test_file, "%u\n", &NUM_PKT_BEYOND_WIN);
 		fscanf(test_file, "%u\n", &BDP); // num of
 		fscanf(test_file, "%u\n", &RTT_LIMIT); //us
-
+		if (fscanf(test_file, "%u\n", &CONN_CAPACITY) != 1 || !CONN_CAPACITY)
+			CONN_CAPACITY = TOTAL_NUM_CONN; // older files stop at RTT_LIMIT
+		fscanf(test_file, "%u\n", &MAX_CONN_CAPACITY);
+		if (MAX_CONN_CAPACITY && MAX_CONN_CAPACITY < CONN_CAPACITY)
+			MAX_CONN_CAPACITY = CONN_CAPACITY;
+
+		topo.load("topology.txt");
+
+		// the arena prefers the node of mem_cpu from here on, so the tables
+		// grown later by the capturer and the Forward queues main() builds
+		// land there too. The thread gets its mask back so unpinned threads
+		// spawned later inherit it.
+		cpu_set_t saved;
+		BOOL restore = (topo.mem_cpu >= 0 && sched_getaffinity(0, sizeof(saved), &saved) == 0);
+		pin_self(topo.mem_cpu);
+		if (topo.mem_cpu >= 0)
+		{
+			unsigned cpu, node;
+			if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+				arena.set_node(node);
+		}
 		init_mem_pool();
+		if (restore && sched_setaffinity(0, sizeof(saved), &saved) != 0)
+			fprintf(stderr, "Unable to restore the CPU mask: %s\n", strerror(errno));
 	}
 
 	void init_mem_pool()
 	{
 		pthread_mutex_init(&mutex, NULL);
 		pthread_cond_init(&m_eventConnStateAvailable, NULL );
+		pthread_mutex_init(&id_mutex, NULL);
 
 		_size = 0;
+		conn_num = tcb_num = conn_dir = tcb_dir = 0;
+
+		grow_conn(CONN_CAPACITY);
+		printf("CONN MEMORY ALLOCATED %u\n", conn_num);
+
+		grow_tcb(CONN_CAPACITY);
+		printf("TCB MEMORY ALLOCATED %u\n", tcb_num);
+		printf("FOOTPRINT: %u bytes per connection, %u bytes per TCB\n", conn_table[0]->footprint(), tcb_table[0]->footprint());
+		arena.report();
+
+	}
+
+	/**
+	 * Doubles a directory. The old one is left in place, a reader may have
+	 * loaded it just before the switch; all of them together stay smaller
+	 * than the live directory.
+	 */
+	template <class T> static T** grow_directory(T** dir, u_int num, u_int& size)
+	{
+		u_int new_size = (size ? size * 2 : CONN_CAPACITY);
+		T** new_dir = (T **)huge_alloc(sizeof(T *) * new_size);
 
-		for (u_int i = 0; i < TOTAL_NUM_CONN; i ++)
+		for (u_int i = 0; i < num; i ++)
+			new_dir[i] = dir[i];
+		for (u_int i = num; i < new_size; i ++)
+			new_dir[i] = NULL;
+
+		__sync_synchronize();
+		size = new_size;
+		return new_dir;
+	}
+
+	u_int inline grow_step(u_int num, u_int want)
+	{
+		if (MAX_CONN_CAPACITY && num + want > MAX_CONN_CAPACITY)
+			want = (num < MAX_CONN_CAPACITY ? MAX_CONN_CAPACITY - num : 0);
+		return want;
+	}
+
+	void grow_conn(u_int want) // caller holds id_mutex or runs before the threads start
+	{
+		want = grow_step(conn_num, want);
+
+		for (u_int i = 0; i < want; i ++)
 		{
-			conn_table[i] = new conn_state(CIRCULAR_BUF_SIZE);
+			if (conn_num == conn_dir)
+				conn_table = grow_directory(conn_table, conn_num, conn_dir);
+
+			conn_table[conn_num] = new (huge_alloc(sizeof(conn_state))) conn_state(CIRCULAR_BUF_SIZE);
+			free_conn.add(conn_num);
+			conn_num ++;
 		}
 
-		printf("CONN MEMORY ALLOCATED\n");
+		// the buffers scale with the connections that can hold data
+		slab.set_max(conn_num * SLAB_PKTS_PER_CONN);
+		buf_budget.set_limit((u_long_long)conn_num * SLAB_PKTS_PER_CONN * PKT_SIZE / 100 * BUFFER_BUDGET_SHARE);
+	}
+
+	void grow_tcb(u_int want) // caller holds id_mutex or runs before the threads start
+	{
+		want = grow_step(tcb_num, want);
 
-		for (u_int i = 0; i < TOTAL_NUM_CONN; i ++)
+		for (u_int i = 0; i < want; i ++)
 		{
-			tcb_table[i] = new TCB;
+			if (tcb_num == tcb_dir)
+				tcb_table = grow_directory(tcb_table, tcb_num, tcb_dir);
+
+			tcb_table[tcb_num] = new (huge_alloc(sizeof(TCB))) TCB;
+			free_tcb.add(tcb_num);
+			tcb_num ++;
 		}
+	}
 
-		printf("TCB MEMORY ALLOCATED");
+	int take_id(state_array& free_ids, BOOL is_conn)
+	{
+		int id = -1;
 
+		pthread_mutex_lock(&id_mutex);
+		if (free_ids.isEmpty())
+		{
+			if (is_conn)
+				grow_conn(CAPACITY_GROW_STEP);
+			else
+				grow_tcb(CAPACITY_GROW_STEP);
+		}
+		if (!free_ids.isEmpty())
+		{
+			id = free_ids.state_id[free_ids.num - 1];
+			free_ids.del(free_ids.num - 1);
+		}
+		pthread_mutex_unlock(&id_mutex);
+
+		return id;
+	}
+
+	int inline take_conn() { return take_id(free_conn, TRUE); }
+	int inline take_tcb() { return take_id(free_tcb, FALSE); }
+
+	void inline put_id(state_array& free_ids, u_int id)
+	{
+		pthread_mutex_lock(&id_mutex);
+		free_ids.add(id);
+		pthread_mutex_unlock(&id_mutex);
 	}
 
 	void inline add_tcb(u_int value)
@@ -1102,6 +2036,7 @@ struct mem_pool
 	{
 		pthread_mutex_destroy(&mutex);
 		pthread_cond_destroy(&m_eventConnStateAvailable);
+		pthread_mutex_destroy(&id_mutex);
 		//delete[] conn_table;
 		//delete[] tcb_table;
 	}
@@ -1119,101 +2054,410 @@ u_int HashBernstein(const char *key, size_t len)
 	u_int hash = 5381;
 	for(u_int i = 0; i < len; ++i)
 		hash = 33 * hash + key[i];
-	return (hash ^ (hash >> 16)) % TOTAL_NUM_CONN;
+	return (hash ^ (hash >> 16));
 }
 
+/* a split connection as the flow table sees it; TCBs use the client IP alone */
+struct flow_key
+{
+	ip_address client_ip;
+	ip_address server_ip;
+	u_short client_port;
+	u_short server_port;
+};
+
+/**
+ * Robin Hood index from flow_key to conn or TCB id. Deletion shifts the
+ * following entries back, so there are no tombstones and every chain ends
+ * at the first entry closer to home than the key would be. No entry is
+ * ever left further than FLOW_MAX_PROBE from home: an insert that would
+ * push one past it starts a resize before anything is moved, and a drain
+ * that would do so widens the new table first.
+ *
+ * A resize puts a table of twice the size in front and copies the old one
+ * over REHASH_STEP buckets per insert or erase. The old table is frozen
+ * meanwhile (erase only clears the id there), so lookups probe the new
+ * table and then the old one. Lookups take no lock; each table carries a
+ * sequence count that is odd while a writer is moving entries, and a reader
+ * that saw it change probes again. A drained table is handed to grace.
+ */
+struct flow_index
+{
+	struct slot
+	{
+		flow_key key;
+		u_int hash;
+		int id;       ///< -1 once erased from a table that is being drained
+		u_short dist; ///< distance from home + 1, 0 for an empty slot
+	};
+	struct slots
+	{
+		volatile u_int seq;
+		u_int mask;
+		slot s[1];
+	};
+
+	slots* volatile table;
+	slots* volatile old; ///< being drained into table, NULL when no resize is running
+	u_int drain;         ///< next bucket of old to copy
+	u_int count;         ///< entries in table
+	pthread_mutex_t mutex;
+
+	flow_index() : old(NULL), drain(0), count(0)
+	{
+		table = alloc(FLOW_INDEX_INIT_SIZE);
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~flow_index()
+	{
+		free(old);
+		free(table);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	static slots* alloc(u_int size)
+	{
+		slots* t = (slots *)malloc(sizeof(slots) + sizeof(slot) * (size - 1));
+		t->seq = 0;
+		t->mask = size - 1;
+		for (u_int i = 0; i < size; i ++)
+		{
+			t->s[i].dist = 0;
+			t->s[i].id = -1;
+		}
+		return t;
+	}
+
+	static inline u_int hash(const flow_key& key) { return HashBernstein((const char *)&key, sizeof(key)); }
+
+	static inline BOOL same(const flow_key& a, const flow_key& b) { return memcmp(&a, &b, sizeof(flow_key)) == 0; }
+
+	static inline int locate(slots* t, const flow_key& key, u_int h) // slot of key, -1 if absent
+	{
+		u_int i = h & t->mask;
+		for (u_int d = 1; d <= t->mask + 1; i = (i + 1) & t->mask, d ++)
+		{
+			if (t->s[i].dist < d)
+				break; // key would have displaced this entry
+			if (t->s[i].hash == h && same(t->s[i].key, key))
+				return i;
+		}
+		return -1;
+	}
+
+	static int lookup(slots* t, const flow_key& key, u_int h)
+	{
+		u_int seq;
+		int i, id;
+
+		do
+		{
+			while ((seq = t->seq) & 1)
+				;
+			__sync_synchronize();
+			i = locate(t, key, h);
+			id = (i == -1 ? -1 : t->s[i].id);
+			__sync_synchronize();
+		} while (t->seq != seq);
+
+		return id;
+	}
+
+	inline int find(const flow_key& key)
+	{
+		u_int h = hash(key);
+		slots* t = table;
+		slots* o = old; // loaded after table: if table is the new one, old was set before it
+		int id = lookup(t, key, h);
+
+		if (id == -1 && o && o != t)
+			id = lookup(o, key, h);
+		return id;
+	}
+
+	static BOOL fits(slots* t, const slot& in, u_int bound) // dry run of place(), moves nothing
+	{
+		u_int i = in.hash & t->mask;
+
+		for (u_int d = 1; d <= bound; i = (i + 1) & t->mask, d ++)
+		{
+			if (!t->s[i].dist)
+				return TRUE;
+			if (t->s[i].dist < d)
+				d = t->s[i].dist; // that entry would be carried on instead
+		}
+		return FALSE;
+	}
+
+	/**
+	 * Robin Hood placement, caller holds mutex. Returns FALSE when the entry
+	 * in hand went past bound; that entry, possibly a displaced one, is left
+	 * in in, so only call it on a published table once fits() said yes.
+	 */
+	static BOOL place(slots* t, slot& in, u_int bound)
+	{
+		u_int i = in.hash & t->mask;
+		BOOL placed = FALSE;
+
+		in.dist = 1;
+		t->seq ++;
+		__sync_synchronize();
+		while (in.dist <= bound)
+		{
+			if (!t->s[i].dist)
+			{
+				t->s[i] = in;
+				placed = TRUE;
+				break;
+			}
+			if (t->s[i].dist < in.dist)
+			{
+				slot poorer = t->s[i];
+				t->s[i] = in;
+				in = poorer;
+			}
+			i = (i + 1) & t->mask;
+			in.dist ++;
+		}
+		__sync_synchronize();
+		t->seq ++;
+
+		return placed;
+	}
+
+	static BOOL remove(slots* t, const flow_key& key, u_int h) // caller holds mutex, backward-shift deletion
+	{
+		int at = locate(t, key, h);
+		if (at == -1)
+			return FALSE;
+
+		u_int i = at, j = (i + 1) & t->mask;
+		t->seq ++;
+		__sync_synchronize();
+		while (t->s[j].dist > 1)
+		{
+			t->s[i] = t->s[j];
+			t->s[i].dist --;
+			i = j;
+			j = (j + 1) & t->mask;
+		}
+		t->s[i].dist = 0;
+		t->s[i].id = -1;
+		__sync_synchronize();
+		t->seq ++;
+
+		return TRUE;
+	}
+
+	void drain_step(u_int buckets) // caller holds mutex
+	{
+		if (!old)
+			return;
+
+		for (; buckets && drain <= old->mask; buckets --, drain ++)
+		{
+			if (old->s[drain].dist && old->s[drain].id != -1)
+			{
+				slot in = old->s[drain];
+				while (!fits(table, in, FLOW_MAX_PROBE))
+					widen();
+				place(table, in, FLOW_MAX_PROBE);
+				count ++;
+			}
+		}
+
+		if (drain > old->mask)
+		{
+			slots* drained = old;
+			old = NULL;
+			__sync_synchronize();
+			grace.retire(drained); // freed once no reader can still be probing it
+		}
+	}
+
+	void widen() // caller holds mutex, rehashes table into a larger one while old keeps draining
+	{
+		u_int size = (table->mask + 1) * 2;
+		slots* t;
+
+		for (;;)
+		{
+			BOOL ok = TRUE;
+			t = alloc(size);
+			for (u_int j = 0; j <= table->mask && ok; j ++)
+			{
+				if (table->s[j].dist)
+				{
+					slot in = table->s[j];
+					ok = place(t, in, FLOW_MAX_PROBE); // t is not published yet
+				}
+			}
+			if (ok)
+				break;
+			free(t);
+			size *= 2;
+		}
+
+		slots* prev = table;
+		__sync_synchronize(); // t is complete before readers can pick it up
+		table = t;
+		grace.retire(prev); // still complete, a reader holding it finds every entry
+	}
+
+	void start_resize() // caller holds mutex
+	{
+		while (old)
+			drain_step(old->mask + 1); // the previous resize has to finish first
+
+		old = table;
+		drain = 0;
+		__sync_synchronize();
+		table = alloc((old->mask + 1) * 2);
+		count = 0;
+	}
+
+	void insert(const flow_key& key, int id)
+	{
+		slot in;
+
+		in.key = key;
+		in.hash = hash(key);
+		in.id = id;
+
+		pthread_mutex_lock(&mutex);
+		drain_step(REHASH_STEP);
+		if ((count + 1) * 4 > (table->mask + 1) * 3 || !fits(table, in, FLOW_MAX_PROBE))
+			start_resize(); // the new table is empty, so in fits there
+		place(table, in, FLOW_MAX_PROBE);
+		count ++;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void erase(const flow_key& key)
+	{
+		u_int h = hash(key);
+
+		pthread_mutex_lock(&mutex);
+		drain_step(REHASH_STEP);
+		if (remove(table, key, h))
+			count --;
+		if (old)
+		{
+			int i = locate(old, key, h);
+			if (i != -1)
+				old->s[i].id = -1; // frozen, the drain skips it
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+};
+
 struct conn_Htable
 {
 	u_int size;
+	flow_index index; ///< client and server address and port to conn id
 
 	conn_Htable()
 	{
 		size = 0;
 	}
 
-	int Hash(const char *key, size_t len)
+	int Hash(const flow_key& key)
 	{
-		u_int i = HashBernstein(key, len);
+		int i = pool.take_conn();
 
-		if (size == TOTAL_NUM_CONN)
+		if (i == -1)
 			return -1;
 
-		while(conn_table[i]->initial_time)
-		{
-			i = (i + 1) % TOTAL_NUM_CONN;
-		}
-
+		index.insert(key, i);
 		size ++;
 
 		return i;
 	}
 
-	int search(const char *key, size_t len, u_short cPort)
+	int search(const flow_key& key)
 	{
-		u_int i = HashBernstein(key, len);
-		while (conn_table[i]->initial_time)
-		{
-			if (conn_table[i]->cPort == cPort)
-				return i;
-			i = (i + 1) % TOTAL_NUM_CONN;
-		}
-
-		return -1;
+		return index.find(key);
 	}
 
-	void decrease()
+	void remove(conn_state* conn) // the id stays taken until release()
 	{
+		flow_key key;
+
+		key.client_ip = conn->client_ip_address;
+		key.server_ip = conn->server_ip_address;
+		key.client_port = conn->cPort;
+		key.server_port = conn->sPort;
+		index.erase(key);
+
 		if (size)
 			size --;
 	}
 
+	void rekey(conn_state* conn, const flow_key& key) // a closed connection reused by a new flow keeps its id
+	{
+		remove(conn);
+		index.insert(key, conn->index);
+		size ++;
+	}
+
+	void release(u_int conn_index) // the connection is flushed and unreachable
+	{
+		pool.put_id(pool.free_conn, conn_index);
+	}
+
 };
 conn_Htable conn_hash;
 struct tcb_Htable
 {
 	u_int size;
+	flow_index index; ///< client IP to TCB id
 
 	tcb_Htable()
 	{
 		size = 0;
 	}
 
-	int Hash(const char *key, size_t len)
+	static inline flow_key user_key(ip_address client_ip)
 	{
-		u_int i = HashBernstein(key, len);
+		flow_key key;
 
-		if (size == TOTAL_NUM_CONN)
-			return -1;
+		memset(&key, 0, sizeof(key));
+		key.client_ip = client_ip;
+		return key;
+	}
 
-		while(tcb_table[i]->initial_time)
-		{
-			i = (i + 1) % TOTAL_NUM_CONN;
-		}
+	int Hash(ip_address client_ip)
+	{
+		int i = pool.take_tcb();
 
+		if (i == -1)
+			return -1;
+
+		index.insert(user_key(client_ip), i);
 		size ++;
 
 		return i;
 	}
 
-	int search(const char *key, size_t len, ip_address *client_ip)
+	int search(ip_address client_ip)
 	{
-		u_int i = HashBernstein(key, len);
-		while (tcb_table[i]->initial_time)
-		{
-			if (memcmp(&tcb_table[i]->client_ip_address, client_ip, sizeof(ip_address)) == 0)
-				return i;
-			i = (i + 1) % TOTAL_NUM_CONN;
-		}
-
-		return -1;
+		return index.find(user_key(client_ip));
 	}
 
-	void decrease()
+	void remove(u_int tcb_index) // the id stays taken until release()
 	{
+		index.erase(user_key(tcb_table[tcb_index]->client_ip_address));
+
 		if (size)
 			size --;
 	}
 
+	void release(u_int tcb_index) // the TCB is flushed and unreachable
+	{
+		pool.put_id(pool.free_tcb, tcb_index);
+	}
+
 };
 
 tcb_Htable tcb_hash;
@@ -1272,12 +2516,14 @@ void ifprint(pcap_if_t *d)
 void inline print_bw_info(u_short sport, u_int tcb_index)
 {
 #ifdef DEBUG
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
 	printf("STATE %d BUFFER %u %u ACK %u INTERARRIVAL TIME %u RTT %u RTO %u RTT STD %u SENDING RATE %u AGGREGATE ESTIMATED RATE %u INDIVIDUAL APPROX ESTIMATED RATE %u INDIVIDUAL INSTAN ESTIMATED RATE %u CONNID %hu\n",
-			tcb_table[tcb_index]->conn[sport]->server_state.phase, tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd,
-			tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size(), tcb_table[tcb_index]->conn[sport]->server_state.snd_una,
-			tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->rto,
-			tcb_table[tcb_index]->conn[sport]->rtt_std_dev, tcb_table[tcb_index]->send_rate, tcb_table[tcb_index]->rcv_thrughput_approx,
-			tcb_table[tcb_index]->send_rate_upper, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, sport);
+			conn->server_state.phase, conn->client_state.rcv_wnd,
+			conn->dataPktBuffer.size(), conn->server_state.snd_una,
+			conn->ack_interarrival_time, conn->RTT, conn->rto,
+			conn->rtt_std_dev, tcb_table[tcb_index]->send_rate, tcb_table[tcb_index]->rcv_thrughput_approx,
+			tcb_table[tcb_index]->send_rate_upper, conn->rcv_thrughput_approx, sport);
 #endif
 }
 u_short inline CheckSum(u_short * buffer, u_int size)
@@ -1298,72 +2544,289 @@ u_short inline CheckSum(u_short * buffer, u_int size)
 
     return (u_short) (~cksum);
 }
-void inline init_retx_data_pkt(u_int tcb_index, u_short sport, u_int num_init)
+void inline init_retx_data_pkt(u_int tcb_index, u_short sport, u_int num_init)
+{
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	u_int index = conn->dataPktBuffer._unAck;
+	ForwardPkt *retx_pkt;
+
+	for (u_int i = 0; i < num_init; i ++)
+	{
+		retx_pkt = conn->dataPktBuffer.pkt(index);
+		retx_pkt->snd_time = 0;
+		index = conn->dataPktBuffer.pktNext(index);
+	}
+}
+BOOL inline check_buffer_empty(u_int tcb_index, u_short dport)
+{
+        BOOL empty = TRUE;
+        u_short port;
+        for (int i = 0; i < tcb_table[tcb_index]->states.num; i ++)
+        {
+            port = tcb_table[tcb_index]->states.state_id[i];
+            if (tcb_table[tcb_index]->conn[port]->dataPktBuffer.pkts())
+            {
+                empty = FALSE;
+                break;
+            }            
+        }
+        
+        return empty;
+        
+}
+BOOL inline check_conn_state(u_int tcb_index)
+{
+    BOOL closed = TRUE;
+    u_short port;
+    
+    for (int i = 0; i < tcb_table[tcb_index]->states.num; i ++)
+    {
+        port = tcb_table[tcb_index]->states.state_id[i];
+        if (tcb_table[tcb_index]->conn[port]->server_state.state != CLOSED)
+        {
+            closed = FALSE;
+            break;
+        }            
+    }
+
+    return closed; 
+}
+void inline apply_tx_done(TxCompletion* done)
+{
+    conn_state* conn = tcb_table[done->tcb_index]->conn[done->dport];
+
+    if (conn == NULL || conn->generation != done->gen || conn->server_state.state == CLOSED)
+    {
+        tx_done.stale ++;
+        return;
+    }
+
+    ForwardPkt* sendPkt = conn->dataPktBuffer.pkt(done->index);
+    if (!conn->dataPktBuffer.live(sendPkt) || sendPkt->seq_num != done->seq_num)
+    {
+        tx_done.stale ++;
+        return;
+    }
+
+    sendPkt->snd_time = done->snd_time;
+
+    tcb_table[done->tcb_index]->sliding_avg_window.sent_timestamp_rep = done->TSval;
+    tx_done.applied ++;
+}
+void inline drain_tx_done()
+{
+    TxCompletion batch[TX_DONE_BATCH];
+    u_int n;
+
+    while ((n = tx_done.take(batch, TX_DONE_BATCH)) > 0)
+    {
+        for (u_int i = 0; i < n; i ++)
+            apply_tx_done(&batch[i]);
+    }
+}
+void inline forward_sent(u_short sport, u_short dport, u_int index, u_int tcb_index, u_int gen, u_int seq_num, u_int TSval)
+{
+    if ((sport == APP_PORT_NUM || sport == APP_PORT_FORWARD) && gen) // buffered segments only, relayed frames carry no slot
+    {
+        TxCompletion done = {tcb_index, dport, index, gen, seq_num, TSval, timer.Start()};
+
+#ifdef SINGLE_THREAD_ENGINE
+        if (!tx_done.post(done.tcb_index, done.dport, done.index, done.gen, done.seq_num, done.TSval, done.snd_time))
+            apply_tx_done(&done); // ring full, the scheduler runs on this thread so the slot is ours to write
+#else
+        // never waits on the scheduler: the ring holds every frame the data lane can plus a
+        // visit's burst, all the scheduler can have queued since it last drained the ring.
+        // Should it still fill the record is dropped and counted in tx_done.overflow.
+        tx_done.post(done.tcb_index, done.dport, done.index, done.gen, done.seq_num, done.TSval, done.snd_time);
+#endif
+    }
+}
+void inline forward_space_freed(Forward* forward) // caller holds forward->mutex
+{
+    if (forward->full && forward->pktQueue.size() + forward->held + EGRESS_REARM_SPACE <= CIRCULAR_QUEUE_SIZE &&
+            forward->bql.queued + forward->held * MTU <= forward->bql.limit - forward->bql.limit / 4)
+    {
+        forward->full = FALSE;
+        forward->space_seq ++;
+    }
+    if (forward->ctrl_full && forward->ctrlQueue.size() + CTRL_REARM_SPACE <= forward->ctrlQueue.capacity)
+    {
+        forward->ctrl_full = FALSE;
+        forward->space_seq ++;
+    }
+}
+void inline forward_dequeued(Forward* forward, ForwardPktBuffer* lane, ForwardPkt* pkt) // caller holds forward->mutex
+{
+    if (lane != &forward->pktQueue)
+        return;
+
+    u_long_long now = timer.Start();
+    forward->bql.dequeue(pkt->header.len, now - pkt->enq_time, now);
+}
+ForwardPktBuffer* forward_next_lane(Forward* forward) // caller holds forward->mutex
+{
+    if (forward->ctrlQueue.size())
+        forward->ctrl_nonempty ++;
+    if (forward->pktQueue.size())
+        forward->data_nonempty ++;
+
+    return (forward->ctrlQueue.size() ? &forward->ctrlQueue : &forward->pktQueue);
+}
+void inline forward_xmit_head(Forward* forward) // caller holds forward->mutex
+{
+    ForwardPktBuffer* lane = forward_next_lane(forward);
+    ForwardPkt* tmpForwardPkt = lane->head();
+
+    if (pcap_sendpacket(forward->dev, tmpForwardPkt->pkt_data, tmpForwardPkt->header.len) != 0)
+    {
+        fprintf(stderr,"\nError sending the packet: %s\n", pcap_geterr(forward->dev));
+        exit(-1);
+    }
+
+    forward_sent(tmpForwardPkt->sPort, tmpForwardPkt->dPort, tmpForwardPkt->index, tmpForwardPkt->tcb, tmpForwardPkt->gen, tmpForwardPkt->seq_num, tmpForwardPkt->TSval);
+    forward_dequeued(forward, lane, tmpForwardPkt);
+    tmpForwardPkt->initPkt();
+    lane->headNext();
+    lane->decrease();
+    forward_space_freed(forward);
+}
+void inline forward_flush(Forward* forward)
+{
+    pthread_mutex_lock(&forward->mutex);
+    while (forward->ctrlQueue.size() || forward->pktQueue.size())
+        forward_xmit_head(forward);
+    pthread_mutex_unlock(&forward->mutex);
+}
+ForwardPkt* forward_reserve(Forward* forward) // returns with forward->mutex held
+{
+    pthread_mutex_lock(&forward->mutex);
+    while (forward->pktQueue.size() + forward->held >= CIRCULAR_QUEUE_SIZE)
+    {
+#ifdef SINGLE_THREAD_ENGINE
+        forward_xmit_head(forward); // no forwarder thread to wait for
+#else
+        pthread_cond_wait(&forward->m_eventSpaceAvailable, &forward->mutex);
+#endif
+    }
+
+    return forward->pktQueue.tail();
+}
+void inline forward_push_tail(Forward* forward) // caller holds forward->mutex
+{
+    forward->pktQueue.tail()->enq_time = timer.Start();
+    forward->bql.enqueue(forward->pktQueue.tail()->header.len);
+    forward->pktQueue.tailNext();
+    forward->pktQueue.increase();
+}
+void inline forward_commit(Forward* forward)
+{
+    forward_push_tail(forward);
+    pthread_cond_signal(&forward->m_eventElementAvailable);
+    pthread_mutex_unlock(&forward->mutex);
+}
+ForwardPkt* forward_reserve_ctrl(Forward* forward) // returns with forward->mutex held
+{
+    pthread_mutex_lock(&forward->mutex);
+    while (forward->ctrlQueue.size() >= forward->ctrlQueue.capacity)
+    {
+#ifdef SINGLE_THREAD_ENGINE
+        forward_xmit_head(forward);
+#else
+        pthread_cond_wait(&forward->m_eventSpaceAvailable, &forward->mutex);
+#endif
+    }
+
+    return forward->ctrlQueue.tail();
+}
+/* control lane slot for the scheduler, never waits: NULL when the lane is full, else returns with forward->mutex held */
+ForwardPkt* forward_try_reserve_ctrl(Forward* forward, u_int* space_seq) // *space_seq is read under the lock
+{
+    pthread_mutex_lock(&forward->mutex);
+#ifdef SINGLE_THREAD_ENGINE
+    while (forward->ctrlQueue.size() >= forward->ctrlQueue.capacity)
+        forward_xmit_head(forward);
+#endif
+    if (forward->ctrlQueue.size() >= forward->ctrlQueue.capacity)
+    {
+        forward->ctrl_full = TRUE;
+        *space_seq = forward->space_seq;
+        pthread_mutex_unlock(&forward->mutex);
+        return NULL;
+    }
+
+    return forward->ctrlQueue.tail();
+}
+void inline forward_commit_ctrl(Forward* forward)
 {
-	u_int index = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-	ForwardPkt *retx_pkt;
-
-	for (u_int i = 0; i < num_init; i ++)
-	{
-		retx_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkt(index);
-		retx_pkt->snd_time = 0;
-		index = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pktNext(index);
-	}
+    forward->ctrlQueue.tailNext();
+    forward->ctrlQueue.increase();
+    pthread_cond_signal(&forward->m_eventElementAvailable);
+    pthread_mutex_unlock(&forward->mutex);
 }
-BOOL inline check_buffer_empty(u_int tcb_index, u_short dport)
+/*
+ * segments without payload go to the control lane: pure ACKs, handshake and
+ * FIN/RST. A bare FIN or RST may overtake data of its flow still queued, the
+ * receiver holds it out of order; a FIN carrying data keeps its place.
+ */
+BOOL inline is_ctrl_frame(const u_char* pkt_data, u_int len)
 {
-        BOOL empty = TRUE;
-        u_short port;
-        for (int i = 0; i < tcb_table[tcb_index]->states.num; i ++)
-        {
-            port = tcb_table[tcb_index]->states.state_id[i];
-            if (tcb_table[tcb_index]->conn[port]->dataPktBuffer.pkts())
-            {
-                empty = FALSE;
-                break;
-            }            
-        }
-        
-        return empty;
-        
+    if (len < 14 + 20 || pkt_data[14] == '\0')
+        return FALSE;
+
+    ip_header* ih = (ip_header *)(pkt_data + 14);
+    if ((u_int)ih->proto != 6)
+        return FALSE;
+
+    u_int ip_len = (ih->ver_ihl & 0xf) * 4;
+    if (len < 14 + ip_len + 20)
+        return FALSE;
+
+    tcp_header* th = (tcp_header *)((u_char *)ih + ip_len);
+    u_int tcp_len = ((ntohs(th->hdr_len_resv_code)&0xf000)>>12)*4;
+
+    return (ntohs(ih->tlen) <= ip_len + tcp_len);
 }
-BOOL inline check_conn_state(u_int tcb_index)
+/* set aside up to want slots for a scheduler visit, never waits */
+u_int inline forward_try_hold(Forward* forward, u_int want, u_int* space_seq) // *space_seq is read under the lock
 {
-    BOOL closed = TRUE;
-    u_short port;
-    
-    for (int i = 0; i < tcb_table[tcb_index]->states.num; i ++)
+    u_int got = 0;
+
+    pthread_mutex_lock(&forward->mutex);
+#ifdef SINGLE_THREAD_ENGINE
+    while (forward->pktQueue.size() && (forward->pktQueue.size() + forward->held >= CIRCULAR_QUEUE_SIZE || forward->bql.over(forward->held)))
+        forward_xmit_head(forward);
+#endif
+    while (got < want && forward->pktQueue.size() + forward->held < CIRCULAR_QUEUE_SIZE && !forward->bql.over(forward->held))
     {
-        port = tcb_table[tcb_index]->states.state_id[i];
-        if (tcb_table[tcb_index]->conn[port]->server_state.state != CLOSED)
-        {
-            closed = FALSE;
-            break;
-        }            
+        forward->held ++;
+        got ++;
+    }
+    if (!got)
+    {
+        forward->full = TRUE;
+        forward->bql.ovlimit = TRUE;
     }
+    *space_seq = forward->space_seq;
+    pthread_mutex_unlock(&forward->mutex);
 
-    return closed; 
+    return got;
 }
 void inline send_forward(DATA* data, struct pcap_pkthdr* header, u_char* pkt_data) //+ add const
 {
-	pthread_mutex_lock(&data->forward->mutex);
-	while (data->forward->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-		pthread_cond_wait(&data->forward->m_eventSpaceAvailable, &data->forward->mutex);
-	ForwardPkt *tmpForwardPkt = data->forward->pktQueue.tail();
+	BOOL ctrl = is_ctrl_frame(pkt_data, header->len);
+	ForwardPkt *tmpForwardPkt = (ctrl ? forward_reserve_ctrl(data->forward) : forward_reserve(data->forward));
 	tmpForwardPkt->data = (void *)data;
 	memcpy(&(tmpForwardPkt->header), header, sizeof(struct pcap_pkthdr));
 	memcpy(tmpForwardPkt->pkt_data, pkt_data, header->len);
-	data->forward->pktQueue.tailNext();
-	data->forward->pktQueue.increase();
-	pthread_cond_signal(&data->forward->m_eventElementAvailable);
-	pthread_mutex_unlock(&data->forward->mutex);
+	if (ctrl)
+		forward_commit_ctrl(data->forward);
+	else
+		forward_commit(data->forward);
 }
 void inline send_wait_forward(DATA* data, struct pcap_pkthdr* header, const u_char* pkt_data, u_short sport, u_short dport, u_int data_len, u_short ctrl_flag, u_int seq_num)
 {
-        pthread_mutex_lock(&data->forward->mutex);
-        while (data->forward->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-                pthread_cond_wait(&data->forward->m_eventSpaceAvailable, &data->forward->mutex);
-        ForwardPkt *tmpForwardPkt = data->forward->pktQueue.tail();
+        ForwardPkt *tmpForwardPkt = forward_reserve(data->forward);
         tmpForwardPkt->data = (void *)data;
         tmpForwardPkt->sPort = sport;
         tmpForwardPkt->dPort = dport;
@@ -1372,48 +2835,165 @@ void inline send_wait_forward(DATA* data, struct pcap_pkthdr* header, const u_ch
         tmpForwardPkt->seq_num = seq_num;
         memcpy(&(tmpForwardPkt->header), header, sizeof(struct pcap_pkthdr));
         memcpy(tmpForwardPkt->pkt_data, pkt_data, header->len);
-        data->forward->pktQueue.tailNext();
-        data->forward->pktQueue.increase();
-        pthread_cond_signal(&data->forward->m_eventElementAvailable);
-        pthread_mutex_unlock(&data->forward->mutex);
+        forward_commit(data->forward);
 }
 void inline send_backward(DATA* data, struct pcap_pkthdr* header, const u_char* pkt_data)
 {
-	pthread_mutex_lock(&data->forward_back->mutex);
-	while (data->forward_back->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-		pthread_cond_wait(&data->forward_back->m_eventSpaceAvailable, &data->forward_back->mutex);
-
-	ForwardPkt *tmpForwardPkt = data->forward_back->pktQueue.tail();
+	BOOL ctrl = is_ctrl_frame(pkt_data, header->len);
+	ForwardPkt *tmpForwardPkt = (ctrl ? forward_reserve_ctrl(data->forward_back) : forward_reserve(data->forward_back));
 	tmpForwardPkt->data = (void *)data;
 	memcpy(&(tmpForwardPkt->header), header, sizeof(struct pcap_pkthdr));
 	memcpy(tmpForwardPkt->pkt_data, pkt_data, header->len);
-	data->forward_back->pktQueue.tailNext();
-	data->forward_back->pktQueue.increase();
-	pthread_cond_signal(&data->forward_back->m_eventElementAvailable);
-	pthread_mutex_unlock(&data->forward_back->mutex);
+	if (ctrl)
+		forward_commit_ctrl(data->forward_back);
+	else
+		forward_commit(data->forward_back);
+}
+#ifdef PAYLOAD_STORAGE
+/*
+ * Drops the TCP options that do not fit in room bytes of header, whole
+ * options only, and pads the rest with NOPs. Returns the new header length.
+ */
+u_short inline trim_tcp_options(tcp_header* th, u_short tcp_len, u_int room)
+{
+	u_short limit = (room < 20 ? 20 : room / 4 * 4);
+	if (tcp_len <= limit)
+		return tcp_len;
+
+	u_char *opt = (u_char *)th + 20, *end = (u_char *)th + tcp_len, *out = opt;
+	while (opt < end && *opt != 0)
+	{
+		u_int len = (*opt == 1 ? 1 : (opt + 1 < end ? opt[1] : 0));
+		if (len < 1 || opt + len > end)
+			break;
+		if (out + len <= (u_char *)th + limit)
+		{
+			memmove(out, opt, len);
+			out += len;
+		}
+		opt += len;
+	}
+	memset(out, 1, (u_char *)th + limit - out);
+
+	return limit;
+}
+/*
+ * Builds the frame of a buffered segment: the connection's template with
+ * the slot's sequence number, flags and payload. The ACK number, window
+ * and options are those of the latest segment from the server, so a
+ * retransmission carries them instead of the ones it first went out with.
+ * The headers are cut down to what the segment arrived with, so the frame
+ * is never longer than the one the server sent, and each frame takes the
+ * connection's next IP ID. Returns the frame length, 0 only when the slot
+ * was ACKed; the caller holds the connection mutex.
+ */
+u_int inline build_data_frame(ForwardPkt* pkt, u_char* frame)
+{
+	u_char pkt_buffer[MTU + sizeof(psd_header)];
+	u_int seq_num = pkt->seq_num, data_len = pkt->data_len, off = pkt->off;
+	u_short ctr_flag = pkt->ctr_flag;
+
+	conn_state* conn = tcb_table[pkt->tcb]->conn[pkt->dPort];
+	if (conn == NULL || !conn->dataPktBuffer.live(pkt))
+		return 0;
+
+	conn->dataPktBuffer.get_template(frame);
+	ip_header* ih = (ip_header *)(frame + 14);
+	u_int ip_len = (ih->ver_ihl & 0xf) * 4;
+	tcp_header* th = (tcp_header *)((u_char *)ih + ip_len);
+	u_short tcp_len = ((ntohs(th->hdr_len_resv_code)&0xf000)>>12)*4;
+
+	if (14 + ip_len + 20 > pkt->hdr_len && ip_len > 20)
+	{
+		// the template has IP options the segment did not, keep the fixed IP header only
+		memmove((u_char *)ih + 20, th, tcp_len);
+		ih->ver_ihl = (ih->ver_ihl & 0xf0) | 5;
+		ip_len = 20;
+		th = (tcp_header *)((u_char *)ih + ip_len);
+	}
+	tcp_len = trim_tcp_options(th, tcp_len, pkt->hdr_len - 14 - ip_len);
+	u_int hdr_len = 14 + ip_len + tcp_len;
+
+	if (!conn->dataPktBuffer.payload(off, data_len, frame + hdr_len))
+		return 0;
+
+	ih->tlen = htons(ip_len + tcp_len + data_len);
+	ih->identification = htons(conn->dataPktBuffer.next_ip_id(ntohs(ih->identification)));
+	ih->crc = 0;
+	ih->crc = CheckSum((u_short *)ih, ip_len);
+
+	th->seq_num = htonl(seq_num);
+	th->hdr_len_resv_code = htons((tcp_len / 4) << 12 | ctr_flag);
+	th->crc = 0;
+
+	psd_header psdHeader;
+	psdHeader.saddr = ih->saddr;
+	psdHeader.daddr = ih->daddr;
+	psdHeader.mbz = 0;
+	psdHeader.ptoto = IPPROTO_TCP;
+	psdHeader.tcp_len = htons(tcp_len + data_len);
+
+	memcpy(pkt_buffer, &psdHeader, sizeof(psd_header));
+	memcpy(pkt_buffer + sizeof(psd_header), th, tcp_len + data_len);
+	th->crc = CheckSum((u_short *)pkt_buffer, tcp_len + sizeof(psd_header) + data_len);
+
+	return hdr_len + data_len;
+}
+#endif
+/* copies a scheduled segment and its frame out of the connection, caller holds conn->mutex */
+BOOL inline stage_data_pkt(ForwardPkt* pkt, ForwardPkt* staged)
+{
+	u_char *frame = staged->pkt_data;
+#ifdef PAYLOAD_STORAGE
+	u_int len = build_data_frame(pkt, frame);
+	if (!len)
+		return FALSE;
+#else
+	if (pkt->pkt_data == NULL)
+		return FALSE; // ACKed already, its frame is back in the slab
+	u_int len = pkt->header.len;
+	memcpy(frame, pkt->pkt_data, len);
+#endif
+	*staged = *pkt;
+	staged->pkt_data = frame;
+	staged->header.caplen = staged->header.len = len;
+	return TRUE;
 }
-void inline send_data_pkt(Forward* forward, ForwardPkt* tmpPkt)
+u_int inline send_data_burst(Forward* forward, ForwardPkt burst[], u_int n, u_int held) // consumes the slots from forward_try_hold(), returns the payload bytes queued
 {
+	u_int bytes = 0;
+
 	pthread_mutex_lock(&forward->mutex);
-	while (forward->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-		pthread_cond_wait(&forward->m_eventSpaceAvailable, &forward->mutex);
-	ForwardPkt *tmpForwardPkt = forward->pktQueue.tail();
-	tmpForwardPkt->tcb = tmpPkt->tcb;
-	tmpForwardPkt->index = tmpPkt->index;
-	tmpForwardPkt->sPort = tmpPkt->sPort;
-	tmpForwardPkt->dPort = tmpPkt->dPort;
-	tmpForwardPkt->seq_num = tmpPkt->seq_num;
-	tmpForwardPkt->data_len = tmpPkt->data_len;
-        tmpForwardPkt->TSval = tmpPkt->TSval;
-        tmpForwardPkt->ctr_flag = tmpPkt->ctr_flag;
-	tmpForwardPkt->data = tmpPkt->data;
-	memcpy(&(tmpForwardPkt->header), &(tmpPkt->header), sizeof(struct pcap_pkthdr));
-	memcpy(tmpForwardPkt->pkt_data, tmpPkt->pkt_data, tmpPkt->header.len);
-	forward->pktQueue.tailNext();
-	forward->pktQueue.increase();
-	pthread_cond_signal(&forward->m_eventElementAvailable);
+	forward->held -= held;
+	for (u_int i = 0; i < n; i ++)
+	{
+		ForwardPkt *tmpPkt = &burst[i];
+		ForwardPkt *tmpForwardPkt = forward->pktQueue.tail();
+		tmpForwardPkt->tcb = tmpPkt->tcb;
+		tmpForwardPkt->index = tmpPkt->index;
+		tmpForwardPkt->sPort = tmpPkt->sPort;
+		tmpForwardPkt->dPort = tmpPkt->dPort;
+		tmpForwardPkt->seq_num = tmpPkt->seq_num;
+		tmpForwardPkt->data_len = tmpPkt->data_len;
+		tmpForwardPkt->TSval = tmpPkt->TSval;
+		tmpForwardPkt->gen = tmpPkt->gen;
+		tmpForwardPkt->ctr_flag = tmpPkt->ctr_flag;
+		tmpForwardPkt->data = tmpPkt->data;
+		memcpy(&(tmpForwardPkt->header), &(tmpPkt->header), sizeof(struct pcap_pkthdr));
+		memcpy(tmpForwardPkt->pkt_data, tmpPkt->pkt_data, tmpPkt->header.len);
+		forward_push_tail(forward);
+		bytes += tmpPkt->data_len;
+	}
+	if (n)
+		pthread_cond_signal(&forward->m_eventElementAvailable);
+	if (held > n)
+	{
+		forward_space_freed(forward);
+		pthread_cond_signal(&forward->m_eventSpaceAvailable);
+	}
 	pthread_mutex_unlock(&forward->mutex);
 
+	return bytes;
 }
 void inline send_ack_back(u_short dport, DATA* data, ip_address src_address, ip_address dst_address, u_char src_mac[], u_char dst_mac[], u_short src_port, u_short dst_port, u_int seq, u_int ack, u_short ctr_bits, u_short awin, u_short data_id, sack_header* sack)
 {
@@ -1498,17 +3078,11 @@ void inline send_ack_back(u_short dport, DATA* data, ip_address src_address, ip_
 		memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header), &tcpHeader, sizeof(tcp_header));
 		memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header) + sizeof(tcp_header), &tcpSackHeader, (u_short)tcpSackHeader.length + 2);
 
-		pthread_mutex_lock(&data->forward_back->mutex);
-		while (data->forward_back->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-			pthread_cond_wait(&data->forward_back->m_eventSpaceAvailable, &data->forward_back->mutex);
-		ForwardPkt *tmpForwardPkt = data->forward_back->pktQueue.tail();
+		ForwardPkt *tmpForwardPkt = forward_reserve_ctrl(data->forward_back);
 		tmpForwardPkt->data = (void *)data;
 		memcpy(&(tmpForwardPkt->header), &capHeader, sizeof(struct pcap_pkthdr));
 		memcpy(tmpForwardPkt->pkt_data, Buffer, buffer_len);
-		data->forward_back->pktQueue.tailNext();
-		data->forward_back->pktQueue.increase();
-		pthread_cond_signal(&data->forward_back->m_eventElementAvailable);
-		pthread_mutex_unlock(&data->forward_back->mutex);
+		forward_commit_ctrl(data->forward_back);
 
 
 	}
@@ -1571,18 +3145,11 @@ void inline send_ack_back(u_short dport, DATA* data, ip_address src_address, ip_
 		memcpy(Buffer + sizeof(mac_header), &ipHeader, sizeof(ip_header));
 		memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header), &tcpHeader, sizeof(tcp_header));
 
-		pthread_mutex_lock(&data->forward_back->mutex);
-		while (data->forward_back->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-			pthread_cond_wait(&data->forward_back->m_eventSpaceAvailable, &data->forward_back->mutex);
-
-		ForwardPkt *tmpForwardPkt = data->forward_back->pktQueue.tail();
+		ForwardPkt *tmpForwardPkt = forward_reserve_ctrl(data->forward_back);
 		tmpForwardPkt->data = (void *)data;
 		memcpy(&(tmpForwardPkt->header), &capHeader, sizeof(struct pcap_pkthdr));
 		memcpy(tmpForwardPkt->pkt_data, Buffer, buffer_len);
-		data->forward_back->pktQueue.tailNext();
-		data->forward_back->pktQueue.increase();
-		pthread_cond_signal(&data->forward_back->m_eventElementAvailable);
-		pthread_mutex_unlock(&data->forward_back->mutex);
+		forward_commit_ctrl(data->forward_back);
 
 	}
 }
@@ -1652,10 +3219,7 @@ void inline send_syn_ack_back(u_short dport, DATA* data, ip_address src_address,
 	memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header), &tcpHeader, sizeof(tcp_header));
 	memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header) + sizeof(tcp_header), tcp_opt, tcp_opt_len);
 
-	pthread_mutex_lock(&data->forward_back->mutex);
-	while (data->forward_back->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-		pthread_cond_wait(&data->forward_back->m_eventSpaceAvailable, &data->forward_back->mutex);
-	ForwardPkt *tmpForwardPkt = data->forward_back->pktQueue.tail();
+	ForwardPkt *tmpForwardPkt = forward_reserve_ctrl(data->forward_back);
 	tmpForwardPkt->data = (void *)data;
         tmpForwardPkt->ctr_flag = ctr_bits;
         tmpForwardPkt->sPort = src_port;
@@ -1663,13 +3227,11 @@ void inline send_syn_ack_back(u_short dport, DATA* data, ip_address src_address,
         tmpForwardPkt->seq_num = seq;
 	memcpy(&(tmpForwardPkt->header), &capHeader, sizeof(struct pcap_pkthdr));
 	memcpy(tmpForwardPkt->pkt_data, Buffer, buffer_len);
-	data->forward_back->pktQueue.tailNext();
-	data->forward_back->pktQueue.increase();
-	pthread_cond_signal(&data->forward_back->m_eventElementAvailable);
-	pthread_mutex_unlock(&data->forward_back->mutex);
+	forward_commit_ctrl(data->forward_back);
 
 }
-void inline send_win_update_forward(u_short dport, DATA* data, ip_address src_address, ip_address dst_address, u_char src_mac[], u_char dst_mac[], u_short src_port, u_short dst_port, u_int seq, u_int ack, u_short ctr_bits, u_short awin, u_short data_id, sack_header* sack)
+/* FALSE, with nothing queued, when the control lane is full; *space_seq then tells when to retry */
+BOOL inline send_win_update_forward(u_short dport, DATA* data, ip_address src_address, ip_address dst_address, u_char src_mac[], u_char dst_mac[], u_short src_port, u_short dst_port, u_int seq, u_int ack, u_short ctr_bits, u_short awin, u_short data_id, sack_header* sack, u_int* space_seq)
 {
 	mac_header macHeader;
 	ip_header ipHeader;
@@ -1744,17 +3306,13 @@ void inline send_win_update_forward(u_short dport, DATA* data, ip_address src_ad
 		memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header), &tcpHeader, sizeof(tcp_header));
 		memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header) + sizeof(tcp_header), &tcpSackHeader, (u_short)tcpSackHeader.length + 2);
 
-		pthread_mutex_lock(&data->forward->mutex);
-		while (data->forward->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-			pthread_cond_wait(&data->forward->m_eventSpaceAvailable, &data->forward->mutex);
-		ForwardPkt *tmpForwardPkt = data->forward->pktQueue.tail();
+		ForwardPkt *tmpForwardPkt = forward_try_reserve_ctrl(data->forward, space_seq);
+		if (tmpForwardPkt == NULL)
+			return FALSE;
 		tmpForwardPkt->data = (void *)data;
 		memcpy(&(tmpForwardPkt->header), &capHeader, sizeof(struct pcap_pkthdr));
 		memcpy(tmpForwardPkt->pkt_data, Buffer, buffer_len);
-		data->forward->pktQueue.tailNext();
-		data->forward->pktQueue.increase();
-		pthread_cond_signal(&data->forward->m_eventElementAvailable);
-		pthread_mutex_unlock(&data->forward->mutex);
+		forward_commit_ctrl(data->forward);
 
 	}
 	else
@@ -1809,18 +3367,15 @@ void inline send_win_update_forward(u_short dport, DATA* data, ip_address src_ad
 		memcpy(Buffer + sizeof(mac_header), &ipHeader, sizeof(ip_header));
 		memcpy(Buffer + sizeof(mac_header) + sizeof(ip_header), &tcpHeader, sizeof(tcp_header));
 
-		pthread_mutex_lock(&data->forward->mutex);
-		while (data->forward->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-			pthread_cond_wait(&data->forward->m_eventSpaceAvailable, &data->forward->mutex);
-		ForwardPkt *tmpForwardPkt = data->forward->pktQueue.tail();
+		ForwardPkt *tmpForwardPkt = forward_try_reserve_ctrl(data->forward, space_seq);
+		if (tmpForwardPkt == NULL)
+			return FALSE;
 		tmpForwardPkt->data = (void *)data;
 		memcpy(&(tmpForwardPkt->header), &capHeader, sizeof(struct pcap_pkthdr));
 		memcpy(tmpForwardPkt->pkt_data, Buffer, buffer_len);
-		data->forward->pktQueue.tailNext();
-		data->forward->pktQueue.increase();
-		pthread_cond_signal(&data->forward->m_eventElementAvailable);
-		pthread_mutex_unlock(&data->forward->mutex);
+		forward_commit_ctrl(data->forward);
 	}
+	return TRUE;
 }
 void inline frag_data_pkt(ForwardPkt *frag_pkt, u_int ack_num)
 {
@@ -1884,13 +3439,153 @@ void inline frag_data_pkt(ForwardPkt *frag_pkt, u_int ack_num)
 
 
 
+/* what a buffered segment costs against buf_budget: its payload, or the whole frame it occupies */
+u_int inline buffer_cost(u_int data_len)
+{
+#ifdef PAYLOAD_STORAGE
+    return data_len;
+#else
+    return PKT_SIZE;
+#endif
+}
+void inline buffer_release(u_int tcb_index, conn_state* conn, u_int len)
+{
+    if (len > conn->buffered)
+        len = conn->buffered;
+    conn->buffered -= len;
+    buf_budget.release(&tcb_table[tcb_index]->buffered, len);
+}
+/*
+ * Receive window offered to the server on a connection: the free slots of
+ * its buffer, cut to its part of the TCB's room in buf_budget. Data
+ * already in flight under a larger window is still accepted.
+ */
+u_int inline rcv_wnd_budget(u_int tcb_index, u_short port)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[port];
+    u_int wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS;
+    u_int conns = tcb_table[tcb_index]->states.num;
+    u_long_long room = buf_budget.room(tcb_table[tcb_index]->buffered, pool.ex_tcb.num) / (conns ? conns : 1);
+
+    if (room < wnd)
+    {
+        buf_budget.throttled ++;
+        wnd = (u_int)room;
+    }
+
+    if (room < conn->MSS && !conn->wnd_closed)
+    {
+        conn->wnd_closed = TRUE;
+        buf_budget.close_window();
+    }
+    else if (wnd >= conn->MSS && conn->wnd_closed)
+    {
+        conn->wnd_closed = FALSE;
+        __sync_fetch_and_sub(&buf_budget.closed, 1);
+    }
+    return wnd;
+}
+/* rcv_wnd as the window field of a segment to the server */
+u_short inline adv_window(u_int tcb_index, u_short port)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[port];
+    u_int wnd = conn->client_state.rcv_wnd >> conn->client_state.win_scale;
+
+    return (wnd > LOCAL_WINDOW ? LOCAL_WINDOW : wnd);
+}
+/*
+ * Window update to the server once a connection's buffer has drained by
+ * half its capacity past the window last offered, or when that was zero.
+ */
+void inline ack_win_update(DATA* data, u_int tcb_index, u_short sport, u_short dport)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+    u_int wnd = rcv_wnd_budget(tcb_index, sport);
+
+    if (wnd < conn->client_state.rcv_wnd + 0.5 * conn->dataPktBuffer.capacity * conn->MSS && conn->client_state.rcv_wnd)
+        return;
+
+    u_short flag = 0;
+    u_short adv_win = (wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : wnd / pow((float)2, (int)conn->client_state.win_scale));
+    if (adv_win && adv_win != LOCAL_WINDOW)
+        adv_win ++;
+
+    if (wnd >= conn->MSS)
+    {
+        u_int space_seq;
+        if (!send_win_update_forward(sport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, sport, dport, conn->client_state.snd_nxt, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack, &space_seq))
+        {
+            // control lane full: the old window stands until tcb_win_update_retry() offers this one
+            conn->win_update_due = TRUE;
+            tcb_table[tcb_index]->ctrl_blocked = TRUE;
+            tcb_table[tcb_index]->ctrl_seq = space_seq;
+            return;
+        }
+    }
+
+    conn->client_state.rcv_wnd = wnd;
+    conn->client_state.rcv_adv = conn->client_state.rcv_nxt + conn->client_state.rcv_wnd;
+
+    if (adv_win * pow((float)2, (int)conn->client_state.win_scale) < 2 * conn->MSS)
+        conn->client_state.ack_count = 1; // next ready to ack
+}
+/* window updates a TCB deferred on a full control lane, once the forwarder has freed space there */
+void inline tcb_win_update_retry(u_int tcb_index)
+{
+    tcb_table[tcb_index]->ctrl_blocked = FALSE;
+
+    for (u_int i = 0; i < tcb_table[tcb_index]->states.size(); i ++)
+    {
+        u_short sport = tcb_table[tcb_index]->states.state_id[i];
+        if (sport == 0)
+            continue;
+
+        conn_state* conn = tcb_table[tcb_index]->conn[sport];
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->win_update_due && conn->server_state.state != CLOSED)
+        {
+            conn->win_update_due = FALSE; // judged afresh, set again if the lane is still full
+            ack_win_update(uplink_data, tcb_index, sport, conn->sPort);
+        }
+        pthread_mutex_unlock(&conn->mutex);
+    }
+}
+/*
+ * A connection whose window the budget closed may hold nothing the client
+ * still has to ACK, so no ack_win_update() comes for it on its own. Once
+ * buf_budget is back under the high-water mark, offer those windows again;
+ * buffer_budget::reopen() holds further sweeps until another step is freed.
+ */
+void inline budget_reopen()
+{
+    if (!buf_budget.reopen() || !uplink_data)
+        return;
+
+    for (u_int i = 0; i < pool.ex_tcb.size(); i ++)
+    {
+        u_int tcb_index = pool.ex_tcb.state_id[i];
+
+        for (u_int j = 0; j < tcb_table[tcb_index]->states.size(); j ++)
+        {
+            u_short sport = tcb_table[tcb_index]->states.state_id[j];
+            if (sport == 0)
+                continue;
+
+            conn_state* conn = tcb_table[tcb_index]->conn[sport];
+            pthread_mutex_lock(&conn->mutex);
+            if (conn->wnd_closed && conn->server_state.state != CLOSED)
+            {
+                conn->client_state.rcv_wnd = 0; // closed, so the update is always sent
+                ack_win_update(uplink_data, tcb_index, sport, conn->sPort);
+            }
+            pthread_mutex_unlock(&conn->mutex);
+        }
+    }
+}
 void inline data_size_in_flight(u_int tcb_index, u_int data_len)
 {
         
-    if (tcb_table[tcb_index]->pkts_transit >= data_len)
-        tcb_table[tcb_index]->pkts_transit -= data_len; 
-    else
-        tcb_table[tcb_index]->pkts_transit = 0;
+    tcb_table[tcb_index]->pkts_transit.sub(data_len);
         
 }
 
@@ -1983,42 +3678,44 @@ void inline bandwidth_probe(u_int tcb_index, u_int sport, u_long_long current_ti
 
 void inline log_data(u_short sport, u_int tcb_index)
 {
-    if (!tcb_table[tcb_index]->conn[sport]->rttFd)
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+    if (!conn->cold->rttFd)
     {
         char name[20];
         sprintf(name, "%u", sport);
-        tcb_table[tcb_index]->conn[sport]->rttFd = fopen(strcat(name, "rtt.txt"), "w");
+        conn->cold->rttFd = fopen(strcat(name, "rtt.txt"), "w");
     }
 
     
-    /*fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%lu %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u\n", 
-        tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, 
-        tcb_table[tcb_index]->conn[sport]->server_state.snd_una, 
-        tcb_table[tcb_index]->conn[sport]->RTT, 
-        tcb_table[tcb_index]->conn[sport]->RTT_IETF, 
-        tcb_table[tcb_index]->conn[sport]->mdev, 
-        tcb_table[tcb_index]->conn[sport]->RTT + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev, 
-        tcb_table[tcb_index]->conn[sport]->RTT_IETF + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf, 
-        tcb_table[tcb_index]->conn[sport]->rto, 
-        tcb_table[tcb_index]->conn[sport]->rto_ietf, 
-        tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, 
-        tcb_table[tcb_index]->conn[sport]->cumul_ack, 
+    /*fprintf(conn->cold->rttFd, "%lu %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u\n", 
+        conn->cur_ack_rcv_time, 
+        conn->server_state.snd_una, 
+        conn->RTT, 
+        conn->RTT_IETF, 
+        conn->mdev, 
+        conn->RTT + 4 * conn->rtt_std_dev, 
+        conn->RTT_IETF + 4 * conn->rtt_std_dev_ietf, 
+        conn->rto, 
+        conn->rto_ietf, 
+        conn->ack_interarrival_time, 
+        conn->cumul_ack, 
         tcb_table[tcb_index]->rcv_thrughput_approx, 
         tcb_table[tcb_index]->rcv_thrughput, 
         tcb_table[tcb_index]->send_rate, 
-        tcb_table[tcb_index]->conn[sport]->sliding_avg_win.bytes(), 
-        tcb_table[tcb_index]->conn[sport]->max_data_len);*/
+        conn->ack_history.bytes(), 
+        conn->max_data_len);*/
     
-    fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%u %hu %u %u %u\n",
+    fprintf(conn->cold->rttFd, "%u %hu %u %u %u\n",
         tcb_index,
         sport, 
-        tcb_table[tcb_index]->conn[sport]->RTT, 
-        tcb_table[tcb_index]->conn[sport]->downlink_queueing_length/tcb_table[tcb_index]->conn[sport]->max_data_len, 
-        (tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay - tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay)
-        //tcb_table[tcb_index]->conn[sport]->target_queue_len/tcb_table[tcb_index]->conn[sport]->max_data_len, 
-        //tcb_table[tcb_index]->conn[sport]->send_rate/1000, 
-        //tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput/1000, 
-        //tcb_table[tcb_index]->conn[sport]->buffer_max/tcb_table[tcb_index]->conn[sport]->max_data_len
+        conn->RTT, 
+        conn->downlink_queueing_length/conn->max_data_len, 
+        (conn->downlink_one_way_delay - conn->min_downlink_one_way_delay)
+        //conn->target_queue_len/conn->max_data_len, 
+        //conn->send_rate/1000, 
+        //conn->rcv_tsval_thruput/1000, 
+        //conn->buffer_max/conn->max_data_len
         );
 }
 
@@ -2028,18 +3725,10 @@ void inline log_data(u_short sport, u_int tcb_index)
 void inline rcv_ack_downlink_queueing_len_w_rtt(u_int tcb_index, u_short sport, u_long_long rcv_time, u_int rtt, u_int min_rtt)
 {
         
-    if (tcb_table[tcb_index]->conn[sport]->sliding_avg_win.size())
+    if (tcb_table[tcb_index]->ack_history.size())
     {
-        u_int i = tcb_table[tcb_index]->conn[sport]->sliding_avg_win.size() - 1;
-        int size = tcb_table[tcb_index]->conn[sport]->sliding_avg_win.size();
-        u_int downlink_queueing_length = 0;
-        
-        while (size && rtt - min_rtt > 
-                rcv_time - tcb_table[tcb_index]->conn[sport]->sliding_avg_win.window[i].time) {
-            downlink_queueing_length ++;
-            i --;
-            size --;
-        }
+        // ACKs that arrived within the queueing part of the RTT
+        u_int downlink_queueing_length = tcb_table[tcb_index]->ack_history.recent(rcv_time, (u_int)(rtt - min_rtt));
                 
         tcb_table[tcb_index]->downlink_queueing_length = downlink_queueing_length;
         
@@ -2053,10 +3742,7 @@ void inline send_forward_with_params(DATA* data, struct pcap_pkthdr* header, u_c
                                     u_short sport, u_short dport, u_int data_len, 
                                     u_short ctrl_flag, u_int seq_num, u_int tcb_index)
 {
-    pthread_mutex_lock(&data->forward->mutex);
-    while (data->forward->pktQueue.size() >= CIRCULAR_QUEUE_SIZE)
-            pthread_cond_wait(&data->forward->m_eventSpaceAvailable, &data->forward->mutex);
-    ForwardPkt *tmpForwardPkt = data->forward->pktQueue.tail();
+    ForwardPkt *tmpForwardPkt = forward_reserve(data->forward);
     tmpForwardPkt->data = (void *)data;
     tmpForwardPkt->sPort = sport;
     tmpForwardPkt->dPort = dport;
@@ -2067,29 +3753,19 @@ void inline send_forward_with_params(DATA* data, struct pcap_pkthdr* header, u_c
     tmpForwardPkt->tcb = tcb_index;
     memcpy(&(tmpForwardPkt->header), header, sizeof(struct pcap_pkthdr));
     memcpy(tmpForwardPkt->pkt_data, pkt_data, header->len);
-    data->forward->pktQueue.tailNext();
-    data->forward->pktQueue.increase();
-    pthread_cond_signal(&data->forward->m_eventElementAvailable);
-    pthread_mutex_unlock(&data->forward->mutex);
+    forward_commit(data->forward);
     
 }
 /***********SoD queue length estimation***********/
 void inline SoD_downlink_queue_length_est(u_int tcb_index, u_short sport)
 {
-    if (tcb_table[tcb_index]->sliding_tsval_window.size())
+    if (tcb_table[tcb_index]->ack_history.size())
     {
-        u_int i = tcb_table[tcb_index]->sliding_tsval_window.size() - 1;
-        int size = tcb_table[tcb_index]->sliding_tsval_window.size();
-        u_int downlink_queueing_length = 0;
-                
-        while (size && tcb_table[tcb_index]->downlink_queueing_delay >= (tcb_table[tcb_index]->cur_TSval - 
-                tcb_table[tcb_index]->sliding_tsval_window.window[i].time) * tcb_table[tcb_index]->timestamp_granularity)
-        {
-            
-            downlink_queueing_length ++; //tcb_table[tcb_index]->sliding_tsval_window.window[i].len;
-            i --;
-            size --;                         
-        }
+        // samples whose TSval age, in timer units, is within the queueing delay
+        u_long_long span = (tcb_table[tcb_index]->timestamp_granularity ? 
+                (u_long_long)tcb_table[tcb_index]->downlink_queueing_delay / tcb_table[tcb_index]->timestamp_granularity + 1 : ~0ULL);
+        AckHistory& h = tcb_table[tcb_index]->ack_history;
+        u_int downlink_queueing_length = h.recent_tsval(tcb_table[tcb_index]->cur_TSval, span, h.last(SLIDING_WIN_SIZE));
         
         if (downlink_queueing_length)    
             downlink_queueing_length --;            
@@ -2108,49 +3784,51 @@ void inline SoD_downlink_queue_length_est(u_int tcb_index, u_short sport)
 /***********TCP-RRE estimate queueing delay in the downlink************/
 void inline downlink_queue_delay_estimator(u_int tcb_index, u_short sport, u_long_long send_time)
 {
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
     if (tcb_table[tcb_index]->cur_TSecr && tcb_table[tcb_index]->cur_TSval)
     {
-        tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay = (long long)tcb_table[tcb_index]->cur_TSval * 
+        conn->downlink_one_way_delay = (long long)tcb_table[tcb_index]->cur_TSval * 
                 (long long)tcb_table[tcb_index]->timestamp_granularity - (long long)send_time;
         
         
         
-        if (tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay > tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay)
+        if (conn->min_downlink_one_way_delay > conn->downlink_one_way_delay)
         {
             /*
             printf("%lld %lld %lld %lld %u %u %u %lu\n", 
-                tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay, 
-                tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay, 
-                    tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay - 
-                tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay,
+                conn->downlink_one_way_delay, 
+                conn->min_downlink_one_way_delay, 
+                    conn->downlink_one_way_delay - 
+                conn->min_downlink_one_way_delay,
                 (long long)tcb_table[tcb_index]->cur_TSval * (long long)tcb_table[tcb_index]->timestamp_granularity, 
-                tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput, 
-                tcb_table[tcb_index]->conn[sport]->downlink_queueing_length, 
+                conn->rcv_tsval_thruput, 
+                conn->downlink_queueing_length, 
                     tcb_table[tcb_index]->cur_TSval, send_time);
             */
             
-            tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay = tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay;          
+            conn->min_downlink_one_way_delay = conn->downlink_one_way_delay;          
             
             //exit(-1);
             
         }
         
-        tcb_table[tcb_index]->conn[sport]->downlink_queueing_length = 
-                (u_long_long)(tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay - 
-                tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay) * 
-                (u_long_long)tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput / 
+        conn->downlink_queueing_length = 
+                (u_long_long)(conn->downlink_one_way_delay - 
+                conn->min_downlink_one_way_delay) * 
+                (u_long_long)conn->rcv_tsval_thruput / 
                 (u_long_long)RESOLUTION;
         
         
         /*
         printf("%lld %lld %lld %lld %u %u %u %lu\n", 
-                tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay, 
-                tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay, 
-                tcb_table[tcb_index]->conn[sport]->downlink_one_way_delay - 
-                tcb_table[tcb_index]->conn[sport]->min_downlink_one_way_delay,
+                conn->downlink_one_way_delay, 
+                conn->min_downlink_one_way_delay, 
+                conn->downlink_one_way_delay - 
+                conn->min_downlink_one_way_delay,
                 (long long)tcb_table[tcb_index]->cur_TSval * (long long)tcb_table[tcb_index]->timestamp_granularity, 
-                tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput, 
-                tcb_table[tcb_index]->conn[sport]->downlink_queueing_length, 
+                conn->rcv_tsval_thruput, 
+                conn->downlink_queueing_length, 
                     tcb_table[tcb_index]->cur_TSval, send_time);
          */
           
@@ -2268,26 +3946,28 @@ void inline rcv_data_downlink_queueing_delay_est(u_int tcb_index, u_short sport)
 /***********RSFC data uplink queueing delay estimation***********/
 void inline rcv_data_uplink_delay_var(u_int tcb_index, u_short sport, u_long_long rcv_time, u_int ack_num)
 {
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
    
     if (tcb_table[tcb_index]->cur_TSecr && tcb_table[tcb_index]->cur_TSval)
     {
-        tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay = (long long)rcv_time - (long long)tcb_table[tcb_index]->cur_TSval * 
+        conn->uplink_one_way_delay = (long long)rcv_time - (long long)tcb_table[tcb_index]->cur_TSval * 
                 (long long)tcb_table[tcb_index]->timestamp_granularity;
         
-        if (tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay > tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay)
+        if (conn->min_uplink_one_way_delay > conn->uplink_one_way_delay)
         {
                                    
-            tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay = tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay;          
+            conn->min_uplink_one_way_delay = conn->uplink_one_way_delay;          
             
             /*
             printf("%lld %lld %lld %lld %u %u %u %lu\n", 
-                    tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay, 
-                    tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay, 
-                    tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay - tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
+                    conn->uplink_one_way_delay, 
+                    conn->min_uplink_one_way_delay, 
+                    conn->uplink_one_way_delay - conn->min_uplink_one_way_delay,
                     (long long)tcb_table[tcb_index]->cur_TSval * (long long)tcb_table[tcb_index]->timestamp_granularity, 
-                    tcb_table[tcb_index]->conn[sport]->rcv_uplink_thruput,
+                    conn->rcv_uplink_thruput,
                     tcb_table[tcb_index]->cur_TSval, 
-                    tcb_table[tcb_index]->conn[sport]->uplink_queueing_delay,
+                    conn->uplink_queueing_delay,
                     rcv_time);
             */
             
@@ -2295,18 +3975,18 @@ void inline rcv_data_uplink_delay_var(u_int tcb_index, u_short sport, u_long_lon
             
         }
         
-        tcb_table[tcb_index]->conn[sport]->uplink_queueing_delay = 
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay - tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay;
+        conn->uplink_queueing_delay = 
+                conn->uplink_one_way_delay - conn->min_uplink_one_way_delay;
         
         /*
         printf("%lld %lld %lld %lld %u %u %u %lu\n",
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay,
-                tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay - tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
+                conn->uplink_one_way_delay,
+                conn->min_uplink_one_way_delay,
+                conn->uplink_one_way_delay - conn->min_uplink_one_way_delay,
                 (long long) tcb_table[tcb_index]->cur_TSval * (long long) tcb_table[tcb_index]->timestamp_granularity,
-                tcb_table[tcb_index]->conn[sport]->rcv_uplink_thruput,
+                conn->rcv_uplink_thruput,
                 tcb_table[tcb_index]->cur_TSval,
-                tcb_table[tcb_index]->conn[sport]->uplink_queueing_delay,
+                conn->uplink_queueing_delay,
                 rcv_time);
         */
     }
@@ -2319,77 +3999,79 @@ void inline rcv_data_uplink_delay_var(u_int tcb_index, u_short sport, u_long_lon
 
 void inline RTT_estimator(ForwardPkt *unAckPkt, u_long_long snd_time, u_long_long rcv_time, u_int ack_num, u_short sport, u_int tcb_index)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
 #ifdef LINUX_RTT
     
 	if (tcb_table[tcb_index]->RTT)
 	{
-            if (ack_num <= tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno)
+            if (ack_num <= conn->nxt_timed_seqno)
             {
-                    if (rcv_time - snd_time < tcb_table[tcb_index]->conn[sport]->RTT && abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time))) > tcb_table[tcb_index]->conn[sport]->mdev)
-                            tcb_table[tcb_index]->conn[sport]->mdev = (tcb_table[tcb_index]->conn[sport]->mdev >= 0.96875 * tcb_table[tcb_index]->conn[sport]->mdev + 0.03125 * abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time))) ? tcb_table[tcb_index]->conn[sport]->mdev : 0.96875 * tcb_table[tcb_index]->conn[sport]->mdev + 0.03125 * abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time))));
+                    if (rcv_time - snd_time < conn->RTT && abs((long)(conn->RTT - (rcv_time - snd_time))) > conn->mdev)
+                            conn->mdev = (conn->mdev >= 0.96875 * conn->mdev + 0.03125 * abs((long)(conn->RTT - (rcv_time - snd_time))) ? conn->mdev : 0.96875 * conn->mdev + 0.03125 * abs((long)(conn->RTT - (rcv_time - snd_time))));
                     else
-                            tcb_table[tcb_index]->conn[sport]->mdev = (tcb_table[tcb_index]->conn[sport]->mdev >= 0.75 * tcb_table[tcb_index]->conn[sport]->mdev + 0.25 * abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time))) ? tcb_table[tcb_index]->conn[sport]->mdev : 0.75 * tcb_table[tcb_index]->conn[sport]->mdev + 0.25 * abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time))));
+                            conn->mdev = (conn->mdev >= 0.75 * conn->mdev + 0.25 * abs((long)(conn->RTT - (rcv_time - snd_time))) ? conn->mdev : 0.75 * conn->mdev + 0.25 * abs((long)(conn->RTT - (rcv_time - snd_time))));
 
             }
-            else if (ack_num > tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno && tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkts())
+            else if (ack_num > conn->nxt_timed_seqno && conn->dataPktBuffer.pkts())
             {
-                    tcb_table[tcb_index]->conn[sport]->rtt_std_dev = tcb_table[tcb_index]->conn[sport]->mdev;
-                    if (rcv_time - snd_time < tcb_table[tcb_index]->conn[sport]->RTT && abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time))) > tcb_table[tcb_index]->conn[sport]->mdev)
-                            tcb_table[tcb_index]->conn[sport]->mdev = 0.96875 * tcb_table[tcb_index]->conn[sport]->mdev + 0.03125 * abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time)));
+                    conn->rtt_std_dev = conn->mdev;
+                    if (rcv_time - snd_time < conn->RTT && abs((long)(conn->RTT - (rcv_time - snd_time))) > conn->mdev)
+                            conn->mdev = 0.96875 * conn->mdev + 0.03125 * abs((long)(conn->RTT - (rcv_time - snd_time)));
                     else
-                            tcb_table[tcb_index]->conn[sport]->mdev = 0.75 * tcb_table[tcb_index]->conn[sport]->mdev + 0.25 * abs((long)(tcb_table[tcb_index]->conn[sport]->RTT - (rcv_time - snd_time)));
+                            conn->mdev = 0.75 * conn->mdev + 0.25 * abs((long)(conn->RTT - (rcv_time - snd_time)));
 
-                    tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num;
+                    conn->nxt_timed_seqno = conn->dataPktBuffer.head()->seq_num;
             }
 
 
-            tcb_table[tcb_index]->conn[sport]->RTT = 0.875 * tcb_table[tcb_index]->conn[sport]->RTT + 0.125 * (rcv_time - snd_time);
+            conn->RTT = 0.875 * conn->RTT + 0.125 * (rcv_time - snd_time);
             tcb_table[tcb_index]->RTT_INST = rcv_time - snd_time;
-            tcb_table[tcb_index]->conn[sport]->LAST_RTT = rcv_time - snd_time;
+            conn->LAST_RTT = rcv_time - snd_time;
 
             tcb_table[tcb_index]->RTT = 0.875 * tcb_table[tcb_index]->RTT + 0.125 * (rcv_time - snd_time);
-            tcb_table[tcb_index]->conn[sport]->rto = (MAX_RTO >= tcb_table[tcb_index]->conn[sport]->RTT + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev ? MAX_RTO : tcb_table[tcb_index]->conn[sport]->RTT + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev);
+            conn->rto = (MAX_RTO >= conn->RTT + 4 * conn->rtt_std_dev ? MAX_RTO : conn->RTT + 4 * conn->rtt_std_dev);
 
 	}
 	else
 	{
-            tcb_table[tcb_index]->conn[sport]->RTT = rcv_time - snd_time;
-            tcb_table[tcb_index]->conn[sport]->LAST_RTT = rcv_time - snd_time;
+            conn->RTT = rcv_time - snd_time;
+            conn->LAST_RTT = rcv_time - snd_time;
             tcb_table[tcb_index]->RTT_INST = rcv_time - snd_time;
             tcb_table[tcb_index]->RTT = rcv_time - snd_time;     
-            tcb_table[tcb_index]->conn[sport]->rtt_std_dev = tcb_table[tcb_index]->conn[sport]->RTT / 2;
-            tcb_table[tcb_index]->conn[sport]->mdev = tcb_table[tcb_index]->conn[sport]->RTT / 2;
-            tcb_table[tcb_index]->conn[sport]->rto = (MAX_RTO >= tcb_table[tcb_index]->conn[sport]->RTT + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev ? MAX_RTO : tcb_table[tcb_index]->conn[sport]->RTT + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev);
-            tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num;
+            conn->rtt_std_dev = conn->RTT / 2;
+            conn->mdev = conn->RTT / 2;
+            conn->rto = (MAX_RTO >= conn->RTT + 4 * conn->rtt_std_dev ? MAX_RTO : conn->RTT + 4 * conn->rtt_std_dev);
+            conn->nxt_timed_seqno = conn->dataPktBuffer.head()->seq_num;
 
 	}
 #endif
 
 #ifdef STD_RTT
-	if (tcb_table[tcb_index]->conn[sport]->RTT_IETF)
+	if (conn->RTT_IETF)
 	{
-		if (ack_num > tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno_ietf)
+		if (ack_num > conn->nxt_timed_seqno_ietf)
 		{
-			tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf = 0.75 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf + 0.25 * abs(((long)(rcv_time - snd_time) - tcb_table[tcb_index]->conn[sport]->RTT_IETF));
-			tcb_table[tcb_index]->conn[sport]->RTT_IETF = 0.875 * tcb_table[tcb_index]->conn[sport]->RTT_IETF + 0.125 * (rcv_time - snd_time);
+			conn->rtt_std_dev_ietf = 0.75 * conn->rtt_std_dev_ietf + 0.25 * abs(((long)(rcv_time - snd_time) - conn->RTT_IETF));
+			conn->RTT_IETF = 0.875 * conn->RTT_IETF + 0.125 * (rcv_time - snd_time);
 			tcb_table[tcb_index]->RTT = 0.875 * tcb_table[tcb_index]->RTT + 0.125 * (rcv_time - snd_time);
 			tcb_table[tcb_index]->RTT_INST = rcv_time - snd_time;
-                        tcb_table[tcb_index]->conn[sport]->LAST_RTT = rcv_time - snd_time;
-			tcb_table[tcb_index]->conn[sport]->rto_ietf = (MAX_RTO_IETF >= tcb_table[tcb_index]->conn[sport]->RTT_IETF + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf ? MAX_RTO_IETF : tcb_table[tcb_index]->conn[sport]->RTT_IETF + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf);
-			tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno_ietf = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num;
+                        conn->LAST_RTT = rcv_time - snd_time;
+			conn->rto_ietf = (MAX_RTO_IETF >= conn->RTT_IETF + 4 * conn->rtt_std_dev_ietf ? MAX_RTO_IETF : conn->RTT_IETF + 4 * conn->rtt_std_dev_ietf);
+			conn->nxt_timed_seqno_ietf = conn->dataPktBuffer.head()->seq_num;
 
 		}
 
 	}
 	else
 	{
-		tcb_table[tcb_index]->conn[sport]->RTT_IETF = rcv_time - snd_time;
+		conn->RTT_IETF = rcv_time - snd_time;
 		tcb_table[tcb_index]->RTT = rcv_time - snd_time;
                 tcb_table[tcb_index]->RTT_INST = rcv_time - snd_time;
-		tcb_table[tcb_index]->conn[sport]->LAST_RTT = tcb_table[tcb_index]->conn[sport]->RTT_IETF;
-		tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf = tcb_table[tcb_index]->conn[sport]->RTT_IETF / 2;
-		tcb_table[tcb_index]->conn[sport]->rto_ietf = (MAX_RTO_IETF >= tcb_table[tcb_index]->conn[sport]->RTT_IETF + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf ? MAX_RTO_IETF : tcb_table[tcb_index]->conn[sport]->RTT_IETF + 4 * tcb_table[tcb_index]->conn[sport]->rtt_std_dev_ietf);
-		tcb_table[tcb_index]->conn[sport]->nxt_timed_seqno_ietf = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num;
+		conn->LAST_RTT = conn->RTT_IETF;
+		conn->rtt_std_dev_ietf = conn->RTT_IETF / 2;
+		conn->rto_ietf = (MAX_RTO_IETF >= conn->RTT_IETF + 4 * conn->rtt_std_dev_ietf ? MAX_RTO_IETF : conn->RTT_IETF + 4 * conn->rtt_std_dev_ietf);
+		conn->nxt_timed_seqno_ietf = conn->dataPktBuffer.head()->seq_num;
 
 	}
 #endif
@@ -2422,10 +4104,12 @@ void inline RTT_estimator(ForwardPkt *unAckPkt, u_long_long snd_time, u_long_lon
 
 void inline BW_adaptation(u_short sport, u_int tcb_index)
 {
-	if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL && tcb_table[tcb_index]->conn[sport]->RTT)
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	if (conn->server_state.phase == NORMAL && conn->RTT)
 	{
 	        /*
-	        if (tcb_table[tcb_index]->conn[sport]->RTT >= 1000000)
+	        if (conn->RTT >= 1000000)
 	        {
 	            if (tcb_table[tcb_index]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
                     {
@@ -2439,7 +4123,7 @@ void inline BW_adaptation(u_short sport, u_int tcb_index)
                     }
 	        }
                 */
-	        if (tcb_table[tcb_index]->conn[sport]->RTT > tcb_table[tcb_index]->conn[sport]->RTT_limit)
+	        if (conn->RTT > conn->RTT_limit)
 		{
 			if (tcb_table[tcb_index]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
 			{
@@ -2457,7 +4141,7 @@ void inline BW_adaptation(u_short sport, u_int tcb_index)
 				print_bw_info(sport, tcb_index);
 			}
 		}
-		else if (tcb_table[tcb_index]->conn[sport]->RTT <= tcb_table[tcb_index]->conn[sport]->RTT_limit)
+		else if (conn->RTT <= conn->RTT_limit)
 		{
 			if (tcb_table[tcb_index]->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
 			{
@@ -2474,9 +4158,9 @@ void inline BW_adaptation(u_short sport, u_int tcb_index)
 		}
 
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX && tcb_table[tcb_index]->conn[sport]->RTT)
+	else if (conn->server_state.phase == FAST_RTX && conn->RTT)
 	{
-             if (tcb_table[tcb_index]->conn[sport]->RTT > tcb_table[tcb_index]->conn[sport]->RTT_limit)
+             if (conn->RTT > conn->RTT_limit)
 	    {    
                 if (tcb_table[tcb_index]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
 		{
@@ -2530,12 +4214,12 @@ void inline update_unsent_bytes(u_int tcb_index, u_long_long current_time)
                     tcb_table[tcb_index]->sliding_avg_window._stack_size &&
                     tcb_table[tcb_index]->sliding_avg_window.unsent_stack[tcb_table[tcb_index]->sliding_avg_window._stack_size - 1].len > 0 && 
                     tcb_table[tcb_index]->sliding_avg_window.underflow_time >= BUFFER_UNDERFLOW &&
-                    tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k - 2].sign
+                    tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k - 2).sign
                     )
             {                                  
                 u_long_long rcv_thrughput = tcb_table[tcb_index]->rcv_thrughput_approx;                
                     
-                u_long_long bytes_should_sent = rcv_thrughput * (u_long_long)(current_time - tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k-1].time) / 
+                u_long_long bytes_should_sent = rcv_thrughput * (u_long_long)(current_time - tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k-1).time) / 
                         (u_long_long)RESOLUTION;
 
                 long unsent_bytes_sent = tcb_table[tcb_index]->sent_bytes_counter - (long)bytes_should_sent;
@@ -2707,7 +4391,7 @@ void inline BandwidthAdaptation(u_int tcb_index, u_long_long current_time)
                                     (tcb_table[tcb_index]->send_rate > tcb_table[tcb_index]->send_rate_upper ? 
                                         tcb_table[tcb_index]->send_rate_upper : tcb_table[tcb_index]->send_rate);
 
-                            tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k - 1].sign = TRUE;
+                            tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k - 1).sign = TRUE;
 
 
                             fprintf(stderr, "-----------monitor state: rate %u bw %u under_flow: %u----------\n",
@@ -3126,7 +4810,7 @@ void inline tcb_bw_burst_ctrl(u_int tcb_index, u_long_long current_time, u_int s
 #ifdef DOWNLINK_QUEUE_LEN_EST
             
             tcb_table[tcb_index]->sliding_avg_window.threshold_1(current_time, 
-                    current_time - tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k - 1].time, 
+                    current_time - tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k - 1).time, 
                     tcb_table[tcb_index]->sent_bytes_counter, 
                     tcb_table[tcb_index]->rcv_thrughput_approx, 
                     tcb_table[tcb_index]->send_rate_lower,
@@ -3134,7 +4818,7 @@ void inline tcb_bw_burst_ctrl(u_int tcb_index, u_long_long current_time, u_int s
                     0);            
 #else
             tcb_table[tcb_index]->sliding_avg_window.threshold_1(current_time, 
-                    current_time - tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k - 1].time, 
+                    current_time - tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k - 1).time, 
                     tcb_table[tcb_index]->sent_bytes_counter, 
                     tcb_table[tcb_index]->rcv_thrughput_approx, 
                     tcb_table[tcb_index]->send_rate_lower,
@@ -3168,7 +4852,7 @@ void inline tcb_bw_burst_ctrl(u_int tcb_index, u_long_long current_time, u_int s
             if (tcb_table[tcb_index]->sliding_avg_window.k < tcb_table[tcb_index]->sliding_avg_window.interval / tcb_table[tcb_index]->sliding_avg_window.delta)         
             {
                 tcb_table[tcb_index]->sliding_avg_window.k ++;
-                tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k-1].time = current_time;
+                tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k-1).time = current_time;
                 
             }
             else  
@@ -3231,7 +4915,7 @@ void inline tcb_bw_burst_ctrl(u_int tcb_index, u_long_long current_time, u_int s
                 
 #ifdef DOWNLINK_QUEUE_LEN_EST    
                 tcb_table[tcb_index]->sliding_avg_window.threshold_1(current_time, 
-                        current_time - tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k - 1].time, 
+                        current_time - tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k - 1).time, 
                         tcb_table[tcb_index]->sent_bytes_counter, 
                         tcb_table[tcb_index]->rcv_thrughput_approx, 
                         tcb_table[tcb_index]->send_rate_lower,
@@ -3240,7 +4924,7 @@ void inline tcb_bw_burst_ctrl(u_int tcb_index, u_long_long current_time, u_int s
 
 #else                
                 tcb_table[tcb_index]->sliding_avg_window.threshold_1(current_time, 
-                    current_time - tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k - 1].time, 
+                    current_time - tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k - 1).time, 
                     tcb_table[tcb_index]->sent_bytes_counter, 
                     tcb_table[tcb_index]->rcv_thrughput_approx, 
                     tcb_table[tcb_index]->send_rate_lower,
@@ -3274,7 +4958,7 @@ void inline tcb_bw_burst_ctrl(u_int tcb_index, u_long_long current_time, u_int s
                 if (tcb_table[tcb_index]->sliding_avg_window.k < tcb_table[tcb_index]->sliding_avg_window.interval/tcb_table[tcb_index]->sliding_avg_window.delta)
                 {
                     tcb_table[tcb_index]->sliding_avg_window.k ++;
-                    tcb_table[tcb_index]->sliding_avg_window.bw_window[tcb_table[tcb_index]->sliding_avg_window.k-1].time = current_time;
+                    tcb_table[tcb_index]->sliding_avg_window.bw(tcb_table[tcb_index]->sliding_avg_window.k-1).time = current_time;
                 }
                 else  
                     tcb_table[tcb_index]->sliding_avg_window.bw_window_shift(current_time);
@@ -3309,7 +4993,7 @@ void inline log_debug_tcb_info(u_int tcb_index, u_long_long current_time)
     tcb_table[tcb_index]->send_rate/1000, 
     tcb_table[tcb_index]->rcv_thrughput_approx/1000, 
     tcb_table[tcb_index]->rcv_thrughput/1000, 
-    tcb_table[tcb_index]->pkts_transit, 
+    tcb_table[tcb_index]->pkts_transit.value(), 
     tcb_table[tcb_index]->sliding_avg_window.estmateInterval(current_time), 
     tcb_table[tcb_index]->sliding_avg_window.bytes(), 
     tcb_table[tcb_index]->BusyPeriod.head()->started, 
@@ -3323,6 +5007,8 @@ void inline log_debug_tcb_info(u_int tcb_index, u_long_long current_time)
 }
 void inline log_debug_conn_info(u_int tcb_index, u_short sport, u_long_long current_time)
 {
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
     if (!tcb_table[tcb_index]->out_file)               
     {
         char name[20];
@@ -3330,7 +5016,7 @@ void inline log_debug_conn_info(u_int tcb_index, u_short sport, u_long_long curr
         tcb_table[tcb_index]->out_file = fopen(strcat(name, ".txt"), "w");
     }
 
-    fprintf(tcb_table[tcb_index]->out_file, "%hu %u %u %u %u %u %u %u %u %u %u %u %llu %llu %llu %llu %u %u %u %u\n", sport, tcb_table[tcb_index]->conn[sport]->server_state.phase, tcb_table[tcb_index]->RTT, tcb_table[tcb_index]->send_rate/1000, tcb_table[tcb_index]->rcv_thrughput_approx/1000, tcb_table[tcb_index]->rcv_thrughput/1000, tcb_table[tcb_index]->pkts_transit, tcb_table[tcb_index]->sliding_avg_window.estmateInterval(current_time), tcb_table[tcb_index]->sliding_avg_window.bytes(), tcb_table[tcb_index]->BusyPeriod.head()->started, tcb_table[tcb_index]->BusyPeriod._size, check_buffer_empty(tcb_index, 0), current_time, tcb_table[tcb_index]->sliding_avg_window.sample_time, tcb_table[tcb_index]->sliding_avg_window.tailTime(), tcb_table[tcb_index]->sliding_avg_window.shift_time, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts, tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt, tcb_table[tcb_index]->unsent_data_bytes);
+    fprintf(tcb_table[tcb_index]->out_file, "%hu %u %u %u %u %u %u %u %u %u %u %u %llu %llu %llu %llu %u %u %u %u\n", sport, conn->server_state.phase, tcb_table[tcb_index]->RTT, tcb_table[tcb_index]->send_rate/1000, tcb_table[tcb_index]->rcv_thrughput_approx/1000, tcb_table[tcb_index]->rcv_thrughput/1000, tcb_table[tcb_index]->pkts_transit.value(), tcb_table[tcb_index]->sliding_avg_window.estmateInterval(current_time), tcb_table[tcb_index]->sliding_avg_window.bytes(), tcb_table[tcb_index]->BusyPeriod.head()->started, tcb_table[tcb_index]->BusyPeriod._size, check_buffer_empty(tcb_index, 0), current_time, tcb_table[tcb_index]->sliding_avg_window.sample_time, tcb_table[tcb_index]->sliding_avg_window.tailTime(), tcb_table[tcb_index]->sliding_avg_window.shift_time, conn->dataPktBuffer._pkts, conn->dataPktBuffer._last_pkts, conn->server_state.snd_nxt, tcb_table[tcb_index]->unsent_data_bytes);
     
 }
 u_int inline aggre_bw_estimate_approx(u_short this_port, u_int tcb_index)
@@ -3345,9 +5031,10 @@ u_int inline aggre_bw_estimate_approx(u_short this_port, u_int tcb_index)
 		if (tcb_table[tcb_index]->states.state_id[i] != this_port)
 		{
 			sport = tcb_table[tcb_index]->states.state_id[i];
-			tcb_table[tcb_index]->conn[sport]->rcv_thrughput = (tcb_table[tcb_index]->conn[sport]->sliding_avg_win.timeInterval(current_time) == 0 ? 0 :
-				tcb_table[tcb_index]->conn[sport]->sliding_avg_win.bytesCount() * RESOLUTION / tcb_table[tcb_index]->conn[sport]->sliding_avg_win.timeInterval(current_time));
-			tcb_table[tcb_index]->aggre_bw_estimate += tcb_table[tcb_index]->conn[sport]->rcv_thrughput;
+			conn_state* conn = tcb_table[tcb_index]->conn[sport];
+			conn->rcv_thrughput = (conn->ack_history.time_span(current_time) == 0 ? 0 :
+				conn->ack_history.seq_span() * RESOLUTION / conn->ack_history.time_span(current_time));
+			tcb_table[tcb_index]->aggre_bw_estimate += conn->rcv_thrughput;
 		}
 	}
 
@@ -3356,6 +5043,8 @@ u_int inline aggre_bw_estimate_approx(u_short this_port, u_int tcb_index)
 }
 void inline ack_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short sport, u_int ack_num, u_int tcb_index, u_int awin)
 {
+        conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
         for (u_int i = 0; i < tcp_opt_len; )
         {
             switch ((u_short)*(tcp_opt + i))
@@ -3375,71 +5064,71 @@ void inline ack_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short sport, u
             case 5: //SACK
 
                     u_short sack_block_num = ((u_short)*(tcp_opt + i + 1) - 2) / sizeof(tcp_sack_block);
-                    //tcb_table[tcb_index]->conn[sport]->max_sack_edge = ack_num;
+                    //conn->max_sack_edge = ack_num;
 
                     if (sack_block_num == 1) // init sack_block_num
-                    	tcb_table[tcb_index]->conn[sport]->sack_block_num = sack_block_num;
+                    	conn->sack_block_num = sack_block_num;
                     
                     u_int last_right_sack = 0;
-                    if (sack_block_num > tcb_table[tcb_index]->conn[sport]->sack_block_num && sack_block_num >= 2)
+                    if (sack_block_num > conn->sack_block_num && sack_block_num >= 2)
                     {
                     	last_right_sack = ntohl(*(u_int *)(tcp_opt + i + 2 + 1*8 + 4));
 
-                    	if (MY_SEQ_LT(ack_num, last_right_sack) && tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX) // DSACK
+                    	if (MY_SEQ_LT(ack_num, last_right_sack) && conn->server_state.phase == FAST_RTX) // DSACK
                     	{
-                            ForwardPkt* out_awin_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();
-                            if (MY_SEQ_GT(out_awin_pkt->seq_num, ack_num + tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale)))
+                            ForwardPkt* out_awin_pkt = conn->dataPktBuffer.lastHead();
+                            if (MY_SEQ_GT(out_awin_pkt->seq_num, ack_num + conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale)))
                             {
-                                while (MY_SEQ_GT(out_awin_pkt->seq_num, ack_num + tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale) + last_right_sack - ack_num))
+                                while (MY_SEQ_GT(out_awin_pkt->seq_num, ack_num + conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale) + last_right_sack - ack_num))
                                 {
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadPrev();
-                                    out_awin_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();
+                                    conn->dataPktBuffer.lastHeadPrev();
+                                    out_awin_pkt = conn->dataPktBuffer.lastHead();
                                     
                                 }
                             }
                     	}
                     }
                                             
-                    tcb_table[tcb_index]->conn[sport]->sack_block_num = sack_block_num;
+                    conn->sack_block_num = sack_block_num;
                     u_int left_sack, right_sack;
-                    u_int rtx = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
+                    u_int rtx = conn->dataPktBuffer._unAck;
 
-                    ForwardPkt* is_rtx_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkt(rtx);
+                    ForwardPkt* is_rtx_pkt = conn->dataPktBuffer.pkt(rtx);
 
                     for (int j = sack_block_num - 1; j >= 0; j --) {
                     	left_sack = ntohl(*(u_int *)(tcp_opt + i + 2 + j*8));
                         right_sack = ntohl(*(u_int *)(tcp_opt + i + 2 + j*8 + 4));
 
-                        if (MY_SEQ_GT(right_sack, ack_num + awin * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale)) || 
-                                MY_SEQ_GT(left_sack, ack_num + awin * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale))) {
+                        if (MY_SEQ_GT(right_sack, ack_num + awin * pow((float)2, (int)conn->server_state.win_scale)) || 
+                                MY_SEQ_GT(left_sack, ack_num + awin * pow((float)2, (int)conn->server_state.win_scale))) {
                             //fprintf(stderr)
                         }
 
                         if (MY_SEQ_GEQ(ack_num, right_sack)) { //DSACK
-                            tcb_table[tcb_index]->conn[sport]->sack_diff += (int)(right_sack - left_sack);
+                            conn->sack_diff += (int)(right_sack - left_sack);
                             continue;
                         }
                                                 
                         
-                        while (is_rtx_pkt->occupy && 
+                        while (conn->dataPktBuffer.live(is_rtx_pkt) && 
                                 MY_SEQ_LT(is_rtx_pkt->seq_num, right_sack) && 
                                 MY_SEQ_LT(is_rtx_pkt->seq_num, ack_num + 
-                                awin * pow((float) 2, (int) tcb_table[tcb_index]->conn[sport]->server_state.win_scale))) {
+                                awin * pow((float) 2, (int) conn->server_state.win_scale))) {
                              if (MY_SEQ_GEQ(is_rtx_pkt->seq_num, left_sack) && 
                                      MY_SEQ_LEQ(is_rtx_pkt->seq_num + is_rtx_pkt->data_len, right_sack) && 
                                      is_rtx_pkt->is_rtx) {
                                 is_rtx_pkt->is_rtx = false;
-                                tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
-                                tcb_table[tcb_index]->conn[sport]->sack_diff += is_rtx_pkt->data_len;
-                                tcb_table[tcb_index]->conn[sport]->undup_sack_diff += is_rtx_pkt->data_len;
+                                conn->sack_diff = 0;
+                                conn->sack_diff += is_rtx_pkt->data_len;
+                                conn->undup_sack_diff += is_rtx_pkt->data_len;
                              }
 
-                             rtx = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pktNext(rtx);
-                             is_rtx_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkt(rtx);
+                             rtx = conn->dataPktBuffer.pktNext(rtx);
+                             is_rtx_pkt = conn->dataPktBuffer.pkt(rtx);
                         }
 
-                        if (MY_SEQ_GT(right_sack, tcb_table[tcb_index]->conn[sport]->max_sack_edge)) {
-                            tcb_table[tcb_index]->conn[sport]->max_sack_edge = right_sack;
+                        if (MY_SEQ_GT(right_sack, conn->max_sack_edge)) {
+                            conn->max_sack_edge = right_sack;
                         }                                               
                     }
 
@@ -3456,402 +5145,414 @@ void inline ack_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short sport, u
 }
 void inline rcv_ack_bw_estimate(u_int ack_num, u_short window, u_short sport, u_int tcb_index)
 {
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	conn->cur_ack_seqno = ack_num;
+	conn->cur_ack_rcv_time = timer.Start();
 
-	//if (tcb_table[tcb_index]->conn[sport]->reset_timer == TRUE)
-	//	tcb_table[tcb_index]->conn[sport]->init_state();
+	//if (conn->reset_timer == TRUE)
+	//	conn->init_state();
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == 0)
-		tcb_table[tcb_index]->conn[sport]->init_state();
+	if (conn->last_ack_rcv_time == 0)
+		conn->init_state();
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time != tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	if (conn->last_ack_rcv_time != conn->cur_ack_rcv_time)
 	{
 		//Right version of TCPW bandwidth estimation
-		tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->ref_ack_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->last_ack_seqno - tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no;
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = (tcb_table[tcb_index]->conn[sport]->ack_interarrival_time == 0 ? 0.935 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.065 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput :
-			0.935 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.0325 * (tcb_table[tcb_index]->conn[sport]->rcv_thrughput + tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time));
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput = (tcb_table[tcb_index]->conn[sport]->ack_interarrival_time == 0 ? 0 : tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time);
+		conn->ack_interarrival_time = conn->last_ack_rcv_time - conn->ref_ack_time;
+		conn->cumul_ack = conn->last_ack_seqno - conn->ref_ack_seq_no;
+		conn->rcv_thrughput_approx = (conn->ack_interarrival_time == 0 ? 0.935 * conn->rcv_thrughput_approx + 0.065 * conn->rcv_thrughput :
+			0.935 * conn->rcv_thrughput_approx + 0.0325 * (conn->rcv_thrughput + conn->cumul_ack * 1000 / conn->ack_interarrival_time));
+		conn->rcv_thrughput = (conn->ack_interarrival_time == 0 ? 0 : conn->cumul_ack * 1000 / conn->ack_interarrival_time);
 
 #ifdef LOG_STAT
 
-		if (!tcb_table[tcb_index]->conn[sport]->rttFd)
+		if (!conn->cold->rttFd)
 		{
 			char name[20];
 			itoa(sport, name, 10);
-			tcb_table[tcb_index]->conn[sport]->rttFd = fopen(strcat(name, "rtt.txt"), "w");
+			conn->cold->rttFd = fopen(strcat(name, "rtt.txt"), "w");
 		}
 
-		fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%lu %u %u %u %u %u %u\n", tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, tcb_table[tcb_index]->conn[sport]->rcv_thrughput);
+		fprintf(conn->cold->rttFd, "%lu %u %u %u %u %u %u\n", conn->cur_ack_rcv_time, conn->server_state.snd_una, conn->RTT, conn->ack_interarrival_time, conn->cumul_ack, conn->rcv_thrughput_approx, conn->rcv_thrughput);
 
 #endif
 
 #ifdef DYNAMIC_RATE_FIT
 
-		if (tcb_table[tcb_index]->conn[sport]->RTT >= tcb_table[tcb_index]->conn[sport]->RTT_limit /*&& ack_num >= tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno*/)
+		if (conn->RTT >= conn->RTT_limit /*&& ack_num >= conn->nxt_ack_seqno*/)
 		{
-			//tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len;
+			//conn->nxt_ack_seqno = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len;
 			//tcb_table[tcb_index]->send_rate = aggre_bw_estimate_approx(sport, tcb_index);
 
-			if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
+			if (conn->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
 			{
 				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_lower;
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 5;
+				//conn->RTT_limit -= 5;
 				print_bw_info(sport, tcb_index);
 			}
-			else if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx <= tcb_table[tcb_index]->send_rate - 25000)
+			else if (conn->rcv_thrughput_approx <= tcb_table[tcb_index]->send_rate - 25000)
 			{
-				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 1;
+				tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
+				//conn->RTT_limit -= 1;
 				print_bw_info(sport, tcb_index);
 			}
 			/*
-			else if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 50000 && tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_upper)
+			else if (conn->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 50000 && conn->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_upper)
 			{
-				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+				tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
 				print_bw_info(sport, tcb_index);
 			}
 			*/
 
 		}
-		else if (tcb_table[tcb_index]->conn[sport]->RTT < tcb_table[tcb_index]->conn[sport]->RTT_limit / 2 /*&& ack_num >= tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno*/)
+		else if (conn->RTT < conn->RTT_limit / 2 /*&& ack_num >= conn->nxt_ack_seqno*/)
 		{
-			//tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len
+			//conn->nxt_ack_seqno = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len
 
-			if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
+			if (conn->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
 			{
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 1;
+				//conn->RTT_limit -= 1;
 				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_upper;
 				print_bw_info(sport, tcb_index);
 			}
-			else if (0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 20000)
+			else if (0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * conn->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 20000)
 			{
-				tcb_table[tcb_index]->send_rate = 0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+				tcb_table[tcb_index]->send_rate = 0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * conn->rcv_thrughput_approx;
 				print_bw_info(sport, tcb_index);
 			}
 		}
 
 #endif
 
-		tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no = tcb_table[tcb_index]->conn[sport]->last_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->ref_ack_time = tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time;
+		conn->ref_ack_seq_no = conn->last_ack_seqno;
+		conn->ref_ack_time = conn->last_ack_rcv_time;
 
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->last_ack_seqno - tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
+		conn->cumul_ack = conn->last_ack_seqno - conn->ref_ack_seq_no;
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	else if (conn->last_ack_rcv_time == conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->last_ack_seqno - tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->cumul_ack = conn->last_ack_seqno - conn->ref_ack_seq_no;
 	}
 }
 void inline rcv_dup_ack_bw_estimate(u_int ack_num, u_short window, u_short sport, u_int tcb_index)
 {
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time != tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	conn->cur_ack_seqno = ack_num;
+	conn->cur_ack_rcv_time = timer.Start();
+
+	if (conn->last_ack_rcv_time != conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->ref_ack_time;
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = (tcb_table[tcb_index]->conn[sport]->ack_interarrival_time == 0 ? 0.935 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.065 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput :
-			0.935 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.0325 * (tcb_table[tcb_index]->conn[sport]->rcv_thrughput + tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time));
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput = (tcb_table[tcb_index]->conn[sport]->ack_interarrival_time == 0 ? 0 : tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time);
+		conn->ack_interarrival_time = conn->last_ack_rcv_time - conn->ref_ack_time;
+		conn->rcv_thrughput_approx = (conn->ack_interarrival_time == 0 ? 0.935 * conn->rcv_thrughput_approx + 0.065 * conn->rcv_thrughput :
+			0.935 * conn->rcv_thrughput_approx + 0.0325 * (conn->rcv_thrughput + conn->cumul_ack * 1000 / conn->ack_interarrival_time));
+		conn->rcv_thrughput = (conn->ack_interarrival_time == 0 ? 0 : conn->cumul_ack * 1000 / conn->ack_interarrival_time);
 
 #ifdef DYNAMIC_RATE_FIT
 
-		if (tcb_table[tcb_index]->send_rate_lower >= tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx)
+		if (tcb_table[tcb_index]->send_rate_lower >= conn->rcv_thrughput_approx)
 			tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_lower;
 		else
-			tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+			tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
 
 		print_bw_info(sport, tcb_index);
 #endif
 
 #ifdef LOG_STAT
 
-		fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%lu %u %u %u %u %u %u\n", tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, tcb_table[tcb_index]->conn[sport]->rcv_thrughput);
+		fprintf(conn->cold->rttFd, "%lu %u %u %u %u %u %u\n", conn->cur_ack_rcv_time, conn->server_state.snd_una, conn->RTT, conn->ack_interarrival_time, conn->cumul_ack, conn->rcv_thrughput_approx, conn->rcv_thrughput);
 #endif
-		tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no = tcb_table[tcb_index]->conn[sport]->last_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->ref_ack_time = tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time;
+		conn->ref_ack_seq_no = conn->last_ack_seqno;
+		conn->ref_ack_time = conn->last_ack_rcv_time;
 
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->sack_diff;
-		tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
+		conn->cumul_ack = conn->sack_diff;
+		conn->sack_diff = 0;
 
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	else if (conn->last_ack_rcv_time == conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->cumul_ack += tcb_table[tcb_index]->conn[sport]->sack_diff;
-		tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
+		conn->cumul_ack += conn->sack_diff;
+		conn->sack_diff = 0;
 	}
 
 }
 void inline rcv_ack_stat_count(u_int ack_num, u_short window, u_short sport, u_int tcb_index)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
 	/*
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
+	conn->cur_ack_rcv_time = timer.Start();
 	*/
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
+	conn->cur_ack_rcv_time = timer.Start();
+	conn->cur_ack_seqno = ack_num;
 
-	//if (tcb_table[tcb_index]->conn[sport]->reset_timer == TRUE)
-	//	tcb_table[tcb_index]->conn[sport]->init_state();
+	//if (conn->reset_timer == TRUE)
+	//	conn->init_state();
 
-	if (!tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time)
-		tcb_table[tcb_index]->conn[sport]->init_state();
+	if (!conn->last_ack_rcv_time)
+		conn->init_state();
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time != tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	if (conn->last_ack_rcv_time != conn->cur_ack_rcv_time)
 	{
 		//Wrong version of TCPW bandwidth estimation
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno - tcb_table[tcb_index]->conn[sport]->last_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = 0.935 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.0325 * (tcb_table[tcb_index]->conn[sport]->rcv_thrughput + tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time);
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput = tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time;
+		conn->cumul_ack = conn->cur_ack_seqno - conn->last_ack_seqno;
+		conn->ack_interarrival_time = conn->cur_ack_rcv_time - conn->last_ack_rcv_time;
+		conn->rcv_thrughput_approx = 0.935 * conn->rcv_thrughput_approx + 0.0325 * (conn->rcv_thrughput + conn->cumul_ack * 1000 / conn->ack_interarrival_time);
+		conn->rcv_thrughput = conn->cumul_ack * 1000 / conn->ack_interarrival_time;
 
 #ifdef LOG_STAT
 
-		if (!tcb_table[tcb_index]->conn[sport]->rttFd)
+		if (!conn->cold->rttFd)
 		{
 			char name[20];
 			itoa(sport, name, 10);
-			tcb_table[tcb_index]->conn[sport]->rttFd = fopen(strcat(name, "rtt.txt"), "w");
+			conn->cold->rttFd = fopen(strcat(name, "rtt.txt"), "w");
 		}
 
-		fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%lu %u %u %u %u %u %u\n", tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, tcb_table[tcb_index]->conn[sport]->rcv_thrughput);
+		fprintf(conn->cold->rttFd, "%lu %u %u %u %u %u %u\n", conn->cur_ack_rcv_time, conn->server_state.snd_una, conn->RTT, conn->ack_interarrival_time, conn->cumul_ack, conn->rcv_thrughput_approx, conn->rcv_thrughput);
 
 #endif
 
 #ifdef DYNAMIC_RATE_FIT
 
-		if (tcb_table[tcb_index]->conn[sport]->RTT >= tcb_table[tcb_index]->conn[sport]->RTT_limit /*&& ack_num >= tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno*/)
+		if (conn->RTT >= conn->RTT_limit /*&& ack_num >= conn->nxt_ack_seqno*/)
 		{
-			//tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len;
+			//conn->nxt_ack_seqno = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len;
 			//tcb_table[tcb_index]->send_rate = aggre_bw_estimate_approx(sport, tcb_index);
 
-			if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
+			if (conn->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
 			{
 				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_lower;
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 5;
+				//conn->RTT_limit -= 5;
 				print_bw_info(sport, tcb_index);
 			}
-			else if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx <= tcb_table[tcb_index]->send_rate - 25000)
+			else if (conn->rcv_thrughput_approx <= tcb_table[tcb_index]->send_rate - 25000)
 			{
-				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 1;
+				tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
+				//conn->RTT_limit -= 1;
 				print_bw_info(sport, tcb_index);
 			}
 			/*
-			else if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 50000 && tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_upper)
+			else if (conn->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 50000 && conn->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_upper)
 			{
-				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+				tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
 				print_bw_info(sport, tcb_index);
 			}
 			*/
 
 		}
-		else if (tcb_table[tcb_index]->conn[sport]->RTT < tcb_table[tcb_index]->conn[sport]->RTT_limit / 2 /*&& ack_num >= tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno*/)
+		else if (conn->RTT < conn->RTT_limit / 2 /*&& ack_num >= conn->nxt_ack_seqno*/)
 		{
-			//tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len
+			//conn->nxt_ack_seqno = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len
 
-			if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
+			if (conn->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
 			{
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 1;
+				//conn->RTT_limit -= 1;
 				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_upper;
 				print_bw_info(sport, tcb_index);
 			}
-			else if (0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 20000)
+			else if (0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * conn->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 20000)
 			{
-				tcb_table[tcb_index]->send_rate = 0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+				tcb_table[tcb_index]->send_rate = 0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * conn->rcv_thrughput_approx;
 				print_bw_info(sport, tcb_index);
 			}
 		}
 #endif
 
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = 0;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
+		conn->cumul_ack = 0;
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	else if (conn->last_ack_rcv_time == conn->cur_ack_rcv_time)
 	{
-		assert(tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time);
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno - tcb_table[tcb_index]->conn[sport]->last_ack_seqno;
+		assert(conn->last_ack_rcv_time == conn->cur_ack_rcv_time);
+		conn->cumul_ack = conn->cur_ack_seqno - conn->last_ack_seqno;
 	}
 
 }
 void inline rcv_dup_ack_stat_count(u_int ack_num, u_short window, u_short sport, u_int tcb_index)
 {
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time != tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	conn->cur_ack_rcv_time = timer.Start();
+	conn->cur_ack_seqno = ack_num;
+
+	if (conn->last_ack_rcv_time != conn->cur_ack_rcv_time)
 	{
 		// Wrong version of TCPW of bandwidth estimation
-		tcb_table[tcb_index]->conn[sport]->cumul_ack += tcb_table[tcb_index]->conn[sport]->sack_diff;
-		tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = 0.935 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx +
-			0.0325 * (tcb_table[tcb_index]->conn[sport]->rcv_thrughput + tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time);
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput = tcb_table[tcb_index]->conn[sport]->cumul_ack * 1000 / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time;
+		conn->cumul_ack += conn->sack_diff;
+		conn->ack_interarrival_time = conn->cur_ack_rcv_time - conn->last_ack_rcv_time;
+		conn->rcv_thrughput_approx = 0.935 * conn->rcv_thrughput_approx +
+			0.0325 * (conn->rcv_thrughput + conn->cumul_ack * 1000 / conn->ack_interarrival_time);
+		conn->rcv_thrughput = conn->cumul_ack * 1000 / conn->ack_interarrival_time;
 
 #ifdef DYNAMIC_RATE_FIT
 
-		if (tcb_table[tcb_index]->send_rate_lower >= tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx)
+		if (tcb_table[tcb_index]->send_rate_lower >= conn->rcv_thrughput_approx)
                     tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_lower;
 		else
-                    tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+                    tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
 
 		print_bw_info(sport, tcb_index);
 #endif
 
 #ifdef LOG_STAT
-		fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%lu %u %u %u %u %u %u %u\n", tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, tcb_table[tcb_index]->conn[sport]->thruput_actual, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, tcb_table[tcb_index]->conn[sport]->rcv_thrughput);
+		fprintf(conn->cold->rttFd, "%lu %u %u %u %u %u %u %u\n", conn->cur_ack_rcv_time, conn->thruput_actual, conn->server_state.snd_una, conn->RTT, conn->ack_interarrival_time, conn->cumul_ack, conn->rcv_thrughput_approx, conn->rcv_thrughput);
 
 #endif
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = 0;
-		tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
+		conn->cumul_ack = 0;
+		conn->sack_diff = 0;
 
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	else if (conn->last_ack_rcv_time == conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->cumul_ack += tcb_table[tcb_index]->conn[sport]->sack_diff;
-		tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
+		conn->cumul_ack += conn->sack_diff;
+		conn->sack_diff = 0;
 	}
 }
 void inline rcv_ack_dft_bw(u_int ack_num, u_short window, u_short sport, u_int tcb_index)
 {
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	conn->cur_ack_rcv_time = timer.Start();
+	conn->cur_ack_seqno = ack_num;
 	
 
-	if (!tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time)
-		tcb_table[tcb_index]->conn[sport]->init_state();
+	if (!conn->last_ack_rcv_time)
+		conn->init_state();
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time != tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	if (conn->last_ack_rcv_time != conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = 0.2 * tcb_table[tcb_index]->conn[sport]->ack_interarrival_time + 0.8 * (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->ref_ack_time);
-		tcb_table[tcb_index]->conn[sport]->dft_cumul_ack = 0.2 * tcb_table[tcb_index]->conn[sport]->dft_cumul_ack + 0.8 * tcb_table[tcb_index]->conn[sport]->cumul_ack;
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput = (tcb_table[tcb_index]->conn[sport]->ack_interarrival_time == 0 ? 0 : tcb_table[tcb_index]->conn[sport]->dft_cumul_ack * RESOLUTION / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time);
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = 0.9 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.1 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput;
+		conn->ack_interarrival_time = 0.2 * conn->ack_interarrival_time + 0.8 * (conn->last_ack_rcv_time - conn->ref_ack_time);
+		conn->dft_cumul_ack = 0.2 * conn->dft_cumul_ack + 0.8 * conn->cumul_ack;
+		conn->rcv_thrughput = (conn->ack_interarrival_time == 0 ? 0 : conn->dft_cumul_ack * RESOLUTION / conn->ack_interarrival_time);
+		conn->rcv_thrughput_approx = 0.9 * conn->rcv_thrughput_approx + 0.1 * conn->rcv_thrughput;
 
 #ifdef LOG_STAT
 
-		if (!tcb_table[tcb_index]->conn[sport]->rttFd)
+		if (!conn->cold->rttFd)
 		{
 			char name[20];
 			itoa(sport, name, 10);
-			tcb_table[tcb_index]->conn[sport]->rttFd = fopen(strcat(name, "rtt.txt"), "w");
+			conn->cold->rttFd = fopen(strcat(name, "rtt.txt"), "w");
 		}
 
-		fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%u %u %u %u %u %u %u\n", tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, tcb_table[tcb_index]->conn[sport]->rcv_thrughput);
+		fprintf(conn->cold->rttFd, "%u %u %u %u %u %u %u\n", conn->cur_ack_rcv_time, conn->server_state.snd_una, conn->RTT, conn->ack_interarrival_time, conn->cumul_ack, conn->rcv_thrughput_approx, conn->rcv_thrughput);
 
 #endif
 
 #ifdef DYNAMIC_RATE_FIT
 
-		if (tcb_table[tcb_index]->conn[sport]->RTT >= tcb_table[tcb_index]->conn[sport]->RTT_limit /*&& ack_num >= tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno*/)
+		if (conn->RTT >= conn->RTT_limit /*&& ack_num >= conn->nxt_ack_seqno*/)
 		{
-			//tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len;
+			//conn->nxt_ack_seqno = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len;
 			//tcb_table[tcb_index]->send_rate = aggre_bw_estimate_approx(sport, tcb_index);
 
-			if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
+			if (conn->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_lower)
 			{
 				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_lower;
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 5;
+				//conn->RTT_limit -= 5;
 				print_bw_info(sport, tcb_index);
 			}
-			else if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx <= tcb_table[tcb_index]->send_rate - 25000)
+			else if (conn->rcv_thrughput_approx <= tcb_table[tcb_index]->send_rate - 25000)
 			{
-				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 1;
+				tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
+				//conn->RTT_limit -= 1;
 				print_bw_info(sport, tcb_index);
 			}
 			/*
-			else if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 50000 && tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_upper)
+			else if (conn->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 50000 && conn->rcv_thrughput_approx < tcb_table[tcb_index]->send_rate_upper)
 			{
-				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+				tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
 				print_bw_info(sport, tcb_index);
 			}
 			*/
 
 		}
-		else if (tcb_table[tcb_index]->conn[sport]->RTT < tcb_table[tcb_index]->conn[sport]->RTT_limit / 2 /*&& ack_num >= tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno*/)
+		else if (conn->RTT < conn->RTT_limit / 2 /*&& ack_num >= conn->nxt_ack_seqno*/)
 		{
-			//tcb_table[tcb_index]->conn[sport]->nxt_ack_seqno = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len
+			//conn->nxt_ack_seqno = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len
 
-			if (tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
+			if (conn->rcv_thrughput_approx > tcb_table[tcb_index]->send_rate_upper)
 			{
-				//tcb_table[tcb_index]->conn[sport]->RTT_limit -= 1;
+				//conn->RTT_limit -= 1;
 				tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_upper;
 				print_bw_info(sport, tcb_index);
 			}
-			else if (0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 20000)
+			else if (0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * conn->rcv_thrughput_approx >= tcb_table[tcb_index]->send_rate + 20000)
 			{
-				tcb_table[tcb_index]->send_rate = 0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+				tcb_table[tcb_index]->send_rate = 0.2 * tcb_table[tcb_index]->send_rate_upper + 0.8 * conn->rcv_thrughput_approx;
 				print_bw_info(sport, tcb_index);
 			}
 		}
 
 #endif
 
-		tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no = tcb_table[tcb_index]->conn[sport]->last_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->ref_ack_time = tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time;
+		conn->ref_ack_seq_no = conn->last_ack_seqno;
+		conn->ref_ack_time = conn->last_ack_rcv_time;
 
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->last_ack_seqno - tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
+		conn->cumul_ack = conn->last_ack_seqno - conn->ref_ack_seq_no;
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	else if (conn->last_ack_rcv_time == conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->last_ack_seqno - tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->cumul_ack = conn->last_ack_seqno - conn->ref_ack_seq_no;
 	}
 
 }
 void inline rcv_dup_ack_dft_bw(u_int ack_num, u_short window, u_short sport, u_int tcb_index)
 {
-	tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time = timer.Start();
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
 
+	conn->cur_ack_rcv_time = timer.Start();
 
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
 
-	if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time != tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	conn->cur_ack_seqno = ack_num;
+
+	if (conn->last_ack_rcv_time != conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = 0.2 * tcb_table[tcb_index]->conn[sport]->ack_interarrival_time + 0.8 * (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->ref_ack_time);
-		tcb_table[tcb_index]->conn[sport]->dft_cumul_ack = 0.2 * tcb_table[tcb_index]->conn[sport]->dft_cumul_ack + 0.8 * tcb_table[tcb_index]->conn[sport]->cumul_ack;
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput = (tcb_table[tcb_index]->conn[sport]->ack_interarrival_time == 0 ? 0 : tcb_table[tcb_index]->conn[sport]->dft_cumul_ack * RESOLUTION / tcb_table[tcb_index]->conn[sport]->ack_interarrival_time);
-		tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = 0.9 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.1 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput;
+		conn->ack_interarrival_time = 0.2 * conn->ack_interarrival_time + 0.8 * (conn->last_ack_rcv_time - conn->ref_ack_time);
+		conn->dft_cumul_ack = 0.2 * conn->dft_cumul_ack + 0.8 * conn->cumul_ack;
+		conn->rcv_thrughput = (conn->ack_interarrival_time == 0 ? 0 : conn->dft_cumul_ack * RESOLUTION / conn->ack_interarrival_time);
+		conn->rcv_thrughput_approx = 0.9 * conn->rcv_thrughput_approx + 0.1 * conn->rcv_thrughput;
 
 #ifdef DYNAMIC_RATE_FIT
 
-		if (tcb_table[tcb_index]->send_rate_lower >= tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx)
+		if (tcb_table[tcb_index]->send_rate_lower >= conn->rcv_thrughput_approx)
 			tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_lower;
 		else
-			tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;
+			tcb_table[tcb_index]->send_rate = conn->rcv_thrughput_approx;
 
 		print_bw_info(sport, tcb_index);
 #endif
 
 #ifdef LOG_STAT
-		fprintf(tcb_table[tcb_index]->conn[sport]->rttFd, "%lu %u %u %u %u %u %u\n", tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->RTT, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time, tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx, tcb_table[tcb_index]->conn[sport]->rcv_thrughput);
+		fprintf(conn->cold->rttFd, "%lu %u %u %u %u %u %u\n", conn->cur_ack_rcv_time, conn->server_state.snd_una, conn->RTT, conn->ack_interarrival_time, conn->cumul_ack, conn->rcv_thrughput_approx, conn->rcv_thrughput);
 
 #endif
-		tcb_table[tcb_index]->conn[sport]->ref_ack_seq_no = tcb_table[tcb_index]->conn[sport]->last_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->ref_ack_time = tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time;
+		conn->ref_ack_seq_no = conn->last_ack_seqno;
+		conn->ref_ack_time = conn->last_ack_rcv_time;
 
-		tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-		tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
-		tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->sack_diff;
-		tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
+		conn->last_ack_seqno = conn->cur_ack_seqno;
+		conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
+		conn->cumul_ack = conn->sack_diff;
+		conn->sack_diff = 0;
 
 	}
-	else if (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time == tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time)
+	else if (conn->last_ack_rcv_time == conn->cur_ack_rcv_time)
 	{
-		tcb_table[tcb_index]->conn[sport]->cumul_ack += tcb_table[tcb_index]->conn[sport]->sack_diff;
-		tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
+		conn->cumul_ack += conn->sack_diff;
+		conn->sack_diff = 0;
 	}
 
 }
@@ -3859,9 +5560,19 @@ void inline rcv_dup_ack_dft_bw(u_int ack_num, u_short window, u_short sport, u_i
 
 
 
+/* bytes per second acked by the newest SLIDING_WIN_SIZE samples of h, timed by their TSvals */
+u_int inline ack_tsval_rate(AckHistory& h, u_int TSval, u_int granularity)
+{
+    u_int i = h.last(SLIDING_WIN_SIZE);
+    u_int span = h.tsval_span(TSval, i);
+
+    return (span == 0 ? 0 : h.bytes(i) * (u_long_long)RESOLUTION / ((u_long_long)span * (u_long_long)granularity));
+}
 /***********ATRC and RSFC estimate uplink receiving throughput according to data receiving rate*********/
 void inline rcv_data_uplink_slide_win_avg_bw(u_int tcb_index, u_short sport, u_int ack_num, u_short data_len, u_long_long current_time)
 {
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
    
     if (!tcb_table[tcb_index]->sliding_uplink_window.sample_time)
     {          
@@ -3870,10 +5581,10 @@ void inline rcv_data_uplink_slide_win_avg_bw(u_int tcb_index, u_short sport, u_i
 
     tcb_table[tcb_index]->sliding_uplink_window.another_put(data_len, current_time, ack_num);
   
-    tcb_table[tcb_index]->conn[sport]->sliding_uplink_window.put(data_len, current_time, ack_num);
-    tcb_table[tcb_index]->conn[sport]->rcv_uplink_thruput = (tcb_table[tcb_index]->conn[sport]->sliding_uplink_window.timeInterval(current_time) == 0 ? 
-		    MAX_UPLINK_BW : (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_uplink_window.bytes() * 
-		    (u_long_long)RESOLUTION / (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_uplink_window.timeInterval(current_time));
+    conn->sliding_uplink_window.put(data_len, current_time, ack_num);
+    conn->rcv_uplink_thruput = (conn->sliding_uplink_window.timeInterval(current_time) == 0 ? 
+		    MAX_UPLINK_BW : (u_long_long)conn->sliding_uplink_window.bytes() * 
+		    (u_long_long)RESOLUTION / (u_long_long)conn->sliding_uplink_window.timeInterval(current_time));
     
     
 }
@@ -3885,55 +5596,47 @@ void inline rcv_data_uplink_slide_win_avg_bw(u_int tcb_index, u_short sport, u_i
 
 void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short sport, u_int tcb_index, u_long_long current_time)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
 
-	tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time > 0 ? tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time : 0);
-	tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
+	conn->ack_interarrival_time = (conn->last_ack_rcv_time > 0 ? conn->cur_ack_rcv_time - conn->last_ack_rcv_time : 0);
+	conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
 
-	tcb_table[tcb_index]->conn[sport]->cur_ack_seqno = ack_num;
-	tcb_table[tcb_index]->conn[sport]->last_ack_seqno = (tcb_table[tcb_index]->conn[sport]->last_ack_seqno == 0 ? ack_num : tcb_table[tcb_index]->conn[sport]->last_ack_seqno);
+	conn->cur_ack_seqno = ack_num;
+	conn->last_ack_seqno = (conn->last_ack_seqno == 0 ? ack_num : conn->last_ack_seqno);
 
-	tcb_table[tcb_index]->conn[sport]->cumul_ack = (int)(tcb_table[tcb_index]->conn[sport]->cur_ack_seqno - tcb_table[tcb_index]->conn[sport]->last_ack_seqno);
+	conn->cumul_ack = (int)(conn->cur_ack_seqno - conn->last_ack_seqno);
 
-	if (tcb_table[tcb_index]->conn[sport]->cumul_ack > tcb_table[tcb_index]->conn[sport]->max_data_len)
+	if (conn->cumul_ack > conn->max_data_len)
 	{
-            if (tcb_table[tcb_index]->conn[sport]->accounted_for >= tcb_table[tcb_index]->conn[sport]->cumul_ack)
+            if (conn->accounted_for >= conn->cumul_ack)
             {
-                tcb_table[tcb_index]->conn[sport]->accounted_for = tcb_table[tcb_index]->conn[sport]->accounted_for - tcb_table[tcb_index]->conn[sport]->cumul_ack;
-                tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->max_data_len;
+                conn->accounted_for = conn->accounted_for - conn->cumul_ack;
+                conn->cumul_ack = conn->max_data_len;
             }
             else
             {
-                tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->cumul_ack - tcb_table[tcb_index]->conn[sport]->accounted_for;
-                tcb_table[tcb_index]->conn[sport]->accounted_for = 0;
+                conn->cumul_ack = conn->cumul_ack - conn->accounted_for;
+                conn->accounted_for = 0;
             }
 	}
 
-	tcb_table[tcb_index]->conn[sport]->sliding_avg_win.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, current_time, ack_num);
-	tcb_table[tcb_index]->conn[sport]->rcv_thrughput = 
-		(tcb_table[tcb_index]->conn[sport]->sliding_avg_win.timeInterval(current_time) == 0 ? tcb_table[tcb_index]->send_rate_upper : 
-			(u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_avg_win.bytesCount() * 
-                (u_long_long)RESOLUTION / (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_avg_win.timeInterval(current_time));
+	conn->ack_history.put(conn->cumul_ack, current_time, tcb_table[tcb_index]->cur_TSval, conn->RTT, ack_num);
+	conn->rcv_thrughput = (conn->ack_history.time_span(current_time) == 0 ? tcb_table[tcb_index]->send_rate_upper : 
+            (u_long_long)conn->ack_history.seq_span() * (u_long_long)RESOLUTION / conn->ack_history.time_span(current_time));
+	conn->rcv_thrughput_approx = 0.875 * conn->rcv_thrughput_approx + 0.125 * conn->rcv_thrughput;
 
-	tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = 0.875 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.125 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput;
-                
-        tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->cur_TSval, ack_num);
-        tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput = 0.0 * tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput + 
-                1.0 * (tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) == 0 ? 
-                    0 : (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.bytes() * (u_long_long)RESOLUTION / 
-                ((u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) * 
-                (u_long_long)tcb_table[tcb_index]->timestamp_granularity));
-        
+        conn->rcv_tsval_thruput = ack_tsval_rate(conn->ack_history, tcb_table[tcb_index]->cur_TSval, tcb_table[tcb_index]->timestamp_granularity);
+
+	tcb_table[tcb_index]->ack_history.put(conn->cumul_ack, current_time, tcb_table[tcb_index]->cur_TSval, tcb_table[tcb_index]->RTT, ack_num);
         
 #ifdef FIX_TIME_INTERVAL_EST
 
-	tcb_table[tcb_index]->sliding_tsval_window.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->cur_TSval, ack_num);
-        tcb_table[tcb_index]->rcv_tsval_est_thruput = 0.0 * tcb_table[tcb_index]->rcv_tsval_est_thruput + 1.0 * (tcb_table[tcb_index]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) == 0 ? 
-            0 : (u_long_long)tcb_table[tcb_index]->sliding_tsval_window.bytes() * (u_long_long)RESOLUTION / 
-                ((u_long_long)tcb_table[tcb_index]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) * (u_long_long)tcb_table[tcb_index]->timestamp_granularity));
+        tcb_table[tcb_index]->rcv_tsval_est_thruput = ack_tsval_rate(tcb_table[tcb_index]->ack_history, tcb_table[tcb_index]->cur_TSval, tcb_table[tcb_index]->timestamp_granularity);
         
         
         
-        if(!tcb_table[tcb_index]->sliding_avg_window.sample_time && tcb_table[tcb_index]->conn[sport]->cumul_ack)
+        if(!tcb_table[tcb_index]->sliding_avg_window.sample_time && conn->cumul_ack)
 	{            
             
         
@@ -3945,11 +5648,11 @@ void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short spor
 #else
             
             tcb_table[tcb_index]->sliding_avg_window.sample_time = current_time;                
-            tcb_table[tcb_index]->sliding_avg_window.init_burst = tcb_table[tcb_index]->pkts_transit;
+            tcb_table[tcb_index]->sliding_avg_window.init_burst = tcb_table[tcb_index]->pkts_transit.value();
             tcb_table[tcb_index]->sliding_avg_window.init_burst = tcb_table[tcb_index]->sent_bytes_counter;
             tcb_table[tcb_index]->sliding_avg_window.init_burst_unsent_bytes = (long long)tcb_table[tcb_index]->send_rate_upper * (long long)tcb_table[tcb_index]->RTT / (long long)RESOLUTION - 
                     tcb_table[tcb_index]->sliding_avg_window.init_burst;
-            tcb_table[tcb_index]->sliding_avg_window.bw_window[0].time = current_time;
+            tcb_table[tcb_index]->sliding_avg_window.bw(0).time = current_time;
             tcb_table[tcb_index]->sent_bytes_counter = 0;
              
             
@@ -3958,14 +5661,14 @@ void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short spor
 	}
         
                                        
-        if (tcb_table[tcb_index]->sliding_avg_window.sample_time && tcb_table[tcb_index]->conn[sport]->cumul_ack)
+        if (tcb_table[tcb_index]->sliding_avg_window.sample_time && conn->cumul_ack)
         {
             
 #ifdef USE_TIMESTAMP
-            tcb_table[tcb_index]->sliding_avg_window.another_put(tcb_table[tcb_index]->conn[sport]->cumul_ack, 
+            tcb_table[tcb_index]->sliding_avg_window.another_put(conn->cumul_ack, 
                     (u_long_long)tcb_table[tcb_index]->cur_TSval * (u_long_long)tcb_table[tcb_index]->timestamp_granularity, ack_num);
 #else
-            tcb_table[tcb_index]->sliding_avg_window.another_put(tcb_table[tcb_index]->conn[sport]->cumul_ack , current_time, ack_num);         
+            tcb_table[tcb_index]->sliding_avg_window.another_put(conn->cumul_ack , current_time, ack_num);         
                         
 #endif 
         }
@@ -3973,7 +5676,7 @@ void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short spor
 	
 #else
 
-	tcb_table[tcb_index]->sliding_avg_window.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, current_time, ack_num);
+	tcb_table[tcb_index]->sliding_avg_window.put(conn->cumul_ack, current_time, ack_num);
 	tcb_table[tcb_index]->rcv_thrughput = (tcb_table[tcb_index]->sliding_avg_window.timeInterval(current_time) == 0 ? tcb_table[tcb_index]->send_rate_upper : (u_long_long)tcb_table[tcb_index]->sliding_avg_window.bytes() * (u_long_long)RESOLUTION / (u_long_long)tcb_table[tcb_index]->sliding_avg_window.timeInterval(current_time));
 	tcb_table[tcb_index]->rcv_thrughput_approx = 0.875 * tcb_table[tcb_index]->rcv_thrughput_approx + 0.125 * tcb_table[tcb_index]->rcv_thrughput;
 
@@ -3983,14 +5686,14 @@ void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short spor
 	
 #ifndef DEBUG
 	printf("%d  %u  %u  %u  %u  %u  %u  %u %hu\t\t\t\t\t\r", 
-	tcb_table[tcb_index]->conn[sport]->server_state.phase, 
-	tcb_table[tcb_index]->conn[sport]->server_state.snd_una, 
-	tcb_table[tcb_index]->conn[sport]->ack_interarrival_time/1000, 
-	tcb_table[tcb_index]->conn[sport]->RTT/1000, 
-	tcb_table[tcb_index]->conn[sport]->RTT_limit/1000, 
+	conn->server_state.phase, 
+	conn->server_state.snd_una, 
+	conn->ack_interarrival_time/1000, 
+	conn->RTT/1000, 
+	conn->RTT_limit/1000, 
 	tcb_table[tcb_index]->send_rate/1000, 
 	tcb_table[tcb_index]->rcv_thrughput_approx/1000, 
-	tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx/1000, 
+	conn->rcv_thrughput_approx/1000, 
 	sport);
 #endif
 	
@@ -4001,8 +5704,8 @@ void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short spor
 #endif
 	
         
-        if (current_time > tcb_table[tcb_index]->conn[sport]->initial_time + 2 * RESOLUTION /*&& tcb_table[tcb_index]->mean_throughput == MAX_SEND_RATE*/) {
-            tcb_table[tcb_index]->mean_throughput = tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx;        
+        if (current_time > conn->initial_time + 2 * RESOLUTION /*&& tcb_table[tcb_index]->mean_throughput == MAX_SEND_RATE*/) {
+            tcb_table[tcb_index]->mean_throughput = conn->rcv_thrughput_approx;        
             
         }
         
@@ -4026,57 +5729,53 @@ void inline rcv_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short spor
 
 #endif
         
-        tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-	tcb_table[tcb_index]->conn[sport]->cumul_ack = 0;
+        conn->last_ack_seqno = conn->cur_ack_seqno;
+	conn->cumul_ack = 0;
                 
 }
 void inline rcv_dup_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short sport, u_int tcb_index, u_long_long current_time)
 {
-	tcb_table[tcb_index]->conn[sport]->ack_interarrival_time = (tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time > 0 ? tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time - tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time : 0);
-	tcb_table[tcb_index]->conn[sport]->last_ack_rcv_time = tcb_table[tcb_index]->conn[sport]->cur_ack_rcv_time;
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	conn->ack_interarrival_time = (conn->last_ack_rcv_time > 0 ? conn->cur_ack_rcv_time - conn->last_ack_rcv_time : 0);
+	conn->last_ack_rcv_time = conn->cur_ack_rcv_time;
 
-	if (tcb_table[tcb_index]->conn[sport]->sack_diff)
+	if (conn->sack_diff)
 	{
-            tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->sack_diff;
-            tcb_table[tcb_index]->conn[sport]->accounted_for = tcb_table[tcb_index]->conn[sport]->accounted_for + tcb_table[tcb_index]->conn[sport]->cumul_ack;
+            conn->cumul_ack = conn->sack_diff;
+            conn->accounted_for = conn->accounted_for + conn->cumul_ack;
 
 	}
 	else
 	{
-            tcb_table[tcb_index]->conn[sport]->cumul_ack = tcb_table[tcb_index]->conn[sport]->max_data_len;
-            tcb_table[tcb_index]->conn[sport]->accounted_for = tcb_table[tcb_index]->conn[sport]->accounted_for + tcb_table[tcb_index]->conn[sport]->cumul_ack;
+            conn->cumul_ack = conn->max_data_len;
+            conn->accounted_for = conn->accounted_for + conn->cumul_ack;
 
 	}
 
-	tcb_table[tcb_index]->conn[sport]->sliding_avg_win.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, current_time, tcb_table[tcb_index]->conn[sport]->cur_ack_seqno);
-	tcb_table[tcb_index]->conn[sport]->rcv_thrughput = (tcb_table[tcb_index]->conn[sport]->sliding_avg_win.timeInterval(current_time) == 0 ? tcb_table[tcb_index]->send_rate_upper : 
-            (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_avg_win.bytesCount() * (u_long_long)RESOLUTION / 
-                (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_avg_win.timeInterval(current_time));
-	tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx = 0.875 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx + 0.125 * tcb_table[tcb_index]->conn[sport]->rcv_thrughput;
+	conn->ack_history.put(conn->cumul_ack, current_time, tcb_table[tcb_index]->cur_TSval, conn->RTT, conn->cur_ack_seqno);
+	conn->rcv_thrughput = (conn->ack_history.time_span(current_time) == 0 ? tcb_table[tcb_index]->send_rate_upper : 
+            (u_long_long)conn->ack_history.seq_span() * (u_long_long)RESOLUTION / conn->ack_history.time_span(current_time));
+	conn->rcv_thrughput_approx = 0.875 * conn->rcv_thrughput_approx + 0.125 * conn->rcv_thrughput;
 
-        tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->cur_TSval, ack_num);
-        tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput = 0.0 * tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput + 
-                1.0 * (tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) == 0 ? 0 : 
-                    (u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.bytes() * (u_long_long)RESOLUTION / 
-                ((u_long_long)tcb_table[tcb_index]->conn[sport]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) * (u_long_long)tcb_table[tcb_index]->timestamp_granularity));
+        conn->rcv_tsval_thruput = ack_tsval_rate(conn->ack_history, tcb_table[tcb_index]->cur_TSval, tcb_table[tcb_index]->timestamp_granularity);
+
+	tcb_table[tcb_index]->ack_history.put(conn->cumul_ack, current_time, tcb_table[tcb_index]->cur_TSval, tcb_table[tcb_index]->RTT, conn->cur_ack_seqno);
         
 #ifdef FIX_TIME_INTERVAL_EST
 
-        tcb_table[tcb_index]->sliding_tsval_window.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, tcb_table[tcb_index]->cur_TSval, ack_num);
-        tcb_table[tcb_index]->rcv_tsval_est_thruput = 0.0 * tcb_table[tcb_index]->rcv_tsval_est_thruput + 1.0 * (tcb_table[tcb_index]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) == 0 ? 
-            0 : (u_long_long)tcb_table[tcb_index]->sliding_tsval_window.bytes() * (u_long_long)RESOLUTION / 
-                (u_long_long)(tcb_table[tcb_index]->sliding_tsval_window.timeInterval(tcb_table[tcb_index]->cur_TSval) * tcb_table[tcb_index]->timestamp_granularity));
+        tcb_table[tcb_index]->rcv_tsval_est_thruput = ack_tsval_rate(tcb_table[tcb_index]->ack_history, tcb_table[tcb_index]->cur_TSval, tcb_table[tcb_index]->timestamp_granularity);
         
 #ifdef USE_TIMESTAMP
-        tcb_table[tcb_index]->sliding_avg_window.another_put(tcb_table[tcb_index]->conn[sport]->cumul_ack, 
-            (u_long_long)tcb_table[tcb_index]->cur_TSval * (u_long_long)tcb_table[tcb_index]->timestamp_granularity, tcb_table[tcb_index]->conn[sport]->cur_ack_seqno);
+        tcb_table[tcb_index]->sliding_avg_window.another_put(conn->cumul_ack, 
+            (u_long_long)tcb_table[tcb_index]->cur_TSval * (u_long_long)tcb_table[tcb_index]->timestamp_granularity, conn->cur_ack_seqno);
 #else
         
-        tcb_table[tcb_index]->sliding_avg_window.another_put(tcb_table[tcb_index]->conn[sport]->cumul_ack, current_time, tcb_table[tcb_index]->conn[sport]->cur_ack_seqno);
+        tcb_table[tcb_index]->sliding_avg_window.another_put(conn->cumul_ack, current_time, conn->cur_ack_seqno);
 #endif
         
 #else
-	tcb_table[tcb_index]->sliding_avg_window.put(tcb_table[tcb_index]->conn[sport]->cumul_ack, current_time, tcb_table[tcb_index]->conn[sport]->cur_ack_seqno);
+	tcb_table[tcb_index]->sliding_avg_window.put(conn->cumul_ack, current_time, conn->cur_ack_seqno);
 	tcb_table[tcb_index]->rcv_thrughput = (tcb_table[tcb_index]->sliding_avg_window.timeInterval(current_time) == 0 ? (u_long_long)tcb_table[tcb_index]->send_rate_upper : tcb_table[tcb_index]->sliding_avg_window.bytes() * (u_long_long)RESOLUTION / (u_long_long)tcb_table[tcb_index]->sliding_avg_window.timeInterval(current_time));
 	tcb_table[tcb_index]->rcv_thrughput_approx = 0.875 * tcb_table[tcb_index]->rcv_thrughput_approx + 0.125 * tcb_table[tcb_index]->rcv_thrughput;
 
@@ -4102,7 +5801,7 @@ void inline rcv_dup_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short
 
 
 #ifndef DEBUG
-    printf("%d  %u  %u  %u  %u  %u  %u  %u %hu\t\t\t\t\t\r", tcb_table[tcb_index]->conn[sport]->server_state.phase, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, tcb_table[tcb_index]->conn[sport]->ack_interarrival_time/1000, tcb_table[tcb_index]->conn[sport]->RTT/1000, tcb_table[tcb_index]->conn[sport]->RTT_limit/1000, tcb_table[tcb_index]->send_rate/1000, tcb_table[tcb_index]->rcv_thrughput_approx/1000, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx/1000, sport);
+    printf("%d  %u  %u  %u  %u  %u  %u  %u %hu\t\t\t\t\t\r", conn->server_state.phase, conn->server_state.snd_una, conn->ack_interarrival_time/1000, conn->RTT/1000, conn->RTT_limit/1000, tcb_table[tcb_index]->send_rate/1000, tcb_table[tcb_index]->rcv_thrughput_approx/1000, conn->rcv_thrughput_approx/1000, sport);
 #endif
 
 #endif
@@ -4118,7 +5817,7 @@ void inline rcv_dup_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short
             tcb_table[tcb_index]->downlink_queueing_delay, 
             0, 
             tcb_table[tcb_index]->downlink_queueing_length, 
-            tcb_table[tcb_index]->conn[sport]->rcv_thrughput, 
+            conn->rcv_thrughput, 
             current_time);
         */
 #else
@@ -4131,8 +5830,8 @@ void inline rcv_dup_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short
             current_time);
 #endif           
         
-	tcb_table[tcb_index]->conn[sport]->last_ack_seqno = tcb_table[tcb_index]->conn[sport]->cur_ack_seqno;
-	tcb_table[tcb_index]->conn[sport]->cumul_ack = 0;
+	conn->last_ack_seqno = conn->cur_ack_seqno;
+	conn->cumul_ack = 0;
 
 }
 
@@ -4143,13 +5842,15 @@ void inline rcv_dup_ack_slide_win_avg_bw(u_int ack_num, u_short window, u_short
 /**********TCP-RRE adapt to the sending rate according to buffering**********/
 void inline rcv_ack_buffer_manage_mode(u_int tcb_index, u_short sport, u_int ack_num, u_long_long current_time)
 {
-    if (tcb_table[tcb_index]->conn[sport]->RTT)
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+    if (conn->RTT)
     {
-        if (tcb_table[tcb_index]->conn[sport]->downlink_queueing_length < tcb_table[tcb_index]->conn[sport]->target_queue_len)
+        if (conn->downlink_queueing_length < conn->target_queue_len)
         {
-            tcb_table[tcb_index]->conn[sport]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput + 
-                    (u_long_long)(tcb_table[tcb_index]->conn[sport]->buffer_max - tcb_table[tcb_index]->conn[sport]->target_queue_len) * (u_long_long)RESOLUTION / 
-                    (u_long_long)tcb_table[tcb_index]->conn[sport]->RTT;
+            conn->send_rate = conn->rcv_tsval_thruput + 
+                    (u_long_long)(conn->buffer_max - conn->target_queue_len) * (u_long_long)RESOLUTION / 
+                    (u_long_long)conn->RTT;
             
             
             printf("TCP-RRE Buffer Fill %u %hu %u %lu %u %u %u %u %u %u \n", 
@@ -4157,19 +5858,19 @@ void inline rcv_ack_buffer_manage_mode(u_int tcb_index, u_short sport, u_int ack
                     sport, 
                     ack_num, 
                     current_time, 
-                    tcb_table[tcb_index]->conn[sport]->RTT/1000, 
-                    tcb_table[tcb_index]->conn[sport]->downlink_queueing_length/tcb_table[tcb_index]->conn[sport]->max_data_len, 
-                    tcb_table[tcb_index]->conn[sport]->target_queue_len/tcb_table[tcb_index]->conn[sport]->max_data_len, 
-                    tcb_table[tcb_index]->conn[sport]->send_rate/1000, 
-                    tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput/1000, 
-                    tcb_table[tcb_index]->conn[sport]->buffer_max/tcb_table[tcb_index]->conn[sport]->max_data_len);
+                    conn->RTT/1000, 
+                    conn->downlink_queueing_length/conn->max_data_len, 
+                    conn->target_queue_len/conn->max_data_len, 
+                    conn->send_rate/1000, 
+                    conn->rcv_tsval_thruput/1000, 
+                    conn->buffer_max/conn->max_data_len);
             
         }
         else
         {
-            tcb_table[tcb_index]->conn[sport]->send_rate = tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput - 
-                    (u_long_long)(tcb_table[tcb_index]->conn[sport]->target_queue_len - tcb_table[tcb_index]->conn[sport]->buffer_min) * (u_long_long)RESOLUTION / 
-                    (u_long_long)tcb_table[tcb_index]->conn[sport]->RTT;
+            conn->send_rate = conn->rcv_tsval_thruput - 
+                    (u_long_long)(conn->target_queue_len - conn->buffer_min) * (u_long_long)RESOLUTION / 
+                    (u_long_long)conn->RTT;
           
             
             printf("TCP-RRE Buffer Drain %u %hu %u %lu %u %u %u %u %u %u \n", 
@@ -4177,12 +5878,12 @@ void inline rcv_ack_buffer_manage_mode(u_int tcb_index, u_short sport, u_int ack
                     sport, 
                     ack_num, 
                     current_time, 
-                    tcb_table[tcb_index]->conn[sport]->RTT/1000, 
-                    tcb_table[tcb_index]->conn[sport]->downlink_queueing_length/tcb_table[tcb_index]->conn[sport]->max_data_len, 
-                    tcb_table[tcb_index]->conn[sport]->target_queue_len/tcb_table[tcb_index]->conn[sport]->max_data_len, 
-                    tcb_table[tcb_index]->conn[sport]->send_rate/1000, 
-                    tcb_table[tcb_index]->conn[sport]->rcv_tsval_thruput/1000, 
-                    tcb_table[tcb_index]->conn[sport]->buffer_max/tcb_table[tcb_index]->conn[sport]->max_data_len);
+                    conn->RTT/1000, 
+                    conn->downlink_queueing_length/conn->max_data_len, 
+                    conn->target_queue_len/conn->max_data_len, 
+                    conn->send_rate/1000, 
+                    conn->rcv_tsval_thruput/1000, 
+                    conn->buffer_max/conn->max_data_len);
             
         }
         
@@ -4195,39 +5896,41 @@ void inline rcv_ack_buffer_manage_mode(u_int tcb_index, u_short sport, u_int ack
 /**********RSFC window adaptation***********/
 void inline rcv_data_flow_ctrl(u_int tcb_index, u_short sport, u_int ack_num, u_long_long current_time)
 {
-    if (tcb_table[tcb_index]->conn[sport]->local_adv_window)
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+    if (conn->local_adv_window)
     {
-        if (tcb_table[tcb_index]->conn[sport]->uplink_queueing_delay > MIN_RTT)
+        if (conn->uplink_queueing_delay > MIN_RTT)
         {
-            tcb_table[tcb_index]->conn[sport]->local_adv_window = min(tcb_table[tcb_index]->conn[sport]->local_adv_window, 
-                    (u_int)((u_long_long)tcb_table[tcb_index]->conn[sport]->rcv_uplink_thruput*(u_long_long)MIN_RTT/(u_long_long)RESOLUTION));
+            conn->local_adv_window = min(conn->local_adv_window, 
+                    (u_int)((u_long_long)conn->rcv_uplink_thruput*(u_long_long)MIN_RTT/(u_long_long)RESOLUTION));
             
             printf("Fast State %lld %lld %lld %lld %u %u %u %lu %u %u\n",
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay,
-                tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay - tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
+                conn->uplink_one_way_delay,
+                conn->min_uplink_one_way_delay,
+                conn->uplink_one_way_delay - conn->min_uplink_one_way_delay,
                 (long long)tcb_table[tcb_index]->cur_TSval * (long long)tcb_table[tcb_index]->timestamp_granularity,
-                tcb_table[tcb_index]->conn[sport]->rcv_uplink_thruput,
+                conn->rcv_uplink_thruput,
                 tcb_table[tcb_index]->cur_TSval,
-                tcb_table[tcb_index]->conn[sport]->uplink_queueing_delay,
+                conn->uplink_queueing_delay,
                 current_time,
-                tcb_table[tcb_index]->conn[sport]->local_adv_window, 
-                tcb_table[tcb_index]->conn[sport]->client_state.sender_win_scale);
+                conn->local_adv_window, 
+                conn->client_state.sender_win_scale);
         }
         else
         {
-            tcb_table[tcb_index]->conn[sport]->local_adv_window += tcb_table[tcb_index]->conn[sport]->MSS;
+            conn->local_adv_window += conn->MSS;
             printf("Slow State %lld %lld %lld %lld %u %u %u %lu %u %u\n",
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay,
-                tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
-                tcb_table[tcb_index]->conn[sport]->uplink_one_way_delay - tcb_table[tcb_index]->conn[sport]->min_uplink_one_way_delay,
+                conn->uplink_one_way_delay,
+                conn->min_uplink_one_way_delay,
+                conn->uplink_one_way_delay - conn->min_uplink_one_way_delay,
                 (long long)tcb_table[tcb_index]->cur_TSval * (long long)tcb_table[tcb_index]->timestamp_granularity,
-                tcb_table[tcb_index]->conn[sport]->rcv_uplink_thruput,
+                conn->rcv_uplink_thruput,
                 tcb_table[tcb_index]->cur_TSval,
-                tcb_table[tcb_index]->conn[sport]->uplink_queueing_delay,
+                conn->uplink_queueing_delay,
                 current_time,
-                tcb_table[tcb_index]->conn[sport]->local_adv_window, 
-                tcb_table[tcb_index]->conn[sport]->client_state.sender_win_scale);
+                conn->local_adv_window, 
+                conn->client_state.sender_win_scale);
         }
 
        
@@ -4241,15 +5944,19 @@ void inline rcv_data_flow_ctrl(u_int tcb_index, u_short sport, u_int ack_num, u_
 
 void inline update_max_sack_edge(u_int tcb_index, u_short sport, u_int ack_num)
 {
-    if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)
-        tcb_table[tcb_index]->conn[sport]->max_sack_edge = ack_num;
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+    if (conn->server_state.phase == NORMAL)
+        conn->max_sack_edge = ack_num;
         
 }
 void inline rcv_rst_handler(u_short sport, u_int tcb_index, u_long_long current_time, u_short ctr_flag)
 {
-        ForwardPkt *unAckPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
+        conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+        ForwardPkt *unAckPkt = conn->dataPktBuffer.unAck();
     
-        while (unAckPkt->occupy)
+        while (conn->dataPktBuffer.live(unAckPkt))
         {           
              unAckPkt->rcv_time = current_time;             
              if (unAckPkt->is_rtx)
@@ -4257,13 +5964,15 @@ void inline rcv_rst_handler(u_short sport, u_int tcb_index, u_long_long current_
                 data_size_in_flight(tcb_index, unAckPkt->data_len);                                                    
              }
              
+             buffer_release(tcb_index, conn, buffer_cost(unAckPkt->data_len));
              unAckPkt->initPkt();
-             tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAckNext();
-             tcb_table[tcb_index]->conn[sport]->dataPktBuffer.decrease();
-             unAckPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
+             conn->dataPktBuffer.unAckNext();
+             conn->dataPktBuffer.decrease();
+             unAckPkt = conn->dataPktBuffer.unAck();
         }
         
-        tcb_table[tcb_index]->conn[sport]->dataPktBuffer.flush();        
+        buffer_release(tcb_index, conn, conn->buffered);
+        conn->dataPktBuffer.flush();        
         
 }
 
@@ -4397,13 +6106,15 @@ void inline rcv_ack_uplink_queueing_delay_est(u_int tcb_index, u_short sport, u_
 
 void inline rcv_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short window, u_short sport, u_int tcb_index, u_long_long current_time)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
 	// ACK sent but unAck packet
-	ForwardPkt *unAckPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
-	tcb_table[tcb_index]->conn[sport]->server_state.snd_una = ack_num;
-	tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
+	ForwardPkt *unAckPkt = conn->dataPktBuffer.unAck();
+	conn->server_state.snd_una = ack_num;
+	conn->server_state.snd_wnd = window;
 
-        if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)
-            tcb_table[tcb_index]->conn[sport]->max_sack_edge = ack_num;
+        if (conn->server_state.phase == NORMAL)
+            conn->max_sack_edge = ack_num;
 
 	if (tcp_len > 20) // TCP Options Check SACK lists
 	{
@@ -4412,18 +6123,18 @@ void inline rcv_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short wi
             ack_sack_option(tcp_opt, tcp_opt_len, sport, ack_num, tcb_index, window);
 	}
         
-        while (unAckPkt->occupy && MY_SEQ_GEQ(ack_num, unAckPkt->seq_num + unAckPkt->data_len))
+        while (conn->dataPktBuffer.live(unAckPkt) && MY_SEQ_GEQ(ack_num, unAckPkt->seq_num + unAckPkt->data_len))
         {                       
             unAckPkt->rcv_time = current_time;
             if (unAckPkt->is_rtx)
             {                               
                 data_size_in_flight(tcb_index, unAckPkt->data_len);
-                if (tcb_table[tcb_index]->conn[sport]->server_state.state == ESTABLISHED)
+                if (conn->server_state.state == ESTABLISHED)
                 {                    
                     if (tcb_table[tcb_index]->probe_state && unAckPkt->data_len)
                         bandwidth_probe(tcb_index, sport, current_time, unAckPkt->data_len);
                                         
-                    if (tcb_table[tcb_index]->conn[sport]->server_state.phase != FAST_RTX)
+                    if (conn->server_state.phase != FAST_RTX)
                     {
                         if (unAckPkt->snd_time && unAckPkt->snd_time < unAckPkt->rcv_time)
                         {                                                        
@@ -4444,7 +6155,7 @@ void inline rcv_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short wi
                             */
                         }
                     }
-                    else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX)
+                    else if (conn->server_state.phase == FAST_RTX)
                     {
                         if (unAckPkt->snd_time && unAckPkt->snd_time < unAckPkt->rcv_time)
                         {
@@ -4461,88 +6172,89 @@ void inline rcv_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short wi
             }
                    
              
+            buffer_release(tcb_index, conn, buffer_cost(unAckPkt->data_len));
             unAckPkt->initPkt();
-            tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAckNext();
-            tcb_table[tcb_index]->conn[sport]->dataPktBuffer.decrease();
-            unAckPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
+            conn->dataPktBuffer.unAckNext();
+            conn->dataPktBuffer.decrease();
+            unAckPkt = conn->dataPktBuffer.unAck();
 
         }
          
   
-	if ((tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX || 
-                tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT))
+	if ((conn->server_state.phase == FAST_RTX || 
+                conn->server_state.phase == NORMAL_TIMEOUT))
         {
-            if (MY_SEQ_GEQ(ack_num, tcb_table[tcb_index]->conn[sport]->max_sack_edge))
+            if (MY_SEQ_GEQ(ack_num, conn->max_sack_edge))
             {
 
-                if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX)
+                if (conn->server_state.phase == FAST_RTX)
                 {
                  
-                    if (tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win && 
-                            MY_SEQ_LT(tcb_table[tcb_index]->conn[sport]->max_sack_edge, tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge))
+                    if (conn->server_state.ignore_adv_win && 
+                            MY_SEQ_LT(conn->max_sack_edge, conn->rcv_max_seq_edge))
                     {
-                        tcb_table[tcb_index]->conn[sport]->max_sack_edge = tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge;
+                        conn->max_sack_edge = conn->rcv_max_seq_edge;
                     }
                     else
                     {
-                        tcb_table[tcb_index]->conn[sport]->sack_block_num = 0;
+                        conn->sack_block_num = 0;
 
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head;
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts;
+                        conn->dataPktBuffer._head = conn->dataPktBuffer._last_head;
+                        conn->dataPktBuffer._pkts = conn->dataPktBuffer._last_pkts;
 
-                        if (!tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win)
-                            tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win = TRUE;
+                        if (!conn->server_state.ignore_adv_win)
+                            conn->server_state.ignore_adv_win = TRUE;
 
-                        tcb_table[tcb_index]->conn[sport]->opp_rtx_space = 0; 
-                        tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;                       
+                        conn->opp_rtx_space = 0; 
+                        conn->server_state.phase = NORMAL;                       
                           
                     }
                 }
-                else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
+                else if (conn->server_state.phase == NORMAL_TIMEOUT)
                 {
-                    tcb_table[tcb_index]->conn[sport]->FRTO_ack_count ++;
-                    if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 1)
+                    conn->FRTO_ack_count ++;
+                    if (conn->FRTO_ack_count == 1)
                     {
                                            
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head;
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts;
+                        conn->dataPktBuffer._head = conn->dataPktBuffer._last_head;
+                        conn->dataPktBuffer._pkts = conn->dataPktBuffer._last_pkts;
 
                         if (!unAckPkt->snd_time)
                         {
-                          tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;
-                          tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                          tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+                          conn->server_state.phase = NORMAL;
+                          conn->FRTO_ack_count = 0;
+                          conn->FRTO_dup_ack_count = 0;
                         }
                         else
                         {
-                            tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
-                            if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts)
+                            conn->FRTO_dup_ack_count = 0;
+                            if (conn->dataPktBuffer._pkts)
                             {
-                                if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len)
-                                    tcb_table[tcb_index]->conn[sport]->max_sack_edge = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len;
+                                if (conn->dataPktBuffer.head()->data_len)
+                                    conn->max_sack_edge = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len;
                                 else //FIN packet
-                                    tcb_table[tcb_index]->conn[sport]->max_sack_edge = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + 1;
+                                    conn->max_sack_edge = conn->dataPktBuffer.head()->seq_num + 1;
 
-                                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
+                                conn->server_state.phase = NORMAL_TIMEOUT;
                             }
-                            else if (!tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts)
+                            else if (!conn->dataPktBuffer._pkts)
                             {
-                                if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len)
-                                    tcb_table[tcb_index]->conn[sport]->max_sack_edge = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->data_len;
+                                if (conn->dataPktBuffer.head()->data_len)
+                                    conn->max_sack_edge = conn->dataPktBuffer.head()->seq_num + conn->dataPktBuffer.head()->data_len;
                                 else //FIN packet
-                                    tcb_table[tcb_index]->conn[sport]->max_sack_edge = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num + 1;
+                                    conn->max_sack_edge = conn->dataPktBuffer.head()->seq_num + 1;
 
-                                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
+                                conn->server_state.phase = NORMAL_TIMEOUT;
                             }
 
                         }
 
                     }
-                    else if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 2)
+                    else if (conn->FRTO_ack_count == 2)
                     {
-                        tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                        tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
-                        tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;
+                        conn->FRTO_ack_count = 0;
+                        conn->FRTO_dup_ack_count = 0;
+                        conn->server_state.phase = NORMAL;
                      
                     }
                 }
@@ -4550,7 +6262,7 @@ void inline rcv_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short wi
         }
         
     
-	if (tcb_table[tcb_index]->conn[sport]->server_state.state == ESTABLISHED)         
+	if (conn->server_state.state == ESTABLISHED)         
         {
             if (!tcb_table[tcb_index]->probe_state) 
             {
@@ -4570,71 +6282,73 @@ void inline rcv_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short wi
             }
         }
         
-	if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts > tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size)
+	if (conn->dataPktBuffer._pkts > conn->dataPktBuffer._size)
 	{
-            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck()->seq_num;
+            conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+            conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+            conn->server_state.snd_nxt = conn->dataPktBuffer.unAck()->seq_num;
 
-            if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
+            if (conn->server_state.phase == NORMAL_TIMEOUT)
             {
-                tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
-                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;
+                conn->FRTO_ack_count = 0;
+                conn->FRTO_dup_ack_count = 0;
+                conn->server_state.phase = NORMAL;
 
             }
 	}
 
 	// Adv window is zero, prepare to retransmit,
-	if (tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win && 
-                tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd <= tcb_table[tcb_index]->conn[sport]->server_state.win_limit)
+	if (conn->server_state.ignore_adv_win && 
+                conn->server_state.snd_wnd <= conn->server_state.win_limit)
 	{
-            tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win = FALSE;
+            conn->server_state.ignore_adv_win = FALSE;
             tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_upper;
 	}
 
 }
 void inline rcv_dup_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_short window, u_short sport, u_int tcb_index, u_long_long current_time)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
     
-	ForwardPkt* retransmitPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
-	tcb_table[tcb_index]->conn[sport]->server_state.snd_una = ack_num;
+	ForwardPkt* retransmitPkt = conn->dataPktBuffer.unAck();
+	conn->server_state.snd_una = ack_num;
         
-        if (!retransmitPkt->num_dup && tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)
-            tcb_table[tcb_index]->conn[sport]->max_sack_edge = ack_num;
+        if (!retransmitPkt->num_dup && conn->server_state.phase == NORMAL)
+            conn->max_sack_edge = ack_num;
                 
 	if (window)
 	{   
-            if (window != tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd)
+            if (window != conn->server_state.snd_wnd)
             {
                 //window update
             }
             
-            if (tcb_table[tcb_index]->conn[sport]->undup_sack_diff) // send within AWnd
+            if (conn->undup_sack_diff) // send within AWnd
 	    {
 	    	retransmitPkt->num_dup ++;
                 
-                if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
-                    tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count ++; // check state bug
+                if (conn->server_state.phase == NORMAL_TIMEOUT)
+                    conn->FRTO_dup_ack_count ++; // check state bug
                 
-                data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->undup_sack_diff);
+                data_size_in_flight(tcb_index, conn->undup_sack_diff);
                
 	    }
-	    else if (tcb_table[tcb_index]->conn[sport]->sack_diff) // send before AWnd
+	    else if (conn->sack_diff) // send before AWnd
 	    {
-                if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
-                        tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count ++; // check state bug
+                if (conn->server_state.phase == NORMAL_TIMEOUT)
+                        conn->FRTO_dup_ack_count ++; // check state bug
                 
-                data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->sack_diff);
+                data_size_in_flight(tcb_index, conn->sack_diff);
 	    }
-	    else if (!tcb_table[tcb_index]->conn[sport]->undup_sack_diff && !tcb_table[tcb_index]->conn[sport]->sack_diff) // send beyond AWnd
+	    else if (!conn->undup_sack_diff && !conn->sack_diff) // send beyond AWnd
 	    {
                 retransmitPkt->num_dup ++;
                 
-                if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
-                    tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count ++;
+                if (conn->server_state.phase == NORMAL_TIMEOUT)
+                    conn->FRTO_dup_ack_count ++;
                 
-                data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->max_data_len);
+                data_size_in_flight(tcb_index, conn->max_data_len);
                 
 	    }
 	}
@@ -4642,23 +6356,23 @@ void inline rcv_dup_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_shor
 	{
             retransmitPkt->num_dup ++;
             
-            if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
-                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count ++;
+            if (conn->server_state.phase == NORMAL_TIMEOUT)
+                conn->FRTO_dup_ack_count ++;
             
-            data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->max_data_len);
+            data_size_in_flight(tcb_index, conn->max_data_len);
             
 	}
         
         
-        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
+        conn->server_state.snd_wnd = window;
         
-	if (tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win && tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd <= tcb_table[tcb_index]->conn[sport]->server_state.win_limit)
+	if (conn->server_state.ignore_adv_win && conn->server_state.snd_wnd <= conn->server_state.win_limit)
 	{
-            tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win = FALSE;
+            conn->server_state.ignore_adv_win = FALSE;
             tcb_table[tcb_index]->send_rate = tcb_table[tcb_index]->send_rate_upper;
 	}
 	
-        if (tcb_table[tcb_index]->conn[sport]->server_state.state == ESTABLISHED)                 
+        if (conn->server_state.state == ESTABLISHED)                 
         {
             if (!tcb_table[tcb_index]->probe_state) 
             {
@@ -4673,54 +6387,54 @@ void inline rcv_dup_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_shor
             }
         }
         
-	if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts > tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size)
+	if (conn->dataPktBuffer._pkts > conn->dataPktBuffer._size)
 	{
-            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
+            conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
            
-            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck()->seq_num;
+            conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+            conn->server_state.snd_nxt = conn->dataPktBuffer.unAck()->seq_num;
 
-            if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
+            if (conn->server_state.phase == NORMAL_TIMEOUT)
             {
-                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;
-                tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+                conn->server_state.phase = NORMAL;
+                conn->FRTO_ack_count = 0;
+                conn->FRTO_dup_ack_count = 0;
                 
             }
 
 	}
 
-	if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
+	if (conn->server_state.phase == NORMAL_TIMEOUT)
 	{
             
-            if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 0)//&& tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count == 2)
+            if (conn->FRTO_ack_count == 0)//&& conn->FRTO_dup_ack_count == 2)
             {
                 /*
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head;
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts;
+                conn->dataPktBuffer._head = conn->dataPktBuffer._last_head;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._last_pkts;
 
-                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;
-                tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+                conn->server_state.phase = NORMAL;
+                conn->FRTO_ack_count = 0;
+                conn->FRTO_dup_ack_count = 0;
                 */
             }
-            else if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 1 && tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count >= 2)
+            else if (conn->FRTO_ack_count == 1 && conn->FRTO_dup_ack_count >= 2)
             {
                                 
-                tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+                conn->FRTO_ack_count = 0;
+                conn->FRTO_dup_ack_count = 0;
                 
-                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = retransmitPkt->seq_num;
+                conn->server_state.phase = NORMAL;
+                conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                conn->server_state.snd_nxt = retransmitPkt->seq_num;
                 retransmitPkt->rtx_time = retransmitPkt->snd_time;
                 retransmitPkt->snd_time = 0;
                 retransmitPkt->num_dup = 0;
                 
                 
 #ifdef DEBUG
-                printf("%u %u %u %u %u\n",  tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts, ack_num);
+                printf("%u %u %u %u %u\n",  conn->dataPktBuffer._last_head, conn->dataPktBuffer._last_pkts, conn->dataPktBuffer._head, conn->dataPktBuffer._pkts, ack_num);
 #endif
                 
             }
@@ -4729,105 +6443,105 @@ void inline rcv_dup_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_shor
         else if (retransmitPkt->num_dup == NUM_DUP_ACK)
 	{
 
-	    if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)
+	    if (conn->server_state.phase == NORMAL)
             {
-	        if (MY_SEQ_LT(tcb_table[tcb_index]->conn[sport]->max_sack_edge, retransmitPkt->seq_num + retransmitPkt->data_len))
+	        if (MY_SEQ_LT(conn->max_sack_edge, retransmitPkt->seq_num + retransmitPkt->data_len))
 	        {
-	           //tcb_table[tcb_index]->conn[sport]->max_sack_edge = retransmitPkt->seq_num + retransmitPkt->data_len;
-	           tcb_table[tcb_index]->conn[sport]->max_sack_edge = retransmitPkt->seq_num +  tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
+	           //conn->max_sack_edge = retransmitPkt->seq_num + retransmitPkt->data_len;
+	           conn->max_sack_edge = retransmitPkt->seq_num +  conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
 
 	        }
                 
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head;
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts;
+                conn->dataPktBuffer._last_head = conn->dataPktBuffer._head;
+                conn->dataPktBuffer._last_pkts = conn->dataPktBuffer._pkts;
 
                 
-                if (!tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts)
-                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadPrev();
+                if (!conn->dataPktBuffer._last_pkts)
+                    conn->dataPktBuffer.lastHeadPrev();
                                                 
-                ForwardPkt *out_awin_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();
+                ForwardPkt *out_awin_pkt = conn->dataPktBuffer.lastHead();
 
-                if (MY_SEQ_GT(out_awin_pkt->seq_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 
-                        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale)))
+                if (MY_SEQ_GT(out_awin_pkt->seq_num, conn->server_state.snd_una + 
+                        conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale)))
                 {
-                    tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
+                    conn->rcv_max_seq_edge = conn->server_state.snd_una + 
+                            conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
 
-                    while (MY_SEQ_GT(out_awin_pkt->seq_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale)))
+                    while (MY_SEQ_GT(out_awin_pkt->seq_num, conn->server_state.snd_una + 
+                            conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale)))
                     {
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadPrev();
-                        out_awin_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();                        
+                        conn->dataPktBuffer.lastHeadPrev();
+                        out_awin_pkt = conn->dataPktBuffer.lastHead();                        
                     }
                 }
                 else
                 {
-                    tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge = out_awin_pkt->seq_num;                                        
-                    tcb_table[tcb_index]->conn[sport]->opp_rtx_space = 
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 
-                        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * 
-                            pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale) - 
+                    conn->rcv_max_seq_edge = out_awin_pkt->seq_num;                                        
+                    conn->opp_rtx_space = 
+                            conn->server_state.snd_una + 
+                        conn->server_state.snd_wnd * 
+                            pow((float)2, (int)conn->server_state.win_scale) - 
                             out_awin_pkt->seq_num;
                      
                 }
                 
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = retransmitPkt->seq_num;
+                conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                conn->server_state.snd_nxt = retransmitPkt->seq_num;
                 retransmitPkt->rtx_time = retransmitPkt->snd_time;
                 retransmitPkt->snd_time = 0;
 
-                tcb_table[tcb_index]->conn[sport]->server_state.phase = FAST_RTX;
+                conn->server_state.phase = FAST_RTX;
 
 #ifdef DEBUG
-                printf("LOCAL RETRANSMISSION PACKET %u ON CONNECTION %hu DUE TO DUP ACKS ON ESTIMATED RATE %u\n", retransmitPkt->seq_num, sport, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx);
+                printf("LOCAL RETRANSMISSION PACKET %u ON CONNECTION %hu DUE TO DUP ACKS ON ESTIMATED RATE %u\n", retransmitPkt->seq_num, sport, conn->rcv_thrughput_approx);
 #endif
 
             }
-	    else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX)
+	    else if (conn->server_state.phase == FAST_RTX)
 	    {
 
-	        if (MY_SEQ_GT(tcb_table[tcb_index]->conn[sport]->max_sack_edge, tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge)) // out-of-AWnd tx successful
+	        if (MY_SEQ_GT(conn->max_sack_edge, conn->rcv_max_seq_edge)) // out-of-AWnd tx successful
                 {
 
-	           tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge = tcb_table[tcb_index]->conn[sport]->max_sack_edge;
+	           conn->rcv_max_seq_edge = conn->max_sack_edge;
                    
 	           /*
-                   ForwardPkt *out_awin_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();
-                   while (MY_SEQ_GT(out_awin_pkt->seq_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una + tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale)))
+                   ForwardPkt *out_awin_pkt = conn->dataPktBuffer.lastHead();
+                   while (MY_SEQ_GT(out_awin_pkt->seq_num, conn->server_state.snd_una + conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale)))
                    {
-                       tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadPrev();
-                       out_awin_pkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();
+                       conn->dataPktBuffer.lastHeadPrev();
+                       out_awin_pkt = conn->dataPktBuffer.lastHead();
                    }
                    */
 
-	           tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
-	           tcb_table[tcb_index]->conn[sport]->undup_sack_diff = 0;
+	           conn->sack_diff = 0;
+	           conn->undup_sack_diff = 0;
 
                    return;
                 }
 	        else // out-of-AWnd tx are all failed
 	        {
-                    tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
-	            tcb_table[tcb_index]->conn[sport]->undup_sack_diff = 0;
+                    conn->sack_diff = 0;
+	            conn->undup_sack_diff = 0;
 
 	            return;
 	        }
                 
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = retransmitPkt->seq_num;
+                conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                conn->server_state.snd_nxt = retransmitPkt->seq_num;
                 retransmitPkt->rtx_time = retransmitPkt->snd_time;
                 retransmitPkt->snd_time = 0;
                 
-                tcb_table[tcb_index]->conn[sport]->server_state.phase = FAST_RTX;
+                conn->server_state.phase = FAST_RTX;
             
 #ifdef DEBUG
-                printf("LOCAL RETRANSMISSION PACKET %u ON CONNECTION %hu DUE TO DUP ACKS ON ESTIMATED RATE %u\n", retransmitPkt->seq_num, sport, tcb_table[tcb_index]->conn[sport]->rcv_thrughput_approx);
+                printf("LOCAL RETRANSMISSION PACKET %u ON CONNECTION %hu DUE TO DUP ACKS ON ESTIMATED RATE %u\n", retransmitPkt->seq_num, sport, conn->rcv_thrughput_approx);
 #endif
 
             }
-            else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
+            else if (conn->server_state.phase == NORMAL_TIMEOUT)
             {
                 // NORMAL_TIMEOUT
             }
@@ -4835,61 +6549,153 @@ void inline rcv_dup_ack_handler(u_char* th, u_int tcp_len, u_int ack_num, u_shor
 	}
 	else if (retransmitPkt->num_dup > NUM_DUP_ACK)
 	{
-            if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX || tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)
+            if (conn->server_state.phase == FAST_RTX || conn->server_state.phase == NORMAL)
             {
-                if (tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win && tcb_table[tcb_index]->conn[sport]->sack_block_num && !tcb_table[tcb_index]->conn[sport]->undup_sack_diff && !tcb_table[tcb_index]->conn[sport]->sack_diff)
+                if (conn->server_state.ignore_adv_win && conn->sack_block_num && !conn->undup_sack_diff && !conn->sack_diff)
                 {
                     /*
-                    if (MY_SEQ_LT(tcb_table[tcb_index]->conn[sport]->max_sack_edge, tcb_table[tcb_index]->conn[sport]->server_state.snd_una + tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale)))
-                        tcb_table[tcb_index]->conn[sport]->max_sack_edge = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
+                    if (MY_SEQ_LT(conn->max_sack_edge, conn->server_state.snd_una + conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale)))
+                        conn->max_sack_edge = conn->server_state.snd_una + conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
                     */
                 }
 
-                tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge = (tcb_table[tcb_index]->conn[sport]->max_sack_edge > tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge ? tcb_table[tcb_index]->conn[sport]->max_sack_edge : tcb_table[tcb_index]->conn[sport]->rcv_max_seq_edge);
+                conn->rcv_max_seq_edge = (conn->max_sack_edge > conn->rcv_max_seq_edge ? conn->max_sack_edge : conn->rcv_max_seq_edge);
             }
 	}
 
-	tcb_table[tcb_index]->conn[sport]->sack_diff = 0;
-	tcb_table[tcb_index]->conn[sport]->undup_sack_diff = 0;
+	conn->sack_diff = 0;
+	conn->undup_sack_diff = 0;
 
 }
 
 
 
 
-void inline rcv_data_pkt(DATA* data, struct pcap_pkthdr* header, const u_char* pkt_data, u_short sport, u_short dport, u_int seq_num, u_short data_len, u_short ctr_flag, u_int tcb_index)
+#ifdef ACK_INBOX
+void inline apply_ack_event(AckEvent* ev)
+{
+    u_int tcb_index = ev->tcb_index;
+    u_short sport = ev->sport;
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+    if (conn == NULL)
+        return;
+
+    BOOL new_pure_ack = FALSE;
+
+    pthread_mutex_lock(&conn->mutex);
+    if (conn->server_state.state == CLOSED)
+    {
+        pthread_mutex_unlock(&conn->mutex);
+        return;
+    }
+
+    if ((ev->type == DATA_ACK_EVENT && MY_SEQ_GEQ(ev->ack_num, conn->server_state.snd_una)) || (MY_SEQ_GT(ev->ack_num, conn->server_state.snd_una) && ev->ack_num <= conn->server_state.snd_max))
+    {
+        rcv_ack_handler(ev->th, ev->tcp_len, ev->ack_num, ev->window, sport, tcb_index, ev->rcv_time);
+        new_pure_ack = (ev->type == PURE_ACK_EVENT);
+    }
+    else if (ev->ack_num == conn->server_state.snd_una)
+    {
+        if (ev->tcp_len > 20) // TCP Options
+            ack_sack_option(ev->th + 20, ev->tcp_len - 20, sport, ev->ack_num, tcb_index, ev->window);
+
+        rcv_dup_ack_handler(ev->th, ev->tcp_len, ev->ack_num, ev->window, sport, tcb_index, ev->rcv_time);
+    }
+    pthread_mutex_unlock(&conn->mutex);
+
+    // the ACK has freed buffer space only now, so the window is judged here
+    if (new_pure_ack)
+        ack_win_update(ev->data, tcb_index, sport, ev->dport);
+}
+void inline drain_ack_inbox();
+void inline post_ack_event(u_char type, u_char* th, u_int tcp_len, u_int ack_num, u_short window, u_short sport, u_short dport, u_int tcb_index, u_long_long current_time, DATA* data)
+{
+    while (!ack_inbox.post(data->mode, type, th, tcp_len, ack_num, window, sport, dport, tcb_index, current_time, data))
+    {
+#ifdef SINGLE_THREAD_ENGINE
+        drain_ack_inbox(); // this thread is the owner, make room in place
+#else
+        // inbox full: hold the capturer back until the scheduler drains it.
+        // With no connections left the scheduler sleeps and the ACK is stale anyway.
+        if (pool.ex_tcb.isEmpty())
+            return;
+        sched_yield();
+#endif
+    }
+}
+void inline drain_ack_inbox()
+{
+    AckEvent batch[ACK_INBOX_BATCH];
+    u_int n;
+
+    while ((n = ack_inbox.take(batch, ACK_INBOX_BATCH)) > 0)
+    {
+        for (u_int i = 0; i < n; i ++)
+            apply_ack_event(&batch[i]);
+    }
+}
+#endif
+BOOL inline rcv_data_pkt(DATA* data, struct pcap_pkthdr* header, const u_char* pkt_data, u_short sport, u_short dport, u_int seq_num, u_short data_len, u_short ctr_flag, u_int tcb_index)
 {
-    ForwardPkt *tmpForwardPkt = tcb_table[tcb_index]->conn[dport]->dataPktBuffer.tail();
-    tmpForwardPkt->index = (tcb_table[tcb_index]->conn[dport]->dataPktBuffer._tail % tcb_table[tcb_index]->conn[dport]->dataPktBuffer.capacity);
+    conn_state* conn = tcb_table[tcb_index]->conn[dport];
+
+#ifdef PAYLOAD_STORAGE
+    ip_header* ih = (ip_header *)(pkt_data + 14);
+    tcp_header* th = (tcp_header *)((u_char *)ih + (ih->ver_ihl & 0xf) * 4);
+    u_int hdr_len = (u_char *)th - pkt_data + ((ntohs(th->hdr_len_resv_code)&0xf000)>>12)*4;
+
+    ForwardPkt *tmpForwardPkt = conn->dataPktBuffer.tail(pkt_data + hdr_len, data_len);
+#else
+    ForwardPkt *tmpForwardPkt = conn->dataPktBuffer.tail();
+#endif
+    if (tmpForwardPkt == NULL)
+        return FALSE; // slab exhausted, the segment stays un-ACKed and the server retransmits it
+
+    tmpForwardPkt->index = (conn->dataPktBuffer._tail % conn->dataPktBuffer.capacity);
     tmpForwardPkt->data = (void *)data;
     memcpy(&(tmpForwardPkt->header), header, sizeof(struct pcap_pkthdr));
+#ifdef PAYLOAD_STORAGE
+    conn->dataPktBuffer.set_template(pkt_data, hdr_len);
+#else
     memcpy(tmpForwardPkt->pkt_data, pkt_data, header->len);
+#endif
     tmpForwardPkt->tcb = tcb_index;
     tmpForwardPkt->sPort = sport;
     tmpForwardPkt->dPort = dport;
+#ifdef PAYLOAD_STORAGE
+    tmpForwardPkt->hdr_len = hdr_len;
+#endif
 #ifdef COMPLETE_SPLITTING_TCP
-    tmpForwardPkt->seq_num = tcb_table[tcb_index]->conn[dport]->client_state.seq_nxt + seq_num - tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt;
+    tmpForwardPkt->seq_num = conn->client_state.seq_nxt + seq_num - conn->client_state.rcv_nxt;
 #else
     tmpForwardPkt->seq_num = seq_num;
 #endif
     tmpForwardPkt->data_len = data_len;
-    tcb_table[tcb_index]->conn[dport]->max_data_len = max(tcb_table[tcb_index]->conn[dport]->max_data_len, (u_int)data_len);
+    conn->max_data_len = max(conn->max_data_len, (u_int)data_len);
     tmpForwardPkt->ctr_flag = ctr_flag;
     tmpForwardPkt->snd_time = 0;
+    tmpForwardPkt->rtx_time = 0;
     tmpForwardPkt->rcv_time = 0;
+    tmpForwardPkt->enq_time = 0;
     tmpForwardPkt->num_dup = 0;
     tmpForwardPkt->is_rtx = true;
     tmpForwardPkt->occupy = true;
     tmpForwardPkt->TSval = tcb_table[tcb_index]->cur_ack_TSval;
+    tmpForwardPkt->gen = conn->generation;
     
-    tcb_table[tcb_index]->conn[dport]->dataPktBuffer.tailNext();
-    tcb_table[tcb_index]->conn[dport]->dataPktBuffer.increase();
-    tcb_table[tcb_index]->conn[dport]->dataPktBuffer._last_pkts ++;
-    
+    conn->dataPktBuffer.tailNext();
+    conn->dataPktBuffer.increase();
+    conn->dataPktBuffer._last_pkts ++;
+
+    conn->buffered += buffer_cost(data_len);
+    buf_budget.charge(&tcb_table[tcb_index]->buffered, buffer_cost(data_len));
+
+    return TRUE;
 }
 void inline accclient_rcv_data_pkt(DATA* data, struct pcap_pkthdr* header, const u_char* pkt_data, u_short sport, u_short dport, u_int seq_num, u_short data_len, u_short ctr_flag, u_int tcb_index)
 {
-    ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.tail();
+    ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[sport]->cold->httpRequest.tail();
     tmpForwardPkt->data = (void *)data;
     memcpy(&(tmpForwardPkt->header), header, sizeof(struct pcap_pkthdr));
     memcpy(tmpForwardPkt->pkt_data, pkt_data, header->len);
@@ -4903,91 +6709,95 @@ void inline accclient_rcv_data_pkt(DATA* data, struct pcap_pkthdr* header, const
     tmpForwardPkt->num_dup = 0;
     tmpForwardPkt->is_rtx = true;
     tmpForwardPkt->occupy = true;
-    tcb_table[tcb_index]->conn[dport]->client_state.httpRequest.tailNext();
-    tcb_table[tcb_index]->conn[dport]->client_state.httpRequest.increase();
+    tcb_table[tcb_index]->conn[dport]->cold->httpRequest.tailNext();
+    tcb_table[tcb_index]->conn[dport]->cold->httpRequest.increase();
     
 }
 void inline clean_sack(u_short sport, u_int ack_num, u_int tcb_index)
 {
-	tcb_table[tcb_index]->conn[sport]->sack_block_num = 0;
-	tcb_table[tcb_index]->conn[sport]->max_sack_edge = ack_num;
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	conn->sack_block_num = 0;
+	conn->max_sack_edge = ack_num;
 	for (u_short i = 0; i < NUM_SACK_BLOCK; i ++)
 	{
-		if (tcb_table[tcb_index]->conn[sport]->sack_block[i].right_edge_block && tcb_table[tcb_index]->conn[sport]->sack_block[i].left_edge_block)
+		if (conn->sack_block[i].right_edge_block && conn->sack_block[i].left_edge_block)
 		{
 
-			tcb_table[tcb_index]->conn[sport]->sack_block[i].right_edge_block = tcb_table[tcb_index]->conn[sport]->sack_block[i].left_edge_block = 0;
+			conn->sack_block[i].right_edge_block = conn->sack_block[i].left_edge_block = 0;
 		}
 	}
 }
 void inline create_sack_list(u_int tcb_index, u_short dport, u_int seq_num, u_short data_len)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[dport];
+
 
-	if (tcb_table[tcb_index]->conn[dport]->client_state.sack.size() == 0)
+	if (conn->cold->sack.size() == 0)
 	{
-		tcb_table[tcb_index]->conn[dport]->client_state.sack._size ++;
-		tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[0].left_edge_block = seq_num;
-		tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[0].right_edge_block = seq_num + data_len;
+		conn->cold->sack._size ++;
+		conn->cold->sack.sack_list[0].left_edge_block = seq_num;
+		conn->cold->sack.sack_list[0].right_edge_block = seq_num + data_len;
 
 		return;
 	}
 	else
 	{
-		for (int i = 0; i < tcb_table[tcb_index]->conn[dport]->client_state.sack.size(); i ++)
+		for (int i = 0; i < conn->cold->sack.size(); i ++)
 		{
-			if (seq_num < tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block)
+			if (seq_num < conn->cold->sack.sack_list[i].left_edge_block)
 			{
-				if (seq_num + data_len < tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block)
+				if (seq_num + data_len < conn->cold->sack.sack_list[i].left_edge_block)
 				{
-					if (tcb_table[tcb_index]->conn[dport]->client_state.sack.size() == CLIENT_SACK_SIZE)
+					if (conn->cold->sack.size() == CLIENT_SACK_SIZE)
 					{
 						return;
 					}
 					else
 					{
 
-						tcb_table[tcb_index]->conn[dport]->client_state.sack._size ++;
-						for (int j = i + 1; j < tcb_table[tcb_index]->conn[dport]->client_state.sack._size; j ++)
+						conn->cold->sack._size ++;
+						for (int j = i + 1; j < conn->cold->sack._size; j ++)
 						{
-							tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j].left_edge_block = tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j-1].left_edge_block;
-							tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j].right_edge_block = tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j-1].right_edge_block;
+							conn->cold->sack.sack_list[j].left_edge_block = conn->cold->sack.sack_list[j-1].left_edge_block;
+							conn->cold->sack.sack_list[j].right_edge_block = conn->cold->sack.sack_list[j-1].right_edge_block;
 
 						}
 
-						tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block = seq_num;
-						tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block = seq_num + data_len;
+						conn->cold->sack.sack_list[i].left_edge_block = seq_num;
+						conn->cold->sack.sack_list[i].right_edge_block = seq_num + data_len;
 
 						return;
 					}
 				}
-				else if (seq_num + data_len >= tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block)
+				else if (seq_num + data_len >= conn->cold->sack.sack_list[i].left_edge_block)
 				{
-					tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block = seq_num;
+					conn->cold->sack.sack_list[i].left_edge_block = seq_num;
 
 					return;
 				}
 			}
-			else if (seq_num >= tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block)
+			else if (seq_num >= conn->cold->sack.sack_list[i].right_edge_block)
 			{
-				if (seq_num == tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block)
+				if (seq_num == conn->cold->sack.sack_list[i].right_edge_block)
 				{
-					tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block = seq_num + data_len;
+					conn->cold->sack.sack_list[i].right_edge_block = seq_num + data_len;
 
 					return;
 				}
-				else if (seq_num > tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block)
+				else if (seq_num > conn->cold->sack.sack_list[i].right_edge_block)
 				{
-					if (i == tcb_table[tcb_index]->conn[dport]->client_state.sack.size() - 1)
+					if (i == conn->cold->sack.size() - 1)
 					{
-						if (tcb_table[tcb_index]->conn[dport]->client_state.sack.size() == CLIENT_SACK_SIZE)
+						if (conn->cold->sack.size() == CLIENT_SACK_SIZE)
 						{
 							return;
 						}
 						else
 						{
-							tcb_table[tcb_index]->conn[dport]->client_state.sack._size ++;
-							tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i+1].left_edge_block = seq_num;
-							tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i+1].right_edge_block = seq_num + data_len;
+							conn->cold->sack._size ++;
+							conn->cold->sack.sack_list[i+1].left_edge_block = seq_num;
+							conn->cold->sack.sack_list[i+1].right_edge_block = seq_num + data_len;
 
 							return;
 						}
@@ -5002,25 +6812,27 @@ void inline create_sack_list(u_int tcb_index, u_short dport, u_int seq_num, u_sh
 }
 u_int inline check_sack_list(u_int tcb_index, u_short dport, u_int seq_num, u_int data_len)
 {
-	if (tcb_table[tcb_index]->conn[dport]->client_state.sack.size() > 0)
+	conn_state* conn = tcb_table[tcb_index]->conn[dport];
+
+	if (conn->cold->sack.size() > 0)
 	{
-		for (int i = 0; i < tcb_table[tcb_index]->conn[dport]->client_state.sack.size(); i ++)
+		for (int i = 0; i < conn->cold->sack.size(); i ++)
 		{
-			if (seq_num < tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block)
+			if (seq_num < conn->cold->sack.sack_list[i].left_edge_block)
 			{
-				if (seq_num + data_len >= tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block)
+				if (seq_num + data_len >= conn->cold->sack.sack_list[i].left_edge_block)
 				{
-					u_int snd_nxt = tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block;
+					u_int snd_nxt = conn->cold->sack.sack_list[i].right_edge_block;
 
-					tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].left_edge_block = tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[i].right_edge_block = 0;
+					conn->cold->sack.sack_list[i].left_edge_block = conn->cold->sack.sack_list[i].right_edge_block = 0;
 
-					for (int j = i + 1; j < tcb_table[tcb_index]->conn[dport]->client_state.sack.size(); j ++)
+					for (int j = i + 1; j < conn->cold->sack.size(); j ++)
 					{
-						tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j-1].left_edge_block = tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j].left_edge_block;
-						tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j-1].right_edge_block = tcb_table[tcb_index]->conn[dport]->client_state.sack.sack_list[j].right_edge_block;
+						conn->cold->sack.sack_list[j-1].left_edge_block = conn->cold->sack.sack_list[j].left_edge_block;
+						conn->cold->sack.sack_list[j-1].right_edge_block = conn->cold->sack.sack_list[j].right_edge_block;
 					}
 
-					tcb_table[tcb_index]->conn[dport]->client_state.sack._size --;
+					conn->cold->sack._size --;
 
 					return snd_nxt;
 				}
@@ -5034,6 +6846,8 @@ u_int inline check_sack_list(u_int tcb_index, u_short dport, u_int seq_num, u_in
 }
 void inline syn_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short dport, BOOL mobile, u_int tcb_index)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[dport];
+
 	for (u_int i = 0; i < tcp_opt_len; )
 	{
 		switch ((u_short)*(tcp_opt + i))
@@ -5046,15 +6860,15 @@ void inline syn_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short dport, B
 			//printf("NO OPERATION\n");
 			break;
 		case 4: // SACK permitted
-			tcb_table[tcb_index]->conn[dport]->server_state.SACK_permitted = TRUE;
+			conn->server_state.SACK_permitted = TRUE;
 #ifdef DEBUG
 			printf("SACK_PERMITTED\n");
 #endif
 			break;
 		case 2:
-			tcb_table[tcb_index]->conn[dport]->MSS = min(ntohs(*(u_short *)(tcp_opt + i + 2)), tcb_table[tcb_index]->conn[dport]->MSS);
+			conn->MSS = min(ntohs(*(u_short *)(tcp_opt + i + 2)), conn->MSS);
 #ifdef DEBUG
-			printf("MSS: %u\n", tcb_table[tcb_index]->conn[dport]->MSS);
+			printf("MSS: %u\n", conn->MSS);
 #endif
 			break;
                 case 8: 
@@ -5068,25 +6882,25 @@ void inline syn_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short dport, B
 		case 3:
 			if (mobile) //from mobile client
 			{
-                            tcb_table[tcb_index]->conn[dport]->server_state.win_scale = (u_short)*(tcp_opt + i + 2);
-                            *(tcp_opt + i + 2) = tcb_table[tcb_index]->conn[dport]->server_state.win_scale > WIN_SCALE ? 
-                                tcb_table[tcb_index]->conn[dport]->server_state.win_scale : WIN_SCALE; // can be 1, 2, 3, 4, 0
-                            tcb_table[tcb_index]->conn[dport]->client_state.win_scale = 
-                                    max((u_short)*(tcp_opt + i + 2), tcb_table[tcb_index]->conn[dport]->server_state.win_scale);
+                            conn->server_state.win_scale = (u_short)*(tcp_opt + i + 2);
+                            *(tcp_opt + i + 2) = conn->server_state.win_scale > WIN_SCALE ? 
+                                conn->server_state.win_scale : WIN_SCALE; // can be 1, 2, 3, 4, 0
+                            conn->client_state.win_scale = 
+                                    max((u_short)*(tcp_opt + i + 2), conn->server_state.win_scale);
 
 #ifdef DEBUG
-                            printf("WIN_SCALE: %hu\n", tcb_table[tcb_index]->conn[dport]->server_state.win_scale);
+                            printf("WIN_SCALE: %hu\n", conn->server_state.win_scale);
 #endif
 			}
 			else //from Internet server
 			{
-			    //tcb_table[tcb_index]->conn[dport]->client_state.win_scale = max((u_short)*(tcp_opt + i + 2), tcb_table[tcb_index]->conn[dport]->server_state.win_scale);
+			    //conn->client_state.win_scale = max((u_short)*(tcp_opt + i + 2), conn->server_state.win_scale);
 			    //*(tcp_opt + i + 2) = 15;
 			    
                             /*the window scale option from Internet server*/
-                            tcb_table[tcb_index]->conn[dport]->client_state.sender_win_scale = (u_short)*(tcp_opt + i + 2);
+                            conn->client_state.sender_win_scale = (u_short)*(tcp_opt + i + 2);
 #ifdef DEBUG
-			    printf("WIN_SCALE: %hu\n", tcb_table[tcb_index]->conn[dport]->client_state.win_scale);
+			    printf("WIN_SCALE: %hu\n", conn->client_state.win_scale);
 #endif
 			}
 
@@ -5110,10 +6924,10 @@ void inline syn_sack_option(u_char* tcp_opt, u_int tcp_opt_len, u_short dport, B
 	}
        
 }
-void inline rcv_header_update(ip_header* ih, tcp_header* th, u_short tcp_len, u_short data_len)
+void inline rcv_header_update(ip_header* ih, tcp_header* th, u_short tcp_len, u_short data_len, u_short window = LOCAL_WINDOW)
 {
 	u_char Buffer[MTU] = {0};
-	th->window = htons(LOCAL_WINDOW);
+	th->window = htons(window);
 	th->crc = 0;
 
 	psd_header psdHeader;
@@ -5291,39 +7105,45 @@ int inline nxt_schedule_conn(u_int tcb_index)
 
 void inline rm_tcb_conn(u_int tcb_index, u_short sport, int tcb_it, int conn_it)
 {
+	conn_state* conn = tcb_table[tcb_index]->conn[sport];
+
+	// unreachable before it is flushed, and flushed before its id can be handed out again
+	buffer_release(tcb_index, conn, conn->buffered);
 	tcb_table[tcb_index]->states.del(conn_it);
-	tcb_table[tcb_index]->conn[sport]->flush();
 	tcb_table[tcb_index]->conn[sport] = NULL;
+	conn_hash.remove(conn);
+	conn->flush();
+	conn_hash.release(conn->index);
 
 	pool._size --;
 
-	conn_hash.decrease();
-
 	if (tcb_table[tcb_index]->states.isEmpty())
 	{
 		pool.ex_tcb.del(tcb_it);
+		tcb_hash.remove(tcb_index);
 		tcb_table[tcb_index]->flush();
-
-		tcb_hash.decrease();
+		tcb_hash.release(tcb_index);
 	}
 }
 void inline accclient_snd_data_pkt(DATA* data, u_int tcb_index, u_short sport, u_short dport, u_short adv_win)
 {            
-    ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[dport]->client_state.httpRequest.head();
+    conn_state* conn = tcb_table[tcb_index]->conn[dport];
+
+    ForwardPkt* tmpForwardPkt = conn->cold->httpRequest.head();
     ip_header* ih = (ip_header *)((u_char *)tmpForwardPkt->pkt_data + 14);
     u_int ip_len = (ih->ver_ihl & 0xf) * 4;
     u_short total_len = ntohs(ih->tlen);
     tcp_header* th = (tcp_header *)((u_char *)ih + ip_len);
     u_short tcp_len = ((ntohs(th->hdr_len_resv_code)&0xf000)>>12)*4;
     u_short data_len = total_len - ip_len - tcp_len;
-    th->ack_num = htonl(tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt);
+    th->ack_num = htonl(conn->client_state.rcv_nxt);
     //th->window = htons(adv_win);
     rcv_header_update(ih, th, tcp_len, data_len);
 
     send_backward(data, &tmpForwardPkt->header, tmpForwardPkt->pkt_data);
     tmpForwardPkt->initPkt();
-    tcb_table[tcb_index]->conn[dport]->client_state.httpRequest.headNext();
-    tcb_table[tcb_index]->conn[dport]->client_state.httpRequest.decrease();
+    conn->cold->httpRequest.headNext();
+    conn->cold->httpRequest.decrease();
                                                      
 }
 u_int urand()
@@ -5433,653 +7253,838 @@ static void deEndianRecord(struct generic_netflow_record *record) {
 
 
 
-void* scheduler(void* _arg)
+void inline sched_load_update(Forward* forward, u_long_long current_time)
 {
-	struct pcap_pkthdr *header;
-
-	DATA* data = (DATA *)_arg;
-	Forward* forward = data->forward;
+    if (current_time - sched_load.start < LOAD_REPORT_INTERVAL)
+        return;
 
-	ForwardPkt *tmpPkt, *timeoutPkt;
-	u_short sport, tcb_index;
-	u_long_long current_time;
-	int tcb_it, conn_it;
+    u_long_long busy = 0, bytes = 0, heaviest_cost = 0;
+    u_int active = 0, heaviest = 0;
 
-	BOOL retransmit;
-	BOOL newTransmit;
+    for (u_int i = 0; i < pool.tcb_num; i ++)
+    {
+        if (!tcb_table[i]->sched_cost)
+            continue;
 
-	u_int snd_win;
-	int space;
-	printf("State Ack iTime(ms) RTT(ms) SendRate(KB/s) TotalEstRate(KB/s) EstRate(KB/s) Conn\n");
+        busy += tcb_table[i]->sched_cost;
+        bytes += tcb_table[i]->sched_bytes;
+        active ++;
+        if (tcb_table[i]->sched_cost > heaviest_cost)
+        {
+            heaviest_cost = tcb_table[i]->sched_cost;
+            heaviest = i;
+        }
 
-	u_int seq_nxt = 0;
+        tcb_table[i]->sched_cost = 0;
+        tcb_table[i]->sched_bytes = 0;
+    }
 
-	while (TRUE)
-	{
-            pthread_mutex_lock(&pool.mutex);
-            while (pool.ex_tcb.isEmpty())
-                pthread_cond_wait(&pool.m_eventConnStateAvailable, &pool.mutex);
+    sched_load.busy = busy;
+    sched_load.bytes = bytes;
+    sched_load.active = active;
+    sched_load.heaviest = heaviest;
+    sched_load.heaviest_share = (busy ? (double)heaviest_cost / (double)busy : 0);
+    sched_load.imbalance = (busy ? (double)heaviest_cost * active / (double)busy : 0);
+    sched_load.intervals ++;
+    sched_load.start = current_time;
+
+    pthread_mutex_lock(&forward->mutex);
+    sched_load.bql_limit = forward->bql.limit;
+    sched_load.bql_sojourn = forward->bql.sojourn;
+    sched_load.bql_sojourn_max = forward->bql.sojourn_max;
+    sched_load.bql_grow_count = forward->bql.grow_count;
+    sched_load.bql_shrink_count = forward->bql.shrink_count;
+    sched_load.ctrl_nonempty = forward->ctrl_nonempty;
+    sched_load.data_nonempty = forward->data_nonempty;
+    pthread_mutex_unlock(&forward->mutex);
+
+#ifdef LOAD_REPORT
+    fprintf(stderr, "scheduler load: busy %llu us bytes %llu active %u heaviest %u share %.2f imbalance %.2f\n",
+            busy, bytes, active, heaviest, sched_load.heaviest_share, sched_load.imbalance);
+    fprintf(stderr, "egress queue: limit %u sojourn %llu us max %llu us grow %llu shrink %llu\n",
+            sched_load.bql_limit, sched_load.bql_sojourn, sched_load.bql_sojourn_max, sched_load.bql_grow_count, sched_load.bql_shrink_count);
+    fprintf(stderr, "egress lanes: ctrl non-empty %llu data non-empty %llu\n", sched_load.ctrl_nonempty, sched_load.data_nonempty);
+#endif
+}
+/* segments the TCB may send in one visit: one, plus whatever pacing credit it has built up */
+u_int inline tcb_visit_budget(u_int tcb_index)
+{
+    if (tcb_table[tcb_index]->send_rate == 0)
+        return 1; // no rate yet, nothing to pace a burst against
 
-            pthread_mutex_unlock(&pool.mutex);
+    u_long_long current_time = timer.Start();
+    double ahead = (double)tcb_table[tcb_index]->sliding_snd_window.timeInterval(current_time) -
+            (double)tcb_table[tcb_index]->sliding_snd_window.bytes() * (double)RESOLUTION / (double)tcb_table[tcb_index]->send_rate;
+    u_int budget = 1;
 
-            tcb_it = nxt_schedule_tcb();
+    if (ahead > 0)
+        budget += (u_int)(ahead * (double)tcb_table[tcb_index]->send_rate / (double)RESOLUTION / (double)MTU);
 
-            if (tcb_it == -1)
-                continue;
-            tcb_index = pool.ex_tcb.state_id[tcb_it];
-            conn_it = nxt_schedule_conn(tcb_index);
+    return (budget < SCHED_MICRO_BURST ? budget : SCHED_MICRO_BURST);
+}
+/* retransmission timers of a connection with nothing new to send, caller holds conn->mutex */
+void inline conn_timer_check(u_int tcb_index, u_short sport, u_long_long current_time)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
 
-            if (conn_it == -1)
-                continue;
+    ForwardPkt* timeoutPkt;
 
-            sport = tcb_table[tcb_index]->states.state_id[conn_it];
+    if (conn->dataPktBuffer._size > 0)
+    {
+        timeoutPkt = conn->dataPktBuffer.unAck();
+        if (conn->client_state.state == CLOSED && 
+                timeoutPkt->snd_time && 
+                current_time > timeoutPkt->snd_time + TIME_TO_LIVE)
+        {
+            conn->server_state.state = CLOSED;
+            conn->client_state.state = CLOSED;
+            data_size_in_flight(tcb_index, conn->dataPktBuffer._size * (int)conn->max_data_len);
 
-            if (sport == 0)
-                continue;
-            
-            pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);                        
-            if(tcb_table[tcb_index]->conn[sport]->server_state.state != CLOSED)
+        }
+        else
+        {                            
+            if (conn->server_state.phase == NORMAL)// I modified the timeout handler 29/11/2012
             {
-                current_time = timer.Start();
 
-#ifdef LOG_STAT
-                log_data(sport, tcb_index);
-#endif
+                timeoutPkt = conn->dataPktBuffer.unAck();
+                if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + conn->rto*2)
+                {
+                    conn->server_state.phase = NORMAL_TIMEOUT;
 
-                retransmit = TRUE;                
-                //print_conn_stats(tcb_index, sport, current_time);
+                    conn->FRTO_ack_count = 0;
+                    conn->FRTO_dup_ack_count = 0;
 
-                if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkts() > 0)
-                {                    
+                    conn->max_sack_edge = timeoutPkt->seq_num + timeoutPkt->data_len;
 
-                    if (tcb_table[tcb_index]->conn[sport]->close_time)
-                        tcb_table[tcb_index]->conn[sport]->close_time = 0;
+                    conn->dataPktBuffer._last_head = conn->dataPktBuffer._head;
+                    conn->dataPktBuffer._last_pkts = conn->dataPktBuffer._pkts;
 
-                    if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)
-                    {
-                        tmpPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head();
+                    if (!conn->dataPktBuffer._last_pkts)
+                        conn->dataPktBuffer.lastHeadPrev();                                    
 
-                        if (!tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win)
-                        {
-                            snd_win = tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
-                            space = snd_win - (int)(tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt - tcb_table[tcb_index]->conn[sport]->server_state.snd_una);
+                    conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                    conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                    conn->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                            if ((int)tmpPkt->data_len > space + NUM_PKT_BEYOND_WIN * tcb_table[tcb_index]->conn[sport]->max_data_len)
-                            {
-                                retransmit = FALSE;
-                                goto normal_timeout_check;
-                            }
+                    if (!timeoutPkt->rtx_time)
+                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                    timeoutPkt->snd_time = 0;
+                }
 
-                        }
-                        else if (tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win)
-                        {
-#ifdef CTRL_FLIGHT
-                            
-                            if (tcb_table[tcb_index]->probe_state) 
-                            {
-                                snd_win =tcb_table[tcb_index]->snd_wnd * tcb_table[tcb_index]->conn[sport]->max_data_len;
-                                space = snd_win - (int)tcb_table[tcb_index]->pkts_transit;
 
-                                if ((int)tmpPkt->data_len > space)
-                                {
-                                    retransmit = FALSE;
-                                    goto normal_timeout_check;
-                                }
-                            }
-                            else if (tcb_table[tcb_index]->send_rate < 2 * tcb_table[tcb_index]->conn[sport]->max_data_len * RESOLUTION / MIN_RTT)
-                            {
-                                space = 3 * MTU - (int) tcb_table[tcb_index]->pkts_transit;
+            }
+            else if (conn->server_state.phase == FAST_RTX)// I modified the timeout handler 29/11/2012
+            {
 
-                                if ((int)tmpPkt->data_len > space) {
-                                    retransmit = FALSE;
-                                    goto normal_timeout_check;
-                                }
-                            }
-#endif
-                        }
+                timeoutPkt = conn->dataPktBuffer.unAck();
+                if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + conn->rto)
+                {
+
+                    conn->server_state.phase = FAST_RTX;
+                    conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                    conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                    conn->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                        if (tmpPkt->snd_time && !tmpPkt->rtx_time)
-                            tmpPkt->rtx_time = tmpPkt->snd_time;
-                        tmpPkt->snd_time = 0;
+                    if (timeoutPkt->snd_time && !timeoutPkt->rtx_time)
+                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                    timeoutPkt->snd_time = 0;
+
+                }
+            }
+            else if (conn->server_state.phase == NORMAL_TIMEOUT)// I modified the timeout handler 29/11/2012
+            {
 
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer.headNext();
+                if (conn->FRTO_ack_count == 1)
+                {
 
-                        if ((tmpPkt->ctr_flag & 0x01) == 1)
+                    timeoutPkt = conn->dataPktBuffer.pkt(conn->dataPktBuffer._last_head);
+                    if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + conn->rto)
+                    {
+                        if (conn->FRTO_dup_ack_count >= 2)
                         {
-                            if (tcb_table[tcb_index]->conn[sport]->server_state.state == SYN_REVD || tcb_table[tcb_index]->conn[sport]->server_state.state == CLOSED)
-                            {
-                                tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
-                                tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
-                            }
-                            else
-                                tcb_table[tcb_index]->conn[sport]->server_state.state = FIN_WAIT_1;
-                            
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
-                            if (tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt > tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt;
-                        }
+                            conn->server_state.phase = NORMAL;                                    
+
+                            conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                            conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+
+                            conn->server_state.snd_nxt = timeoutPkt->seq_num;
+
+                            if (!timeoutPkt->rtx_time)
+                                timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                            timeoutPkt->snd_time = 0;
+
+                            conn->FRTO_ack_count = 0;
+                            conn->FRTO_dup_ack_count = 0;
+
+                            data_size_in_flight(tcb_index, timeoutPkt->data_len);
+
+                        }   
                         else
                         {
-                                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len;
-                                if (tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt > tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt;
-                        }
+                           conn->server_state.phase = NORMAL_TIMEOUT;
 
-normal_timeout_check: 
+                           conn->dataPktBuffer._head = conn->dataPktBuffer._last_head;
+                           conn->dataPktBuffer._pkts = conn->dataPktBuffer._last_pkts;
+                           conn->server_state.snd_nxt = conn->dataPktBuffer.head()->seq_num;
 
-                        timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
-                        if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + tcb_table[tcb_index]->conn[sport]->rto*2)
-                        {
-                                tcb_table[tcb_index]->conn[sport]->max_sack_edge = timeoutPkt->seq_num + timeoutPkt->data_len;
+                           if (!timeoutPkt->rtx_time)
+                              timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                           timeoutPkt->snd_time = 0;
 
-                                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
+                           conn->FRTO_dup_ack_count ++;
+                           data_size_in_flight(tcb_index, timeoutPkt->data_len);
+                        } 
+                    }
+                }                                                              
+            }
+        }
+    }
+}
+/* a TCB parked on egress space still has to notice its RTOs, so the retransmission goes first once space frees */
+void inline tcb_timer_check(u_int tcb_index)
+{
+    u_long_long current_time = timer.Start();
+    u_short sport;
 
-                                tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+    for (u_int i = 0; i < tcb_table[tcb_index]->states.size(); i ++)
+    {
+        sport = tcb_table[tcb_index]->states.state_id[i];
+        if (sport == 0)
+            continue;
+
+        conn_state* conn = tcb_table[tcb_index]->conn[sport];
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->server_state.state != CLOSED)
+            conn_timer_check(tcb_index, sport, current_time);
+        pthread_mutex_unlock(&conn->mutex);
+    }
+}
+/*
+ * one scheduling decision for a connection with segments waiting, caller
+ * holds conn->mutex. Returns the segment to put on the wire, or NULL.
+ */
+ForwardPkt* conn_next_pkt(u_int tcb_index, u_short sport, u_long_long current_time)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
 
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head;
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts;
+    ForwardPkt *tmpPkt = NULL, *timeoutPkt;
 
-                                if (!tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts)
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadPrev();
+    BOOL retransmit = TRUE;
+    BOOL newTransmit;
 
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
+    u_int snd_win;
+    int space;
 
-                                if (!timeoutPkt->rtx_time)
-                                    timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                timeoutPkt->snd_time = 0;
+    if (conn->close_time)
+        conn->close_time = 0;
 
-                        }
+    if (conn->server_state.phase == NORMAL)
+    {
+        tmpPkt = conn->dataPktBuffer.head();
 
+        if (!conn->server_state.ignore_adv_win)
+        {
+            snd_win = conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
+            space = snd_win - (int)(conn->server_state.snd_nxt - conn->server_state.snd_una);
 
-                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+            if ((int)tmpPkt->data_len > space + NUM_PKT_BEYOND_WIN * conn->max_data_len)
+            {
+                retransmit = FALSE;
+                goto normal_timeout_check;
+            }
 
-                    }
-                    else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)
-                    {
-                        tmpPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head();
+        }
+        else if (conn->server_state.ignore_adv_win)
+        {
+#ifdef CTRL_FLIGHT
+            
+            if (tcb_table[tcb_index]->probe_state) 
+            {
+                snd_win =tcb_table[tcb_index]->snd_wnd * conn->max_data_len;
+                space = snd_win - (int)tcb_table[tcb_index]->pkts_transit.value();
 
-                        if (MY_SEQ_GEQ(tmpPkt->seq_num, tcb_table[tcb_index]->conn[sport]->max_sack_edge)) // Cannot retransmit beyong the largest right edge of SACK lists
-                        {
-                            retransmit = FALSE;
-                            goto timeout_timer_check;
-                        }
+                if ((int)tmpPkt->data_len > space)
+                {
+                    retransmit = FALSE;
+                    goto normal_timeout_check;
+                }
+            }
+            else if (tcb_table[tcb_index]->send_rate < 2 * conn->max_data_len * RESOLUTION / MIN_RTT)
+            {
+                space = 3 * MTU - (int) tcb_table[tcb_index]->pkts_transit.value();
 
-                        if (retransmit)
-                        {
-                            if (tmpPkt->snd_time && !tmpPkt->rtx_time)
-                                    tmpPkt->rtx_time = tmpPkt->snd_time;
-                            tmpPkt->snd_time = 0;
-                        }
+                if ((int)tmpPkt->data_len > space) {
+                    retransmit = FALSE;
+                    goto normal_timeout_check;
+                }
+            }
+#endif
+        }
 
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer.headNext();
+        if (tmpPkt->snd_time && !tmpPkt->rtx_time)
+            tmpPkt->rtx_time = tmpPkt->snd_time;
+        tmpPkt->snd_time = 0;
 
+        conn->dataPktBuffer.headNext();
 
-                        if ((tmpPkt->ctr_flag & 0x01) == 1)
-                        {
-                            if (tcb_table[tcb_index]->conn[sport]->server_state.state == SYN_REVD)
-                            {
-                                tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
-                                tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
-                            }
-                            else
-                                tcb_table[tcb_index]->conn[sport]->server_state.state = FIN_WAIT_1;
+        if ((tmpPkt->ctr_flag & 0x01) == 1)
+        {
+            if (conn->server_state.state == SYN_REVD || conn->server_state.state == CLOSED)
+            {
+                conn->server_state.state = CLOSED;
+                conn->client_state.state = CLOSED;
+            }
+            else
+                conn->server_state.state = FIN_WAIT_1;
+            
+            conn->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
+            if (conn->server_state.snd_nxt > conn->server_state.snd_max)
+                    conn->server_state.snd_max = conn->server_state.snd_nxt;
+        }
+        else
+        {
+                conn->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len;
+                if (conn->server_state.snd_nxt > conn->server_state.snd_max)
+                    conn->server_state.snd_max = conn->server_state.snd_nxt;
+        }
 
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
-                        }
-                        else
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num  + tmpPkt->data_len;
+normal_timeout_check: 
 
-                        if (tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt > tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
-                                tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt;
+        timeoutPkt = conn->dataPktBuffer.unAck();
+        if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + conn->rto*2)
+        {
+                conn->max_sack_edge = timeoutPkt->seq_num + timeoutPkt->data_len;
 
-                        
-timeout_timer_check:
-                   
-                        if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 0)
-                        {
-                            timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
+                conn->server_state.phase = NORMAL_TIMEOUT;
 
-                            /*
-                            if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time  + TIME_TO_LIVE)
-                            {
-                                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;                                    
+                conn->FRTO_ack_count = 0;
+                conn->FRTO_dup_ack_count = 0;
 
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
+                conn->dataPktBuffer._last_head = conn->dataPktBuffer._head;
+                conn->dataPktBuffer._last_pkts = conn->dataPktBuffer._pkts;
 
-                                if (!timeoutPkt->rtx_time)
-                                    timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                timeoutPkt->snd_time = 0;
+                if (!conn->dataPktBuffer._last_pkts)
+                    conn->dataPktBuffer.lastHeadPrev();
 
-                                tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                                tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+                conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                conn->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                                data_size_in_flight(tcb_index, timeoutPkt->data_len);
-                            }
-                            */
+                if (!timeoutPkt->rtx_time)
+                    timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                timeoutPkt->snd_time = 0;
 
-                            if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time  + tcb_table[tcb_index]->conn[sport]->rto)
-                            {
-                                tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
-                                tcb_table[tcb_index]->conn[sport]->max_sack_edge = timeoutPkt->seq_num + timeoutPkt->data_len;
+        }
 
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                                if (!timeoutPkt->rtx_time)
-                                     timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                timeoutPkt->snd_time = 0;
-                               
-                            }
-                        }
-                        else if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 1)// I modified the timeout handler 29/11/2012
-                        {
-                            timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkt(tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head);
-                            if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + tcb_table[tcb_index]->conn[sport]->rto)
-                            {
-                                if (tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count >= 2)
-                                {
-                                    tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;                                    
 
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
+    }
+    else if (conn->server_state.phase == NORMAL_TIMEOUT)
+    {
+        tmpPkt = conn->dataPktBuffer.head();
 
-                                    if (!timeoutPkt->rtx_time)
-                                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                    timeoutPkt->snd_time = 0;
+        if (MY_SEQ_GEQ(tmpPkt->seq_num, conn->max_sack_edge)) // Cannot retransmit beyong the largest right edge of SACK lists
+        {
+            retransmit = FALSE;
+            goto timeout_timer_check;
+        }
 
-                                    tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                                    tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+        if (retransmit)
+        {
+            if (tmpPkt->snd_time && !tmpPkt->rtx_time)
+                    tmpPkt->rtx_time = tmpPkt->snd_time;
+            tmpPkt->snd_time = 0;
+        }
 
-                                    data_size_in_flight(tcb_index, timeoutPkt->data_len);
+        conn->dataPktBuffer.headNext();
 
-                                }   
-                                else
-                                {
-                                    tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
 
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head;
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts;
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num;
+        if ((tmpPkt->ctr_flag & 0x01) == 1)
+        {
+            if (conn->server_state.state == SYN_REVD)
+            {
+                conn->server_state.state = CLOSED;
+                conn->client_state.state = CLOSED;
+            }
+            else
+                conn->server_state.state = FIN_WAIT_1;
 
-                                    if (!timeoutPkt->rtx_time)
-                                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                    timeoutPkt->snd_time = 0;
+            conn->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
+        }
+        else
+            conn->server_state.snd_nxt = tmpPkt->seq_num  + tmpPkt->data_len;
 
-                                    tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count ++;
-                                    data_size_in_flight(tcb_index, timeoutPkt->data_len);
-                                }
-                            }
-                        }
+        if (conn->server_state.snd_nxt > conn->server_state.snd_max)
+                conn->server_state.snd_max = conn->server_state.snd_nxt;
 
-                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+        
+timeout_timer_check:
+   
+        if (conn->FRTO_ack_count == 0)
+        {
+            timeoutPkt = conn->dataPktBuffer.unAck();
 
+            /*
+            if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time  + TIME_TO_LIVE)
+            {
+                conn->server_state.phase = NORMAL;                                    
 
-                    }
-                    else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX)
-                    {
+                conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                conn->dataPktBuffer._last_pkts = conn->dataPktBuffer._size;
+                conn->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                        newTransmit = FALSE;
-                        tmpPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head();
-                        if (MY_SEQ_LT(tmpPkt->seq_num, tcb_table[tcb_index]->conn[sport]->max_sack_edge))
-                        {
+                if (!timeoutPkt->rtx_time)
+                    timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                timeoutPkt->snd_time = 0;
 
-                            /*
-                            if (tcb_table[tcb_index]->conn[sport]->sack_block_num > 0)
-                            {
-                                    for (u_short i = 0; i < NUM_SACK_BLOCK; i ++)
-                                    {
-                                            if (tcb_table[tcb_index]->conn[sport]->sack_block[i].right_edge_block && tcb_table[tcb_index]->conn[sport]->sack_block[i].left_edge_block && MY_SEQ_GEQ(tmpPkt->seq_num, tcb_table[tcb_index]->conn[sport]->sack_block[i].left_edge_block) && MY_SEQ_LEQ(tmpPkt->seq_num + tmpPkt->data_len, tcb_table[tcb_index]->conn[sport]->sack_block[i].right_edge_block))
-                                            {
-                                                    retransmit = FALSE;
-                                                    break;
-                                            }
-                                    }
-                            }
-                            */
+                conn->FRTO_ack_count = 0;
+                conn->FRTO_dup_ack_count = 0;
 
-                            if (!tmpPkt->is_rtx)
-                            {
-                                retransmit = FALSE;
-                            }
-                            else if (tmpPkt->is_rtx)
-                            {                                
-                                data_size_in_flight(tcb_index, tmpPkt->data_len);
-                            }
+                data_size_in_flight(tcb_index, timeoutPkt->data_len);
+            }
+            */
 
-                            tcb_table[tcb_index]->conn[sport]->opp_rtx_space += tmpPkt->data_len;
+            if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time  + conn->rto)
+            {
+                conn->server_state.phase = NORMAL_TIMEOUT;
+                conn->max_sack_edge = timeoutPkt->seq_num + timeoutPkt->data_len;
 
+                conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                conn->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                        }
-                        else if (MY_SEQ_GEQ(tmpPkt->seq_num, tcb_table[tcb_index]->conn[sport]->max_sack_edge))
-                        {
-                            if (tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win)
-                            {
-                                retransmit = FALSE;
-                                //tcb_table[tcb_index]->conn[sport]->opp_rtx_space += tmpPkt->data_len;
+                if (!timeoutPkt->rtx_time)
+                     timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                timeoutPkt->snd_time = 0;
+               
+            }
+        }
+        else if (conn->FRTO_ack_count == 1)// I modified the timeout handler 29/11/2012
+        {
+            timeoutPkt = conn->dataPktBuffer.pkt(conn->dataPktBuffer._last_head);
+            if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + conn->rto)
+            {
+                if (conn->FRTO_dup_ack_count >= 2)
+                {
+                    conn->server_state.phase = NORMAL;                                    
 
-                                if (!enable_opp_rtx)
-                                {
-                                    snd_win = tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
-                                    space = snd_win -(int)(tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead()->seq_num - tcb_table[tcb_index]->conn[sport]->server_state.snd_una);
-                                    if (space >= (int)tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead()->data_len)
-                                        newTransmit = TRUE;
+                    conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+                    conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+                    conn->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                                }                             
-                                else if (enable_opp_rtx)
-                                {
-#ifdef CTRL_FLIGHT 
-                                    snd_win = tcb_table[tcb_index]->conn[sport]->opp_rtx_space;
-                                    space = snd_win;
+                    if (!timeoutPkt->rtx_time)
+                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                    timeoutPkt->snd_time = 0;
 
-                                    if (space >= (int)tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead()->data_len)
-                                    {
-                                        newTransmit = TRUE;
-                                    }
+                    conn->FRTO_ack_count = 0;
+                    conn->FRTO_dup_ack_count = 0;
 
-                                    //newTransmit = TRUE;
+                    data_size_in_flight(tcb_index, timeoutPkt->data_len);
 
-#else
+                }   
+                else
+                {
+                    conn->server_state.phase = NORMAL_TIMEOUT;
 
-                                    snd_win = tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
+                    conn->dataPktBuffer._head = conn->dataPktBuffer._last_head;
+                    conn->dataPktBuffer._pkts = conn->dataPktBuffer._last_pkts;
+                    conn->server_state.snd_nxt = conn->dataPktBuffer.head()->seq_num;
 
-                                    space = snd_win - (int)tcb_table[tcb_index]->pkts_transit;
-                                    if (space >= (int)tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead()->data_len)
-                                    {
-                                        newTransmit = TRUE;
-                                    }
+                    if (!timeoutPkt->rtx_time)
+                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
+                    timeoutPkt->snd_time = 0;
 
-                                    //newTransmit = TRUE;
-#endif
-                                }
+                    conn->FRTO_dup_ack_count ++;
+                    data_size_in_flight(tcb_index, timeoutPkt->data_len);
+                }
+            }
+        }
 
-                                goto fast_rtx_timer_check;
 
-                            }
-                            else
+
+    }
+    else if (conn->server_state.phase == FAST_RTX)
+    {
+
+        newTransmit = FALSE;
+        tmpPkt = conn->dataPktBuffer.head();
+        if (MY_SEQ_LT(tmpPkt->seq_num, conn->max_sack_edge))
+        {
+
+            /*
+            if (conn->sack_block_num > 0)
+            {
+                    for (u_short i = 0; i < NUM_SACK_BLOCK; i ++)
+                    {
+                            if (conn->sack_block[i].right_edge_block && conn->sack_block[i].left_edge_block && MY_SEQ_GEQ(tmpPkt->seq_num, conn->sack_block[i].left_edge_block) && MY_SEQ_LEQ(tmpPkt->seq_num + tmpPkt->data_len, conn->sack_block[i].right_edge_block))
                             {
-                                retransmit = FALSE;
+                                    retransmit = FALSE;
+                                    break;
+                            }
+                    }
+            }
+            */
+
+            if (!tmpPkt->is_rtx)
+            {
+                retransmit = FALSE;
+            }
+            else if (tmpPkt->is_rtx)
+            {                                
+                data_size_in_flight(tcb_index, tmpPkt->data_len);
+            }
 
-                                snd_win = tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->server_state.win_scale);
-                                space = snd_win - (int)(tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt - tcb_table[tcb_index]->conn[sport]->server_state.snd_una);
+            conn->opp_rtx_space += tmpPkt->data_len;
 
-                                if ((int)tmpPkt->data_len <= space)
-                                {
-                                    newTransmit = TRUE;
 
-                                }
+        }
+        else if (MY_SEQ_GEQ(tmpPkt->seq_num, conn->max_sack_edge))
+        {
+            if (conn->server_state.ignore_adv_win)
+            {
+                retransmit = FALSE;
+                //conn->opp_rtx_space += tmpPkt->data_len;
 
-                                /*
-                                snd_win = tcb_table[tcb_index]->conn[sport]->max_data_len * BDP;
-                                space = snd_win - (int)tcb_table[tcb_index]->pkts_transit*(int)tcb_table[tcb_index]->conn[sport]->max_data_len;
-                                space = snd_win - (int)tcb_table[tcb_index]->pkts_transit;
-                                if (space >= (int)tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead()->data_len)
-                                {
-                                    newTransmit = TRUE;
-                                }
-                                */
+                if (!enable_opp_rtx)
+                {
+                    snd_win = conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
+                    space = snd_win -(int)(conn->dataPktBuffer.lastHead()->seq_num - conn->server_state.snd_una);
+                    if (space >= (int)conn->dataPktBuffer.lastHead()->data_len)
+                        newTransmit = TRUE;
+
+                }                             
+                else if (enable_opp_rtx)
+                {
+#ifdef CTRL_FLIGHT 
+                    snd_win = conn->opp_rtx_space;
+                    space = snd_win;
 
-                                goto fast_rtx_timer_check;
-                            }
-                        }
+                    if (space >= (int)conn->dataPktBuffer.lastHead()->data_len)
+                    {
+                        newTransmit = TRUE;
+                    }
 
+                    //newTransmit = TRUE;
 
-                        if (retransmit)
-                        {
-                            if (tmpPkt->snd_time && !tmpPkt->rtx_time)
-                                tmpPkt->rtx_time = tmpPkt->snd_time;
-                            tmpPkt->snd_time = 0;
-                        }
+#else
 
-                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer.headNext();
+                    snd_win = conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
 
-                        if ((tmpPkt->ctr_flag & 0x01) == 1)
-                        {
-                            if (tcb_table[tcb_index]->conn[sport]->server_state.state == SYN_REVD)
-                            {
-                                tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
-                                tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
-                            }
-                            else
-                                tcb_table[tcb_index]->conn[sport]->server_state.state = FIN_WAIT_1;
+                    space = snd_win - (int)tcb_table[tcb_index]->pkts_transit.value();
+                    if (space >= (int)conn->dataPktBuffer.lastHead()->data_len)
+                    {
+                        newTransmit = TRUE;
+                    }
 
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
-                        }
-                        else
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num  + tmpPkt->data_len;
+                    //newTransmit = TRUE;
+#endif
+                }
 
-                        if (tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt > tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt;
+                goto fast_rtx_timer_check;
 
-fast_rtx_timer_check:
+            }
+            else
+            {
+                retransmit = FALSE;
 
-                        timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
+                snd_win = conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
+                space = snd_win - (int)(conn->server_state.snd_nxt - conn->server_state.snd_una);
 
-                        if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + tcb_table[tcb_index]->conn[sport]->rto)
-                        {
+                if ((int)tmpPkt->data_len <= space)
+                {
+                    newTransmit = TRUE;
 
-                            tcb_table[tcb_index]->conn[sport]->server_state.phase = FAST_RTX;
-                            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
-                            if (!timeoutPkt->rtx_time)
-                                timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                            timeoutPkt->snd_time = 0;
+                }
 
-                        }
+                /*
+                snd_win = conn->max_data_len * BDP;
+                space = snd_win - (int)tcb_table[tcb_index]->pkts_transit.value()*(int)conn->max_data_len;
+                space = snd_win - (int)tcb_table[tcb_index]->pkts_transit.value();
+                if (space >= (int)conn->dataPktBuffer.lastHead()->data_len)
+                {
+                    newTransmit = TRUE;
+                }
+                */
 
-                        if (newTransmit)
-                        {
+                goto fast_rtx_timer_check;
+            }
+        }
 
-                            if (!tcb_table[tcb_index]->conn[sport]->send_out_awin && 
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts > 0)
-                            {
-                                tmpPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHead();
 
-                                if (tmpPkt->snd_time && !tmpPkt->rtx_time)
-                                    tmpPkt->rtx_time = tmpPkt->snd_time;
-                                tmpPkt->snd_time = 0;
+        if (retransmit)
+        {
+            if (tmpPkt->snd_time && !tmpPkt->rtx_time)
+                tmpPkt->rtx_time = tmpPkt->snd_time;
+            tmpPkt->snd_time = 0;
+        }
 
-                                tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadNext();
+        conn->dataPktBuffer.headNext();
 
-                                if ((tmpPkt->ctr_flag & 0x01) == 1)
-                                {
-                                    if (tcb_table[tcb_index]->conn[sport]->server_state.state == SYN_REVD)
-                                    {
-                                        tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
-                                        tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
-                                    }
-                                    else
-                                        tcb_table[tcb_index]->conn[sport]->server_state.state = FIN_WAIT_1;
+        if ((tmpPkt->ctr_flag & 0x01) == 1)
+        {
+            if (conn->server_state.state == SYN_REVD)
+            {
+                conn->server_state.state = CLOSED;
+                conn->client_state.state = CLOSED;
+            }
+            else
+                conn->server_state.state = FIN_WAIT_1;
 
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
-                                }
-                                else
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tmpPkt->seq_num  + tmpPkt->data_len;
+            conn->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
+        }
+        else
+            conn->server_state.snd_nxt = tmpPkt->seq_num  + tmpPkt->data_len;
 
-                                if (tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt > tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
-                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt;
+        if (conn->server_state.snd_nxt > conn->server_state.snd_max)
+            conn->server_state.snd_max = conn->server_state.snd_nxt;
 
-                                retransmit = TRUE;
-                                tcb_table[tcb_index]->conn[sport]->opp_rtx_space -= tmpPkt->data_len;
-                            }
-                        }
+fast_rtx_timer_check:
 
-                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+        timeoutPkt = conn->dataPktBuffer.unAck();
 
-                    }
+        if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + conn->rto)
+        {
 
+            conn->server_state.phase = FAST_RTX;
+            conn->dataPktBuffer._head = conn->dataPktBuffer._unAck;
+            conn->dataPktBuffer._pkts = conn->dataPktBuffer._size;
+            conn->server_state.snd_nxt = timeoutPkt->seq_num;
+            if (!timeoutPkt->rtx_time)
+                timeoutPkt->rtx_time = timeoutPkt->snd_time;
+            timeoutPkt->snd_time = 0;
 
-                    if (retransmit)
-                    {
+        }
+
+        if (newTransmit)
+        {
 
-                        send_data_pkt(forward, tmpPkt);
-                        tcb_table[tcb_index]->totalByteSent += tmpPkt->data_len;                        
-                        tcb_table[tcb_index]->conn[sport]->totalByteSent += tmpPkt->data_len;
+            if (!conn->send_out_awin && 
+                    conn->dataPktBuffer._last_pkts > 0)
+            {
+                tmpPkt = conn->dataPktBuffer.lastHead();
 
-                        tcb_table[tcb_index]->sliding_snd_window.put(tmpPkt->data_len, current_time, tmpPkt->seq_num);                                                
-                        tcb_table[tcb_index]->conn[sport]->sliding_snd_window.put(tmpPkt->data_len, current_time, tmpPkt->seq_num);                        
-                        tcb_table[tcb_index]->pkts_transit += tmpPkt->data_len;
+                if (tmpPkt->snd_time && !tmpPkt->rtx_time)
+                    tmpPkt->rtx_time = tmpPkt->snd_time;
+                tmpPkt->snd_time = 0;
 
-                        tcb_table[tcb_index]->sent_bytes_counter += tmpPkt->data_len;
-                                                
-                        //log_debug_conn_info(tcb_index, sport, current_time);
+                conn->dataPktBuffer.lastHeadNext();
 
+                if ((tmpPkt->ctr_flag & 0x01) == 1)
+                {
+                    if (conn->server_state.state == SYN_REVD)
+                    {
+                        conn->server_state.state = CLOSED;
+                        conn->client_state.state = CLOSED;
                     }
-                    
+                    else
+                        conn->server_state.state = FIN_WAIT_1;
 
+                    conn->server_state.snd_nxt = tmpPkt->seq_num + tmpPkt->data_len + 1;
                 }
                 else
-                {
+                    conn->server_state.snd_nxt = tmpPkt->seq_num  + tmpPkt->data_len;
 
-                    if (tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size > 0)
-                    {
-                        timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
-                        if (tcb_table[tcb_index]->conn[sport]->client_state.state == CLOSED && 
-                                timeoutPkt->snd_time && 
-                                current_time > timeoutPkt->snd_time + TIME_TO_LIVE)
-                        {
-                            tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
-                            tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
-                            data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size * (int)tcb_table[tcb_index]->conn[sport]->max_data_len);
+                if (conn->server_state.snd_nxt > conn->server_state.snd_max)
+                        conn->server_state.snd_max = conn->server_state.snd_nxt;
 
-                        }
-                        else
-                        {                            
-                            if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL)// I modified the timeout handler 29/11/2012
-                            {
+                retransmit = TRUE;
+                conn->opp_rtx_space -= tmpPkt->data_len;
+            }
+        }
 
-                                timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
-                                if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + tcb_table[tcb_index]->conn[sport]->rto*2)
-                                {
-                                    tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
 
-                                    tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                                    tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+    }
 
-                                    tcb_table[tcb_index]->conn[sport]->max_sack_edge = timeoutPkt->seq_num + timeoutPkt->data_len;
+    return (retransmit ? tmpPkt : NULL);
+}
+/*
+ * up to want scheduling decisions for a connection under one acquisition of
+ * its lock, stopping at the first that sends nothing. The segments are
+ * copied into staged[] before the connection is unlocked, so an ACK that
+ * frees their slots afterwards cannot change what goes out. Returns the
+ * number of segments staged.
+ */
+u_int schedule_conn_burst(u_int tcb_index, u_short sport, int tcb_it, int conn_it, ForwardPkt staged[], u_int want)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
 
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head;
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts;
+    ForwardPkt *tmpPkt;
+    u_long_long current_time;
+    u_int n = 0;
 
-                                    if (!tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts)
-                                        tcb_table[tcb_index]->conn[sport]->dataPktBuffer.lastHeadPrev();                                    
+    pthread_mutex_lock(&conn->mutex);                        
+    if(conn->server_state.state != CLOSED)
+    {
+        current_time = timer.Start();
 
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
+#ifdef LOG_STAT
+        log_data(sport, tcb_index);
+#endif
 
-                                    if (!timeoutPkt->rtx_time)
-                                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                    timeoutPkt->snd_time = 0;
-                                }
+        //print_conn_stats(tcb_index, sport, current_time);
 
+        if (conn->dataPktBuffer.pkts() == 0)
+            conn_timer_check(tcb_index, sport, current_time);
 
-                            }
-                            else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == FAST_RTX)// I modified the timeout handler 29/11/2012
-                            {
+        while (n < want && conn->dataPktBuffer.pkts() > 0 && conn->server_state.state != CLOSED)
+        {
+            tmpPkt = conn_next_pkt(tcb_index, sport, current_time);
+            if (tmpPkt == NULL || !stage_data_pkt(tmpPkt, &staged[n]))
+                break;
 
-                                timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.unAck();
-                                if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + tcb_table[tcb_index]->conn[sport]->rto)
-                                {
+            n ++;
+            tcb_table[tcb_index]->totalByteSent += tmpPkt->data_len;                        
+            conn->totalByteSent += tmpPkt->data_len;
 
-                                    tcb_table[tcb_index]->conn[sport]->server_state.phase = FAST_RTX;
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                    tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
-                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
+            tcb_table[tcb_index]->sliding_snd_window.put(tmpPkt->data_len, current_time, tmpPkt->seq_num);                                                
+            conn->sliding_snd_window.put(tmpPkt->data_len, current_time, tmpPkt->seq_num);                        
+            tcb_table[tcb_index]->pkts_transit.add(tmpPkt->data_len);
 
-                                    if (timeoutPkt->snd_time && !timeoutPkt->rtx_time)
-                                        timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                    timeoutPkt->snd_time = 0;
+            tcb_table[tcb_index]->sent_bytes_counter += tmpPkt->data_len;
+                                    
+            //log_debug_conn_info(tcb_index, sport, current_time);
+        }
 
-                                }
-                            }
-                            else if (tcb_table[tcb_index]->conn[sport]->server_state.phase == NORMAL_TIMEOUT)// I modified the timeout handler 29/11/2012
-                            {
+        pthread_mutex_unlock(&conn->mutex);
+    }
+    else if (conn->server_state.state == CLOSED && 
+            conn->client_state.state == CLOSED)
+    {
+        pthread_mutex_unlock(&conn->mutex);
 
-                                if (tcb_table[tcb_index]->conn[sport]->FRTO_ack_count == 1)
-                                {
+        if (!conn->close_time)
+             conn->close_time = timer.Start();
 
-                                    timeoutPkt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.pkt(tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head);
-                                    if (timeoutPkt->snd_time && current_time >= timeoutPkt->snd_time + tcb_table[tcb_index]->conn[sport]->rto)
-                                    {
-                                        if (tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count >= 2)
-                                        {
-                                            tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL;                                    
 
-                                            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._unAck;
-                                            tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size;
+        if (check_buffer_empty(tcb_index, sport))
+        {
+            tcb_table[tcb_index]->flush_tcb_partially();
+        } 
 
-                                            tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = timeoutPkt->seq_num;
 
-                                            if (!timeoutPkt->rtx_time)
-                                                timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                            timeoutPkt->snd_time = 0;
+        if (timer.Start() > conn->close_time + TIME_TO_LIVE)
+        {
+            rm_tcb_conn(tcb_index, sport, tcb_it, conn_it);
+        }
 
-                                            tcb_table[tcb_index]->conn[sport]->FRTO_ack_count = 0;
-                                            tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count = 0;
+    }
+    else
+    {
+        pthread_mutex_unlock(&conn->mutex);
+    }
 
-                                            data_size_in_flight(tcb_index, timeoutPkt->data_len);
+    return n;
+}
+void* scheduler(void* _arg)
+{
+	struct pcap_pkthdr *header;
 
-                                        }   
-                                        else
-                                        {
-                                           tcb_table[tcb_index]->conn[sport]->server_state.phase = NORMAL_TIMEOUT;
+	DATA* data = (DATA *)_arg;
+	Forward* forward = data->forward;
 
-                                           tcb_table[tcb_index]->conn[sport]->dataPktBuffer._head = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_head;
-                                           tcb_table[tcb_index]->conn[sport]->dataPktBuffer._pkts = tcb_table[tcb_index]->conn[sport]->dataPktBuffer._last_pkts;
-                                           tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tcb_table[tcb_index]->conn[sport]->dataPktBuffer.head()->seq_num;
+	ForwardPkt burst[SCHED_MICRO_BURST];
+	u_char burst_frames[SCHED_MICRO_BURST * PKT_SIZE];
+	u_int budget, burst_len, burst_bytes, space_seq;
+	u_long_long visit_start, current_time;
+	u_short sport, tcb_index;
+	int tcb_it, conn_it;
 
-                                           if (!timeoutPkt->rtx_time)
-                                              timeoutPkt->rtx_time = timeoutPkt->snd_time;
-                                           timeoutPkt->snd_time = 0;
+	if (!data->burst)
+		printf("State Ack iTime(ms) RTT(ms) SendRate(KB/s) TotalEstRate(KB/s) EstRate(KB/s) Conn\n");
 
-                                           tcb_table[tcb_index]->conn[sport]->FRTO_dup_ack_count ++;
-                                           data_size_in_flight(tcb_index, timeoutPkt->data_len);
-                                        } 
-                                    }
-                                }                                                              
-                            }
-                        }
-                    }
+	for (u_int i = 0; i < SCHED_MICRO_BURST; i ++)
+		burst[i].pkt_data = burst_frames + i * PKT_SIZE;
 
-                    pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+	u_int seq_nxt = 0;
 
-                }
+	for (u_int visits = 0; !data->burst || visits < data->burst; visits ++)
+	{
+            pthread_mutex_lock(&pool.mutex);
+            if (data->burst && pool.ex_tcb.isEmpty())
+            {
+                pthread_mutex_unlock(&pool.mutex);
+                break;
             }
-            else if (tcb_table[tcb_index]->conn[sport]->server_state.state == CLOSED && 
-                    tcb_table[tcb_index]->conn[sport]->client_state.state == CLOSED)
+            if (pool.ex_tcb.isEmpty())
             {
-                pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                grace.offline();
+                while (pool.ex_tcb.isEmpty())
+                    pthread_cond_wait(&pool.m_eventConnStateAvailable, &pool.mutex);
+            }
+
+            pthread_mutex_unlock(&pool.mutex);
 
-                if (!tcb_table[tcb_index]->conn[sport]->close_time)
-                     tcb_table[tcb_index]->conn[sport]->close_time = timer.Start();
+            grace.quiescent(); // a visit never carries a table pointer into the next one
+            grace.reclaim();
 
+            drain_tx_done();
+#ifdef ACK_INBOX
+            drain_ack_inbox();
+#endif
+            budget_reopen();
 
-                if (check_buffer_empty(tcb_index, sport))
-                {
-                    tcb_table[tcb_index]->flush_tcb_partially();
-                } 
+            tcb_it = nxt_schedule_tcb();
+
+            if (tcb_it == -1)
+                continue;
+            tcb_index = pool.ex_tcb.state_id[tcb_it];
 
+            if (tcb_table[tcb_index]->ctrl_blocked && tcb_table[tcb_index]->ctrl_seq != __sync_fetch_and_add(&uplink_data->forward->space_seq, 0))
+                tcb_win_update_retry(tcb_index);
 
-                if (timer.Start() > tcb_table[tcb_index]->conn[sport]->close_time + TIME_TO_LIVE)
+            if (tcb_table[tcb_index]->egress_blocked)
+            {
+                if (tcb_table[tcb_index]->egress_seq == __sync_fetch_and_add(&forward->space_seq, 0))
                 {
-                    rm_tcb_conn(tcb_index, sport, tcb_it, conn_it);
+                    tcb_timer_check(tcb_index); // forwarder has not freed space yet
+                    continue;
                 }
+                tcb_table[tcb_index]->egress_blocked = FALSE;
+            }
 
+            budget = forward_try_hold(forward, tcb_visit_budget(tcb_index), &space_seq);
+            if (!budget)
+            {
+                tcb_table[tcb_index]->egress_blocked = TRUE;
+                tcb_table[tcb_index]->egress_seq = space_seq;
+                tcb_table[tcb_index]->egress_block_count ++;
+                tcb_timer_check(tcb_index);
+                continue;
             }
-            else
+
+            visit_start = timer.Start();
+            burst_len = 0;
+            for (u_int tries = 0; tries < budget && burst_len < budget; tries ++)
+            {
+                conn_it = nxt_schedule_conn(tcb_index);
+
+                if (conn_it == -1)
+                    break;
+
+                sport = tcb_table[tcb_index]->states.state_id[conn_it];
+
+                if (sport == 0)
+                    break;
+
+                burst_len += schedule_conn_burst(tcb_index, sport, tcb_it, conn_it, burst + burst_len, budget - burst_len);
+
+                if (tcb_table[tcb_index]->states.isEmpty())
+                    break; // its last connection was removed and the TCB flushed
+            }
+
+            burst_bytes = send_data_burst(forward, burst, burst_len, budget);
+
+            current_time = timer.Start();
+            if (!tcb_table[tcb_index]->states.isEmpty())
             {
-                pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                tcb_table[tcb_index]->sched_bytes += burst_bytes;
+                tcb_table[tcb_index]->sched_cost += current_time - visit_start + 1;
             }
+            sched_load_update(forward, current_time);
         }                   
+
+        return NULL;
 }
 void* forwarder(void* arg)
 {
@@ -6088,7 +8093,7 @@ void* forwarder(void* arg)
 	u_char pkt_data[PKT_SIZE];
 
 	u_short dport, sport, ctrl_flag;
-	u_int index, tcb_index, seq_num, TSval;
+	u_int index, tcb_index, seq_num, TSval, gen;
 	u_short data_len;
         
         BOOL drop = FALSE;
@@ -6175,9 +8180,10 @@ void* forwarder(void* arg)
 	while(1)
 	{
             pthread_mutex_lock(&forward->mutex);
-            while (forward->pktQueue.size() == 0)
+            while (forward->pktQueue.size() == 0 && forward->ctrlQueue.size() == 0)
                 pthread_cond_wait(&forward->m_eventElementAvailable, &forward->mutex);
-            ForwardPkt* tmpForwardPkt = forward->pktQueue.head();
+            ForwardPktBuffer* lane = forward_next_lane(forward);
+            ForwardPkt* tmpForwardPkt = lane->head();
             dport = tmpForwardPkt->dPort;
             index = tmpForwardPkt->index;
             sport = tmpForwardPkt->sPort;
@@ -6186,12 +8192,15 @@ void* forwarder(void* arg)
             tcb_index = tmpForwardPkt->tcb;
             seq_num = tmpForwardPkt->seq_num;
             TSval = tmpForwardPkt->TSval;
+            gen = tmpForwardPkt->gen;
             memcpy(&header, &(tmpForwardPkt->header), sizeof(struct pcap_pkthdr));
             memcpy(pkt_data, tmpForwardPkt->pkt_data, header.len);
+            forward_dequeued(forward, lane, tmpForwardPkt);
             tmpForwardPkt->initPkt();
-            forward->pktQueue.headNext();
-            forward->pktQueue.decrease();
-            pthread_cond_signal(&forward->m_eventSpaceAvailable);
+            lane->headNext();
+            lane->decrease();
+            forward_space_freed(forward);
+            pthread_cond_broadcast(&forward->m_eventSpaceAvailable); // waiters may be on either lane
             pthread_mutex_unlock(&forward->mutex);
 
 #ifdef PKT_DROP_EMULATOR
@@ -6305,16 +8314,7 @@ void* forwarder(void* arg)
             else
                 drop = FALSE;
             
-            if(sport == APP_PORT_NUM || sport == APP_PORT_FORWARD)
-            {
-
-                if (tcb_table[tcb_index]->conn[dport] && tcb_table[tcb_index]->conn[dport]->server_state.state != CLOSED)
-                {
-                    ForwardPkt* sendPkt = tcb_table[tcb_index]->conn[dport]->dataPktBuffer.pkt(index);
-                    sendPkt->snd_time = timer.Start();                
-                    tcb_table[tcb_index]->sliding_avg_window.sent_timestamp_rep = TSval;
-                }                  
-            }
+            forward_sent(sport, dport, index, tcb_index, gen, seq_num, TSval);
 	}
 }
 
@@ -6377,14 +8377,23 @@ void* capturer(void* _data)
 	srand(time(NULL));
 
 	u_long_long current_time;
-	char key[sizeof(ip_address)+sizeof(u_short)];
+	flow_key key;
+	BOOL stored;
 	
-	FILE *form = fopen("toDataBase", "w");
-	
-	while((res = pcap_next_ex(data->dev_this, &header_ptr, &pkt_data_ptr)) >= 0)
+	static FILE *form = fopen("toDataBase", "w");
+	u_int burst_count = 0;
+
+	res = 0;
+	while((!data->burst || burst_count ++ < data->burst) && (res = pcap_next_ex(data->dev_this, &header_ptr, &pkt_data_ptr)) >= 0)
 	{
+		grace.quiescent(); // no table pointer survives from the previous packet
+
 		if (res == 0)
+		{
+			if (data->burst)
+				break; // nothing pending on the non-blocking handle
                         continue; // Timeout elapsed
+		}
 
 		current_time = timer.Start();
                 
@@ -6532,7 +8541,7 @@ void* capturer(void* _data)
 
                         if (sport == APP_PORT_NUM || sport == APP_PORT_FORWARD) //coming from server and we have already allocated a connection table
                         {
-                            int tcb_index = tcb_hash.search((char *)&ih->daddr, sizeof(ip_address), &ih->daddr);
+                            int tcb_index = tcb_hash.search(ih->daddr);
                             if (tcb_index == -1)
                             {
 #ifdef DEBUG
@@ -6543,7 +8552,9 @@ void* capturer(void* _data)
                                 continue;
                             }
 
-                            if (!tcb_table[tcb_index]->conn[dport])
+                            conn_state* conn = tcb_table[tcb_index]->conn[dport];
+
+                            if (!conn)
                             {
 #ifdef DEBUG
                                     printf("CAN FIND A TCB FOR USER %c.%c.%c.%c BUT NO CONNECTION FOR PORT %hu\n", ih->daddr.byte1, ih->daddr.byte2, ih->daddr.byte3, ih->daddr.byte4, dport);
@@ -6552,13 +8563,13 @@ void* capturer(void* _data)
                                 send_forward(data, &header, pkt_data);
                                 continue;
                             }
-                            else if (tcb_table[tcb_index]->conn[dport] != NULL)
+                            else if (conn != NULL)
                             {
-                                tcb_table[tcb_index]->conn[dport]->client_state.snd_nxt = ack_num;                                                                
+                                conn->client_state.snd_nxt = ack_num;                                                                
                                 
                                                                 
                                 
-                                switch(tcb_table[tcb_index]->conn[dport]->client_state.state)
+                                switch(conn->client_state.state)
                                 {
                                     case SYN_SENT:
                                     if (ctr_flag == 18) //SYN+ACK pkt
@@ -6591,20 +8602,20 @@ void* capturer(void* _data)
                                             */
                                         }
 
-                                        tcb_table[tcb_index]->conn[dport]->client_state.state = ESTABLISHED; 
-                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt = seq_num + 1;
-                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[dport]->MSS;
-                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_adv = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt + tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd;
+                                        conn->client_state.state = ESTABLISHED; 
+                                        conn->client_state.rcv_nxt = seq_num + 1;
+                                        conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
+                                        conn->client_state.rcv_adv = conn->client_state.rcv_nxt + conn->client_state.rcv_wnd;
 
 
 #ifdef COMPLETE_SPLITTING_TCP
-                                        //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
-                                        u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                        //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)conn->client_state.win_scale) ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
+                                        u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
-                                        send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
+                                        send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
 
                                         /*
-                                        ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[dport]->client_state.httpRequest;
+                                        ForwardPkt* tmpForwardPkt = conn->cold->httpRequest;
                                         if (tmpForwardPkt->occupy)
                                         {
                                             ip_header* ih = (ip_header *)((u_char *)tmpForwardPkt->pkt_data + 14);
@@ -6613,7 +8624,7 @@ void* capturer(void* _data)
                                             tcp_header* th = (tcp_header *)((u_char *)ih + ip_len);
                                             u_short tcp_len = ((ntohs(th->hdr_len_resv_code)&0xf000)>>12)*4;
                                             u_short data_len = total_len - ip_len - tcp_len;
-                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt);
+                                            th->ack_num = htonl(conn->client_state.rcv_nxt);
                                             th->window = htons(adv_win);
                                             rcv_header_update(ih, th, tcp_len, data_len);
 
@@ -6623,16 +8634,16 @@ void* capturer(void* _data)
                                         */
 
 
-                                        while (tcb_table[tcb_index]->conn[dport]->client_state.httpRequest.size())
+                                        while (conn->cold->httpRequest.size())
                                             accclient_snd_data_pkt(data, tcb_index, sport, dport, adv_win);
 
 
 #else
-                                        tcb_table[tcb_index]->conn[dport]->server_state.state = SYN_REVD;
-                                        tcb_table[tcb_index]->conn[dport]->server_state.snd_una = seq_num;
-                                        tcb_table[tcb_index]->conn[dport]->server_state.seq_nxt = seq_num + 1;
-                                        tcb_table[tcb_index]->conn[dport]->server_state.snd_nxt = seq_num + 1;
-                                        tcb_table[tcb_index]->conn[dport]->server_state.snd_max = seq_num + 1;
+                                        conn->server_state.state = SYN_REVD;
+                                        conn->server_state.snd_una = seq_num;
+                                        conn->server_state.seq_nxt = seq_num + 1;
+                                        conn->server_state.snd_nxt = seq_num + 1;
+                                        conn->server_state.snd_max = seq_num + 1;
                                         send_forward(data, &header, pkt_data);
                                         //send_forward_with_params(data, &header, pkt_data, sport, dport, data_len, ctr_flag, seq_num, tcb_index);
                                          
@@ -6658,10 +8669,10 @@ void* capturer(void* _data)
 
                                     }    
                                         
-                                    if (!tcb_table[tcb_index]->conn[dport]->local_adv_window)
-                                            tcb_table[tcb_index]->conn[dport]->local_adv_window = window * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.sender_win_scale);
+                                    if (!conn->local_adv_window)
+                                            conn->local_adv_window = window * pow((float)2, (int)conn->client_state.sender_win_scale);
                                    
-                                    if ((ctr_flag & 0x10) == 16 && seq_num < tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt)
+                                    if ((ctr_flag & 0x10) == 16 && seq_num < conn->client_state.rcv_nxt)
                                     {
                                         if (data_len > 0 || (ctr_flag & 0x01) == 1)
                                         {
@@ -6669,39 +8680,39 @@ void* capturer(void* _data)
                                             u_short flag = 0;
 
 #ifdef DEBUG
-                                            printf("RECEIVING OLD PACKET %u WAITING PACKET %u ON CONNECTION %hu\n", seq_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, dport);
+                                            printf("RECEIVING OLD PACKET %u WAITING PACKET %u ON CONNECTION %hu\n", seq_num, conn->client_state.rcv_nxt, dport);
 #endif
 
-                                            //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() - 2) * tcb_table[tcb_index]->conn[dport]->MSS:0);
+                                            //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() - 2) * conn->MSS:0);
 
-                                            tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size())*tcb_table[tcb_index]->conn[dport]->MSS;
-                                            //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd);
-                                            //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                            conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
+                                            //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd);
+                                            //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)conn->client_state.win_scale) ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
-                                            u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                            u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
                                             if (adv_win && adv_win != LOCAL_WINDOW)
                                                     adv_win ++;
 
                                             if (adv_win)
                                             {
-                                                send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
+                                                send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
 
                                             }
-                                            else if (!adv_win && tcb_table[tcb_index]->conn[dport]->zero_window_seq_no != tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt)
+                                            else if (!adv_win && conn->zero_window_seq_no != conn->client_state.rcv_nxt)
                                             {
-                                                send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
-                                                tcb_table[tcb_index]->conn[dport]->zero_window_seq_no = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt;
+                                                send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
+                                                conn->zero_window_seq_no = conn->client_state.rcv_nxt;
                                             }
 
-                                            if (adv_win * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) < 2 * tcb_table[tcb_index]->conn[dport]->MSS)
-                                                    tcb_table[tcb_index]->conn[dport]->client_state.ack_count = 1; // next ready to ack
+                                            if (adv_win * pow((float)2, (int)conn->client_state.win_scale) < 2 * conn->MSS)
+                                                    conn->client_state.ack_count = 1; // next ready to ack
                                         }
                                         else 
                                         {
 #ifndef COMPLETE_SPLITTING_TCP
 #ifdef RSFC
-                                            u_short adv_win = tcb_table[tcb_index]->conn[dport]->local_adv_window / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.sender_win_scale);
+                                            u_short adv_win = conn->local_adv_window / pow((float)2, (int)conn->client_state.sender_win_scale);
                                             if (adv_win != window) 
                                             {
                                                 th->window = htons(adv_win);
@@ -6714,7 +8725,7 @@ void* capturer(void* _data)
                                         }
 
                                     }
-                                    else if ((ctr_flag & 0x10) == 16 && seq_num >= tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt) 
+                                    else if ((ctr_flag & 0x10) == 16 && seq_num >= conn->client_state.rcv_nxt) 
                                     {
                                         if (data_len > 0 || (ctr_flag & 0x01) == 1)
                                         {
@@ -6722,14 +8733,14 @@ void* capturer(void* _data)
                                             u_short flag = 0;
                                             u_short adv = 0;
 
-                                            if (seq_num - tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt < 
-                                                    (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size()) * 
-                                                    tcb_table[tcb_index]->conn[dport]->MSS)
+                                            if (seq_num - conn->client_state.rcv_nxt < 
+                                                    (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * 
+                                                    conn->MSS)
                                             {
-                                                if (seq_num == tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt)
+                                                if (seq_num == conn->client_state.rcv_nxt)
                                                 {
 #ifdef COMPLETE_SPLITTING_TCP
-                                                        th->seq_num = htonl(tcb_table[tcb_index]->conn[dport]->client_state.seq_nxt);
+                                                        th->seq_num = htonl(conn->client_state.seq_nxt);
                                                         rcv_header_update(ih, th, tcp_len, data_len);
 
                                                         /*
@@ -6750,76 +8761,80 @@ void* capturer(void* _data)
                                                     if ((ctr_flag & 0x01) == 1)
                                                     {
 
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[dport]->mutex);
-                                                        rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[dport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
+                                                        stored = rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
+                                                        pthread_mutex_unlock(&conn->mutex);
+                                                        if (!stored)
+                                                            break;
 
                                                         u_int rcv_nxt_seq = check_sack_list(tcb_index, dport, seq_num, data_len);
 
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.seq_nxt += (rcv_nxt_seq -tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt + 1);                                                                                               												
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt = (rcv_nxt_seq + 1);
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_adv = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt + tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd;
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size())*tcb_table[tcb_index]->conn[dport]->MSS;
+                                                        conn->client_state.seq_nxt += (rcv_nxt_seq -conn->client_state.rcv_nxt + 1);                                                                                               												
+                                                        conn->client_state.rcv_nxt = (rcv_nxt_seq + 1);
+                                                        conn->client_state.rcv_adv = conn->client_state.rcv_nxt + conn->client_state.rcv_wnd;
+                                                        conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
 
-                                                        //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[dport]->MSS;
-                                                        //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv5_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd);
+                                                        //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS;
+                                                        //u_short adv_win = (conn->client_state.rcv5_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd);
 
-                                                        u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                        u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
                                                         if (adv_win && adv_win != LOCAL_WINDOW)
                                                             adv_win ++;
 
-                                                        send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
+                                                        send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
 
-                                                        //tcb_table[tcb_index]->conn[dport]->client_state.state = CLOSE_WAIT;
-                                                        //send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16|1, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
-                                                        //tcb_table[tcb_index]->conn[dport]->client_state.state = LAST_ACK;
+                                                        //conn->client_state.state = CLOSE_WAIT;
+                                                        //send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16|1, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
+                                                        //conn->client_state.state = LAST_ACK;
 
                                                     }
                                                     else if (data_len > 0)
                                                     {
 
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[dport]->mutex);
-                                                        rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[dport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
+                                                        stored = rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
+                                                        pthread_mutex_unlock(&conn->mutex);
+                                                        if (!stored)
+                                                            break;
 
                                                         u_int rcv_nxt_seq = check_sack_list(tcb_index, dport, seq_num, data_len);
 
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.seq_nxt += (rcv_nxt_seq -tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt) ;
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt = rcv_nxt_seq;
-                                                        //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() - 2) * tcb_table[tcb_index]->conn[dport]->MSS:0);
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size())*tcb_table[tcb_index]->conn[dport]->MSS;
-                                                        adv = tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd - (tcb_table[tcb_index]->conn[dport]->client_state.rcv_adv - tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt);
+                                                        conn->client_state.seq_nxt += (rcv_nxt_seq -conn->client_state.rcv_nxt) ;
+                                                        conn->client_state.rcv_nxt = rcv_nxt_seq;
+                                                        //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() - 2) * conn->MSS:0);
+                                                        conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
+                                                        adv = conn->client_state.rcv_wnd - (conn->client_state.rcv_adv - conn->client_state.rcv_nxt);
 
-                                                        //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() - 1) * tcb_table[tcb_index]->conn[dport]->MSS;
-                                                        //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd);
-                                                        //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                        //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() - 1) * conn->MSS;
+                                                        //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd);
+                                                        //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)conn->client_state.win_scale) ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
-                                                        u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                        u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
                                                         if (adv_win && adv_win != LOCAL_WINDOW)
                                                                 adv_win ++;
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_adv = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt + tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd;
+                                                        conn->client_state.rcv_adv = conn->client_state.rcv_nxt + conn->client_state.rcv_wnd;
 
                                                         BOOL acking = TRUE;
-                                                        tcb_table[tcb_index]->conn[dport]->client_state.ack_count = tcb_table[tcb_index]->conn[dport]->client_state.ack_count + 1;
-                                                        if ((tcb_table[tcb_index]->conn[dport]->client_state.ack_count = tcb_table[tcb_index]->conn[dport]->client_state.ack_count % 2) == 0)
+                                                        conn->client_state.ack_count = conn->client_state.ack_count + 1;
+                                                        if ((conn->client_state.ack_count = conn->client_state.ack_count % 2) == 0)
                                                                 acking = TRUE;
 
                                                         if (acking == TRUE || (ctr_flag & 0x08) == 8)
                                                         {
-                                                            //if (adv_win || (!adv_win && tcb_table[tcb_index]->conn[dport]->zero_window_seq_no != tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt))
+                                                            //if (adv_win || (!adv_win && conn->zero_window_seq_no != conn->client_state.rcv_nxt))
                                                             {
-                                                                send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
+                                                                send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
 
                                                                 if (!adv_win)
-                                                                   tcb_table[tcb_index]->conn[dport]->zero_window_seq_no = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt;
+                                                                   conn->zero_window_seq_no = conn->client_state.rcv_nxt;
                                                             }
 
 
-                                                            if (adv_win * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) < 2 * tcb_table[tcb_index]->conn[dport]->MSS)
-                                                                tcb_table[tcb_index]->conn[dport]->client_state.ack_count = 1; // next ready to ack
+                                                            if (adv_win * pow((float)2, (int)conn->client_state.win_scale) < 2 * conn->MSS)
+                                                                conn->client_state.ack_count = 1; // next ready to ack
                                                             else
-                                                                tcb_table[tcb_index]->conn[dport]->client_state.ack_count = 0;
+                                                                conn->client_state.ack_count = 0;
                                                         }
                                                     }
 
@@ -6827,12 +8842,12 @@ void* capturer(void* _data)
                                                 else // out of order packets
                                                 {
 #ifdef DEBUG
-                                                        printf("DISCARD OUT OF ORDER PACKET %u WAITTING ON PACKET %u ON CONNECTION %hu---\n", seq_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, dport);
+                                                        printf("DISCARD OUT OF ORDER PACKET %u WAITTING ON PACKET %u ON CONNECTION %hu---\n", seq_num, conn->client_state.rcv_nxt, dport);
 
 #endif
 
 #ifdef COMPLETE_SPLITTING_TCP
-                                                        th->seq_num = htonl(tcb_table[tcb_index]->conn[dport]->client_state.seq_nxt + seq_num - tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt);
+                                                        th->seq_num = htonl(conn->client_state.seq_nxt + seq_num - conn->client_state.rcv_nxt);
                                                         rcv_header_update(ih, th, tcp_len, data_len);
 
                                                         /*
@@ -6851,80 +8866,82 @@ void* capturer(void* _data)
                                                         */
 #endif
 
-                                                    pthread_mutex_lock(&tcb_table[tcb_index]->conn[dport]->mutex);
-                                                    rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
-                                                    pthread_mutex_unlock(&tcb_table[tcb_index]->conn[dport]->mutex);
+                                                    pthread_mutex_lock(&conn->mutex);
+                                                    stored = rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
+                                                    pthread_mutex_unlock(&conn->mutex);
+                                                    if (!stored)
+                                                        break;
 
                                                     create_sack_list(tcb_index, dport, seq_num, data_len);
 
-                                                    tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size())*tcb_table[tcb_index]->conn[dport]->MSS;
+                                                    conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
 
-                                                    //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() - 2) * tcb_table[tcb_index]->conn[dport]->MSS:0);
-                                                    //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() - 1) * tcb_table[tcb_index]->conn[dport]->MSS;
-                                                    //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd);
-                                                    //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                    //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() - 2) * conn->MSS:0);
+                                                    //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() - 1) * conn->MSS;
+                                                    //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd);
+                                                    //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)conn->client_state.win_scale) ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
-                                                    u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                    u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
                                                     if (adv_win && adv_win != LOCAL_WINDOW)
                                                             adv_win ++;
 
                                                     if (adv_win)
                                                     {
-                                                        send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
+                                                        send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
 
                                                     }
-                                                    else if (!adv_win && tcb_table[tcb_index]->conn[dport]->zero_window_seq_no != tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt)
+                                                    else if (!adv_win && conn->zero_window_seq_no != conn->client_state.rcv_nxt)
                                                     {
-                                                        send_ack_back(dport, data, tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
-                                                        tcb_table[tcb_index]->conn[dport]->zero_window_seq_no = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt;
+                                                        send_ack_back(dport, data, conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
+                                                        conn->zero_window_seq_no = conn->client_state.rcv_nxt;
                                                     }
 
-                                                    if (adv_win * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) < 2 * tcb_table[tcb_index]->conn[dport]->MSS)
-                                                            tcb_table[tcb_index]->conn[dport]->client_state.ack_count = 1; // next ready to ack
+                                                    if (adv_win * pow((float)2, (int)conn->client_state.win_scale) < 2 * conn->MSS)
+                                                            conn->client_state.ack_count = 1; // next ready to ack
                                                 }
                                             }
-                                            else if (/*(ctr_flag & 0x10) == 16 && (data_len > 0 || (ctr_flag & 0x01) == 1) &&*/seq_num - tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt >= (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[dport]->MSS) // Outbound packets
+                                            else if (/*(ctr_flag & 0x10) == 16 && (data_len > 0 || (ctr_flag & 0x01) == 1) &&*/seq_num - conn->client_state.rcv_nxt >= (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS) // Outbound packets
                                             {
                                                 //u_short flag = 0;
-                                                tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[dport]->MSS;
+                                                conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
 
 #ifdef DEBUG
-                                                printf("DISCARD OUT OF WINDOW PACKET %u WINDOW SIZE %u WAITTING ON PACKET %u %u ON CONNECTION %hu\n", seq_num, tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size(), tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, tcb_table[tcb_index]->conn[dport]->MSS, dport);
+                                                printf("DISCARD OUT OF WINDOW PACKET %u WINDOW SIZE %u WAITTING ON PACKET %u %u ON CONNECTION %hu\n", seq_num, conn->dataPktBuffer.size(), conn->client_state.rcv_nxt, conn->MSS, dport);
 #endif
-                                                //tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size() - 2) * tcb_table[tcb_index]->conn[dport]->MSS:0);
-                                                //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd);
-                                                //u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                //conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() > 2 ? (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size() - 2) * conn->MSS:0);
+                                                //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd);
+                                                //u_short adv_win = (conn->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)conn->client_state.win_scale) ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
 
-                                                u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                                u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
                                                 if (adv_win && adv_win != LOCAL_WINDOW)
                                                                 adv_win ++;
 
                                                 if (adv_win)
                                                 {
-                                                    send_ack_back(dport, data,  tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);       
+                                                    send_ack_back(dport, data,  conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);       
                                                 }
-                                                else if (!adv_win && tcb_table[tcb_index]->conn[dport]->zero_window_seq_no != tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt)
+                                                else if (!adv_win && conn->zero_window_seq_no != conn->client_state.rcv_nxt)
                                                 {
-                                                    send_ack_back(dport, data,  tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
-                                                    tcb_table[tcb_index]->conn[dport]->zero_window_seq_no = tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt;
+                                                    send_ack_back(dport, data,  conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, conn->client_state.rcv_nxt, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
+                                                    conn->zero_window_seq_no = conn->client_state.rcv_nxt;
                                                 }
 
-                                                if (adv_win * pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) < 2 * tcb_table[tcb_index]->conn[dport]->MSS)
-                                                                tcb_table[tcb_index]->conn[dport]->client_state.ack_count = 1; // next ready to ack
+                                                if (adv_win * pow((float)2, (int)conn->client_state.win_scale) < 2 * conn->MSS)
+                                                                conn->client_state.ack_count = 1; // next ready to ack
                                             }
                                         }
                                         else
                                         {
 
 #ifdef COMPLETE_SPLITTING_TCP
-                                            th->seq_num = htonl(tcb_table[tcb_index]->conn[dport]->client_state.seq_nxt);
+                                            th->seq_num = htonl(conn->client_state.seq_nxt);
                                             rcv_header_update(ih, th, tcp_len, data_len, pkt_buffer);
 
 #else
 
 #ifdef RSFC
-                                            u_short adv_win = tcb_table[tcb_index]->conn[dport]->local_adv_window /
-                                                    pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.sender_win_scale);
+                                            u_short adv_win = conn->local_adv_window /
+                                                    pow((float)2, (int)conn->client_state.sender_win_scale);
                                             if (adv_win != window) 
                                             {
                                                 th->window = htons(adv_win);
@@ -6946,7 +8963,7 @@ void* capturer(void* _data)
                                     {
 
 #ifdef RSFC
-                                        u_short adv_win = tcb_table[tcb_index]->conn[dport]->local_adv_window / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.sender_win_scale);
+                                        u_short adv_win = conn->local_adv_window / pow((float)2, (int)conn->client_state.sender_win_scale);
                                         if (adv_win != window) 
                                         {
                                             th->window = htons(adv_win);
@@ -6963,9 +8980,9 @@ void* capturer(void* _data)
                                     break;					
 
                                 case LAST_ACK:
-                                    if ((ctr_flag & 0x10) == 16 /*&& seq_num == tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt*/)
+                                    if ((ctr_flag & 0x10) == 16 /*&& seq_num == conn->client_state.rcv_nxt*/)
                                     {
-                                        tcb_table[tcb_index]->conn[dport]->client_state.state = CLOSED;
+                                        conn->client_state.state = CLOSED;
 #ifdef DEBUG
                                         printf("CLOSED GATEWAY-SERVER CONNECTION %hu\n", dport);
 #endif
@@ -6977,16 +8994,16 @@ void* capturer(void* _data)
                                     if ((ctr_flag & 0x01) == 1)
                                     {
                                         u_short flag = 0;
-                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[dport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[dport]->MSS;
+                                        conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, dport);
 
-                                        u_short adv_win = (tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[dport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[dport]->client_state.win_scale));
+                                        u_short adv_win = (conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : conn->client_state.rcv_wnd / pow((float)2, (int)conn->client_state.win_scale));
                                         if (adv_win && adv_win != LOCAL_WINDOW)
                                                 adv_win ++;
 
-                                        tcb_table[tcb_index]->conn[dport]->client_state.rcv_nxt = check_sack_list(tcb_index, dport, seq_num, data_len) + 1;
-                                        send_ack_back(dport, data,  tcb_table[tcb_index]->conn[dport]->client_ip_address, tcb_table[tcb_index]->conn[dport]->server_ip_address, tcb_table[tcb_index]->conn[dport]->client_mac_address, tcb_table[tcb_index]->conn[dport]->server_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, adv_win, tcb_table[tcb_index]->conn[dport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[dport]->client_state.sack);
+                                        conn->client_state.rcv_nxt = check_sack_list(tcb_index, dport, seq_num, data_len) + 1;
+                                        send_ack_back(dport, data,  conn->client_ip_address, conn->server_ip_address, conn->client_mac_address, conn->server_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, adv_win, conn->client_state.send_data_id + 1, &conn->cold->sack);
 
-                                        tcb_table[tcb_index]->conn[dport]->client_state.state = CLOSED;
+                                        conn->client_state.state = CLOSED;
                                     }
                                     else if ((ctr_flag & 0x02) == 2)
                                     {
@@ -6999,23 +9016,24 @@ void* capturer(void* _data)
                         }
                         else if (dport == APP_PORT_NUM || dport == APP_PORT_FORWARD) //coming from client
                         {
-                                int tcb_index = tcb_hash.search((char *)&ih->saddr, sizeof(ip_address), &ih->saddr);
+                                int tcb_index = tcb_hash.search(ih->saddr);
+                                conn_state* conn = (tcb_index != -1 ? tcb_table[tcb_index]->conn[sport] : (conn_state *)NULL);
 
-                                if (tcb_index != -1 && tcb_table[tcb_index]->conn[sport] != NULL)
+                                if (tcb_index != -1 && conn != NULL)
                                 {
 
                                         if ((ctr_flag & 0x04) == 4)//RST
                                         {
                                             /*
-                                            pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
-                                            delete tcb_table[tcb_index]->conn[sport];
-                                            tcb_table[tcb_index]->conn[sport] = NULL;
-                                            pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                            pthread_mutex_lock(&conn->mutex);
+                                            delete conn;
+                                            conn = NULL;
+                                            pthread_mutex_unlock(&conn->mutex);
                                             */
 
 #ifdef COMPLETE_SPLITTING_TCP
 
-                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);
+                                            th->ack_num = htonl(conn->client_state.rcv_nxt);
                                             rcv_header_update(ih, th, tcp_len, data_len);
 
                                             /*
@@ -7038,36 +9056,36 @@ void* capturer(void* _data)
 
 #endif
                                             send_forward(data, &header, pkt_data);
-                                            //data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size * tcb_table[tcb_index]->conn[sport]->max_data_len);
+                                            //data_size_in_flight(tcb_index, conn->dataPktBuffer._size * conn->max_data_len);
 
-                                            pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                            pthread_mutex_lock(&conn->mutex);
                                             rcv_rst_handler(sport, tcb_index, current_time, ctr_flag);
-                                            pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                            pthread_mutex_unlock(&conn->mutex);
 
                                             if (tcb_table[tcb_index]->conn[sport] != NULL)
                                             {
-                                                tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
-                                                tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
+                                                conn->client_state.state = CLOSED;
+                                                conn->server_state.state = CLOSED;
                                             }
 
                                             continue;
                                         }
 
-                                        switch(tcb_table[tcb_index]->conn[sport]->server_state.state)
+                                        switch(conn->server_state.state)
                                         {
                                                 case SYN_REVD:
-                                                if ((ctr_flag & 0x10) == 16 && ack_num > tcb_table[tcb_index]->conn[sport]->server_state.snd_una && ack_num <= tcb_table[tcb_index]->conn[sport]->server_state.snd_max) //ACK
+                                                if ((ctr_flag & 0x10) == 16 && ack_num > conn->server_state.snd_una && ack_num <= conn->server_state.snd_max) //ACK
                                                 {
 
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.state = ESTABLISHED;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
+                                                    conn->server_state.state = ESTABLISHED;
+                                                    conn->server_state.snd_wnd = window;
 
 #ifdef COMPLETE_SPLITTING_TCP
                                                     /*
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;
+                                                    conn->client_state.seq_nxt = ack_num;
                                                     if (data_len > 0) //http request
                                                     {
-                                                            ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[sport]->client_state.httpRequest;
+                                                            ForwardPkt* tmpForwardPkt = conn->cold->httpRequest;
                                                             tmpForwardPkt->data = (void *)data;
                                                             memcpy(&(tmpForwardPkt->header), &header, sizeof(struct pcap_pkthdr));
                                                             memset(tmpForwardPkt->pkt_data, 0, sizeof(tmpForwardPkt->pkt_data));
@@ -7082,12 +9100,12 @@ void* capturer(void* _data)
                                                             tmpForwardPkt->num_dup = 0;
                                                             tmpForwardPkt->is_rtx = true;
                                                             tmpForwardPkt->occupy = true;
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.state == ESTABLISHED)
+                                                            if (conn->client_state.state == ESTABLISHED)
                                                             {
-                                                                    th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);
+                                                                    th->ack_num = htonl(conn->client_state.rcv_nxt);
                                                                     th->window = htons(LOCAL_WINDOW);
                                                                     rcv_header_update(ih, th, tcp_len, data_len, pkt_buffer);
-                                                                    tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;
+                                                                    conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS;
                                                                     memset(tmpForwardPkt->pkt_data, 0, sizeof(tmpForwardPkt->pkt_data));
                                                                     memcpy(tmpForwardPkt->pkt_data, pkt_data, header.len);
                                                                     send_forward(data, &header, pkt_data);
@@ -7098,16 +9116,16 @@ void* capturer(void* _data)
 
                                                     if (data_len > 0)
                                                     {
-                                                        if (tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.size() < tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.capacity)
+                                                        if (conn->cold->httpRequest.size() < conn->cold->httpRequest.capacity)
                                                         {
 
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                                                                         
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.state != SYN_SENT)
+                                                            conn->client_state.seq_nxt = ack_num;                                                                                         
+                                                            if (conn->client_state.state != SYN_SENT)
                                                             {
-                                                                tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                                th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);                                                                                            
+                                                                conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport);
+                                                                th->ack_num = htonl(conn->client_state.rcv_nxt);                                                                                            
                                                                 //th->window = htons(LOCAL_WINDOW);
-                                                                rcv_header_update(ih, th, tcp_len, data_len);              
+                                                                rcv_header_update(ih, th, tcp_len, data_len, adv_window(tcb_index, sport));              
                                                                 send_forward(data, &header, pkt_data);                                                                
 
                                                             }
@@ -7115,33 +9133,33 @@ void* capturer(void* _data)
                                                                 accclient_rcv_data_pkt(data, &header, pkt_data, sport, dport, seq_num, data_len, ctr_flag, tcb_index);
 
                                                             u_short flag = 0;
-                                                            send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                            send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
                                                         }
                                                         else 
                                                         {
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                                                                         
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.state != SYN_SENT)
+                                                            conn->client_state.seq_nxt = ack_num;                                                                                         
+                                                            if (conn->client_state.state != SYN_SENT)
                                                             {
-                                                                tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                                th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);                                                                                            
+                                                                conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport);
+                                                                th->ack_num = htonl(conn->client_state.rcv_nxt);                                                                                            
                                                                 //th->window = htons(LOCAL_WINDOW);
-                                                                rcv_header_update(ih, th, tcp_len, data_len);              
+                                                                rcv_header_update(ih, th, tcp_len, data_len, adv_window(tcb_index, sport));              
                                                                 send_forward(data, &header, pkt_data);             
                                                             }
 
                                                             u_short flag = 0;
-                                                            send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, 0, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                            send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, 0, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
                                                         }
                                                     }
                                                     else
                                                     {
                                                             /*
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                                                                                       
+                                                            conn->client_state.seq_nxt = ack_num;                                                                                                       
 
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);                                                                                           
+                                                            conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS;                                                                                        
+                                                            th->ack_num = htonl(conn->client_state.rcv_nxt);                                                                                           
                                                             rcv_header_update(ih, th, tcp_len, data_len);              
                                                             send_forward(data, &header, pkt_data);                
                                                             */ 
@@ -7152,11 +9170,11 @@ void* capturer(void* _data)
                                                     if (data_len > 0)
                                                     {
                                                         u_short flag = 0;
-                                                        send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                        send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
                                                     }
 
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.state = ESTABLISHED;
+                                                    conn->client_state.state = ESTABLISHED;
                                                     send_forward(data, &header, pkt_data);
 
 
@@ -7192,28 +9210,28 @@ void* capturer(void* _data)
                                                     memcpy(pkt_buffer + sizeof(psd_header), th, tcp_len);
                                                     th->crc = CheckSum((u_short *)pkt_buffer, tcp_len + sizeof(psd_header));
                                                     */
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = CIRCULAR_BUF_SIZE * tcb_table[tcb_index]->conn[sport]->MSS; // can be increased
+                                                    conn->client_state.rcv_wnd = CIRCULAR_BUF_SIZE * conn->MSS; // can be increased
 
 #ifdef COMPLETE_SPLITTING_TCP
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.state = SYN_REVD;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_una = tcb_table[tcb_index]->conn[sport]->server_state.snd_una;
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 1;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 1;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 1;
+                                                    conn->server_state.state = SYN_REVD;
+                                                    conn->server_state.snd_wnd = window;
+                                                    conn->server_state.snd_una = conn->server_state.snd_una;
+                                                    conn->client_state.seq_nxt = conn->server_state.snd_una + 1;
+                                                    conn->server_state.snd_nxt = conn->server_state.snd_una + 1;
+                                                    conn->server_state.snd_max = conn->server_state.snd_una + 1;
 #else
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.state = SYN_SENT;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.state = SYN_REVD;
+                                                    conn->client_state.state = SYN_SENT;
+                                                    conn->server_state.state = SYN_REVD;
 #endif
                                                     send_forward(data, &header, pkt_data);
 #ifdef COMPLETE_SPLITTING_TCP
-                                                    send_syn_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, seq_num + data_len + 1, flag|18, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, tcp_opt,  tcp_opt_len, pkt_buffer);
+                                                    send_syn_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, conn->server_state.snd_una, seq_num + data_len + 1, flag|18, LOCAL_WINDOW, conn->server_state.send_data_id + 1, tcp_opt,  tcp_opt_len, pkt_buffer);
 #endif
                                                 }
                                                 else
                                                 {
 #ifdef DEBUG
-                                                    printf("FLAG %hu UNACK PACKET DUMPED IN SYN_REV STATE snd_max: %u snd_una: %u, ack: %u\n", ctr_flag, tcb_table[tcb_index]->conn[sport]->server_state.snd_max, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, ack_num);
+                                                    printf("FLAG %hu UNACK PACKET DUMPED IN SYN_REV STATE snd_max: %u snd_una: %u, ack: %u\n", ctr_flag, conn->server_state.snd_max, conn->server_state.snd_una, ack_num);
 #endif
                                                 }
                                                 break;
@@ -7221,76 +9239,75 @@ void* capturer(void* _data)
                                                 case ESTABLISHED:
                                                 if ((ctr_flag & 0x10) == 16) // have ACK flag
                                                 {
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.state = ESTABLISHED;
+                                                    conn->server_state.state = ESTABLISHED;
 
                                                     if ((ctr_flag & 0x01) == 1) //FIN Received
                                                     {
                                                         u_short flag = 0;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_una = ack_num;
+                                                        conn->server_state.snd_wnd = window;
+                                                        conn->server_state.snd_una = ack_num;
 
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
                                                         rcv_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_unlock(&conn->mutex);
 
 
                                                         send_ack_back(sport, data, 
-                                                                tcb_table[tcb_index]->conn[sport]->server_ip_address, 
-                                                                tcb_table[tcb_index]->conn[sport]->client_ip_address, 
-                                                                tcb_table[tcb_index]->conn[sport]->server_mac_address, 
-                                                                tcb_table[tcb_index]->conn[sport]->client_mac_address, 
+                                                                conn->server_ip_address, 
+                                                                conn->client_ip_address, 
+                                                                conn->server_mac_address, 
+                                                                conn->client_mac_address, 
                                                                 dport, sport, ack_num, seq_num + data_len + 1, flag|16, 
-                                                                LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, 
-                                                                &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                                LOCAL_WINDOW, conn->server_state.send_data_id + 1, 
+                                                                &conn->cold->sack);
 
                                                         send_ack_back(sport, data, 
-                                                                tcb_table[tcb_index]->conn[sport]->server_ip_address, 
-                                                                tcb_table[tcb_index]->conn[sport]->client_ip_address, 
-                                                                tcb_table[tcb_index]->conn[sport]->server_mac_address, 
-                                                                tcb_table[tcb_index]->conn[sport]->client_mac_address, 
+                                                                conn->server_ip_address, 
+                                                                conn->client_ip_address, 
+                                                                conn->server_mac_address, 
+                                                                conn->client_mac_address, 
                                                                 dport, sport, ack_num, seq_num + data_len + 1, flag|16|1, 
-                                                                LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, 
-                                                                &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                                LOCAL_WINDOW, conn->server_state.send_data_id + 1, 
+                                                                &conn->cold->sack);
 
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt ++;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_max ++;
+                                                        conn->server_state.snd_nxt ++;
+                                                        conn->server_state.snd_max ++;
 
                                                         
-                                                        //send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt, seq_num + data_len + 1, flag|16|1, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1);                                                        
+                                                        //send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, conn->server_state.snd_nxt, seq_num + data_len + 1, flag|16|1, LOCAL_WINDOW, conn->server_state.send_data_id + 1);                                                        
 
-                                                        if (tcb_table[tcb_index]->conn[sport]->client_state.state != CLOSED)
+                                                        if (conn->client_state.state != CLOSED)
                                                         {
 #ifdef COMPLETE_SPLITTING_TCP
-                                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);
+                                                            th->ack_num = htonl(conn->client_state.rcv_nxt);
                                                             rcv_header_update(ih, th, tcp_len, data_len);
 #endif
-                                                            //tcb_table[tcb_index]->conn[sport]->client_state.state = FIN_WAIT_1;
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
+                                                            //conn->client_state.state = FIN_WAIT_1;
+                                                            conn->client_state.state = CLOSED;
                                                             send_forward(data, &header, pkt_data);
                                                         }
 
-                                                        data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size * tcb_table[tcb_index]->conn[sport]->max_data_len);
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
+                                                        data_size_in_flight(tcb_index, conn->dataPktBuffer._size * conn->max_data_len);
+                                                        conn->server_state.state = CLOSED;
 #ifdef DEBUG
                                                         printf("CLOSED GATEWAY-CLIENT CONNECTION %hu\n", sport);
 #endif
                                                     }
-                                                    else if (data_len > 0 /*&& MY_SEQ_GEQ(ack_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una) && ack_num <= tcb_table[tcb_index]->conn[sport]->server_state.snd_max*/) // data packet needs be acked
+                                                    else if (data_len > 0 /*&& MY_SEQ_GEQ(ack_num, conn->server_state.snd_una) && ack_num <= conn->server_state.snd_max*/) // data packet needs be acked
                                                     {
 
 #ifdef COMPLETE_SPLITTING_TCP
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.size() 
-                                                                    < tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.capacity)
+                                                            if (conn->cold->httpRequest.size() 
+                                                                    < conn->cold->httpRequest.capacity)
                                                             {
 
-                                                                tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                       
-                                                                if (tcb_table[tcb_index]->conn[sport]->client_state.state != SYN_SENT)
+                                                                conn->client_state.seq_nxt = ack_num;                                       
+                                                                if (conn->client_state.state != SYN_SENT)
                                                                 {
-                                                                   tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = 
-                                                                           (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                                   th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);        
+                                                                   conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport);                                                                                        
+                                                                   th->ack_num = htonl(conn->client_state.rcv_nxt);        
                                                                    //th->window = htons(LOCAL_WINDOW);
-                                                                   rcv_header_update(ih, th, tcp_len, data_len);    
+                                                                   rcv_header_update(ih, th, tcp_len, data_len, adv_window(tcb_index, sport));    
                                                                    send_forward(data, &header, pkt_data);                                                                
                                                                 }
                                                                 else
@@ -7301,40 +9318,38 @@ void* capturer(void* _data)
                                                                 }
 
                                                                 u_short flag = 0;
-                                                                send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, 
-                                                                        tcb_table[tcb_index]->conn[sport]->client_ip_address, 
-                                                                        tcb_table[tcb_index]->conn[sport]->server_mac_address, 
-                                                                        tcb_table[tcb_index]->conn[sport]->client_mac_address, 
+                                                                send_ack_back(sport, data, conn->server_ip_address, 
+                                                                        conn->client_ip_address, 
+                                                                        conn->server_mac_address, 
+                                                                        conn->client_mac_address, 
                                                                         dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, 
-                                                                        tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, 
-                                                                        &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                                        conn->server_state.send_data_id + 1, 
+                                                                        &conn->cold->sack);
 
                                                             }
                                                             else 
                                                             {
-                                                                tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                                                                                                               if (tcb_table[tcb_index]->conn[sport]->client_state.state != SYN_SENT)
+                                                                conn->client_state.seq_nxt = ack_num;                                                                                                                               if (conn->client_state.state != SYN_SENT)
                                                                  {
-                                                                    tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - 
-                                                                            tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * 
-                                                                            tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                                    th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);                                                 
-                                                                    rcv_header_update(ih, th, tcp_len, data_len);              
+                                                                    conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport);                                                                                        
+                                                                    th->ack_num = htonl(conn->client_state.rcv_nxt);                                                 
+                                                                    rcv_header_update(ih, th, tcp_len, data_len, adv_window(tcb_index, sport));              
                                                                     send_forward(data, &header, pkt_data);             
                                                                  }
 
                                                                 u_short flag = 0;
-                                                                send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, 
-                                                                        tcb_table[tcb_index]->conn[sport]->client_ip_address, 
-                                                                        tcb_table[tcb_index]->conn[sport]->server_mac_address, 
-                                                                        tcb_table[tcb_index]->conn[sport]->client_mac_address, 
+                                                                send_ack_back(sport, data, conn->server_ip_address, 
+                                                                        conn->client_ip_address, 
+                                                                        conn->server_mac_address, 
+                                                                        conn->client_mac_address, 
                                                                         dport, sport, ack_num, seq_num + data_len, flag|16, 0, 
-                                                                        tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, 
-                                                                        &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                                        conn->server_state.send_data_id + 1, 
+                                                                        &conn->cold->sack);
 
                                                             }
 
                                                             /*
-                                                            ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[sport]->client_state.httpRequest;
+                                                            ForwardPkt* tmpForwardPkt = conn->cold->httpRequest;
                                                             tmpForwardPkt->data = (void *)data;
                                                             memcpy(&(tmpForwardPkt->header), &header, sizeof(struct pcap_pkthdr));
                                                             memset(tmpForwardPkt->pkt_data, 0, sizeof(tmpForwardPkt->pkt_data));
@@ -7349,13 +9364,13 @@ void* capturer(void* _data)
                                                             tmpForwardPkt->num_dup = 0;
                                                             tmpForwardPkt->is_rtx = true;
                                                             tmpForwardPkt->occupy = true;
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.state == ESTABLISHED)
+                                                            conn->client_state.seq_nxt = ack_num;
+                                                            if (conn->client_state.state == ESTABLISHED)
                                                             {
-                                                                    th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);
+                                                                    th->ack_num = htonl(conn->client_state.rcv_nxt);
                                                                     th->window = htons(LOCAL_WINDOW);
                                                                     rcv_header_update(ih, th, tcp_len, data_len);
-                                                                    tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;
+                                                                    conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS;
                                                                     memset(tmpForwardPkt->pkt_data, 0, sizeof(tmpForwardPkt->pkt_data));
                                                                     memcpy(tmpForwardPkt->pkt_data, pkt_data, header.len);
                                                                     send_forward(data, &header, pkt_data);
@@ -7366,55 +9381,49 @@ void* capturer(void* _data)
                                                             send_forward(data, &header, pkt_data);
                                                             /*
                                                             u_short flag = 0;
-                                                            send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, 
-                                                                    tcb_table[tcb_index]->conn[sport]->client_ip_address, 
-                                                                    tcb_table[tcb_index]->conn[sport]->server_mac_address, 
-                                                                    tcb_table[tcb_index]->conn[sport]->client_mac_address, 
+                                                            send_ack_back(sport, data, conn->server_ip_address, 
+                                                                    conn->client_ip_address, 
+                                                                    conn->server_mac_address, 
+                                                                    conn->client_mac_address, 
                                                                     dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, 
-                                                                    tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, 
-                                                                    &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                                    conn->server_state.send_data_id + 1, 
+                                                                    &conn->cold->sack);
                                                             */
 
 #endif
 
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_una = ack_num;																											
-                                                        //pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+#ifndef ACK_INBOX
+                                                        conn->server_state.snd_wnd = window;
+                                                        conn->server_state.snd_una = ack_num;
+#endif																											
+                                                        //pthread_mutex_lock(&conn->mutex);
+#ifdef ACK_INBOX
+                                                        post_ack_event(DATA_ACK_EVENT, (u_char *)th, tcp_len, ack_num, window, sport, dport, tcb_index, current_time, data);
+#else
                                                         rcv_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        //pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);									
+#endif
+                                                        //pthread_mutex_unlock(&conn->mutex);									
                                                         //rcv_data_uplink_slide_win_avg_bw(tcb_index, sport, ack_num, data_len, current_time);
                                                         //rcv_data_downlink_queueing_delay_est(tcb_index, sport);
 
 
                                                     }
-                                                    else if (MY_SEQ_GT(ack_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una) && ack_num <= tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
+#ifdef ACK_INBOX
+                                                    else
+                                                    {
+                                                        // new or duplicate is decided when applied, server_state belongs to the scheduler
+                                                        post_ack_event(PURE_ACK_EVENT, (u_char *)th, tcp_len, ack_num, window, sport, dport, tcb_index, current_time, data);
+                                                    }
+#else
+                                                    else if (MY_SEQ_GT(ack_num, conn->server_state.snd_una) && ack_num <= conn->server_state.snd_max)
                                                     {
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
                                                         rcv_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
-
-                                                        u_int adv_win = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) 
-                                                                * tcb_table[tcb_index]->conn[sport]->MSS;
-                                                        if (adv_win >= tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd + 0.5 * tcb_table[tcb_index]->conn[sport]->dataPktBuffer.capacity * tcb_table[tcb_index]->conn[sport]->MSS || !tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd)
-                                                        {
-                                                            u_short flag = 0;
-                                                            //tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size() - 2 > 0 ? (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size() - 2) * tcb_table[tcb_index]->conn[sport]->MSS:0);
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size())*tcb_table[tcb_index]->conn[sport]->MSS;
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_adv = tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt + tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd;
-                                                            //u_short adv_win = (tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale));
-                                                            u_short adv_win = (tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale));
-                                                            if (adv_win && adv_win != LOCAL_WINDOW)
-                                                                    adv_win ++;
-
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd >= tcb_table[tcb_index]->conn[sport]->MSS)
-                                                                    send_win_update_forward(sport, data, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, sport, dport, tcb_table[tcb_index]->conn[sport]->client_state.snd_nxt, tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[sport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
-
-                                                            if (adv_win * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale) < 2 * tcb_table[tcb_index]->conn[sport]->MSS)
-                                                                    tcb_table[tcb_index]->conn[sport]->client_state.ack_count = 1; // next ready to ack
-                                                        }
+                                                        pthread_mutex_unlock(&conn->mutex);
 
+                                                        ack_win_update(data, tcb_index, sport, dport);
                                                     }
-                                                    else if (ack_num == tcb_table[tcb_index]->conn[sport]->server_state.snd_una)
+                                                    else if (ack_num == conn->server_state.snd_una)
                                                     {
                                                         if (tcp_len > 20) // TCP Options
                                                         {
@@ -7423,9 +9432,9 @@ void* capturer(void* _data)
                                                             ack_sack_option(tcp_opt, tcp_opt_len, sport, ack_num, tcb_index, window);
                                                         }
                                                                 
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
                                                         rcv_dup_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_unlock(&conn->mutex);
                                                     }
                                                     else
                                                     {
@@ -7433,6 +9442,7 @@ void* capturer(void* _data)
                                                             printf("FLAGS %hu PACKET DUMPED\n", ctr_flag);
 #endif
                                                     }
+#endif
                                                 }
                                                 else
                                                 {
@@ -7459,47 +9469,49 @@ void* capturer(void* _data)
                                                     {
                                                         u_short flag = 0;
 
-                                                        send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                        send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, LOCAL_WINDOW, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
-                                                        //send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16|1, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                        //send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16|1, LOCAL_WINDOW, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt ++;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_max ++;
+                                                        conn->server_state.snd_nxt ++;
+                                                        conn->server_state.snd_max ++;
                                                         /*
-                                                        send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt, seq_num + data_len + 1, flag|16|1, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1);
+                                                        send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, conn->server_state.snd_nxt, seq_num + data_len + 1, flag|16|1, LOCAL_WINDOW, conn->server_state.send_data_id + 1);
                                                         */
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_una = ack_num;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
+                                                        conn->server_state.snd_una = ack_num;
+                                                        conn->server_state.snd_wnd = window;
 
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
                                                         rcv_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_unlock(&conn->mutex);
 
-                                                        if (tcb_table[tcb_index]->conn[sport]->client_state.state != CLOSED)
+                                                        if (conn->client_state.state != CLOSED)
                                                         {
 #ifdef COMPLETE_SPLITTING_TCP
-                                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);
+                                                            th->ack_num = htonl(conn->client_state.rcv_nxt);
                                                             rcv_header_update(ih, th, tcp_len, data_len);
 #endif
-                                                            //tcb_table[tcb_index]->conn[sport]->client_state.state = FIN_WAIT_1;
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.state = CLOSED;
+                                                            //conn->client_state.state = FIN_WAIT_1;
+                                                            conn->client_state.state = CLOSED;
                                                             send_forward(data, &header, pkt_data);
                                                         }
 
-                                                        data_size_in_flight(tcb_index, tcb_table[tcb_index]->conn[sport]->dataPktBuffer._size * tcb_table[tcb_index]->conn[sport]->max_data_len);
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.state = CLOSED;
+                                                        data_size_in_flight(tcb_index, conn->dataPktBuffer._size * conn->max_data_len);
+                                                        conn->server_state.state = CLOSED;
 #ifdef DEBUG
                                                             printf("CLOSED GATEWAY-CLIENT CONNECTION %hu\n", sport);
 #endif
                                                     }
-                                                    else if (data_len > 0 /*&& MY_SEQ_GEQ(ack_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una) && ack_num <= tcb_table[tcb_index]->conn[sport]->server_state.snd_max*/) // data packet needs be acked
+                                                    else if (data_len > 0 /*&& MY_SEQ_GEQ(ack_num, conn->server_state.snd_una) && ack_num <= conn->server_state.snd_max*/) // data packet needs be acked
                                                     {
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.snd_una = ack_num;
+#ifndef ACK_INBOX
+                                                        conn->server_state.snd_wnd = window;
+                                                        conn->server_state.snd_una = ack_num;
+#endif
 
 #ifdef COMPLETE_SPLITTING_TCP
                                                         /*
-                                                        ForwardPkt* tmpForwardPkt = tcb_table[tcb_index]->conn[sport]->client_state.httpRequest;
+                                                        ForwardPkt* tmpForwardPkt = conn->cold->httpRequest;
                                                         tmpForwardPkt->data = (void *)data;
                                                         memcpy(&(tmpForwardPkt->header), &header, sizeof(struct pcap_pkthdr));
                                                         //memset(tmpForwardPkt->pkt_data, 0, sizeof(tmpForwardPkt->pkt_data));
@@ -7515,15 +9527,15 @@ void* capturer(void* _data)
                                                         tmpForwardPkt->is_rtx = true;
                                                         tmpForwardPkt->occupy = true;
 
-                                                        tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;
+                                                        conn->client_state.seq_nxt = ack_num;
 
-                                                        if (tcb_table[tcb_index]->conn[sport]->client_state.state == ESTABLISHED)
+                                                        if (conn->client_state.state == ESTABLISHED)
                                                         {
-                                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);
+                                                            th->ack_num = htonl(conn->client_state.rcv_nxt);
                                                             th->window = htons(LOCAL_WINDOW);
                                                             rcv_header_update(ih, th, tcp_len, data_len);
 
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;
+                                                            conn->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - conn->dataPktBuffer.size()) * conn->MSS;
                                                             memset(tmpForwardPkt->pkt_data, 0, sizeof(tmpForwardPkt->pkt_data));
                                                             memcpy(tmpForwardPkt->pkt_data, pkt_data, header.len);
 
@@ -7532,74 +9544,68 @@ void* capturer(void* _data)
                                                         }
                                                         */
 
-                                                        if (tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.size() < tcb_table[tcb_index]->conn[sport]->client_state.httpRequest.capacity)
+                                                        if (conn->cold->httpRequest.size() < conn->cold->httpRequest.capacity)
                                                         {
 
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                                                                                       
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);                                                                                            
+                                                            conn->client_state.seq_nxt = ack_num;                                                                                                       
+                                                            conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport);
+                                                            th->ack_num = htonl(conn->client_state.rcv_nxt);                                                                                            
                                                             //th->window = htons(LOCAL_WINDOW);
-                                                            rcv_header_update(ih, th, tcp_len, data_len);              
+                                                            rcv_header_update(ih, th, tcp_len, data_len, adv_window(tcb_index, sport));              
                                                             send_forward(data, &header, pkt_data);                                                       
 
                                                             u_short flag = 0;
-                                                            send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                            send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
                                                         }
                                                         else 
                                                         {
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = ack_num;                                                                                                       
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;                                                                                        
-                                                            th->ack_num = htonl(tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt);                                                                                            
+                                                            conn->client_state.seq_nxt = ack_num;                                                                                                       
+                                                            conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport);
+                                                            th->ack_num = htonl(conn->client_state.rcv_nxt);                                                                                            
                                                             //th->window = htons(LOCAL_WINDOW);
-                                                            rcv_header_update(ih, th, tcp_len, data_len);              
+                                                            rcv_header_update(ih, th, tcp_len, data_len, adv_window(tcb_index, sport));              
                                                             send_forward(data, &header, pkt_data);             
 
                                                             u_short flag = 0;
-                                                            send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, 0, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                            send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, 0, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
                                                         }
 #else
                                                         send_forward(data, &header, pkt_data);
 
                                                         //u_short flag = 0;
-                                                        //send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                        //send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len, flag|16, LOCAL_WINDOW, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
 #endif
                                                     
-                                                        //pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);                                                        
+                                                        //pthread_mutex_lock(&conn->mutex);                                                        
+#ifdef ACK_INBOX
+                                                        post_ack_event(DATA_ACK_EVENT, (u_char *)th, tcp_len, ack_num, window, sport, dport, tcb_index, current_time, data);
+#else
                                                         rcv_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        //pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+#endif
+                                                        //pthread_mutex_unlock(&conn->mutex);
                                                         //rcv_data_uplink_slide_win_avg_bw(tcb_index, sport, ack_num, data_len, current_time);
                                                         //rcv_data_downlink_queueing_delay_est(tcb_index, sport);
 
                                                     }                                                                
-                                                    else if (MY_SEQ_GT(ack_num, tcb_table[tcb_index]->conn[sport]->server_state.snd_una) && ack_num <= tcb_table[tcb_index]->conn[sport]->server_state.snd_max)
+#ifdef ACK_INBOX
+                                                    else
+                                                    {
+                                                        // new or duplicate is decided when applied, server_state belongs to the scheduler
+                                                        post_ack_event(PURE_ACK_EVENT, (u_char *)th, tcp_len, ack_num, window, sport, dport, tcb_index, current_time, data);
+                                                    }
+#else
+                                                    else if (MY_SEQ_GT(ack_num, conn->server_state.snd_una) && ack_num <= conn->server_state.snd_max)
                                                     {
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
                                                         rcv_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_unlock(&conn->mutex);
 
-                                                        u_int adv_win = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size()) * tcb_table[tcb_index]->conn[sport]->MSS;
-                                                        if (adv_win >= tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd + 0.5 * tcb_table[tcb_index]->conn[sport]->dataPktBuffer.capacity * tcb_table[tcb_index]->conn[sport]->MSS || !tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd)
-                                                        {
-                                                            u_short flag = 0;
-                                                            //tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size() - 2 > 0 ? (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size() - 2) * tcb_table[tcb_index]->conn[sport]->MSS:0);
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size())*tcb_table[tcb_index]->conn[sport]->MSS;
-                                                            tcb_table[tcb_index]->conn[sport]->client_state.rcv_adv = tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt + tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd;
-                                                            //u_short adv_win = (tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd > LOCAL_WINDOW * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale) ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale));
-                                                            adv_win = (tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale) > LOCAL_WINDOW ? LOCAL_WINDOW : tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd / pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale));
-                                                            if (adv_win && adv_win != LOCAL_WINDOW)
-                                                                    adv_win ++;
-
-                                                            if (tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd >= tcb_table[tcb_index]->conn[sport]->MSS)
-                                                                    send_win_update_forward(sport, data, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, sport, dport, tcb_table[tcb_index]->conn[sport]->client_state.snd_nxt, tcb_table[tcb_index]->conn[sport]->client_state.rcv_nxt, flag|16, adv_win, tcb_table[tcb_index]->conn[sport]->client_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
-
-                                                            if (adv_win * pow((float)2, (int)tcb_table[tcb_index]->conn[sport]->client_state.win_scale) < 2 * tcb_table[tcb_index]->conn[sport]->MSS)
-                                                                    tcb_table[tcb_index]->conn[sport]->client_state.ack_count = 1; // next ready to ack
-                                                        }
+                                                        ack_win_update(data, tcb_index, sport, dport);
                                                     }
-                                                    else if (ack_num == tcb_table[tcb_index]->conn[sport]->server_state.snd_una)
+                                                    else if (ack_num == conn->server_state.snd_una)
                                                     {
                                                         if (tcp_len > 20) // TCP Options
                                                         {
@@ -7609,9 +9615,9 @@ void* capturer(void* _data)
                                                         }
         
                                                         
-                                                        pthread_mutex_lock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_lock(&conn->mutex);
                                                         rcv_dup_ack_handler((u_char *)th, tcp_len, ack_num, window, sport, tcb_index, current_time);
-                                                        pthread_mutex_unlock(&tcb_table[tcb_index]->conn[sport]->mutex);
+                                                        pthread_mutex_unlock(&conn->mutex);
                                                     }
                                                     else
                                                     {
@@ -7619,6 +9625,7 @@ void* capturer(void* _data)
                                                             printf("FLAGS %hu PACKET DUMPED\n", ctr_flag);
 #endif
                                                     }
+#endif
                                                 }
                                                 else
                                                 {
@@ -7631,7 +9638,13 @@ void* capturer(void* _data)
                                                 case CLOSED:
                                                 if ((ctr_flag & 0x02) == 2)
                                                 {
-                                                    tcb_table[tcb_index]->conn[sport]->init_state_ex(mh->mac_src, mh->mac_dst, ih->saddr, ih->daddr, sport, dport, tcb_table[tcb_index], tcb_table[tcb_index]->conn[sport]->index);
+                                                    key.client_ip = ih->saddr;
+                                                    key.server_ip = ih->daddr;
+                                                    key.client_port = sport;
+                                                    key.server_port = dport;
+                                                    conn_hash.rekey(conn, key); // the old flow's key would still lead here
+
+                                                    conn->init_state_ex(mh->mac_src, mh->mac_dst, ih->saddr, ih->daddr, sport, dport, tcb_table[tcb_index], conn->index);
                                                     u_short flag = 0;
                                                     u_int tcp_opt_len = tcp_len - 20;
                                                     u_char *tcp_opt = (u_char *)th + 20;
@@ -7639,28 +9652,28 @@ void* capturer(void* _data)
                                                     syn_sack_option(tcp_opt, tcp_opt_len, sport, TRUE, tcb_index);
                                                     rcv_header_update(ih, th, tcp_len, data_len);
 
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.state = SYN_SENT;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.state = SYN_REVD;
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size())* tcb_table[tcb_index]->conn[sport]->MSS; // can be increased
+                                                    conn->client_state.state = SYN_SENT;
+                                                    conn->server_state.state = SYN_REVD;
+                                                    conn->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport); // can be increased
 
                                                     if (tcb_table[tcb_index]->send_beyong_win)
-                                                        tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win = TRUE;
+                                                        conn->server_state.ignore_adv_win = TRUE;
 
 #ifdef COMPLETE_SPLITTING_TCP                                                            
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.state = SYN_REVD;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_wnd = window;
+                                                    conn->server_state.state = SYN_REVD;
+                                                    conn->server_state.snd_wnd = window;
 
 
 
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_una = seq_num;
+                                                    conn->server_state.snd_una = seq_num;
 
 
-                                                    tcb_table[tcb_index]->conn[sport]->client_state.seq_nxt = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 1;;
+                                                    conn->client_state.seq_nxt = conn->server_state.snd_una + 1;;
 
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 1;
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_max = tcb_table[tcb_index]->conn[sport]->server_state.snd_una + 1;
+                                                    conn->server_state.snd_nxt = conn->server_state.snd_una + 1;
+                                                    conn->server_state.snd_max = conn->server_state.snd_una + 1;
 
-                                                    send_syn_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, tcb_table[tcb_index]->conn[sport]->server_state.snd_una, seq_num + data_len + 1, flag|18, LOCAL_WINDOW, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, tcp_opt, tcp_opt_len, pkt_buffer);
+                                                    send_syn_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, conn->server_state.snd_una, seq_num + data_len + 1, flag|18, LOCAL_WINDOW, conn->server_state.send_data_id + 1, tcp_opt, tcp_opt_len, pkt_buffer);
 
 #endif
                                                     send_forward(data, &header, pkt_data);
@@ -7670,10 +9683,10 @@ void* capturer(void* _data)
                                                 {
                                                     u_short flag = 0;                                                                        
 
-                                                    send_ack_back(sport, data, tcb_table[tcb_index]->conn[sport]->server_ip_address, tcb_table[tcb_index]->conn[sport]->client_ip_address, tcb_table[tcb_index]->conn[sport]->server_mac_address, tcb_table[tcb_index]->conn[sport]->client_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, 64, tcb_table[tcb_index]->conn[sport]->server_state.send_data_id + 1, &tcb_table[tcb_index]->conn[sport]->client_state.sack);
+                                                    send_ack_back(sport, data, conn->server_ip_address, conn->client_ip_address, conn->server_mac_address, conn->client_mac_address, dport, sport, ack_num, seq_num + data_len + 1, flag|16, 64, conn->server_state.send_data_id + 1, &conn->cold->sack);
 
-                                                    tcb_table[tcb_index]->conn[sport]->server_state.snd_nxt = seq_num + data_len + 1;
-                                                    //tcb_table[tcb_index]->conn[sport]->server_state.snd_max ;
+                                                    conn->server_state.snd_nxt = seq_num + data_len + 1;
+                                                    //conn->server_state.snd_max ;
                                                 }
 
                                                 break;
@@ -7686,7 +9699,7 @@ void* capturer(void* _data)
                                             {
                                                 if (tcb_index == -1)
                                                 {
-                                                    tcb_index = tcb_hash.Hash((char *)&ih->saddr, sizeof(ip_address));                                                               
+                                                    tcb_index = tcb_hash.Hash(ih->saddr);                                                               
                                                     if (tcb_index == -1)
                                                     {
                                                         send_forward(data, &header, pkt_data);
@@ -7697,9 +9710,11 @@ void* capturer(void* _data)
                                                     pool.add_tcb(tcb_index);
                                                 }
 
-                                                memcpy(key, &ih->saddr, sizeof(ip_address));
-                                                memcpy(key+sizeof(ip_address), &sport, sizeof(u_short));
-                                                int conn_index = conn_hash.Hash(key, sizeof(key));
+                                                key.client_ip = ih->saddr;
+                                                key.server_ip = ih->daddr;
+                                                key.client_port = sport;
+                                                key.server_port = dport;
+                                                int conn_index = conn_hash.Hash(key);
 
                                                 if (conn_index == -1)
                                                 {
@@ -7736,7 +9751,7 @@ void* capturer(void* _data)
 
                                                 tcb_table[tcb_index]->conn[sport]->client_state.state = SYN_SENT;
                                                 tcb_table[tcb_index]->conn[sport]->server_state.state = SYN_REVD;
-                                                tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = (CIRCULAR_BUF_SIZE - tcb_table[tcb_index]->conn[sport]->dataPktBuffer.size())* tcb_table[tcb_index]->conn[sport]->MSS; // can be increased
+                                                tcb_table[tcb_index]->conn[sport]->client_state.rcv_wnd = rcv_wnd_budget(tcb_index, sport); // can be increased
 
                                                 if (tcb_table[tcb_index]->send_beyong_win)
                                                     tcb_table[tcb_index]->conn[sport]->server_state.ignore_adv_win = TRUE;
@@ -7785,7 +9800,142 @@ void* capturer(void* _data)
 		printf("Error reading the packets: %s\n", pcap_geterr(data->dev_this));
 		exit(-1);
 	}
+
+	return NULL;
+}
+#ifdef SINGLE_THREAD_ENGINE
+/* earliest time (us) at which the scheduler has something to do for a connection */
+u_long_long inline conn_next_deadline(u_int tcb_index, u_short sport, u_long_long current_time)
+{
+    conn_state* conn = tcb_table[tcb_index]->conn[sport];
+    u_long_long deadline = current_time + ENGINE_IDLE_TIMEOUT * 1000;
+    u_int snd_win;
+    int space;
+
+    if (conn->server_state.state == CLOSED && conn->client_state.state == CLOSED)
+        return (conn->close_time ? conn->close_time + TIME_TO_LIVE : current_time);
+
+    if (conn->dataPktBuffer.pkts() > 0)
+    {
+        BOOL win_open = TRUE;
+
+        if (conn->server_state.phase == NORMAL && !conn->server_state.ignore_adv_win)
+        {
+            snd_win = conn->server_state.snd_wnd * pow((float)2, (int)conn->server_state.win_scale);
+            space = snd_win - (int)(conn->server_state.snd_nxt - conn->server_state.snd_una);
+            if ((int)conn->dataPktBuffer.head()->data_len > space + NUM_PKT_BEYOND_WIN * conn->max_data_len)
+                win_open = FALSE; // waits for an ACK, which wakes poll() anyway
+        }
+
+        if (win_open)
+        {
+            if (tcb_table[tcb_index]->send_rate == 0)
+                return current_time;
+
+            double ahead = (double)tcb_table[tcb_index]->sliding_snd_window.timeInterval(current_time) -
+                    (double)tcb_table[tcb_index]->sliding_snd_window.bytes() * (double)RESOLUTION / (double)tcb_table[tcb_index]->send_rate;
+            if (ahead >= 0)
+                return current_time;
+            if (current_time + (u_long_long)(-ahead) < deadline)
+                deadline = current_time + (u_long_long)(-ahead);
+        }
+    }
+
+    if (conn->dataPktBuffer.size() > 0)
+    {
+        ForwardPkt* timeoutPkt = conn->dataPktBuffer.unAck();
+        if (timeoutPkt->snd_time && timeoutPkt->snd_time + conn->rto < deadline)
+            deadline = timeoutPkt->snd_time + conn->rto;
+    }
+
+    return deadline;
+}
+/*
+ * poll() timeout in ms: the earliest conn_next_deadline() over all
+ * connections, rounded up, and never past ENGINE_IDLE_TIMEOUT. Zero only
+ * when some connection is already due; a connection waiting for an ACK
+ * sets no deadline, the ACK wakes poll().
+ */
+int inline engine_timeout()
+{
+    if (pool.ex_tcb.isEmpty())
+        return ENGINE_IDLE_TIMEOUT;
+
+    u_long_long current_time = timer.Start();
+    u_long_long deadline = current_time + ENGINE_IDLE_TIMEOUT * 1000;
+
+    for (u_int i = 0; i < pool.ex_tcb.size(); i ++)
+    {
+        u_int tcb_index = pool.ex_tcb.state_id[i];
+
+        for (u_int j = 0; j < tcb_table[tcb_index]->states.size(); j ++)
+        {
+            u_short sport = tcb_table[tcb_index]->states.state_id[j];
+            if (sport == 0)
+                continue;
+
+            u_long_long due = conn_next_deadline(tcb_index, sport, current_time);
+            if (due <= current_time)
+                return 0;
+            if (due < deadline)
+                deadline = due;
+        }
+    }
+
+    return (int)((deadline - current_time + 999) / 1000);
+}
+/* Polls both adapters and runs capture, scheduling and transmission in the calling thread */
+void engine(DATA* data_out2in, DATA* data_in2out)
+{
+	DATA* dirs[2] = {data_out2in, data_in2out};
+	struct pollfd fds[2];
+	char errbuf[PCAP_ERRBUF_SIZE];
+	int timeout;
+
+	printf("State Ack iTime(ms) RTT(ms) SendRate(KB/s) TotalEstRate(KB/s) EstRate(KB/s) Conn\n");
+
+	for (u_int i = 0; i < 2; i ++)
+	{
+		dirs[i]->burst = ENGINE_BURST;
+		if (pcap_setnonblock(dirs[i]->dev_this, 1, errbuf) < 0)
+		{
+			fprintf(stderr, "\nUnable to set %s non-blocking: %s\n", dirs[i]->name_this, errbuf);
+			exit(-1);
+		}
+
+		fds[i].fd = pcap_get_selectable_fd(dirs[i]->dev_this);
+		fds[i].events = POLLIN;
+		if (fds[i].fd < 0)
+		{
+			fprintf(stderr, "\nAdapter %s has no selectable descriptor\n", dirs[i]->name_this);
+			exit(-1);
+		}
+	}
+
+	while (TRUE)
+	{
+		// connections with pending data or timers must not wait for the next packet
+		timeout = engine_timeout();
+
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			exit(-1);
+		}
+
+		for (u_int i = 0; i < 2; i ++)
+		{
+			if (fds[i].revents & POLLIN)
+				capturer((void *)dirs[i]);
+		}
+
+		scheduler((void *)data_in2out);
+
+		forward_flush(data_in2out->forward);
+		forward_flush(data_out2in->forward);
+	}
 }
+#endif
 void* monitor(void* dummy)
 {
 #ifdef BW_SMOOTH
@@ -7955,6 +10105,7 @@ void inline init_dev()
                                 (unsigned char)req.ifr_hwaddr.sa_data[4],
                                 (unsigned char)req.ifr_hwaddr.sa_data[5]);
 	printf("The application filter of inner adapter is %s\n", inner_ad_packet_filter);
+	printf("The inner adapter %s is on NUMA node %d\n", d->name, nic_numa_node(d->name));
 
 	/* Open the input adapter */
 	/*
@@ -8017,6 +10168,7 @@ void inline init_dev()
                                 (unsigned char)req.ifr_hwaddr.sa_data[5]);
 
 	printf("The application filter of outter adapter is %s\n", outter_ad_packet_filter);
+	printf("The outter adapter %s is on NUMA node %d\n", d->name, nic_numa_node(d->name));
 
 	/* Open the output adapter */
 	if ((outAdHandle = pcap_open_live(d->name, 65535, 1, 1, errbuf)) == NULL)
@@ -8066,19 +10218,23 @@ int main()
 	forward_out2in = new Forward(inAdHandle, circularBufferSize, out2inDelay, CLIENT_TO_SERVER);
 	forward_in2out = new Forward(outAdHandle, circularBufferSize, in2outDelay, SERVER_TO_CLIENT);
 	data_out2in = new DATA(outAdHandle, inAdHandle, "eth0", "eth2", CLIENT_TO_SERVER, forward_out2in, forward_in2out);
+	uplink_data = data_out2in;
 	data_in2out = new DATA(inAdHandle, outAdHandle, "eth2", "eth0", SERVER_TO_CLIENT, forward_in2out, forward_out2in);
 
-	pthread_create(&th_out2in_forward, 0, forwarder, (void *)forward_out2in);
-	pthread_create(&th_in2out_forward, 0, forwarder, (void *)forward_in2out);
-	pthread_create(&th_out2in_capture, 0, capturer, (void *)data_out2in);
-	pthread_create(&th_in2out_capture, 0, capturer, (void *)data_in2out);
-	pthread_create(&th_scheduler, 0, scheduler, (void *)data_in2out);
-	//pthread_create(&th_monitor, 0, monitor, NULL);
+	if (topo.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		fprintf(stderr, "Unable to lock memory: %s\n", strerror(errno));
 
-	//struct sched_param param;
-	//param.sched_priority = sched_get_priority_max(SCHED_RR);
-	//pthread_setschedparam(th_out2in_capture, SCHED_RR, &param);
-	//pthread_setschedparam(th_in2out_capture, SCHED_RR, &param);
+#ifdef SINGLE_THREAD_ENGINE
+	pin_self(topo.scheduler_cpu);
+	set_self_fifo();
+	engine(data_out2in, data_in2out);
+#else
+	spawn_thread(&th_out2in_forward, forwarder, (void *)forward_out2in, topo.forward_cpu[CLIENT_TO_SERVER]);
+	spawn_thread(&th_in2out_forward, forwarder, (void *)forward_in2out, topo.forward_cpu[SERVER_TO_CLIENT]);
+	spawn_thread(&th_out2in_capture, capturer, (void *)data_out2in, topo.capture_cpu[CLIENT_TO_SERVER]);
+	spawn_thread(&th_in2out_capture, capturer, (void *)data_in2out, topo.capture_cpu[SERVER_TO_CLIENT]);
+	spawn_thread(&th_scheduler, scheduler, (void *)data_in2out, topo.scheduler_cpu);
+	//pthread_create(&th_monitor, 0, monitor, NULL);
 
 	pthread_join(th_out2in_forward, NULL);
 	pthread_join(th_in2out_forward, NULL);
@@ -8086,6 +10242,7 @@ int main()
 	pthread_join(th_in2out_capture, NULL);
 	pthread_join(th_scheduler, NULL);
 	//pthread_join(th_monitor, NULL);
+#endif
 
 	if (inAdHandle != NULL)
 		pcap_close(inAdHandle);
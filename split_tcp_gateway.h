@@ -24,6 +24,13 @@
 #include <netinet/in.h>
 #include <bitset>
 #include <stdarg.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <stddef.h>
+#include <new>
 #include <time.h>
 
 
@@ -32,11 +39,14 @@ using namespace std;
 #define PKT_SIZE 1515
 #define CIRCULAR_BUF_SIZE 2048*1
 #define CIRCULAR_QUEUE_SIZE 1024
+#define CTRL_QUEUE_SIZE 256
 
 #define END_TO_END_DELAY 250000000
 #define IPTOSBUFFERS 12
 
 #define MAX_CONN_STATES	65536
+#define CONN_MAP_INIT_SIZE 8       // per-TCB port map slots, power of two
+#define GRACE_MAX_THREADS 8        // threads that may probe the lock-free maps
 
 #define LOCAL_WINDOW 65535
 #define RECEIVE 0
@@ -59,6 +69,7 @@ using namespace std;
 //#define LOG_STAT
 #define RESOLUTION 1000000
 #define SLIDING_WIN_SIZE 1500
+#define ACK_HISTORY_SIZE (SLIDING_WIN_SIZE + 3500) // ACKs an AckHistory keeps, estimators over SLIDING_WIN_SIZE take the newest
 
 #define SLIDING_GRADIENT_SIZE 10
 
@@ -66,7 +77,7 @@ using namespace std;
 //#define COMPLETE_SPLITTING_TCP 
 
 /* multi-user extension */
-#define TOTAL_NUM_CONN 150
+#define TOTAL_NUM_CONN 150 // default capacity, parameters.txt may set another
 #define CLIENT_SACK_SIZE 5
 
 //#define DEBUG
@@ -113,6 +124,8 @@ u_int SND_BEYOND_WIN;
 u_int NUM_PKT_BEYOND_WIN;
 u_int RTT_LIMIT;
 u_int BDP;
+u_int CONN_CAPACITY = TOTAL_NUM_CONN;  ///< conn and TCB objects allocated at startup
+u_int MAX_CONN_CAPACITY = 0;           ///< growth stops here, 0 for no limit
 
 BOOL enable_opp_rtx = TRUE;
 #define CTRL_FLIGHT
@@ -138,6 +151,66 @@ BOOL enable_opp_rtx = TRUE;
 
 //#define DOWNLINK_QUEUE_LEN_EST
 
+/* fields written by different threads start on their own cache line */
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/* one thread polls both adapters and runs capture, scheduling and transmit inline */
+//#define SINGLE_THREAD_ENGINE
+#define ENGINE_BURST 32
+#define ENGINE_IDLE_TIMEOUT 10 //ms
+
+/* free slots the forwarder must see before re-arming egress-blocked TCBs */
+#define EGRESS_REARM_SPACE (CIRCULAR_QUEUE_SIZE/4)
+#define CTRL_REARM_SPACE (CTRL_QUEUE_SIZE/4) // same for TCBs holding a deferred window update
+
+/* long-lived tables are carved from huge-page arenas, falling back to THP and then 4 KB pages */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define HUGE_ARENA_SIZE (32*1024*1024)
+//#define HUGE_PAGE_1GB
+
+/* retransmission buffers of all connections come from one packet slab */
+#define SLAB_PKTS_PER_CONN 256              // global cap on buffered segments, per pooled connection
+#define SLAB_CHUNK (HUGE_PAGE_SIZE/PKT_SIZE) // frames added at a time
+#define SLAB_CACHE 64                       // per-thread free cache
+#define PAYLOAD_STORAGE                     // keep only payload, headers are rebuilt from a per-connection template on send
+#define PKT_HDR_MAX (14 + 60 + 60)          // largest Ethernet/IP/TCP header a template holds
+
+/* server data buffered over all connections, kept below the slab cap by closing windows */
+#define BUFFER_BUDGET_SHARE 75 // % of the slab cap, in bytes, the budget lets servers fill
+#define BUFFER_HIGH_WATER 75 // % of the budget a TCB above its share may borrow up to
+#define BUFFER_REOPEN_STEP 5 // % of the budget freed between two budget_reopen() sweeps
+
+/* conn and TCB pools grow online once the startup capacity is used up */
+#define CAPACITY_GROW_STEP 32     // objects allocated per growth step
+#define FLOW_INDEX_INIT_SIZE 256
+#define REHASH_STEP 8             // old index buckets moved per insert or erase
+#define FLOW_MAX_PROBE 16         // longest distance from home an insert may leave, else the index grows
+#define STATE_ARRAY_INIT_SIZE 16
+
+/* most segments one scheduler visit may hand to the forwarder at once */
+#define SCHED_MICRO_BURST 4
+
+/* per-TCB scheduler cost is folded into sched_load once per interval */
+#define LOAD_REPORT_INTERVAL 1000000 //us
+//#define LOAD_REPORT
+
+/* byte limit on the egress data lane, adapted like Linux BQL */
+#define BQL_MIN_LIMIT (2*MTU)
+#define BQL_MAX_LIMIT (CIRCULAR_QUEUE_SIZE*MTU)
+#define BQL_INIT_LIMIT (16*MTU)
+#define BQL_SLACK_INTERVAL 100000 //us
+
+/* forwarders report departure times back to the scheduler */
+#define TX_DONE_SIZE (CIRCULAR_QUEUE_SIZE+SCHED_MICRO_BURST) // a full data lane and one visit's burst, cannot fill
+#define TX_DONE_BATCH 64
+
+/* capturers post client ACKs to the scheduler inbox instead of running the handlers themselves */
+#define ACK_INBOX
+#define ACK_INBOX_SIZE 4096
+#define ACK_INBOX_BATCH 64
+#define MAX_TCP_HDR_LEN 60
+
 #define DELAY_TOLERANCE 10000
 #define DELAY_THRES 0.0000
 #define DELAY_STDDEV 90000
@@ -332,7 +405,7 @@ struct ForwardPkt
 {
 	void *data;
 	struct pcap_pkthdr header;
-	u_char pkt_data[PKT_SIZE];
+	u_char* pkt_data;  ///< PKT_SIZE bytes of frame, kept apart so scans only touch metadata
 	struct ForwardPkt* next;
 	struct ForwardPkt* prev;
 
@@ -349,6 +422,10 @@ struct ForwardPkt
 	u_int tcb;
 	bool is_rtx;
         u_int TSval;
+        u_int gen;  ///< generation of the owning connection when buffered
+        u_int off;  ///< where the payload starts in the connection's byte stream, PAYLOAD_STORAGE
+        u_short hdr_len; ///< Ethernet/IP/TCP header bytes the segment arrived with, PAYLOAD_STORAGE
+        u_long_long enq_time; ///< when it entered a Forward queue
         
 	void initPkt()
 	{
@@ -365,6 +442,8 @@ struct ForwardPkt
             is_rtx = true;
             index = 0;
             TSval = 0;
+            gen = 0;
+            enq_time = 0;
 	}
 	void PktHandler()
 	{
@@ -556,13 +635,15 @@ public:
 };
 struct state_array
 {
-	u_int state_id[TOTAL_NUM_CONN];
+	u_int* volatile state_id;
+	u_int cap;
 	u_int num;
 	u_int it;
 
-	state_array()
+	state_array() : cap(STATE_ARRAY_INIT_SIZE)
 	{
-		for (u_int i = 0; i < TOTAL_NUM_CONN; i ++)
+		state_id = (u_int *)malloc(sizeof(u_int) * cap);
+		for (u_int i = 0; i < cap; i ++)
 		{
 			state_id[i] = 0;
 		}
@@ -571,6 +652,13 @@ struct state_array
 		it = 0;
 	}
 
+	~state_array()
+	{
+		free(state_id);
+	}
+
+	void grow(); // the replaced array goes through grace, see split_tcp_gateway.cpp
+
 	BOOL isEmpty()
 	{
 		if (!num)
@@ -581,11 +669,11 @@ struct state_array
 
 	void flush()
 	{
-		num = it = 0;
-		for (u_int i = 0; i < TOTAL_NUM_CONN; i ++)
+		for (u_int i = 0; i < num; i ++) // del() zeroes the slot it vacates
 		{
 			state_id[i] = 0;
 		}
+		num = it = 0;
 	}
 
 	u_int iterator()
@@ -617,6 +705,8 @@ struct state_array
 
 	void add(u_int port)
 	{
+		if (num == cap)
+			grow();
 		state_id[num] = port;
 		num ++;
 	}
@@ -649,20 +739,380 @@ struct state_array
 		del(index);
 	}
 };
+/**
+ * Bytes in flight shared by the send and ACK paths. Each side only writes
+ * its own half, on its own cache line, and readers take the difference.
+ */
+struct transit_counter
+{
+	u_long_long sent CACHE_ALIGNED;   ///< written by the scheduler
+	u_long_long acked CACHE_ALIGNED;  ///< written by the ACK path
+
+	transit_counter() { flush(); }
+
+	void inline flush() { sent = acked = 0; }
+
+	inline void add(u_int len) { sent += len; }
+	inline void sub(u_int len)
+	{
+		u_long_long in_flight = value();
+		acked += (len < in_flight ? len : in_flight);
+	}
+	inline u_int value() { return (sent > acked ? (u_int)(sent - acked) : 0); }
+};
+enum PAGE_BACKING
+{
+	HUGETLB_PAGES,  ///< MAP_HUGETLB, explicit huge pages
+	THP_PAGES,      ///< anonymous mapping advised MADV_HUGEPAGE
+	SMALL_PAGES,    ///< malloc
+	NUM_PAGE_BACKINGS,
+};
+/**
+ * Bump allocator for tables that live as long as the process: TCBs,
+ * connection states, SlideWindow arrays, packet buffers. Memory is never
+ * handed back; huge_free() only releases blocks that did not come from an
+ * arena. Once set_node() is called every region prefers that NUMA node,
+ * whichever thread touches it first.
+ */
+struct huge_arena
+{
+	struct region
+	{
+		u_char* base;
+		size_t size, used;
+	};
+
+	region regions[64];
+	u_int n_regions;
+	size_t bytes[NUM_PAGE_BACKINGS];
+	int node;             ///< NUMA node the regions prefer, -1 leaves placement to first touch
+	pthread_mutex_t mutex;
+
+	huge_arena() : n_regions(0), node(-1)
+	{
+		bytes[HUGETLB_PAGES] = bytes[THP_PAGES] = bytes[SMALL_PAGES] = 0;
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	BOOL map_region(size_t size)
+	{
+		void* base;
+		size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+		if (n_regions == sizeof(regions) / sizeof(regions[0]))
+			return FALSE;
+
+#ifdef HUGE_PAGE_1GB
+		size_t gb = 1024*1024*1024;
+		size_t gb_size = (size + gb - 1) / gb * gb;
+		if ((base = mmap(NULL, gb_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0)) != MAP_FAILED)
+		{
+			size = gb_size;
+			bytes[HUGETLB_PAGES] += size;
+		}
+		else
+#endif
+		if ((base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+			bytes[HUGETLB_PAGES] += size;
+		else if ((base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
+		{
+			madvise(base, size, MADV_HUGEPAGE); // best effort, the kernel may still use 4 KB pages
+			bytes[THP_PAGES] += size;
+		}
+		else
+			return FALSE;
+
+		regions[n_regions].base = (u_char *)base;
+		regions[n_regions].size = size;
+		regions[n_regions].used = 0;
+		bind_region(regions + n_regions);
+		n_regions ++;
+		return TRUE;
+	}
+
+	/* pages not faulted in yet come from node; those already touched stay put */
+	void bind_region(region* r)
+	{
+		unsigned long mask;
+
+		if (node < 0 || node >= (int)(sizeof(mask) * 8))
+			return;
+
+		mask = 1UL << node;
+		if (syscall(SYS_mbind, r->base, r->size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0)
+			fprintf(stderr, "Unable to prefer NUMA node %d: %s\n", node, strerror(errno));
+	}
+
+	void set_node(int _node)
+	{
+		pthread_mutex_lock(&mutex);
+		node = _node;
+		for (u_int i = 0; i < n_regions; i ++)
+			bind_region(regions + i);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void* alloc(size_t size)
+	{
+		void* p = NULL;
+		size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+		pthread_mutex_lock(&mutex);
+		region* r = (n_regions ? regions + n_regions - 1 : NULL);
+		if ((r == NULL || r->size - r->used < size) && map_region(size > HUGE_ARENA_SIZE ? size : HUGE_ARENA_SIZE))
+			r = regions + n_regions - 1;
+
+		if (r != NULL && r->size - r->used >= size)
+		{
+			p = r->base + r->used;
+			r->used += size;
+		}
+		else if ((p = malloc(size)) != NULL)
+			bytes[SMALL_PAGES] += size;
+		pthread_mutex_unlock(&mutex);
+
+		return p;
+	}
+
+	BOOL owns(void* p)
+	{
+		for (u_int i = 0; i < n_regions; i ++)
+		{
+			if ((u_char *)p >= regions[i].base && (u_char *)p < regions[i].base + regions[i].size)
+				return TRUE;
+		}
+		return FALSE;
+	}
+
+	void report()
+	{
+		printf("MEMORY BACKING: %lu MB huge pages, %lu MB transparent huge pages, %lu MB small pages\n",
+				(u_long)(bytes[HUGETLB_PAGES] >> 20), (u_long)(bytes[THP_PAGES] >> 20), (u_long)(bytes[SMALL_PAGES] >> 20));
+	}
+}arena;
+
+inline void* huge_alloc(size_t size) { return arena.alloc(size); }
+inline void huge_free(void* p)
+{
+	if (p != NULL && !arena.owns(p))
+		free(p);
+}
+/**
+ * Shared pool of PKT_SIZE frame buffers for connection retransmission
+ * buffers. Frames are carved from the huge page arena (huge_alloc) in
+ * SLAB_CHUNK chunks up to max_pkts and never returned to the system, so a
+ * stale pointer always refers to valid memory.
+ */
+struct pkt_slab
+{
+	u_char** free_list;
+	u_int n_free, allocated, max_pkts;
+	u_long_long exhausted;  ///< takes refused at the cap
+
+	pthread_mutex_t mutex;
+
+	pkt_slab() : free_list(NULL), n_free(0), allocated(0), max_pkts(0), exhausted(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	void set_max(u_int max) // follows the connection pool, never shrinks
+	{
+		pthread_mutex_lock(&mutex);
+		if (max > max_pkts)
+		{
+			free_list = (u_char **)realloc(free_list, sizeof(u_char *) * max);
+			if (free_list == NULL)
+			{
+				fprintf(stderr, "\nUnable to size the packet slab for %u frames\n", max);
+				exit(-1);
+			}
+			max_pkts = max;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	~pkt_slab()
+	{
+		free(free_list);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	u_int take(u_char** batch, u_int n)
+	{
+		u_int got = 0;
+
+		pthread_mutex_lock(&mutex);
+		if (n_free < n && allocated < max_pkts)
+		{
+			u_int chunk = (max_pkts - allocated < SLAB_CHUNK ? max_pkts - allocated : SLAB_CHUNK);
+			u_char* frames = (u_char *)huge_alloc(PKT_SIZE * chunk);
+			if (frames != NULL)
+			{
+				for (u_int i = 0; i < chunk; i ++)
+					free_list[n_free ++] = frames + i * PKT_SIZE;
+				allocated += chunk;
+			}
+		}
+		while (got < n && n_free)
+			batch[got ++] = free_list[-- n_free];
+		if (!got)
+			exhausted ++;
+		pthread_mutex_unlock(&mutex);
+
+		return got;
+	}
+
+	void put(u_char** batch, u_int n)
+	{
+		pthread_mutex_lock(&mutex);
+		for (u_int i = 0; i < n; i ++)
+			free_list[n_free ++] = batch[i];
+		pthread_mutex_unlock(&mutex);
+	}
+
+	inline u_int in_use() { return allocated - n_free; } ///< not counting per-thread caches
+};
+/**
+ * Global byte budget for buffered server data. Every active TCB has an
+ * equal share. A TCB below its share may fill the rest of it from what
+ * is free; one above its share only borrows while the whole gateway is
+ * under BUFFER_HIGH_WATER, which keeps the remainder for the TCBs still
+ * below theirs. The budget never drops data: it only decides the window
+ * offered to the server, see rcv_wnd_budget().
+ */
+struct buffer_budget
+{
+	volatile u_long_long limit; ///< follows the slab cap as the connection pool grows
+	volatile u_long_long used;  ///< bytes charged over all connections
+	u_long_long throttled;      ///< windows cut short by the budget
+	volatile u_int closed;      ///< connections left without a window, see budget_reopen()
+	volatile u_long_long mark;  ///< used at the last sweep, a step above high water once a window closed
+	u_long_long sweeps;         ///< budget_reopen() sweeps run
+
+	buffer_budget() : limit(0), used(0), throttled(0), closed(0), mark(0), sweeps(0) {}
+
+	inline void set_limit(u_long_long max) { limit = max; }
+
+	inline void close_window()
+	{
+		__sync_fetch_and_add(&closed, 1);
+		mark = limit / 100 * (BUFFER_HIGH_WATER + BUFFER_REOPEN_STEP); // the next sweep comes at high water
+	}
+
+	inline void charge(volatile u_long_long* tcb_used, u_int len)
+	{
+		__sync_fetch_and_add(&used, len);
+		__sync_fetch_and_add(tcb_used, len);
+	}
+	inline void release(volatile u_long_long* tcb_used, u_int len)
+	{
+		__sync_fetch_and_sub(&used, len);
+		__sync_fetch_and_sub(tcb_used, len);
+	}
+
+	/* bytes a TCB holding tcb_used may still take in while tcbs TCBs are active */
+	u_long_long room(u_long_long tcb_used, u_int tcbs)
+	{
+		u_long_long total = used, share = limit / (tcbs ? tcbs : 1);
+		u_long_long high = limit / 100 * BUFFER_HIGH_WATER;
+
+		if (tcb_used < share)
+			return (total >= limit ? 0 : (share - tcb_used < limit - total ? share - tcb_used : limit - total));
+		return (total >= high ? 0 : high - total);
+	}
+	/*
+	 * windows closed by the budget, used under the high-water mark and a
+	 * step below the last sweep, so the sweep runs once per step freed
+	 * rather than on every scheduler visit
+	 */
+	inline BOOL reopen()
+	{
+		u_long_long total = used;
+
+		if (!closed || total >= limit / 100 * BUFFER_HIGH_WATER || total + limit / 100 * BUFFER_REOPEN_STEP > mark)
+			return FALSE;
+		mark = total;
+		sweeps ++;
+		return TRUE;
+	}
+};
+/**
+ * Dynamic byte limit for a Forward data lane. The limit grows when the
+ * queue runs empty after the scheduler was held back by it, and shrinks
+ * by the bytes that never left the queue during a slack interval.
+ */
+struct byte_queue_limit
+{
+	u_int limit;            ///< bytes the scheduler may keep queued
+	u_int queued;           ///< bytes currently queued
+	u_int min_queued;       ///< low-water mark since the last adjustment
+	BOOL ovlimit;           ///< the scheduler was held back since the queue last ran empty
+	u_long_long slack_start;
+
+	u_long_long sojourn;    ///< smoothed queueing delay of data frames, us
+	u_long_long sojourn_max;
+	u_long_long grow_count, shrink_count;
+
+	byte_queue_limit() : limit(BQL_INIT_LIMIT), queued(0), min_queued(0), ovlimit(FALSE), slack_start(0), sojourn(0), sojourn_max(0), grow_count(0), shrink_count(0) {}
+
+	inline BOOL over(u_int held) { return (queued + held * MTU >= limit); }
+	inline void enqueue(u_int len) { queued += len; }
+	void dequeue(u_int len, u_long_long wait, u_long_long now)
+	{
+		queued = (len < queued ? queued - len : 0);
+		if (queued < min_queued)
+			min_queued = queued;
+
+		sojourn = (7 * sojourn + wait) / 8;
+		if (wait > sojourn_max)
+			sojourn_max = wait;
+
+		if (!queued && ovlimit)
+		{
+			/* starved: the forwarder went idle while data was waiting on us */
+			limit += (limit / 2 > MTU ? limit / 2 : MTU);
+			if (limit > BQL_MAX_LIMIT)
+				limit = BQL_MAX_LIMIT;
+			ovlimit = FALSE;
+			grow_count ++;
+			slack_start = now;
+			min_queued = queued;
+		}
+		else if (now - slack_start >= BQL_SLACK_INTERVAL)
+		{
+			if (min_queued)
+			{
+				limit = (min_queued + BQL_MIN_LIMIT < limit ? limit - min_queued : BQL_MIN_LIMIT);
+				shrink_count ++;
+			}
+			slack_start = now;
+			min_queued = queued;
+		}
+	}
+};
 struct ForwardPktBuffer
 {
 	ForwardPkt* pktQueue;
+	u_char* payload;  ///< frames of all slots, slot i at i * PKT_SIZE
 
 	u_int capacity, _size, _head, _tail, _unAck, _pkts, _last_head, _last_pkts;
-        ForwardPktBuffer(){}
+        ForwardPktBuffer() : pktQueue(NULL), payload(NULL), capacity(0) {}
         
-	ForwardPktBuffer(u_int size):capacity(size)
+	ForwardPktBuffer(u_int size)
 	{
-		pktQueue = (ForwardPkt *)malloc(sizeof(ForwardPkt)*capacity);
+		alloc(size);
+	}
+
+	void alloc(u_int size)
+	{
+		capacity = size;
+		pktQueue = (ForwardPkt *)huge_alloc(sizeof(ForwardPkt)*capacity);
+		payload = (u_char *)huge_alloc(PKT_SIZE*capacity);
 		for (int i = 0; i < capacity; i ++)
-			pktQueue[i].initPkt();
+			pktQueue[i].pkt_data = payload + i * PKT_SIZE;
 
-		_head = _tail = _size = _unAck = _pkts = _last_head = _last_pkts = 0;
+		init();
 	}
 
 	void inline flush()
@@ -672,7 +1122,8 @@ struct ForwardPktBuffer
 
 	~ForwardPktBuffer()
 	{
-		free(pktQueue);
+		huge_free(pktQueue);
+		huge_free(payload);
 	}
 
 	inline void init()
@@ -749,6 +1200,10 @@ struct Packet
                 sign = NEGATIVE;
 	}
 };
+/* optional parts of a SlideWindow, each instance allocates only those it uses */
+#define SW_BANDWIDTH 0x1 // bw_window of interval/delta slots: another_put(), bw_window_shift(), threshold()
+#define SW_UNSENT 0x2    // unsent_window and unsent_stack: threshold_1(), window_update(), put_stack()
+
 struct SlideWindow
 {
 	Packet* window;
@@ -759,6 +1214,12 @@ struct SlideWindow
 	u_int _size, _bytes, capacity, delta, interval;
 	u_long_long sample_time;
         u_int k, M, unsent_cap;
+        u_int _w_head, _b_head; ///< window and bw_window are rings, index 0 is the oldest entry
+        u_int _w_count;         ///< samples put since the last flush, at(i) is sample _w_count - _size + i
+        u_int* unsent_marks;    ///< sample numbers marked by record_unsent_pos(), oldest first
+        u_int _m_head, _m_size;
+        long long _bw_sum;      ///< sum of bw(i).len, kept as intervals fill and expire
+        long long _bw_weighted; ///< sum of (i+1)*bw(i).len, so threshold() needs no walk
         
         long heuristic; 
         long heuristic_0;
@@ -804,30 +1265,44 @@ struct SlideWindow
         
 #define HEURISTIC_UNSENT_STACK_SIZE 0
         
-	SlideWindow(u_int size, u_int _interval, u_int _delta)
+	SlideWindow(u_int size, u_int _interval, u_int _delta, u_int features = 0)
 	{
             capacity = size;
             delta = _delta;
             interval = _interval;
-            M = interval/delta;
-            unsent_cap = size * 10;
+            M = ((features & SW_BANDWIDTH) && delta ? interval/delta : 0);
+            unsent_cap = (features & SW_UNSENT ? size * 10 : 0);
             
-            window = (Packet *)malloc(sizeof(Packet) * size);
+            window = (Packet *)huge_alloc(sizeof(Packet) * size);
 
             for (int i = 0; i < size; i ++)
                 window[i].flush();
 
-            bw_window = (Packet *)malloc(sizeof(Packet) * M);
-            for (int i = 0; i < M; i ++)
-                bw_window[i].flush();
+            bw_window = NULL;
+            if (M)
+            {
+                bw_window = (Packet *)huge_alloc(sizeof(Packet) * M);
+                for (int i = 0; i < M; i ++)
+                    bw_window[i].flush();
+            }
+            _w_head = _b_head = 0;
+            _bw_sum = _bw_weighted = 0;
             
-            unsent_window = (Packet *)malloc(sizeof(Packet) * unsent_cap);
-            for (int i = 0; i < unsent_cap; i ++)
-                unsent_window[i].flush();
+            unsent_window = unsent_stack = NULL;
+            unsent_marks = NULL;
+            _w_count = _m_head = _m_size = 0;
+            if (unsent_cap)
+            {
+                unsent_window = (Packet *)huge_alloc(sizeof(Packet) * unsent_cap);
+                for (int i = 0; i < unsent_cap; i ++)
+                    unsent_window[i].flush();
             
-            unsent_stack = (Packet *)malloc(sizeof(Packet) * capacity);
-            for (int i = 0; i < capacity; i ++)
-                unsent_stack[i].flush();
+                unsent_stack = (Packet *)huge_alloc(sizeof(Packet) * capacity);
+                for (int i = 0; i < capacity; i ++)
+                    unsent_stack[i].flush();
+
+                unsent_marks = (u_int *)huge_alloc(sizeof(u_int) * capacity);
+            }
             
             _stack_size = 0;
             
@@ -866,9 +1341,29 @@ struct SlideWindow
 
 	~SlideWindow()
 	{
-		free(window);
-                free(bw_window);
-                free(unsent_window);
+		huge_free(window);
+                huge_free(bw_window);
+                huge_free(unsent_window);
+                huge_free(unsent_stack);
+                huge_free(unsent_marks);
+	}
+
+	u_int footprint() // bytes behind the window's arrays
+	{
+            return sizeof(Packet) * (capacity + M + unsent_cap + (unsent_stack ? capacity : 0)) + 
+                    (unsent_marks ? sizeof(u_int) * capacity : 0);
+	}
+
+	inline Packet& at(u_int i) // i-th oldest sample
+	{
+            u_int j = _w_head + i;
+            return window[j < capacity ? j : j - capacity];
+	}
+
+	inline Packet& bw(u_int i) // i-th oldest bandwidth interval
+	{
+            u_int j = _b_head + i;
+            return bw_window[j < M ? j : j - M];
 	}
 
 	u_int size()
@@ -899,7 +1394,7 @@ struct SlideWindow
              return 0;
           }
           else
-             return window[_size-1].seqNo - window[0].seqNo;
+             return at(_size-1).seqNo - at(0).seqNo;
 	}
 
 	u_long_long frontTime()
@@ -907,7 +1402,7 @@ struct SlideWindow
             if (isEmpty())
                 return 0;
             else
-                return window[0].time;
+                return at(0).time;
 	}
 
 	u_long_long tailTime()
@@ -915,7 +1410,7 @@ struct SlideWindow
             if (isEmpty())
                 return 0;
             else
-                return window[_size-1].time;
+                return at(_size-1).time;
 	}
 
         u_long_long estmateInterval(u_long_long current_time)
@@ -955,35 +1450,47 @@ struct SlideWindow
             if (isEmpty())
                 return 0;
             else
-                return (current_time <= window[0].time ? 0 : current_time - window[0].time);
+                return (current_time <= at(0).time ? 0 : current_time - at(0).time);
+	}
+
+	/*
+	 * Number of newest samples with now - time < span, by binary search;
+	 * sample times never go backwards.
+	 */
+	u_int recent(u_long_long now, u_long_long span)
+	{
+            u_int lo = 0, hi = _size; // samples from hi on are recent
+
+            while (lo < hi)
+            {
+                u_int mid = lo + (hi - lo) / 2;
+                if (now - at(mid).time < span)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+
+            return _size - hi;
 	}
 
 	void shift()
         {
-            _bytes -= window[0].len;
+            _bytes -= at(0).len;
             
-            if (window[0].seqNo == 15) // what is it?
-                unsent_delay_bytes += window[0].len;
+            if (at(0).seqNo == 15) // what is it?
+                unsent_delay_bytes += at(0).len;
             
-            for (u_int i = 0; i < _size - 1; i ++)
-            {
-                window[i].len = window[i+1].len;
-                window[i].time = window[i+1].time;
-                window[i].seqNo = window[i+1].seqNo;
-                window[i].future_time = window[i+1].future_time;
-                window[i].unsent_len = window[i+1].unsent_len;
-                window[i].sign = window[i+1].sign;
-            }
-            
-            window[_size - 1].flush();
+            at(0).flush(); // the slot comes round again as the one past the tail
+            if (++ _w_head == capacity)
+                _w_head = 0;
 	}
         
         void pop(u_int len) 
         {
             
-            if (_bytes > len && window[_size - 1].len >= len)
+            if (_bytes > len && at(_size - 1).len >= len)
             {
-                window[_size - 1].len -= len;
+                at(_size - 1).len -= len;
                 _bytes -= len; 
             }
         }
@@ -1036,20 +1543,21 @@ struct SlideWindow
 	{
             if (_size < capacity)
             {
-                window[_size].len = len;
-                window[_size].time = time;
-                window[_size].seqNo = seqNo;
-                _bytes += window[_size].len;
+                at(_size).len = len;
+                at(_size).time = time;
+                at(_size).seqNo = seqNo;
+                _bytes += at(_size).len;
                 _size ++;
             }
             else
             {                
                 shift();
-                window[_size-1].len = len;
-                window[_size-1].time = time;
-                window[_size-1].seqNo = seqNo;
-                _bytes += window[_size-1].len;
+                at(_size-1).len = len;
+                at(_size-1).time = time;
+                at(_size-1).seqNo = seqNo;
+                _bytes += at(_size-1).len;
             }
+            _w_count ++;
 	}
 
 	void another_put(u_int len, u_long_long time, u_int seqNo)
@@ -1057,23 +1565,24 @@ struct SlideWindow
 
             if (_size < capacity)
             {
-                window[_size].len = len;
-                window[_size].time = time;
-                window[_size].seqNo = seqNo;
-                _bytes += window[_size].len;
+                at(_size).len = len;
+                at(_size).time = time;
+                at(_size).seqNo = seqNo;
+                _bytes += at(_size).len;
                 _size ++;
             }
             else
             {
 
                 shift();
-                window[_size-1].len = len;
-                window[_size-1].time = time;
-                window[_size-1].seqNo = seqNo;
-                _bytes += window[_size-1].len;
+                at(_size-1).len = len;
+                at(_size-1).time = time;
+                at(_size-1).seqNo = seqNo;
+                _bytes += at(_size-1).len;
             }
+            _w_count ++;
 
-            bw_window[k-1].len += len;                                                
+            bw_add(len);
             total_bw_bytes += len;
                 
                 
@@ -1082,25 +1591,44 @@ struct SlideWindow
         void record_unsent_pos(u_long_long current_time)
         {
             another_put(0, current_time, 0);
-            window[_size-1].sign = TRUE;
+            at(_size-1).sign = TRUE;
             nb_unsent_pos ++;
+
+            if (_m_size == capacity) // the oldest mark has left the window already
+            {
+                _m_head = (_m_head + 1) % capacity;
+                _m_size --;
+            }
+            unsent_marks[(_m_head + _m_size) % capacity] = _w_count - 1;
+            _m_size ++;
         }
         
+        /*
+         * The marks are visited newest first from unsent_marks instead of
+         * scanning the window for signed samples. Marks are in sample
+         * order, so the first one that has been shifted out ends the walk.
+         * Such marks still count in nb_unsent_pos, as they did before.
+         */
         void update_unsent_pos(u_int len, u_int rcv_bw, u_long_long current_time)
         {
-            for (int i = _size - 1; i >= 0; i --)
+            u_int first = _w_count - _size; // sample number of at(0)
+
+            while (_m_size)
             {
-                if (window[i].sign)
-                {
-                    window[i].len += len;
-                    _bytes += len;                                        
-                    window[i].sign = FALSE;                    
-                    nb_unsent_pos --;
-                    
-                    if (!nb_unsent_pos)
-                        break;
-                }
+                u_int i = unsent_marks[(_m_head + -- _m_size) % capacity] - first;
+
+                if (i >= _size)
+                    break;
+
+                at(i).len += len;
+                _bytes += len;                                        
+                at(i).sign = FALSE;                    
+                nb_unsent_pos --;
+                
+                if (!nb_unsent_pos)
+                    break;
             }
+            _m_head = _m_size = 0;
             
             u_int updated_bw =  (estmateInterval(current_time) == 0 ? MAX_SEND_RATE :
                 (u_long_long)bytes() * (u_long_long)RESOLUTION / 
@@ -1125,7 +1653,7 @@ struct SlideWindow
             */
             
             if (updated_bw > rcv_bw + std_dev) {
-                window[_size - 1].len -= len;
+                at(_size - 1).len -= len;
                 _bytes -= len;
             }
             
@@ -1139,7 +1667,7 @@ struct SlideWindow
             u_int one = total/_size;
             for (int i = 0; i < _size; i ++)
             {
-                window[i].len += one;
+                at(i).len += one;
                 _bytes += one;
             }
         }
@@ -1149,15 +1677,15 @@ struct SlideWindow
             
             if (sign)
             {                
-                window[_size-1].len += unrcv_acks;
+                at(_size-1).len += unrcv_acks;
                 _bytes += unrcv_acks;
                 unrcv_acks = 0;
             }
             else
             {
-                if (window[_size-1].len >= unrcv_acks)
+                if (at(_size-1).len >= unrcv_acks)
                 {
-                    window[_size-1].len -= unrcv_acks;
+                    at(_size-1).len -= unrcv_acks;
                     _bytes -= unrcv_acks;
                     
                     unrcv_acks = 0;
@@ -1167,18 +1695,18 @@ struct SlideWindow
                     
                     for (int i = _size - 1; i >= 0; i --)
                     {
-                        if (window[i].len >= unrcv_acks)
+                        if (at(i).len >= unrcv_acks)
                         {
-                            window[i].len -= unrcv_acks;
+                            at(i).len -= unrcv_acks;
                             _bytes -= unrcv_acks;
                             unrcv_acks = 0;
                             break;
                         }
                         else
                         {
-                            window[i].len = 0;
-                            _bytes -= window[i].len;
-                            unrcv_acks -= window[i].len;
+                            at(i).len = 0;
+                            _bytes -= at(i).len;
+                            unrcv_acks -= at(i).len;
                         }
                     }
                    
@@ -1195,22 +1723,30 @@ struct SlideWindow
         inline Packet* utail() { return unsent_window + (_u_tail % unsent_cap); }
         inline void utailNext() { _u_tail = (_u_tail + 1) % unsent_cap; _u_size ++; }
                                  
+	/*
+	 * Only the live entries are cleared. shift() and shift_stack() flush
+	 * the slot they vacate and window_update() flushes every unsent entry
+	 * it consumes, so everything outside the live ranges is clean already.
+	 */
 	void flush()
 	{           
+            for (u_int i = 0; i < _size; i ++)
+                    at(i).flush();
             _size = _bytes = sample_time = shift_time = 0;
-            for (u_int i = 0; i < capacity; i ++)
-                    window[i].flush();
 
             for (int i = 0; i < M; i ++)
-                bw_window[i].flush(); 
+                bw(i).flush(); 
             
-            for (int i = 0; i < unsent_cap; i ++)
-                unsent_window[i].flush(); 
+            for (u_int i = 0; i < _u_size; i ++)
+                unsent_window[(_u_head + i) % unsent_cap].flush(); 
             
-            for (int i = 0; i < capacity; i ++)
+            for (u_int i = 0; i < _stack_size; i ++)
                 unsent_stack[i].flush();
             
             _stack_size = 0;       
+            _w_head = _b_head = 0;
+            _w_count = _m_head = _m_size = 0;
+            _bw_sum = _bw_weighted = 0;
             
             init_burst = heuristic = sample_time = shift_time = upper_heuristic = lower_heuristic = unsent_data = 0;
             heuristic_0 = heuristic_1 = heuristic_2 = 0;
@@ -1248,20 +1784,22 @@ struct SlideWindow
 	
 	}
 
+        inline void bw_add(u_int len) // bytes for the current interval
+        {
+            bw(k-1).len += len;
+            _bw_sum += len;
+            _bw_weighted += (long long)k * len;
+        }
+
         void bw_window_shift(u_long_long current_time)
         {                                    
-            for (int i = 0; i < M - 1; i ++) 
-            {                
-                bw_window[i].len = bw_window[i+1].len;
-                bw_window[i].time = bw_window[i+1].time;
-                bw_window[i].seqNo = bw_window[i+1].seqNo;
-                bw_window[i].unsent_len = bw_window[i+1].unsent_len;
-                bw_window[i].future_time = bw_window[i+1].future_time;
-                bw_window[i].sign = bw_window[i+1].sign;
-            }
+            _bw_weighted -= _bw_sum; // every interval moves one place towards the oldest
+            _bw_sum -= bw(0).len;
+            bw(0).flush();
+            if (++ _b_head == M)
+                _b_head = 0;
             
-            bw_window[M-1].flush();
-            bw_window[M-1].time = current_time;
+            bw(M-1).time = current_time;
         }
         
         long threshold(long X)
@@ -1270,11 +1808,8 @@ struct SlideWindow
             {
                 heuristic = ((2*M - k + 1)*k*X*(double(delta)/double(RESOLUTION)))/(2*M);
                 
-               
-                for (int i = 1; i <= k; i ++)
-                {
-                    heuristic -= (M - (k-i))*bw_window[i-1].len/M;                    
-                }
+                // sum of (M - (k-i))*bw(i-1).len over i <= k; the intervals past k are still empty
+                heuristic -= ((long long)(M - k)*_bw_sum + _bw_weighted)/M;
                                            
                 heuristic_0 = phase_1_sent_bytes - total_bw_bytes;
                 unsent_data_due_schedule_delay = heuristic - heuristic_0;
@@ -1283,10 +1818,7 @@ struct SlideWindow
             {
                 heuristic = (1 + M)*X*(double(delta)/double(RESOLUTION))/2;
                                  
-                for (int i = 1; i <= M; i ++)
-                {
-                    heuristic -= i*bw_window[i-1].len/M;                   
-                }
+                heuristic -= _bw_weighted/M; // sum of i*bw(i-1).len over the M intervals
                 
                 
                 heuristic_0 = phase_2_sent_bytes - total_bw_bytes;                
@@ -1313,6 +1845,11 @@ struct SlideWindow
             return DELAY_THRES * RESOLUTION;            
         }
         
+        /*
+         * unsent_window is due-time ordered: every entry gets a future_time
+         * past the one queued before it, requeued entries included. Only
+         * the head is looked at, and entries leave exactly when due.
+         */
         void window_update(u_int current_time, u_int rtt, u_int rtt_limit, u_int queue_len, u_int rcv_bw, u_long_long now)
         {                
             while (_u_size > 0) 
@@ -1400,7 +1937,7 @@ struct SlideWindow
             if (upper_heuristic && _u_size < unsent_cap)
             {
                 
-                heuristic_1 = upper_heuristic - bw_window[k-1].len;                                                                                  
+                heuristic_1 = upper_heuristic - bw(k-1).len;                                                                                  
                 u_int send_rate_lower = min_rcv_thrughput;
                 u_long_long sending_bytes = ((u_long_long)rcv_thrughput * (u_long_long)sample_period / (u_long_long)RESOLUTION > 
                         (u_long_long)send_rate_lower * (u_long_long)sample_period / (u_long_long)RESOLUTION ? 
@@ -1491,18 +2028,18 @@ struct SlideWindow
         {
             if (_size)
             {
-                window[_size-1].len += len;            
-                window[_size-1].seqNo = seqNo;
-                _bytes += window[_size-1].len;
+                at(_size-1).len += len;            
+                at(_size-1).seqNo = seqNo;
+                _bytes += at(_size-1).len;
             }
             else
             {
-                window[_size].len = len;            
-                window[_size].seqNo = seqNo;
-                _bytes += window[_size].len;
+                at(_size).len = len;            
+                at(_size).seqNo = seqNo;
+                _bytes += at(_size).len;
             }
             
-            bw_window[k-1].len += len;            
+            bw_add(len);
         }
         
         u_int tail()
@@ -1510,7 +2047,7 @@ struct SlideWindow
             if (isEmpty())
                 return 0;
             else
-                return window[_size-1].len;
+                return at(_size-1).len;
         }
         
         u_int head()
@@ -1518,11 +2055,148 @@ struct SlideWindow
             if (isEmpty())
                 return 0;
             else
-                return window[0].len;
+                return at(0).len;
         }
                 
 };
 
+/* one ACK as the estimators see it */
+struct ack_sample
+{
+	u_long_long time;  ///< arrival time
+	u_long_long cum;   ///< bytes acked by all earlier samples, so window sums are differences
+	u_int TSval;
+	u_int rtt;         ///< RTT estimate when the ACK came in
+	u_int seqNo;
+};
+/**
+ * Time-ordered ring of the last capacity ACKs. Sample times and TSvals
+ * never go backwards, so a point in the past is found by binary search,
+ * and the bytes between two samples come from their running totals.
+ */
+struct AckHistory
+{
+	ack_sample* ring;
+	u_int capacity, _head, _size;
+	u_long_long total; ///< bytes acked since the last flush
+
+	AckHistory(u_int size) : capacity(size)
+	{
+		ring = (ack_sample *)huge_alloc(sizeof(ack_sample) * capacity);
+		flush();
+	}
+
+	~AckHistory()
+	{
+		huge_free(ring);
+	}
+
+	void flush()
+	{
+		_head = _size = 0;
+		total = 0;
+	}
+
+	u_int footprint()
+	{
+		return sizeof(ack_sample) * capacity;
+	}
+
+	u_int size()
+	{
+		return _size;
+	}
+
+	inline ack_sample& at(u_int i) // i-th oldest sample
+	{
+		u_int j = _head + i;
+		return ring[j < capacity ? j : j - capacity];
+	}
+
+	void put(u_int len, u_long_long time, u_int TSval, u_int rtt, u_int seqNo)
+	{
+		ack_sample* s;
+
+		if (_size < capacity)
+			s = &at(_size ++);
+		else
+		{
+			s = &ring[_head];
+			if (++ _head == capacity)
+				_head = 0;
+		}
+
+		s->time = time;
+		s->cum = total;
+		s->TSval = TSval;
+		s->rtt = rtt;
+		s->seqNo = seqNo;
+		total += len;
+	}
+
+	/* bytes acked by the samples from the i-th oldest on */
+	u_long_long bytes(u_int i = 0)
+	{
+		return (i < _size ? total - at(i).cum : 0);
+	}
+
+	/* the i-th oldest sample up to the newest, in sequence space */
+	u_int seq_span(u_int i = 0)
+	{
+		return (i < _size ? at(_size-1).seqNo - at(i).seqNo : 0);
+	}
+
+	u_long_long time_span(u_long_long now, u_int i = 0)
+	{
+		return (i < _size && now > at(i).time ? now - at(i).time : 0);
+	}
+
+	u_int tsval_span(u_int now, u_int i = 0)
+	{
+		return (i < _size && (int)(now - at(i).TSval) > 0 ? now - at(i).TSval : 0);
+	}
+
+	/* index of the first of the newest n samples */
+	u_int last(u_int n)
+	{
+		return (n < _size ? _size - n : 0);
+	}
+
+	/* number of newest samples with now - time < span */
+	u_int recent(u_long_long now, u_long_long span)
+	{
+		u_int lo = 0, hi = _size; // samples from hi on are recent
+
+		while (lo < hi)
+		{
+			u_int mid = lo + (hi - lo) / 2;
+			if (now - at(mid).time < span)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+
+		return _size - hi;
+	}
+
+	/* number of samples from the i-th oldest on with now - TSval < span, in timestamp units */
+	u_int recent_tsval(u_int now, u_long_long span, u_int i = 0)
+	{
+		u_int lo = (i < _size ? i : _size), hi = _size;
+
+		while (lo < hi)
+		{
+			u_int mid = lo + (hi - lo) / 2;
+			if ((u_int)(now - at(mid).TSval) < span)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+
+		return _size - hi;
+	}
+};
+
 struct busyPeriod
 {
     u_long_long idle_start_time;
@@ -1642,12 +2316,22 @@ struct Forward
 	DIRECTION mode;
 
 	ForwardPktBuffer pktQueue;
+	ForwardPktBuffer ctrlQueue; ///< pure ACKs, handshake and FIN/RST, always drained first
 	pthread_mutex_t mutex;
 
 	pthread_cond_t m_eventElementAvailable;
 	pthread_cond_t m_eventSpaceAvailable;
 
-	Forward(pcap_t *_dev, u_int count, u_int _delay, DIRECTION _mode) : dev(_dev), delay(_delay), mode(_mode), pktQueue(count)
+	u_int held;       ///< slots set aside for scheduler visits in progress
+	BOOL full;        ///< a scheduler visit found no space
+	BOOL ctrl_full;   ///< the scheduler found no space on the control lane
+	u_int space_seq;  ///< bumped when space is freed after the queue was full
+
+	u_long_long ctrl_nonempty, data_nonempty; ///< dequeues that found each lane non-empty
+
+	byte_queue_limit bql;  ///< byte limit and sojourn time of pktQueue
+
+	Forward(pcap_t *_dev, u_int count, u_int _delay, DIRECTION _mode) : dev(_dev), delay(_delay), mode(_mode), pktQueue(count), ctrlQueue(CTRL_QUEUE_SIZE), held(0), full(FALSE), ctrl_full(FALSE), space_seq(0), ctrl_nonempty(0), data_nonempty(0)
 	{
 		pthread_mutex_init(&mutex, NULL);
 		pthread_cond_init(&m_eventSpaceAvailable, NULL );
@@ -1670,8 +2354,237 @@ struct DATA
 	char *name_another;
 	DIRECTION mode;
 	Forward *forward, *forward_back;
-	DATA(pcap_t *dev_0, pcap_t *dev_1, char *name_0, char *name_1, DIRECTION _mode, Forward *_forward, Forward *_forward_back) : dev_this(dev_0), dev_another(dev_1), name_this(name_0), name_another(name_1), mode(_mode), forward(_forward), forward_back(_forward_back){}
+	u_int burst; ///< 0: thread loops forever, otherwise return after this many packets/visits
+	DATA(pcap_t *dev_0, pcap_t *dev_1, char *name_0, char *name_1, DIRECTION _mode, Forward *_forward, Forward *_forward_back) : dev_this(dev_0), dev_another(dev_1), name_this(name_0), name_another(name_1), mode(_mode), forward(_forward), forward_back(_forward_back), burst(0){}
+
+};
+
+enum ACK_EVENT_TYPE
+{
+	PURE_ACK_EVENT,  ///< pure ACK, classified new/duplicate when applied
+	DATA_ACK_EVENT,  ///< ACK piggybacked on client data, always a new ACK
+};
+/**
+ * Compact ACK record parsed by a capturer. The TCP header (with options) is
+ * copied because the pcap buffer is reused by the next pcap_next_ex().
+ */
+struct AckEvent
+{
+	u_char type;
+	u_char tcp_len;
+	u_short sport;
+	u_short dport;
+	u_short window;
+	u_int ack_num;
+	u_int tcb_index;
+	u_long_long rcv_time;
+	DATA* data;        ///< capturer that saw the ACK, window updates to the server go out its way
+	u_char th[MAX_TCP_HDR_LEN];
+};
+/**
+ * Single-producer ring of an EventInbox. The producer only writes _tail,
+ * the owner only writes _head, so neither side takes a lock.
+ */
+struct EventRing
+{
+	AckEvent* eventQueue;
+	u_int capacity;
+	volatile u_int _head, _tail;
+	u_long_long posted, applied, overflow;
+
+	EventRing() : eventQueue(NULL), capacity(0), _head(0), _tail(0), posted(0), applied(0), overflow(0) {}
+
+	~EventRing()
+	{
+		free(eventQueue);
+	}
+
+	void init(u_int size)
+	{
+		capacity = size + 1; // one slot stays empty to tell full from empty
+		eventQueue = (AckEvent *)malloc(sizeof(AckEvent)*capacity);
+	}
+
+	BOOL post(u_char type, u_char* th, u_int tcp_len, u_int ack_num, u_short window, u_short sport, u_short dport, u_int tcb_index, u_long_long rcv_time, DATA* data)
+	{
+		u_int tail = _tail, next = (tail + 1 == capacity ? 0 : tail + 1);
+		if (next == _head)
+		{
+			overflow ++;
+			return FALSE;
+		}
+
+		AckEvent* ev = eventQueue + tail;
+		ev->type = type;
+		ev->tcp_len = (tcp_len > MAX_TCP_HDR_LEN ? MAX_TCP_HDR_LEN : tcp_len);
+		ev->sport = sport;
+		ev->dport = dport;
+		ev->window = window;
+		ev->ack_num = ack_num;
+		ev->tcb_index = tcb_index;
+		ev->rcv_time = rcv_time;
+		ev->data = data;
+		memcpy(ev->th, th, ev->tcp_len);
+
+		__sync_synchronize(); // the record is complete before _tail publishes it
+		_tail = next;
+		posted ++;
+		return TRUE;
+	}
 
+	u_int take(AckEvent* batch, u_int max)
+	{
+		u_int head = _head, tail = _tail, n = 0;
+
+		__sync_synchronize(); // records are read after the _tail that published them
+		while (head != tail && n < max)
+		{
+			memcpy(batch + n, eventQueue + head, sizeof(AckEvent));
+			head = (head + 1 == capacity ? 0 : head + 1);
+			n ++;
+		}
+		__sync_synchronize(); // copied out before the slots go back to the producer
+		_head = head;
+		applied += n;
+		return n;
+	}
+
+	inline u_int size() { u_int head = _head, tail = _tail; return (tail >= head ? tail - head : tail + capacity - head); }
+};
+/**
+ * Inbox of the thread owning the connection state, with one EventRing per
+ * capturer. A capturer finding its ring full waits for the owner to drain
+ * it rather than touching the state itself, see post_ack_event().
+ */
+struct EventInbox
+{
+	EventRing from[2]; ///< indexed by the DIRECTION of the posting capturer
+
+	EventInbox(u_int size)
+	{
+		from[SERVER_TO_CLIENT].init(size);
+		from[CLIENT_TO_SERVER].init(size);
+	}
+
+	inline BOOL post(DIRECTION producer, u_char type, u_char* th, u_int tcp_len, u_int ack_num, u_short window, u_short sport, u_short dport, u_int tcb_index, u_long_long rcv_time, DATA* data)
+	{
+		return from[producer].post(type, th, tcp_len, ack_num, window, sport, dport, tcb_index, rcv_time, data);
+	}
+
+	/* up to max events, taken from both rings in turn */
+	u_int take(AckEvent* batch, u_int max)
+	{
+		u_int n = from[SERVER_TO_CLIENT].take(batch, max / 2);
+		n += from[CLIENT_TO_SERVER].take(batch + n, max - n);
+		if (n < max)
+			n += from[SERVER_TO_CLIENT].take(batch + n, max - n);
+		return n;
+	}
+
+	inline u_int size() { return from[SERVER_TO_CLIENT].size() + from[CLIENT_TO_SERVER].size(); }
+};
+/**
+ * Departure record of a buffered data segment. Applied by the scheduler only
+ * if the connection generation and the slot sequence number still match.
+ */
+struct TxCompletion
+{
+	u_int tcb_index;
+	u_short dport;
+	u_int index;
+	u_int gen;
+	u_int seq_num;
+	u_int TSval;
+	u_long_long snd_time;
+};
+struct TxCompletionRing
+{
+	TxCompletion* doneQueue;
+	u_int capacity, _head, _tail, _size;
+	u_long_long posted, applied, stale, overflow;
+
+	pthread_mutex_t mutex;
+
+	TxCompletionRing(u_int size):capacity(size)
+	{
+		doneQueue = (TxCompletion *)malloc(sizeof(TxCompletion)*capacity);
+		_head = _tail = _size = 0;
+		posted = applied = stale = overflow = 0;
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~TxCompletionRing()
+	{
+		free(doneQueue);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	BOOL post(u_int tcb_index, u_short dport, u_int index, u_int gen, u_int seq_num, u_int TSval, u_long_long snd_time)
+	{
+		pthread_mutex_lock(&mutex);
+		if (_size == capacity)
+		{
+			overflow ++;
+			pthread_mutex_unlock(&mutex);
+			return FALSE;
+		}
+
+		TxCompletion* done = doneQueue + _tail;
+		done->tcb_index = tcb_index;
+		done->dport = dport;
+		done->index = index;
+		done->gen = gen;
+		done->seq_num = seq_num;
+		done->TSval = TSval;
+		done->snd_time = snd_time;
+
+		_tail = (_tail + 1) % capacity;
+		_size ++;
+		posted ++;
+		pthread_mutex_unlock(&mutex);
+		return TRUE;
+	}
+
+	u_int take(TxCompletion* batch, u_int max)
+	{
+		u_int n = 0;
+		pthread_mutex_lock(&mutex);
+		while (_size && n < max)
+		{
+			batch[n] = doneQueue[_head];
+			_head = (_head + 1) % capacity;
+			_size --;
+			n ++;
+		}
+		pthread_mutex_unlock(&mutex);
+		return n;
+	}
+
+	inline u_int size() { return _size; }
+};
+/**
+ * How the scheduler's time was split across TCBs during the last
+ * LOAD_REPORT_INTERVAL, and where the egress byte queue limit stood.
+ */
+struct SchedLoad
+{
+	u_long_long start;       ///< beginning of the current interval
+	u_long_long busy;        ///< us spent in TCB visits during the last interval
+	u_long_long bytes;       ///< bytes handed to the forwarder during the last interval
+	u_int active;            ///< TCBs that were visited
+	u_int heaviest;          ///< tcb_index with the largest cost
+	double heaviest_share;   ///< its fraction of busy
+	double imbalance;        ///< largest TCB cost over the mean cost
+	u_long_long intervals;
+
+	u_int bql_limit;              ///< byte_queue_limit of the data lane at the end of the interval
+	u_long_long bql_sojourn, bql_sojourn_max;
+	u_long_long bql_grow_count, bql_shrink_count;
+	u_long_long ctrl_nonempty, data_nonempty; ///< Forward lane counters at the end of the interval
+
+	SchedLoad() : start(0), busy(0), bytes(0), active(0), heaviest(0), heaviest_share(0), imbalance(0), intervals(0),
+		bql_limit(0), bql_sojourn(0), bql_sojourn_max(0), bql_grow_count(0), bql_shrink_count(0),
+		ctrl_nonempty(0), data_nonempty(0) {}
 };
 
 /*u_char console_y;